@@ -1,3 +1,29 @@
+param(
+  # Run without a display, with the console on stdio (used for BENCH_MODE builds)
+  [switch]$Headless,
+  # Attach nvme.img as an NVMe controller and run with 4 processors
+  [switch]$Nvme,
+  # Attach virtio.img as a virtio-blk device
+  [switch]$Virtio
+)
+
+$display = @()
+if ($Headless) {
+  $display = @("-nographic")
+}
+
+$nvme = @()
+if ($Nvme) {
+  $nvme = @("-smp", "4", "-drive", "id=nvme,file=nvme.img,if=none",
+    "-device", "nvme,drive=nvme,serial=nvme0")
+}
+
+$virtio = @()
+if ($Virtio) {
+  $virtio = @("-drive", "id=virtio,file=virtio.img,if=none",
+    "-device", "virtio-blk-pci,drive=virtio,disable-legacy=on")
+}
+
 qemu-system-x86_64 -cpu qemu64 -machine q35 `
   -drive if=pflash,format=raw,unit=0,file="libs/ovmf-blobs/OVMF_CODE-pure-efi.fd",readonly=on `
   -drive if=pflash,format=raw,unit=1,file="libs/ovmf-blobs/OVMF_VARS-pure-efi.fd" `
@@ -5,4 +31,4 @@ qemu-system-x86_64 -cpu qemu64 -machine q35 `
   -drive id=disk,file=drive.img,if=none `
   -device ahci,id=ahci `
   -device ide-hd,drive=disk,bus=ahci.0 `
-  -net none
\ No newline at end of file
+  -net none @display @nvme @virtio
@@ -0,0 +1,339 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "std.h"
+#include "aes.h"
+
+// S-boxes, and tables combining SubBytes and MixColumns (or their inverses) for a byte in the
+// first row of a column. The other rows are the same word rotated
+static uint8_t aes_sbox[256];
+static uint8_t aes_inverse_sbox[256];
+static uint32_t aes_encrypt_table[256];
+static uint32_t aes_decrypt_table[256];
+static void (*xts_update)(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t blocks, bool encrypt);
+static const char *aes_name;
+
+bool aes_xts_set_key(aes_xts_key_t *key, const uint8_t *bytes, uint32_t length) {
+    if (length != 32 && length != 64) {
+        handle_error("XTS keys are 32 or 64 bytes\n");
+        return false;
+    }
+    // IEEE 1619 requires the two halves to differ, equal halves make the tweak predictable
+    if (memcmp(bytes, bytes + length / 2, length / 2) == 0) {
+        handle_error("XTS data and tweak keys must differ\n");
+        return false;
+    }
+    if (xts_update == NULL) init_aes();
+    expand_key(&key->data, bytes, length / 2);
+    expand_key(&key->tweak, bytes + length / 2, length / 2);
+    return true;
+}
+
+void aes_xts_encrypt(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t length) {
+    if (xts_update == NULL) init_aes();
+    xts_update(key, unit, input, output, length / AES_BLOCK_BYTES, true);
+}
+
+void aes_xts_decrypt(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t length) {
+    if (xts_update == NULL) init_aes();
+    xts_update(key, unit, input, output, length / AES_BLOCK_BYTES, false);
+}
+
+const char *aes_implementation() {
+    if (xts_update == NULL) init_aes();
+    return aes_name;
+}
+
+static void init_aes() {
+    // Walk GF(2^8) by powers of 3, a generator, so p and q stay inverses of each other, and apply
+    // the S-box's affine transform to each inverse
+    uint8_t p = 1;
+    uint8_t q = 1;
+    do {
+        p = p ^ (uint8_t) (p << 1) ^ (p & 0x80 ? 0x1B : 0);
+        q ^= q << 1;
+        q ^= q << 2;
+        q ^= q << 4;
+        if (q & 0x80) q ^= 0x09;
+        uint8_t affine = q ^ (uint8_t) (q << 1 | q >> 7) ^ (uint8_t) (q << 2 | q >> 6)
+            ^ (uint8_t) (q << 3 | q >> 5) ^ (uint8_t) (q << 4 | q >> 4);
+        aes_sbox[p] = affine ^ 0x63;
+    } while (p != 1);
+    aes_sbox[0] = 0x63;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint8_t s = aes_sbox[i];
+        aes_inverse_sbox[s] = i;
+        aes_encrypt_table[i] = gf_multiply(s, 2) | (uint32_t) s << 8 | (uint32_t) s << 16
+            | (uint32_t) gf_multiply(s, 3) << 24;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        uint8_t s = aes_inverse_sbox[i];
+        aes_decrypt_table[i] = gf_multiply(s, 14) | (uint32_t) gf_multiply(s, 9) << 8
+            | (uint32_t) gf_multiply(s, 13) << 16 | (uint32_t) gf_multiply(s, 11) << 24;
+    }
+
+    // CPUID leaf 1: ECX bit 25 is AES-NI
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+    if (ecx & (1 << 25)) {
+        aes_name = "aes-ni";
+        xts_update = xts_aesni;
+    } else {
+        aes_name = "table";
+        xts_update = xts_table;
+    }
+}
+
+static void expand_key(aes_key_t *key, const uint8_t *bytes, uint32_t length) {
+    uint32_t key_words = length / 4;
+    uint32_t rounds = key_words + 6;
+    uint32_t total = 4 * (rounds + 1);
+    uint32_t *words = key->encrypt;
+    key->rounds = rounds;
+
+    for (uint32_t i = 0; i < key_words; i++) {
+        words[i] = bytes[4 * i] | (uint32_t) bytes[4 * i + 1] << 8
+            | (uint32_t) bytes[4 * i + 2] << 16 | (uint32_t) bytes[4 * i + 3] << 24;
+    }
+    uint8_t round_constant = 1;
+    for (uint32_t i = key_words; i < total; i++) {
+        uint32_t word = words[i - 1];
+        if (i % key_words == 0) {
+            // RotWord moves the first byte to the end, which is a right rotation little endian
+            word = substitute_word(rotate_left(word, 24)) ^ round_constant;
+            round_constant = gf_multiply(round_constant, 2);
+        } else if (key_words > 6 && i % key_words == 4) {
+            word = substitute_word(word);
+        }
+        words[i] = words[i - key_words] ^ word;
+    }
+
+    // The equivalent inverse cipher uses the round keys backwards, with InvMixColumns applied to
+    // all but the first and last
+    for (uint32_t round = 0; round <= rounds; round++) {
+        for (uint32_t column = 0; column < 4; column++) {
+            uint32_t word = words[4 * (rounds - round) + column];
+            key->decrypt[4 * round + column] = round == 0 || round == rounds
+                ? word : inverse_mix_column(word);
+        }
+    }
+}
+
+static void xts_table(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t blocks, bool encrypt) {
+    // The tweak is the data unit number as a little endian 128-bit value, encrypted
+    uint64_t tweak[2] = { unit, 0 };
+    crypt_block_table(key->tweak.encrypt, key->tweak.rounds, true, (uint8_t *) tweak,
+        (uint8_t *) tweak);
+
+    const uint32_t *round_keys = encrypt ? key->data.encrypt : key->data.decrypt;
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint64_t block[2];
+        memcpy(block, input, AES_BLOCK_BYTES);
+        block[0] ^= tweak[0];
+        block[1] ^= tweak[1];
+        crypt_block_table(round_keys, key->data.rounds, encrypt, (uint8_t *) block,
+            (uint8_t *) block);
+        block[0] ^= tweak[0];
+        block[1] ^= tweak[1];
+        memcpy(output, block, AES_BLOCK_BYTES);
+
+        next_tweak(tweak);
+        input += AES_BLOCK_BYTES;
+        output += AES_BLOCK_BYTES;
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void xts_aesni(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t blocks, bool encrypt) {
+    const aes_block_t *tweak_keys = (const aes_block_t *) key->tweak.encrypt;
+    const aes_block_t *round_keys = (const aes_block_t *)
+        (encrypt ? key->data.encrypt : key->data.decrypt);
+    uint32_t rounds = key->data.rounds;
+
+    aes_block_t tweak = { (long long) unit, 0 };
+    tweak ^= tweak_keys[0];
+    for (uint32_t round = 1; round < key->tweak.rounds; round++) {
+        tweak = __builtin_ia32_aesenc128(tweak, tweak_keys[round]);
+    }
+    tweak = __builtin_ia32_aesenclast128(tweak, tweak_keys[key->tweak.rounds]);
+
+    // Each block only depends on its own tweak, so eight go through every round together and
+    // the instructions of one round overlap instead of waiting on each other. The blocks are
+    // separate variables rather than an array so they can stay in registers
+    while (blocks >= AES_XTS_PARALLEL) {
+        const aes_unaligned_t *in = (const aes_unaligned_t *) input;
+        aes_block_t t0 = tweak;
+        aes_block_t t1 = multiply_tweak(t0);
+        aes_block_t t2 = multiply_tweak(t1);
+        aes_block_t t3 = multiply_tweak(t2);
+        aes_block_t t4 = multiply_tweak(t3);
+        aes_block_t t5 = multiply_tweak(t4);
+        aes_block_t t6 = multiply_tweak(t5);
+        aes_block_t t7 = multiply_tweak(t6);
+        tweak = multiply_tweak(t7);
+
+        aes_block_t round_key = round_keys[0];
+        aes_block_t b0 = in[0] ^ t0 ^ round_key;
+        aes_block_t b1 = in[1] ^ t1 ^ round_key;
+        aes_block_t b2 = in[2] ^ t2 ^ round_key;
+        aes_block_t b3 = in[3] ^ t3 ^ round_key;
+        aes_block_t b4 = in[4] ^ t4 ^ round_key;
+        aes_block_t b5 = in[5] ^ t5 ^ round_key;
+        aes_block_t b6 = in[6] ^ t6 ^ round_key;
+        aes_block_t b7 = in[7] ^ t7 ^ round_key;
+
+        if (encrypt) {
+            for (uint32_t round = 1; round < rounds; round++) {
+                round_key = round_keys[round];
+                b0 = __builtin_ia32_aesenc128(b0, round_key);
+                b1 = __builtin_ia32_aesenc128(b1, round_key);
+                b2 = __builtin_ia32_aesenc128(b2, round_key);
+                b3 = __builtin_ia32_aesenc128(b3, round_key);
+                b4 = __builtin_ia32_aesenc128(b4, round_key);
+                b5 = __builtin_ia32_aesenc128(b5, round_key);
+                b6 = __builtin_ia32_aesenc128(b6, round_key);
+                b7 = __builtin_ia32_aesenc128(b7, round_key);
+            }
+            round_key = round_keys[rounds];
+            b0 = __builtin_ia32_aesenclast128(b0, round_key);
+            b1 = __builtin_ia32_aesenclast128(b1, round_key);
+            b2 = __builtin_ia32_aesenclast128(b2, round_key);
+            b3 = __builtin_ia32_aesenclast128(b3, round_key);
+            b4 = __builtin_ia32_aesenclast128(b4, round_key);
+            b5 = __builtin_ia32_aesenclast128(b5, round_key);
+            b6 = __builtin_ia32_aesenclast128(b6, round_key);
+            b7 = __builtin_ia32_aesenclast128(b7, round_key);
+        } else {
+            for (uint32_t round = 1; round < rounds; round++) {
+                round_key = round_keys[round];
+                b0 = __builtin_ia32_aesdec128(b0, round_key);
+                b1 = __builtin_ia32_aesdec128(b1, round_key);
+                b2 = __builtin_ia32_aesdec128(b2, round_key);
+                b3 = __builtin_ia32_aesdec128(b3, round_key);
+                b4 = __builtin_ia32_aesdec128(b4, round_key);
+                b5 = __builtin_ia32_aesdec128(b5, round_key);
+                b6 = __builtin_ia32_aesdec128(b6, round_key);
+                b7 = __builtin_ia32_aesdec128(b7, round_key);
+            }
+            round_key = round_keys[rounds];
+            b0 = __builtin_ia32_aesdeclast128(b0, round_key);
+            b1 = __builtin_ia32_aesdeclast128(b1, round_key);
+            b2 = __builtin_ia32_aesdeclast128(b2, round_key);
+            b3 = __builtin_ia32_aesdeclast128(b3, round_key);
+            b4 = __builtin_ia32_aesdeclast128(b4, round_key);
+            b5 = __builtin_ia32_aesdeclast128(b5, round_key);
+            b6 = __builtin_ia32_aesdeclast128(b6, round_key);
+            b7 = __builtin_ia32_aesdeclast128(b7, round_key);
+        }
+
+        aes_unaligned_t *out = (aes_unaligned_t *) output;
+        out[0] = b0 ^ t0;
+        out[1] = b1 ^ t1;
+        out[2] = b2 ^ t2;
+        out[3] = b3 ^ t3;
+        out[4] = b4 ^ t4;
+        out[5] = b5 ^ t5;
+        out[6] = b6 ^ t6;
+        out[7] = b7 ^ t7;
+        input += AES_XTS_PARALLEL * AES_BLOCK_BYTES;
+        output += AES_XTS_PARALLEL * AES_BLOCK_BYTES;
+        blocks -= AES_XTS_PARALLEL;
+    }
+
+    // Data units that are not a multiple of 128 bytes finish one block at a time
+    while (blocks > 0) {
+        aes_block_t block = *(const aes_unaligned_t *) input ^ tweak ^ round_keys[0];
+        for (uint32_t round = 1; round < rounds; round++) {
+            block = encrypt ? __builtin_ia32_aesenc128(block, round_keys[round])
+                : __builtin_ia32_aesdec128(block, round_keys[round]);
+        }
+        block = encrypt ? __builtin_ia32_aesenclast128(block, round_keys[rounds])
+            : __builtin_ia32_aesdeclast128(block, round_keys[rounds]);
+        *(aes_unaligned_t *) output = block ^ tweak;
+
+        tweak = multiply_tweak(tweak);
+        input += AES_BLOCK_BYTES;
+        output += AES_BLOCK_BYTES;
+        blocks--;
+    }
+}
+
+static void crypt_block_table(const uint32_t *round_keys, uint32_t rounds, bool encrypt,
+    const uint8_t *input, uint8_t *output) {
+    uint32_t s[4];
+    uint32_t t[4];
+    memcpy(s, input, AES_BLOCK_BYTES);
+    for (uint32_t column = 0; column < 4; column++) s[column] ^= round_keys[column];
+
+    // ShiftRows takes row r of each column from r columns to the right, InvShiftRows from r
+    // columns to the left
+    const uint32_t *table = encrypt ? aes_encrypt_table : aes_decrypt_table;
+    const uint8_t *sbox = encrypt ? aes_sbox : aes_inverse_sbox;
+    uint32_t step = encrypt ? 1 : 3;
+    for (uint32_t round = 1; round < rounds; round++) {
+        for (uint32_t c = 0; c < 4; c++) {
+            t[c] = table[s[c] & 0xFF]
+                ^ rotate_left(table[(s[(c + step) & 3] >> 8) & 0xFF], 8)
+                ^ rotate_left(table[(s[(c + 2 * step) & 3] >> 16) & 0xFF], 16)
+                ^ rotate_left(table[s[(c + 3 * step) & 3] >> 24], 24)
+                ^ round_keys[4 * round + c];
+        }
+        memcpy(s, t, sizeof(s));
+    }
+    for (uint32_t c = 0; c < 4; c++) {
+        t[c] = (sbox[s[c] & 0xFF] | (uint32_t) sbox[(s[(c + step) & 3] >> 8) & 0xFF] << 8
+            | (uint32_t) sbox[(s[(c + 2 * step) & 3] >> 16) & 0xFF] << 16
+            | (uint32_t) sbox[s[(c + 3 * step) & 3] >> 24] << 24)
+            ^ round_keys[4 * rounds + c];
+    }
+    memcpy(output, t, AES_BLOCK_BYTES);
+}
+
+static void next_tweak(uint64_t tweak[2]) {
+    uint64_t carry = tweak[1] >> 63;
+    tweak[1] = tweak[1] << 1 | tweak[0] >> 63;
+    tweak[0] = tweak[0] << 1 ^ (carry ? AES_XTS_FEEDBACK : 0);
+}
+
+static aes_block_t multiply_tweak(aes_block_t tweak) {
+    // Each half shifts left by one. The top bit of the low half carries into the high half, and
+    // the top bit of the high half wraps round as the feedback polynomial. Shifting right
+    // arithmetically turns the top bits into masks, which the shuffle swaps between the halves
+    const aes_block_t feedback = { AES_XTS_FEEDBACK, 1 };
+    aes_block_t carries = __builtin_shuffle(tweak >> 63, (aes_block_t) { 1, 0 });
+    return (tweak << 1) ^ (carries & feedback);
+}
+
+static uint32_t inverse_mix_column(uint32_t column) {
+    // The decryption table applies the inverse S-box first, which the S-box undoes
+    return aes_decrypt_table[aes_sbox[column & 0xFF]]
+        ^ rotate_left(aes_decrypt_table[aes_sbox[(column >> 8) & 0xFF]], 8)
+        ^ rotate_left(aes_decrypt_table[aes_sbox[(column >> 16) & 0xFF]], 16)
+        ^ rotate_left(aes_decrypt_table[aes_sbox[column >> 24]], 24);
+}
+
+static uint32_t substitute_word(uint32_t word) {
+    return aes_sbox[word & 0xFF] | (uint32_t) aes_sbox[(word >> 8) & 0xFF] << 8
+        | (uint32_t) aes_sbox[(word >> 16) & 0xFF] << 16 | (uint32_t) aes_sbox[word >> 24] << 24;
+}
+
+static uint8_t gf_multiply(uint8_t a, uint8_t b) {
+    uint8_t product = 0;
+    while (b != 0) {
+        if (b & 1) product ^= a;
+        a = (uint8_t) (a << 1) ^ (a & 0x80 ? 0x1B : 0);
+        b >>= 1;
+    }
+    return product;
+}
+
+static uint32_t rotate_left(uint32_t word, uint32_t bits) {
+    return word << bits | word >> (32 - bits);
+}
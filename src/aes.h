@@ -0,0 +1,126 @@
+#ifndef _AES_H_
+#define _AES_H_
+
+#define AES_BLOCK_BYTES 16
+#define AES_MAX_ROUNDS 14               // AES-256, 10 for AES-128
+#define AES_XTS_PARALLEL 8              // Blocks interleaved through the AES-NI rounds at once
+#define AES_XTS_FEEDBACK 0x87           // x^7 + x^2 + x + 1, reducing tweaks modulo x^128 + 0x87
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/**
+ * @brief One AES block as the AES-NI instructions take it, and the same for loads that may be
+ * unaligned
+ */
+typedef long long aes_block_t __attribute__((vector_size(16)));
+typedef long long aes_unaligned_t __attribute__((vector_size(16), aligned(1)));
+
+/**
+ * @brief Expanded AES key. Round keys are little endian words, 4 per round, and the decryption
+ * keys are in the order of the equivalent inverse cipher, which is also what AESDEC expects
+ */
+typedef struct aes_key {
+    uint32_t encrypt[4 * (AES_MAX_ROUNDS + 1)] __attribute__((aligned(16)));
+    uint32_t decrypt[4 * (AES_MAX_ROUNDS + 1)] __attribute__((aligned(16)));
+    uint32_t rounds;
+} aes_key_t;
+
+/**
+ * @brief XTS-AES key pair: one key encrypts the data, the other the data unit numbers into tweaks
+ */
+typedef struct aes_xts_key {
+    aes_key_t data;
+    aes_key_t tweak;
+} aes_xts_key_t;
+
+/**
+ * @brief Expands an XTS-AES key, the data key followed by the tweak key
+ * 
+ * @param length 32 bytes for XTS-AES-128 or 64 for XTS-AES-256
+ * @return False for any other length, or if the data and tweak keys are the same
+ */
+bool aes_xts_set_key(aes_xts_key_t *key, const uint8_t *bytes, uint32_t length);
+
+/**
+ * @brief Encrypts one data unit (a sector) with XTS-AES. Input and output may be the same buffer
+ * 
+ * @param unit Data unit number the tweak is made from, normally the LBA
+ * @param length Bytes in the data unit, a multiple of AES_BLOCK_BYTES
+ */
+void aes_xts_encrypt(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t length);
+
+/**
+ * @brief Decrypts one data unit encrypted by aes_xts_encrypt, in place if input is output
+ */
+void aes_xts_decrypt(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t length);
+
+/**
+ * @brief Returns the name of the AES implementation in use: "aes-ni" or "table"
+ */
+const char *aes_implementation();
+
+/**
+ * @brief Builds the S-boxes and round tables and picks the implementation on first use
+ */
+static void init_aes();
+
+/**
+ * @brief Expands a 16 or 32 byte key into encryption and decryption round keys
+ */
+static void expand_key(aes_key_t *key, const uint8_t *bytes, uint32_t length);
+
+/**
+ * @brief XTS over whole blocks with the lookup tables, one block at a time
+ */
+static void xts_table(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t blocks, bool encrypt);
+
+/**
+ * @brief XTS over whole blocks with AES-NI, AES_XTS_PARALLEL blocks at a time
+ */
+static void xts_aesni(const aes_xts_key_t *key, uint64_t unit, const uint8_t *input,
+    uint8_t *output, uint32_t blocks, bool encrypt);
+
+/**
+ * @brief Encrypts or decrypts a single block with the lookup tables
+ * 
+ * @param round_keys The key's encrypt or decrypt round keys
+ */
+static void crypt_block_table(const uint32_t *round_keys, uint32_t rounds, bool encrypt,
+    const uint8_t *input, uint8_t *output);
+
+/**
+ * @brief Multiplies a tweak by x in GF(2^128), moving it on to the next block
+ */
+static void next_tweak(uint64_t tweak[2]);
+
+/**
+ * @brief next_tweak for a tweak held in a vector register
+ */
+static aes_block_t multiply_tweak(aes_block_t tweak);
+
+/**
+ * @brief Applies InvMixColumns to one column, for the decryption round keys
+ */
+static uint32_t inverse_mix_column(uint32_t column);
+
+/**
+ * @brief Applies the S-box to each byte of a word
+ */
+static uint32_t substitute_word(uint32_t word);
+
+/**
+ * @brief Multiplies two elements of GF(2^8) modulo the AES polynomial
+ */
+static uint8_t gf_multiply(uint8_t a, uint8_t b);
+
+/**
+ * @brief Rotates a word left by the given number of bits, which must be between 1 and 31
+ */
+static uint32_t rotate_left(uint32_t word, uint32_t bits);
+
+#endif
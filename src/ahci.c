@@ -2,25 +2,22 @@
 #include "std.h"
 #include "defs.h"
 #include "pci.h"
+#include "timer.h"
+#include "blk.h"
+
+static const blk_ops_t ahci_ops = {ahci_submit, ahci_poll, ahci_abort};
 
 bool init_ahci(pci_device_list_t device_list) {
     if (BOOT_VERBOSE) {
         printf("Starting initialisation for AHCI\n");
     }
 
-    size_t device_list_size = device_list.device_list_size;
-    pci_header_t **all_devices = device_list.all_devices;
-
+    // The first SATA controller in AHCI mode
+    pci_match_t match = {PCI_ANY, PCI_ANY, 0x01, 0x06, PCI_ANY, 0x0};
+    uint32_t index;
     pci_header_0_t *ahci_entry = NULL;
-
-    // Iterate over all PCI devices to find ACPI
-    for (size_t i = 0; i < device_list_size; i++) {
-        pci_header_t *pci_header = all_devices[i];
-
-        if (is_ahci(pci_header)) {
-            ahci_entry = pci_header;
-            break;
-        }
+    if (pci_find(&device_list, &match, &index, 1) > 0) {
+        ahci_entry = (pci_header_0_t *) device_list.all_devices[index];
     }
 
     if (ahci_entry == NULL) {
@@ -28,30 +25,54 @@ bool init_ahci(pci_device_list_t device_list) {
         return false;
     }
 
-    enable_msi(ahci_entry);
+    // The vector is programmed but never raised, since HBA interrupts stay off
+    uint8_t vector = device_list.capabilities[index].msi != 0 ? pci_allocate_vectors(1) : 0;
+    if (vector != 0) {
+        enable_msi(&device_list, index, vector);
+    }
+    ahci_entry->command |= 0x6; // Memory space and bus master, so the HBA can DMA
     
-    hba_t *hba = ahci_entry->bar5; // Get the HBA table from ABAR (BAR5)
-    hba_port_t *port;
+    // Get the HBA table from ABAR (BAR5)
+    hba_t *hba = (hba_t *) (uint64_t) (ahci_entry->bar5 & ~0xF);
+    uint32_t open_ports;
 
-    bool success = find_open_port(hba, &port);
+    bool success = find_open_ports(hba, &open_ports);
     if (!success) {
         return false;
     }
 
+    hba->global_host_control |= HBA_GHC_AHCI_ENABLE;
+
+    // Every active port becomes its own block device, so volumes can span them
+    uint32_t port_count = 0;
+    while (open_ports) {
+        uint8_t port_number = __builtin_ctz(open_ports);
+        open_ports &= open_ports - 1;
+        if (init_port(hba, port_number, port_count)) {
+            port_count++;
+        }
+    }
+    return port_count > 0;
+}
+
+static bool init_port(hba_t *hba, uint8_t port_number, uint32_t index) {
+    hba_port_t *port = &hba->ports[port_number];
+
     if (BOOT_VERBOSE) {
         uint8_t type = check_type(port);
+        printf("Port %d: ", (uint64_t) port_number);
         switch (type) {
             case AHCI_DEV_SATA:
-                printf("Chosen device is a SATA device\n");
+                printf("SATA device\n");
                 break;
             case AHCI_DEV_SATAPI:
-                printf("Chosen device is a SATAPI device\n");
+                printf("SATAPI device\n");
                 break;
             case AHCI_DEV_SEMB:
-                printf("Chosen device is a SEMB device\n");
+                printf("SEMB device\n");
                 break;
             case AHCI_DEV_PM:
-                printf("Chosen device is a PM device\n");
+                printf("PM device\n");
                 break;
             
             default:
@@ -59,22 +80,136 @@ bool init_ahci(pci_device_list_t device_list) {
                 break;
         }
 
-        printf("Enter anything for next: ");
-        char c = getchar();
-        printf("\n");
+        if (!BENCH_MODE) {
+            printf("Enter anything for next: ");
+            char c = getchar();
+            printf("\n");
+        }
+    }
+
+    // Only ATA drives take the read and write commands below
+    if (check_type(port) != AHCI_DEV_SATA) {
+        return false;
+    }
+
+    ahci_port_t *new_port = malloc(sizeof(ahci_port_t));
+    if (new_port == NULL) {
+        handle_error("Could not allocate AHCI port\n");
+        return false;
+    }
+    memset(new_port, 0, sizeof(ahci_port_t));
+    new_port->hba = hba;
+    new_port->port = port;
+    new_port->port_number = port_number;
+    new_port->slot_count = ((hba->capabilities >> 8) & 0x1F) + 1; // Bits 8-12
+    new_port->device.ops = &ahci_ops;
+    new_port->device.driver = new_port;
+
+    if (!rebase_port(new_port) || !identify_device(new_port)) {
+        free(new_port);
+        return false;
+    }
+
+    if (BOOT_VERBOSE) {
+        printf("Port %d: %d sectors of %d bytes, NCQ %s, queue depth %d\n",
+            (uint64_t) new_port->port_number, new_port->sector_count,
+            (uint64_t) new_port->sector_size, new_port->ncq ? "on" : "off",
+            (uint64_t) new_port->queue_depth);
+    }
+
+    blk_device_t *device = &new_port->device;
+    snprintf(device->name, BLK_NAME_LENGTH, "sata%d", (uint64_t) index);
+    device->sector_size = new_port->sector_size;
+    device->sector_count = new_port->sector_count;
+    // Each segment can add one PRD entry to the 4MB splits the transfer size needs, so the size
+    // is limited to what the entries left over can describe
+    device->max_transfer = (uint64_t) (AHCI_PRDT_ENTRIES - AHCI_MAX_SEGMENTS)
+        * AHCI_PRD_MAX_BYTES / new_port->sector_size;
+    if (device->max_transfer > AHCI_MAX_SECTORS) device->max_transfer = AHCI_MAX_SECTORS;
+    device->max_segments = AHCI_MAX_SEGMENTS;
+    device->queue_depth = new_port->queue_depth;
+    if (!blk_register(device)) {
+        free(new_port);
+        return false;
+    }
+    return true;
+}
+
+static bool ahci_submit(blk_device_t *device, io_request_t *request) {
+    ahci_port_t *ahci_port = device->driver;
+    bool queued = ahci_port->ncq && (request->op == IO_OP_READ || request->op == IO_OP_WRITE);
+
+    // Queued and non-queued commands cannot be outstanding at the same time
+    if (ahci_port->non_queued_busy) return false;
+    if (!queued && ahci_port->slots_in_flight != 0) return false;
+
+    uint32_t busy = ahci_port->slots_in_flight
+        | ahci_port->port->command_issue
+        | ahci_port->port->sata_active;
+    uint8_t slot;
+    for (slot = 0; slot < ahci_port->queue_depth; slot++) {
+        if (!(busy & (1 << slot))) break;
     }
+    if (slot == ahci_port->queue_depth) return false;
 
+    if (!build_command(ahci_port, slot, request)) {
+        // Issuing part of the transfer would complete it as a success
+        handle_error("AHCI request does not fit in a command table\n");
+        request->success = false;
+        request->submit_ticks = timer_ticks();
+        request->complete_ticks = request->submit_ticks;
+        blk_complete(request);
+        return true;
+    }
+
+    ahci_port->slots[slot] = request;
+    ahci_port->slots_in_flight |= 1 << slot;
+    ahci_port->non_queued_busy = !queued;
+    request->submit_ticks = timer_ticks();
+
+    if (queued) {
+        ahci_port->port->sata_active = 1 << slot;
+    }
+    ahci_port->port->command_issue = 1 << slot;
     return true;
 }
 
-static bool is_ahci(pci_header_t *pci_header) {
-    return
-        swap_byte(pci_header->header_type) == 0x0 &&
-        pci_header->class_code == 0x01 &&
-        pci_header->subclass == 0x06;
+static uint32_t ahci_poll(blk_device_t *device) {
+    ahci_port_t *ahci_port = device->driver;
+    hba_port_t *port = ahci_port->port;
+
+    if (port->interrupt_status & HBA_PxIS_TFES) {
+        return recover_port(ahci_port);
+    }
+
+    uint32_t done = ahci_port->slots_in_flight & ~(port->command_issue | port->sata_active);
+    if (done == 0) return 0;
+
+    port->interrupt_status = port->interrupt_status; // Write 1 to clear
+    ahci_port->slots_in_flight &= ~done;
+    ahci_port->non_queued_busy = false;
+
+    uint64_t now = timer_ticks();
+    uint32_t completed = 0;
+    while (done) {
+        uint8_t slot = __builtin_ctz(done);
+        done &= done - 1;
+
+        io_request_t *request = ahci_port->slots[slot];
+        ahci_port->slots[slot] = NULL;
+        request->success = true;
+        request->complete_ticks = now;
+        blk_complete(request);
+        completed++;
+    }
+    return completed;
+}
+
+static void ahci_abort(blk_device_t *device) {
+    recover_port(device->driver);
 }
 
-static bool find_open_port(hba_t *hba, hba_port_t** port) {
+static bool find_open_ports(hba_t *hba, uint32_t *open_ports) {
     printf("Ports Supported: %d\n", (hba->capabilities & 0x1F) + 1);  // First 5 bits
     uint8_t no_supported_ports = 0;
     for (uint8_t port = 0; port < 32; port++) {
@@ -151,25 +286,23 @@ static bool find_open_port(hba_t *hba, hba_port_t** port) {
         }
     }
 
-    bool is_open_port = false;
-    hba_port_t *connected_port;
+    uint32_t connected_ports = 0;
     for (uint8_t port = 0; port < no_supported_ports; port++) {
         port_t current_port = ports[port];
         if (current_port.status == HBA_PORT_DET_PRESENT &&
             current_port.power == HBA_PORT_IPM_ACTIVE) {
-            is_open_port = true;
-            connected_port = &hba->ports[current_port.port_number];
+            connected_ports |= 1 << current_port.port_number;
         }
     }
 
     free(ports);
 
-    if (!is_open_port) {
+    if (connected_ports == 0) {
         handle_error("Could not find any SATA port with an active connection.\n");
         return false;
     }
 
-    *port = connected_port;
+    *open_ports = connected_ports;
     return true;
 }
 
@@ -184,4 +317,270 @@ static uint8_t check_type(hba_port_t *port) {
         default:
             return AHCI_DEV_SATA;
 	}
+}
+
+static bool rebase_port(ahci_port_t *ahci_port) {
+    hba_port_t *port = ahci_port->port;
+
+    if (!stop_command_engine(port)) {
+        handle_error("Could not stop the AHCI command engine\n");
+        return false;
+    }
+
+    // 32 command headers of 32 bytes (1K aligned), then the 256 byte received FIS area
+    ahci_port->command_list = dma_alloc(1024 + sizeof(hba_fis_t));
+    if (ahci_port->command_list == NULL) {
+        handle_error("Could not allocate AHCI command list\n");
+        return false;
+    }
+    ahci_port->fis = (hba_fis_t *) ((uint8_t *) ahci_port->command_list + 1024);
+
+    // Each command table is 128 bytes followed by its PRDT, and must be 128 byte aligned
+    size_t table_size = sizeof(hba_cmd_tbl_t) + (AHCI_PRDT_ENTRIES - 1) * sizeof(hba_prdt_entry_t);
+    uint8_t *tables = dma_alloc(table_size * ahci_port->slot_count);
+    if (tables == NULL) {
+        handle_error("Could not allocate AHCI command tables\n");
+        return false;
+    }
+
+    for (uint8_t slot = 0; slot < ahci_port->slot_count; slot++) {
+        hba_cmd_tbl_t *table = (hba_cmd_tbl_t *) (tables + slot * table_size);
+        ahci_port->command_tables[slot] = table;
+        ahci_port->command_list[slot].ctd_base_address = (uint32_t) (uint64_t) table;
+        ahci_port->command_list[slot].ctd_bass_address_upper = (uint64_t) table >> 32;
+    }
+
+    uint64_t command_list = (uint64_t) ahci_port->command_list;
+    uint64_t fis = (uint64_t) ahci_port->fis;
+    port->command_list_base = (uint32_t) command_list;
+    port->command_list_upper = command_list >> 32;
+    port->fis_base = (uint32_t) fis;
+    port->fis_upper = fis >> 32;
+
+    port->sata_error = port->sata_error;               // Write 1 to clear
+    port->interrupt_status = port->interrupt_status;
+    if (!start_command_engine(port)) {
+        handle_error("Could not start the AHCI command engine\n");
+        return false;
+    }
+    return true;
+}
+
+static bool stop_command_engine(hba_port_t *port) {
+    port->command_and_status &= ~HBA_PxCMD_ST;
+    port->command_and_status &= ~HBA_PxCMD_FRE;
+
+    // The engines have 500ms to acknowledge
+    uint64_t deadline = timer_ticks() + ns_to_ticks(500000000);
+    while (port->command_and_status & (HBA_PxCMD_FR | HBA_PxCMD_CR)) {
+        if (timer_ticks() > deadline) return false;
+    }
+    return true;
+}
+
+static bool start_command_engine(hba_port_t *port) {
+    uint64_t deadline = timer_ticks() + ns_to_ticks(500000000);
+    while (port->command_and_status & HBA_PxCMD_CR) {
+        if (timer_ticks() > deadline) return false;
+    }
+    port->command_and_status |= HBA_PxCMD_FRE;
+    port->command_and_status |= HBA_PxCMD_ST;
+    return true;
+}
+
+static bool reset_link(hba_port_t *port) {
+    // DET = 1 sends COMRESET for as long as it is set, which has to be at least 1ms
+    port->sata_control = (port->sata_control & ~0xF) | 0x1;
+    uint64_t deadline = timer_ticks() + ns_to_ticks(1000000);
+    while (timer_ticks() < deadline);
+    port->sata_control &= ~0xF;
+
+    deadline = timer_ticks() + ns_to_ticks((uint64_t) AHCI_LINK_TIMEOUT_MS * 1000000);
+    while ((port->sata_status & 0xF) != HBA_PORT_DET_PRESENT) {
+        if (timer_ticks() > deadline) return false;
+    }
+    port->sata_error = port->sata_error;
+    return true;
+}
+
+static bool identify_device(ahci_port_t *ahci_port) {
+    uint16_t *identify = dma_alloc(512);
+    if (identify == NULL) {
+        handle_error("Could not allocate IDENTIFY buffer\n");
+        return false;
+    }
+
+    // IDENTIFY is issued before the queue depth is known, so use a single slot
+    ahci_port->queue_depth = 1;
+    ahci_port->sector_size = 512;
+
+    io_request_t request = {0};
+    request.op = AHCI_OP_IDENTIFY;
+    request.count = 1;
+    request.buffer = identify;
+    if (!submit_and_wait(ahci_port, &request)) {
+        dma_free(identify, 512);
+        handle_error("IDENTIFY DEVICE failed\n");
+        return false;
+    }
+
+    ahci_port->sector_count = *(uint64_t *) &identify[100]; // Words 100-103, 48-bit LBA count
+    if ((identify[106] & 0xC000) == 0x4000 && (identify[106] & (1 << 12))) {
+        ahci_port->sector_size = 2 * (identify[117] | (uint32_t) identify[118] << 16);
+    }
+
+    bool drive_ncq = identify[76] & (1 << 8);
+    ahci_port->ncq = drive_ncq && (ahci_port->hba->capabilities & HBA_CAP_NCQ);
+
+    // FPDMA commands always carry FUA, otherwise it needs WRITE DMA FUA EXT (word 84 bit 6)
+    ahci_port->device.capabilities = BLK_CAP_FLUSH;
+    if (ahci_port->ncq || (identify[84] & (1 << 6))) {
+        ahci_port->device.capabilities |= BLK_CAP_FUA;
+    }
+    ahci_port->queue_depth = ahci_port->slot_count;
+    if (ahci_port->ncq) {
+        uint8_t drive_depth = (identify[75] & 0x1F) + 1;
+        if (drive_depth < ahci_port->queue_depth) ahci_port->queue_depth = drive_depth;
+    }
+
+    dma_free(identify, 512);
+    return true;
+}
+
+static bool build_command(ahci_port_t *ahci_port, uint8_t slot, io_request_t *request) {
+    hba_cmd_header_t *header = &ahci_port->command_list[slot];
+    hba_cmd_tbl_t *table = ahci_port->command_tables[slot];
+    bool write = request->op == IO_OP_WRITE;
+    bool queued = ahci_port->ncq && (request->op == IO_OP_READ || request->op == IO_OP_WRITE);
+    uint64_t bytes = (uint64_t) request->count * ahci_port->sector_size;
+
+    memset(table, 0, sizeof(hba_cmd_tbl_t));
+
+    // Split each segment into PRD entries of at most 4MB each
+    hba_prdt_entry_t *prdt = &table->prdt_entry;
+    uint16_t entries = 0;
+    // IDENTIFY is built here without going through the block layer, so wrap the buffer directly
+    io_segment_t single = { request->buffer, bytes };
+    uint32_t segment_count = bytes > 0 ? 1 : 0;
+    io_segment_t *segments = &single;
+    if (request->segment_count != 0) {
+        segment_count = request->segment_count;
+        segments = request->segments;
+    }
+    for (uint32_t i = 0; i < segment_count; i++) {
+        uint8_t *buffer = segments[i].buffer;
+        uint32_t remaining = segments[i].length;
+        while (remaining > 0 && entries < AHCI_PRDT_ENTRIES) {
+            uint32_t chunk = remaining > AHCI_PRD_MAX_BYTES ? AHCI_PRD_MAX_BYTES : remaining;
+            prdt[entries].data_base_address = (uint32_t) (uint64_t) buffer;
+            prdt[entries].data_base_address_upper = (uint64_t) buffer >> 32;
+            prdt[entries].reserved = 0;
+            prdt[entries].options = chunk - 1; // Byte count is stored minus one
+            buffer += chunk;
+            remaining -= chunk;
+            entries++;
+        }
+        if (remaining > 0) return false;
+    }
+
+    header->options = (sizeof(fis_reg_h2d_t) / 4) | (write ? 1 << 6 : 0);
+    header->options1 = 0;
+    header->prd_table_length = entries;
+    header->prd_byte_count = 0;
+
+    fis_reg_h2d_t *fis = (fis_reg_h2d_t *) table->command_fis;
+    fis->fis_type = fis_reg_h2d_e;
+    fis->options = 1 << 7; // Command
+    fis->device = 1 << 6;  // LBA mode
+
+    uint64_t lba = request->lba;
+    fis->lba0 = lba;
+    fis->lba1 = lba >> 8;
+    fis->lba2 = lba >> 16;
+    fis->lba3 = lba >> 24;
+    fis->lba4 = lba >> 32;
+    fis->lba5 = lba >> 40;
+
+    if (request->op == AHCI_OP_IDENTIFY) {
+        fis->command = ATA_CMD_IDENTIFY;
+        fis->device = 0;
+    } else if (request->op == IO_OP_FLUSH) {
+        fis->command = ATA_CMD_FLUSH_CACHE_EXT;
+        fis->device = 0;
+    } else if (queued) {
+        // NCQ carries the count in the features register and the tag in the count register
+        fis->command = write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED;
+        fis->feature_lower = request->count;
+        fis->feature_upper = request->count >> 8;
+        fis->count_lower = slot << 3;
+        if (request->flags & IO_FLAG_FUA) fis->device |= 1 << 7;
+    } else {
+        if (write) {
+            fis->command = (request->flags & IO_FLAG_FUA)
+                ? ATA_CMD_WRITE_DMA_FUA_EXT : ATA_CMD_WRITE_DMA_EXT;
+        } else {
+            fis->command = ATA_CMD_READ_DMA_EXT;
+        }
+        fis->count_lower = request->count;
+        fis->count_upper = request->count >> 8;
+    }
+    return true;
+}
+
+static uint32_t recover_port(ahci_port_t *ahci_port) {
+    hba_port_t *port = ahci_port->port;
+
+    // An engine that does not stop is hung, and a COMRESET of the link stops it
+    if (!stop_command_engine(port) && !reset_link(port)) {
+        handle_error("AHCI port did not come back after a COMRESET\n");
+    }
+    port->sata_error = port->sata_error;
+    port->interrupt_status = port->interrupt_status;
+    if (!start_command_engine(port)) handle_error("Could not restart the AHCI command engine\n");
+
+    // Callbacks may submit again into the freed slots, so every slot is emptied before any
+    // request completes
+    io_request_t *failed[32];
+    uint32_t count = 0;
+    uint32_t slots = ahci_port->slots_in_flight;
+    while (slots) {
+        uint8_t slot = __builtin_ctz(slots);
+        slots &= slots - 1;
+        failed[count++] = ahci_port->slots[slot];
+        ahci_port->slots[slot] = NULL;
+    }
+    ahci_port->slots_in_flight = 0;
+    ahci_port->non_queued_busy = false;
+
+    uint64_t now = timer_ticks();
+    for (uint32_t i = 0; i < count; i++) {
+        failed[i]->success = false;
+        failed[i]->complete_ticks = now;
+        blk_complete(failed[i]);
+    }
+    return count;
+}
+
+static void wait_complete(io_request_t *request) {
+    *(bool *) request->context = true;
+}
+
+static bool submit_and_wait(ahci_port_t *ahci_port, io_request_t *request) {
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) AHCI_COMMAND_TIMEOUT_MS * 1000000);
+    bool complete = false;
+    request->callback = wait_complete;
+    request->context = &complete;
+
+    while (!ahci_submit(&ahci_port->device, request)) {
+        ahci_poll(&ahci_port->device);
+        if (timer_ticks() > deadline) return false;
+    }
+    while (!complete) {
+        ahci_poll(&ahci_port->device);
+        if (timer_ticks() > deadline) {
+            recover_port(ahci_port);
+            return false;
+        }
+    }
+    return request->success;
 }
\ No newline at end of file
@@ -23,35 +23,173 @@
 #define HBA_PORT_DET_PRESENT 3
 #define HBA_PORT_DET_OFFLINE 4
 
+#define HBA_GHC_AHCI_ENABLE (1 << 31)
+#define HBA_CAP_NCQ (1 << 30)
+
+#define HBA_PxCMD_ST (1 << 0)
+#define HBA_PxCMD_FRE (1 << 4)
+#define HBA_PxCMD_FR (1 << 14)
+#define HBA_PxCMD_CR (1 << 15)
+#define HBA_PxIS_TFES (1 << 30)
+
+#define ATA_DEV_BUSY 0x80
+#define ATA_DEV_DRQ 0x08
+
+#define ATA_CMD_READ_DMA_EXT 0x25
+#define ATA_CMD_WRITE_DMA_EXT 0x35
+#define ATA_CMD_WRITE_DMA_FUA_EXT 0x3D
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY 0xEC
+
+#define AHCI_OP_IDENTIFY 0x80 // Driver internal, only issued during initialisation
+
+#define AHCI_PRDT_ENTRIES 24                    // One per segment plus 8 more 4MB splits
+#define AHCI_MAX_SEGMENTS 16
+#define AHCI_PRD_MAX_BYTES (4 * 1024 * 1024)   // 22-bit byte count
+#define AHCI_MAX_SECTORS 0xFFFF                 // 16-bit sector count
+#define AHCI_COMMAND_TIMEOUT_MS 5000
+#define AHCI_LINK_TIMEOUT_MS 1000
+
 #include <stdbool.h>
 
 #include "types.h"
+#include "blk.h"
+
+/**
+ * @brief A SATA port which has been set up to issue commands
+ */
+typedef struct ahci_port {
+    blk_device_t device;
+    hba_t *hba;
+    hba_port_t *port;
+    uint8_t port_number;
+    /**
+     * @brief Number of command slots the HBA supports, and how many of those the driver uses
+     */
+    uint8_t slot_count;
+    uint8_t queue_depth;
+    /**
+     * @brief True if the drive and HBA both support native command queuing
+     */
+    bool ncq;
+    uint32_t sector_size;
+    uint64_t sector_count;
+    hba_cmd_header_t *command_list;
+    hba_fis_t *fis;
+    hba_cmd_tbl_t *command_tables[32];
+    /**
+     * @brief Request currently occupying each command slot
+     */
+    io_request_t *slots[32];
+    uint32_t slots_in_flight;
+    /**
+     * @brief Set while a non-queued command is in flight, which may not be mixed with NCQ commands
+     */
+    bool non_queued_busy;
+} ahci_port_t;
 
 /**
- * @brief Initialises AHCI from a list of PCI devices
+ * @brief Initialises AHCI from a list of PCI devices, registering each active SATA port as a block
+ * device named "sataN"
  * 
  * @param device_list List of PCI devices to search within for AHCI devices
- * @return True if AHCI successfully found and initialised
+ * @return True if AHCI was found and at least one port initialised
  */
 bool init_ahci(pci_device_list_t device_list);
 
 /**
- * @brief Finds if the given PCI entry is an AHCI interface
+ * @brief Finds every open port in the given HBA
+ * 
+ * @param hba Input HBA to search for open ports
+ * @param open_ports Output bitmask of the open port numbers
+ * @return True if at least one open port was found
  */
-static bool is_ahci(pci_header_t *pci_header);
+static bool find_open_ports(hba_t *hba, uint32_t *open_ports);
 
 /**
- * @brief Finds the first open port in the given HBA, returning that entry
- * 
- * @param hba Input HBA to search for open ports
- * @param port Output port pointer
- * @return True if an open port was found and returned
+ * @brief Sets up an open port and registers it as the block device "sataN", N being index
  */
-static bool find_open_port(hba_t *hba, hba_port_t** port);
+static bool init_port(hba_t *hba, uint8_t port_number, uint32_t index);
 
 /**
  * @brief Finds and returns the type of the given port
  */
 static uint8_t check_type(hba_port_t *port);
 
+/**
+ * @brief Allocates the command list, received FIS area and command tables for the port, and starts
+ * its command engine
+ */
+static bool rebase_port(ahci_port_t *ahci_port);
+
+/**
+ * @brief Stops the port's command list and FIS receive engines
+ */
+static bool stop_command_engine(hba_port_t *port);
+
+/**
+ * @brief Starts the port's command list and FIS receive engines
+ * 
+ * @return False if the command list engine is still running from before
+ */
+static bool start_command_engine(hba_port_t *port);
+
+/**
+ * @brief Resets the link with a COMRESET, which also stops a hung command list engine
+ * 
+ * @return False if the device is not back within AHCI_LINK_TIMEOUT_MS
+ */
+static bool reset_link(hba_port_t *port);
+
+/**
+ * @brief Sends IDENTIFY DEVICE to find the capacity and queuing support of the drive
+ */
+static bool identify_device(ahci_port_t *ahci_port);
+
+/**
+ * @brief Fills in the command table of the given slot for the request
+ * 
+ * @return False if its buffers need more PRD entries than the table holds
+ */
+static bool build_command(ahci_port_t *ahci_port, uint8_t slot, io_request_t *request);
+
+/**
+ * @brief Issues a request to the port without waiting for it to complete
+ * 
+ * @return False if no command slot is free
+ */
+static bool ahci_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Completes any finished requests through blk_complete
+ * 
+ * @return Number of requests completed
+ */
+static uint32_t ahci_poll(blk_device_t *device);
+
+/**
+ * @brief Stops and restarts the port's command engine, failing every request in flight
+ */
+static void ahci_abort(blk_device_t *device);
+
+/**
+ * @brief Fails every request in flight and restarts the port after a task file error or a timeout,
+ * resetting the link if the command engine does not stop
+ * 
+ * @return Number of requests failed
+ */
+static uint32_t recover_port(ahci_port_t *ahci_port);
+
+/**
+ * @brief Callback used by submit_and_wait to flag its request as complete
+ */
+static void wait_complete(io_request_t *request);
+
+/**
+ * @brief Submits the request and polls until it completes
+ */
+static bool submit_and_wait(ahci_port_t *ahci_port, io_request_t *request);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,516 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "crc.h"
+#include "bcache.h"
+
+bcache_t *bcache_create(blk_device_t *device, uint32_t block_size, uint32_t block_count) {
+    if (block_size == 0) block_size = BCACHE_BLOCK_SIZE;
+    if (block_count == 0) block_count = BCACHE_BLOCK_COUNT;
+    if (block_size < device->sector_size) block_size = device->sector_size;
+    if (block_size % device->sector_size != 0) {
+        handle_error("Cache block size must be a multiple of the sector size\n");
+        return NULL;
+    }
+
+    bcache_t *cache = malloc(sizeof(bcache_t));
+    if (cache == NULL) {
+        handle_error("Could not allocate block cache\n");
+        return NULL;
+    }
+    memset(cache, 0, sizeof(bcache_t));
+    cache->device = device;
+    cache->block_size = block_size;
+    cache->sectors_per_block = block_size / device->sector_size;
+    cache->block_count = block_count;
+
+    // A power of two hash table with at least one bucket per block
+    uint32_t buckets = 1;
+    while (buckets < block_count) buckets <<= 1;
+    cache->hash_mask = buckets - 1;
+
+    cache->blocks = malloc(block_count * sizeof(bcache_block_t));
+    cache->hash = malloc(buckets * sizeof(bcache_block_t *));
+    cache->data = dma_alloc((size_t) block_count * block_size);
+    cache->edges = dma_alloc(2 * device->sector_size);
+    if (cache->blocks == NULL || cache->hash == NULL || cache->data == NULL
+        || cache->edges == NULL) {
+        free(cache->blocks);
+        free(cache->hash);
+        dma_free(cache->data, (size_t) block_count * block_size);
+        dma_free(cache->edges, 2 * device->sector_size);
+        free(cache);
+        handle_error("Could not allocate block cache\n");
+        return NULL;
+    }
+    memset(cache->blocks, 0, block_count * sizeof(bcache_block_t));
+    memset(cache->hash, 0, buckets * sizeof(bcache_block_t *));
+
+    cache->lru.lru_next = &cache->lru;
+    cache->lru.lru_prev = &cache->lru;
+    for (uint32_t i = 0; i < block_count; i++) {
+        bcache_block_t *block = &cache->blocks[i];
+        block->data = cache->data + (size_t) i * block_size;
+        block->lru_next = cache->lru.lru_next;
+        block->lru_prev = &cache->lru;
+        cache->lru.lru_next->lru_prev = block;
+        cache->lru.lru_next = block;
+    }
+    for (uint32_t i = 0; i < BCACHE_DIRECT_DEPTH; i++) {
+        cache->direct[i].callback = direct_complete;
+        cache->direct[i].context = cache;
+        cache->direct_idle[i] = &cache->direct[i];
+    }
+    cache->direct_idle_count = BCACHE_DIRECT_DEPTH;
+    if (BCACHE_CHECKSUMS && !bcache_enable_checksums(cache)) {
+        bcache_destroy(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+bool bcache_enable_checksums(bcache_t *cache) {
+    if (cache->checksums != NULL) return true;
+    uint32_t buckets = (cache->hash_mask + 1) * BCACHE_CHECKSUM_MULTIPLE;
+    uint32_t capacity = cache->block_count * BCACHE_CHECKSUM_MULTIPLE;
+    bcache_checksum_t **checksums = malloc(buckets * sizeof(bcache_checksum_t *));
+    bcache_checksum_t *entries = malloc(capacity * sizeof(bcache_checksum_t));
+    if (checksums == NULL || entries == NULL) {
+        free(checksums);
+        free(entries);
+        handle_error("Could not allocate block cache checksums\n");
+        return false;
+    }
+    memset(checksums, 0, buckets * sizeof(bcache_checksum_t *));
+    memset(entries, 0, capacity * sizeof(bcache_checksum_t));
+    cache->checksums = checksums;
+    cache->checksum_mask = buckets - 1;
+    cache->checksum_entries = entries;
+    cache->checksum_capacity = capacity;
+    cache->checksum_next = 0;
+
+    // Blocks already cached are trusted as they are
+    for (uint32_t i = 0; i < cache->block_count; i++) {
+        bcache_block_t *block = &cache->blocks[i];
+        if (!block->valid || block->dirty) continue;
+        uint32_t crc = crc32c(0, block->data, block_sectors(cache, block->block)
+            * cache->device->sector_size);
+        set_checksum(cache, block->block, crc);
+    }
+    return true;
+}
+
+void bcache_destroy(bcache_t *cache) {
+    if (cache == NULL) return;
+    bcache_sync(cache);
+    free(cache->checksums);
+    free(cache->checksum_entries);
+    dma_free(cache->data, (size_t) cache->block_count * cache->block_size);
+    dma_free(cache->edges, 2 * cache->device->sector_size);
+    free(cache->hash);
+    free(cache->blocks);
+    free(cache);
+}
+
+bcache_block_t *bcache_get(bcache_t *cache, uint64_t block) {
+    bcache_block_t *entry = find_block(cache, block);
+    if (entry != NULL) {
+        cache->stats.hits++;
+        entry->references++;
+        touch_block(cache, entry);
+        return entry;
+    }
+
+    cache->stats.misses++;
+    entry = evict_block(cache);
+    if (entry == NULL) return NULL;
+
+    if (!read_block(cache, entry, block)) return NULL;
+
+    entry->block = block;
+    entry->valid = true;
+    entry->dirty = false;
+    entry->references = 1;
+    uint32_t bucket = hash_block(cache, block);
+    entry->hash_next = cache->hash[bucket];
+    cache->hash[bucket] = entry;
+    touch_block(cache, entry);
+    return entry;
+}
+
+void bcache_put(bcache_t *cache, bcache_block_t *block) {
+    if (block != NULL && block->references > 0) block->references--;
+}
+
+void bcache_mark_dirty(bcache_t *cache, bcache_block_t *block) {
+    if (block->dirty) return;
+    block->dirty = true;
+    cache->dirty_count++;
+}
+
+bool bcache_read(bcache_t *cache, uint64_t offset, uint64_t length, void *buffer) {
+    return bcache_transfer(cache, false, offset, length, buffer, BCACHE_IO_AUTO);
+}
+
+bool bcache_write(bcache_t *cache, uint64_t offset, uint64_t length, const void *buffer) {
+    return bcache_transfer(cache, true, offset, length, (void *) buffer, BCACHE_IO_AUTO);
+}
+
+bool bcache_transfer(bcache_t *cache, bool write, uint64_t offset, uint64_t length, void *buffer,
+    uint32_t flags) {
+    uint8_t *data = buffer;
+    uint32_t sector_size = cache->device->sector_size;
+    bool direct = (flags & BCACHE_IO_DIRECT)
+        || (!(flags & BCACHE_IO_CACHED) && length >= BCACHE_DIRECT_MIN);
+    // Within one sector there is nothing to send directly
+    if (!direct || length == 0 || offset / sector_size == (offset + length - 1) / sector_size) {
+        return transfer_cached(cache, write, offset, length, data);
+    }
+
+    uint32_t head = (sector_size - offset % sector_size) % sector_size;
+    uint32_t tail = (offset + length) % sector_size;
+    // Drivers need dword aligned DMA addresses, and AHCI and NVMe drop the low bits of any other
+    if (((uint64_t) (data + head) & 0x3) != 0) {
+        return transfer_cached(cache, write, offset, length, data);
+    }
+    bool gather = !write && cache->device->max_segments >= BCACHE_DIRECT_SEGMENTS;
+    if (!gather) {
+        // Partial sectors are written by read-modify-write of cached blocks, and read through
+        // them when the device takes a single buffer per request
+        if (head != 0 && !transfer_cached(cache, write, offset, head, data)) return false;
+        if (tail != 0 && !transfer_cached(cache, write, offset + length - tail, tail,
+            data + length - tail)) {
+            return false;
+        }
+        offset += head;
+        data += head;
+        length -= head + tail;
+        if (length == 0) return true;
+    }
+
+    if (write) {
+        cache->stats.direct_writes++;
+    } else {
+        cache->stats.direct_reads++;
+    }
+    cache->stats.direct_bytes += length;
+    if (!transfer_direct(cache, write, offset, length, data)) return false;
+    return reconcile_direct(cache, write, offset, length, data);
+}
+
+bool bcache_sync(bcache_t *cache) {
+    bool success = true;
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < cache->block_count; i++) {
+        bcache_block_t *block = &cache->blocks[i];
+        if (!block->valid || !block->dirty) continue;
+        if (!write_back(cache, block)) success = false;
+        written++;
+    }
+    // Nothing to make durable if nothing was written
+    if (written == 0) return success;
+    return blk_flush(cache->device) && success;
+}
+
+void bcache_print_stats(bcache_t *cache) {
+    printf("bcache,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d\n", cache->device->name, cache->stats.hits,
+        cache->stats.misses, cache->stats.evictions, cache->stats.writebacks,
+        cache->stats.verified, cache->stats.checksum_errors, cache->stats.direct_reads,
+        cache->stats.direct_writes, cache->stats.direct_bytes);
+}
+
+static bool transfer_cached(bcache_t *cache, bool write, uint64_t offset, uint64_t length,
+    uint8_t *buffer) {
+    while (length > 0) {
+        uint64_t block_number = offset / cache->block_size;
+        uint32_t block_offset = offset - block_number * cache->block_size;
+        uint64_t chunk = cache->block_size - block_offset;
+        if (chunk > length) chunk = length;
+
+        bcache_block_t *block = bcache_get(cache, block_number);
+        if (block == NULL) return false;
+        if (write) {
+            memcpy(block->data + block_offset, buffer, chunk);
+            bcache_mark_dirty(cache, block);
+        } else {
+            memcpy(buffer, block->data + block_offset, chunk);
+        }
+        bcache_put(cache, block);
+
+        buffer += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+static bool transfer_direct(bcache_t *cache, bool write, uint64_t offset, uint64_t length,
+    uint8_t *buffer) {
+    blk_device_t *device = cache->device;
+    uint32_t sector_size = device->sector_size;
+    uint64_t end = offset + length;
+    uint64_t lba = offset / sector_size;
+    uint64_t end_lba = (end + sector_size - 1) / sector_size;
+
+    cache->direct_failed = false;
+    while (lba < end_lba) {
+        if (cache->direct_idle_count == 0 && !wait_direct(cache, BCACHE_DIRECT_DEPTH - 1)) {
+            return false;
+        }
+        io_request_t *request = cache->direct_idle[--cache->direct_idle_count];
+        uint64_t left = end_lba - lba;
+        uint32_t count = left < device->max_transfer ? left : device->max_transfer;
+        request->op = write ? IO_OP_WRITE : IO_OP_READ;
+        build_direct(cache, request, lba, count, offset, end, buffer);
+        blk_submit(device, request);
+        lba += count;
+    }
+    if (!wait_direct(cache, 0)) return false;
+    if (cache->direct_failed) {
+        handle_error("Direct block cache transfer failed\n");
+        return false;
+    }
+
+    // Only scatter-gather reads leave partial sectors in the edge buffers
+    uint32_t head = offset % sector_size;
+    uint32_t tail = end % sector_size;
+    if (head != 0) memcpy(buffer, cache->edges + head, sector_size - head);
+    if (tail != 0) memcpy(buffer + length - tail, cache->edges + sector_size, tail);
+    return true;
+}
+
+static void build_direct(bcache_t *cache, io_request_t *request, uint64_t lba, uint32_t count,
+    uint64_t offset, uint64_t end, uint8_t *buffer) {
+    uint32_t sector_size = cache->device->sector_size;
+    request->lba = lba;
+    request->count = count;
+    request->segment_count = 0;
+
+    bool head = lba * sector_size < offset;
+    bool tail = (lba + count) * sector_size > end;
+    if (!head && !tail) {
+        request->buffer = buffer + (lba * sector_size - offset);
+        return;
+    }
+
+    // The partial sectors are read whole into the edge buffers, the rest straight into buffer
+    io_segment_t *segments = cache->direct_segments[request - cache->direct];
+    uint32_t segment_count = 0;
+    uint64_t whole = lba;
+    uint64_t whole_end = lba + count;
+    if (head) {
+        segments[segment_count].buffer = cache->edges;
+        segments[segment_count++].length = sector_size;
+        whole++;
+    }
+    if (tail) whole_end--;
+    if (whole_end > whole) {
+        segments[segment_count].buffer = buffer + (whole * sector_size - offset);
+        segments[segment_count++].length = (whole_end - whole) * sector_size;
+    }
+    if (tail) {
+        segments[segment_count].buffer = cache->edges + sector_size;
+        segments[segment_count++].length = sector_size;
+    }
+    request->buffer = NULL;
+    request->segments = segments;
+    request->segment_count = segment_count;
+}
+
+static bool reconcile_direct(bcache_t *cache, bool write, uint64_t offset, uint64_t length,
+    uint8_t *buffer) {
+    // Clean cached blocks already match the device
+    if (!write && cache->dirty_count == 0) return true;
+
+    uint64_t end = offset + length;
+    for (uint64_t number = offset / cache->block_size; number * cache->block_size < end;
+        number++) {
+        uint64_t start = number * cache->block_size;
+        uint64_t first = start > offset ? start : offset;
+        uint64_t last = start + cache->block_size < end ? start + cache->block_size : end;
+        bcache_block_t *block = find_block(cache, number);
+        if (block == NULL) {
+            if (write && cache->checksums != NULL) drop_checksum(cache, number);
+            continue;
+        }
+
+        if (!write) {
+            if (block->dirty) {
+                memcpy(buffer + (first - offset), block->data + (first - start), last - first);
+            }
+            continue;
+        }
+        memcpy(block->data + (first - start), buffer + (first - offset), last - first);
+        // A dirty block gets its checksum when it is written back
+        if (!block->dirty && cache->checksums != NULL) {
+            set_checksum(cache, number,
+                crc32c(0, block->data, block_sectors(cache, number) * cache->device->sector_size));
+        }
+    }
+    return true;
+}
+
+static bool wait_direct(bcache_t *cache, uint32_t in_flight) {
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_TIMEOUT_MS * 1000000);
+    bool timed_out = false;
+    while (BCACHE_DIRECT_DEPTH - cache->direct_idle_count > in_flight) {
+        blk_poll(cache->device);
+        if (timer_ticks() <= deadline) continue;
+        if (timed_out) {
+            handle_error("Device kept direct block cache transfers after being aborted\n");
+            return false;
+        }
+
+        // The requests point into the caller's buffer and are reused by the next transfer, so
+        // the ones still queued are cancelled and the driver is aborted to fail the rest
+        handle_error("Direct block cache transfer timed out\n");
+        timed_out = true;
+        in_flight = 0;
+        for (uint32_t i = 0; i < BCACHE_DIRECT_DEPTH; i++) {
+            blk_cancel(cache->device, &cache->direct[i]);
+        }
+        if (cache->direct_idle_count < BCACHE_DIRECT_DEPTH) blk_abort(cache->device);
+        deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_ABORT_TIMEOUT_MS * 1000000);
+    }
+    return !timed_out;
+}
+
+static void direct_complete(io_request_t *request) {
+    bcache_t *cache = request->context;
+    if (!request->success) cache->direct_failed = true;
+    cache->direct_idle[cache->direct_idle_count++] = request;
+}
+
+static bcache_block_t *find_block(bcache_t *cache, uint64_t block) {
+    uint32_t bucket = hash_block(cache, block);
+    for (bcache_block_t *entry = cache->hash[bucket]; entry != NULL; entry = entry->hash_next) {
+        if (entry->block == block) return entry;
+    }
+    return NULL;
+}
+
+static bcache_block_t *evict_block(bcache_t *cache) {
+    bcache_block_t *entry = cache->lru.lru_prev;
+    while (entry != &cache->lru && entry->references > 0) entry = entry->lru_prev;
+    if (entry == &cache->lru) {
+        handle_error("Every block cache entry is in use\n");
+        return NULL;
+    }
+    if (!entry->valid) return entry;
+
+    if (entry->dirty && !write_back(cache, entry)) return NULL;
+    cache->stats.evictions++;
+
+    uint32_t bucket = hash_block(cache, entry->block);
+    bcache_block_t **link = &cache->hash[bucket];
+    while (*link != entry) link = &(*link)->hash_next;
+    *link = entry->hash_next;
+    entry->hash_next = NULL;
+    entry->valid = false;
+    return entry;
+}
+
+static bool read_block(bcache_t *cache, bcache_block_t *entry, uint64_t block) {
+    uint32_t sectors = block_sectors(cache, block);
+    if (sectors == 0) return false;
+    size_t bytes = (size_t) sectors * cache->device->sector_size;
+    for (uint32_t attempt = 0; attempt < 2; attempt++) {
+        if (!blk_read(cache->device, block * cache->sectors_per_block, sectors, entry->data)) {
+            return false;
+        }
+        if (cache->checksums == NULL) return true;
+
+        uint32_t crc = crc32c(0, entry->data, bytes);
+        bcache_checksum_t *checksum = find_checksum(cache, block);
+        if (checksum == NULL) {
+            set_checksum(cache, block, crc);
+            return true;
+        }
+        cache->stats.verified++;
+        if (checksum->crc == crc) return true;
+        cache->stats.checksum_errors++;
+    }
+    handle_error("Block cache checksum mismatch\n");
+    return false;
+}
+
+static void set_checksum(bcache_t *cache, uint64_t block, uint32_t crc) {
+    bcache_checksum_t *checksum = find_checksum(cache, block);
+    if (checksum == NULL) {
+        checksum = &cache->checksum_entries[cache->checksum_next];
+        cache->checksum_next = (cache->checksum_next + 1) % cache->checksum_capacity;
+        if (checksum->used) drop_checksum(cache, checksum->block);
+
+        uint32_t bucket = checksum_bucket(block, cache->checksum_mask);
+        checksum->block = block;
+        checksum->used = true;
+        checksum->next = cache->checksums[bucket];
+        cache->checksums[bucket] = checksum;
+    }
+    checksum->crc = crc;
+}
+
+static void drop_checksum(bcache_t *cache, uint64_t block) {
+    bcache_checksum_t **link = &cache->checksums[checksum_bucket(block, cache->checksum_mask)];
+    while (*link != NULL && (*link)->block != block) link = &(*link)->next;
+    if (*link == NULL) return;
+    bcache_checksum_t *checksum = *link;
+    *link = checksum->next;
+    checksum->next = NULL;
+    checksum->used = false;
+}
+
+static bcache_checksum_t *find_checksum(bcache_t *cache, uint64_t block) {
+    uint32_t bucket = checksum_bucket(block, cache->checksum_mask);
+    for (bcache_checksum_t *checksum = cache->checksums[bucket]; checksum != NULL;
+        checksum = checksum->next) {
+        if (checksum->block == block) return checksum;
+    }
+    return NULL;
+}
+
+static bool write_back(bcache_t *cache, bcache_block_t *block) {
+    uint32_t sectors = block_sectors(cache, block->block);
+    if (!blk_write(cache->device, block->block * cache->sectors_per_block, sectors, block->data)) {
+        return false;
+    }
+    if (cache->checksums != NULL) {
+        set_checksum(cache, block->block,
+            crc32c(0, block->data, (size_t) sectors * cache->device->sector_size));
+    }
+    block->dirty = false;
+    cache->dirty_count--;
+    cache->stats.writebacks++;
+    return true;
+}
+
+static void touch_block(bcache_t *cache, bcache_block_t *block) {
+    block->lru_prev->lru_next = block->lru_next;
+    block->lru_next->lru_prev = block->lru_prev;
+    block->lru_next = cache->lru.lru_next;
+    block->lru_prev = &cache->lru;
+    cache->lru.lru_next->lru_prev = block;
+    cache->lru.lru_next = block;
+}
+
+static uint32_t block_sectors(bcache_t *cache, uint64_t block) {
+    uint64_t first = block * cache->sectors_per_block;
+    if (first >= cache->device->sector_count) return 0;
+    uint64_t left = cache->device->sector_count - first;
+    return left < cache->sectors_per_block ? left : cache->sectors_per_block;
+}
+
+static uint32_t hash_block(bcache_t *cache, uint64_t block) {
+    // Fibonacci hashing spreads runs of consecutive blocks over the table
+    return (block * 0x9E3779B97F4A7C15ULL) >> 32 & cache->hash_mask;
+}
+
+static uint32_t checksum_bucket(uint64_t block, uint32_t mask) {
+    // Same hash as hash_block, the checksum table grows independently of the block table
+    return (block * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+}
@@ -0,0 +1,278 @@
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#define BCACHE_BLOCK_SIZE 4096          // Default bytes per cached block
+#define BCACHE_BLOCK_COUNT 1024         // Default blocks per cache, 4MB
+#define BCACHE_DIRECT_MIN (128 * 1024)  // Transfers at least this long bypass the cache by default
+#define BCACHE_DIRECT_DEPTH 8           // Direct requests in flight at once
+#define BCACHE_DIRECT_SEGMENTS 3        // Partial first sector, whole sectors, partial last sector
+#define BCACHE_CHECKSUM_MULTIPLE 4      // Checksums remembered per cached block
+
+#define BCACHE_IO_AUTO 0                // Direct if at least BCACHE_DIRECT_MIN bytes, else cached
+#define BCACHE_IO_DIRECT 0x1            // Whole sectors go straight to or from the caller's buffer
+#define BCACHE_IO_CACHED 0x2            // Everything is copied through cached blocks
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief One cached block of a device. Blocks with references are never evicted
+ */
+typedef struct bcache_block {
+    uint64_t block;
+    uint8_t *data;
+    uint32_t references;
+    bool valid;
+    bool dirty;
+    struct bcache_block *hash_next;
+    struct bcache_block *lru_prev;
+    struct bcache_block *lru_next;
+} bcache_block_t;
+
+/**
+ * @brief CRC32C of a block's contents when it was last read from or written to the device
+ */
+typedef struct bcache_checksum {
+    uint64_t block;
+    uint32_t crc;
+    bool used;
+    struct bcache_checksum *next;
+} bcache_checksum_t;
+
+typedef struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;
+    uint64_t verified;              // Misses checked against a known checksum
+    uint64_t checksum_errors;       // Reads that did not match, retried once before failing
+    uint64_t direct_reads;          // Transfers that bypassed the cache
+    uint64_t direct_writes;
+    uint64_t direct_bytes;
+} bcache_stats_t;
+
+/**
+ * @brief Write-back cache of fixed size blocks over a block device, looked up through a hash
+ * table and evicted least recently used first
+ */
+typedef struct bcache {
+    blk_device_t *device;
+    uint32_t block_size;
+    uint32_t sectors_per_block;
+    uint32_t block_count;
+    bcache_block_t *blocks;
+    uint8_t *data;
+    bcache_block_t **hash;
+    uint32_t hash_mask;
+    /**
+     * @brief Sentinel of the LRU list, most recently used first
+     */
+    bcache_block_t lru;
+    /**
+     * @brief Hash table of block checksums, NULL unless bcache_enable_checksums was called. It
+     * remembers blocks after they are evicted, so a block read back later is checked against
+     * what the cache saw before. Its entries are a ring of BCACHE_CHECKSUM_MULTIPLE per cached
+     * block, and a new checksum replaces the oldest, so the table never grows
+     */
+    bcache_checksum_t **checksums;
+    uint32_t checksum_mask;
+    bcache_checksum_t *checksum_entries;
+    uint32_t checksum_capacity;
+    uint32_t checksum_next;         // Ring position the next new checksum takes
+    /**
+     * @brief Blocks waiting to be written back. Direct reads only look for cached data to lay over
+     * what they read while this is non-zero
+     */
+    uint32_t dirty_count;
+    /**
+     * @brief Requests of the direct path and their scatter-gather lists
+     */
+    io_request_t direct[BCACHE_DIRECT_DEPTH];
+    io_segment_t direct_segments[BCACHE_DIRECT_DEPTH][BCACHE_DIRECT_SEGMENTS];
+    io_request_t *direct_idle[BCACHE_DIRECT_DEPTH];
+    uint32_t direct_idle_count;
+    bool direct_failed;
+    /**
+     * @brief Two sectors receiving the partial sectors at either end of a direct read
+     */
+    uint8_t *edges;
+    bcache_stats_t stats;
+} bcache_t;
+
+/**
+ * @brief Creates a cache over the device
+ * 
+ * @param block_size Bytes per block, a multiple of the sector size, 0 for BCACHE_BLOCK_SIZE
+ * @param block_count Blocks held, 0 for BCACHE_BLOCK_COUNT
+ * @return The cache, or NULL on failure
+ */
+bcache_t *bcache_create(blk_device_t *device, uint32_t block_size, uint32_t block_count);
+
+/**
+ * @brief Turns on per-block checksums: every block read from the device is checked against the
+ * CRC32C it had when last read or written, and bcache_get fails on a mismatch. Called by
+ * bcache_create when BCACHE_CHECKSUMS is set
+ */
+bool bcache_enable_checksums(bcache_t *cache);
+
+/**
+ * @brief Frees the cache, writing back dirty blocks first
+ */
+void bcache_destroy(bcache_t *cache);
+
+/**
+ * @brief Returns a referenced block, reading it from the device on a miss. Release it with
+ * bcache_put
+ * 
+ * @return The block, or NULL if it could not be read or every block is referenced
+ */
+bcache_block_t *bcache_get(bcache_t *cache, uint64_t block);
+
+/**
+ * @brief Drops a reference taken by bcache_get
+ */
+void bcache_put(bcache_t *cache, bcache_block_t *block);
+
+/**
+ * @brief Marks a referenced block as modified, to be written back on eviction or bcache_sync
+ */
+void bcache_mark_dirty(bcache_t *cache, bcache_block_t *block);
+
+/**
+ * @brief Copies bytes from the device into buffer, through the cache unless the transfer is at
+ * least BCACHE_DIRECT_MIN bytes long
+ */
+bool bcache_read(bcache_t *cache, uint64_t offset, uint64_t length, void *buffer);
+
+/**
+ * @brief Copies bytes from buffer to the device, into cached blocks that are written back later
+ * unless the transfer is at least BCACHE_DIRECT_MIN bytes long
+ */
+bool bcache_write(bcache_t *cache, uint64_t offset, uint64_t length, const void *buffer);
+
+/**
+ * @brief Reads or writes bytes of the device. Direct transfers move whole sectors between the
+ * device and buffer, which must then be DMA capable, with up to BCACHE_DIRECT_DEPTH requests in
+ * flight. On devices that take scatter-gather requests the partial sectors at either end of a
+ * direct read become segments of the first and last requests, otherwise they and the partial
+ * sectors of a direct write go through the cache. Either way the result is the same as a cached
+ * transfer: direct reads see dirty cached data and direct writes update the cached blocks. If the
+ * first whole sector would land at an address that is not 4 byte aligned, the whole transfer goes
+ * through the cache instead
+ * 
+ * @param flags BCACHE_IO_AUTO, BCACHE_IO_DIRECT or BCACHE_IO_CACHED
+ */
+bool bcache_transfer(bcache_t *cache, bool write, uint64_t offset, uint64_t length, void *buffer,
+    uint32_t flags);
+
+/**
+ * @brief Writes back every dirty block, then flushes the device if anything was written
+ */
+bool bcache_sync(bcache_t *cache);
+
+/**
+ * @brief Prints the hit, miss, checksum and direct transfer counts on one line prefixed with
+ * "bcache,"
+ */
+void bcache_print_stats(bcache_t *cache);
+
+/**
+ * @brief Copies bytes between buffer and cached blocks, reading blocks in on a miss
+ */
+static bool transfer_cached(bcache_t *cache, bool write, uint64_t offset, uint64_t length,
+    uint8_t *buffer);
+
+/**
+ * @brief Moves the sectors of a transfer between buffer and the device without the cache. The
+ * sectors at either end may be partial only for scatter-gather reads
+ */
+static bool transfer_direct(bcache_t *cache, bool write, uint64_t offset, uint64_t length,
+    uint8_t *buffer);
+
+/**
+ * @brief Points a direct request for count sectors from lba at buffer, as segments with the edge
+ * buffers if it takes in a partial sector at either end of the transfer
+ */
+static void build_direct(bcache_t *cache, io_request_t *request, uint64_t lba, uint32_t count,
+    uint64_t offset, uint64_t end, uint8_t *buffer);
+
+/**
+ * @brief Copies dirty cached data over the result of a direct read, or the data of a direct write
+ * into the blocks cached, and forgets the checksums of written blocks that are not cached
+ */
+static bool reconcile_direct(bcache_t *cache, bool write, uint64_t offset, uint64_t length,
+    uint8_t *buffer);
+
+/**
+ * @brief Polls the device until no more than in_flight direct requests are outstanding. On a
+ * timeout it waits for all of them, so none is left in flight when it returns false
+ */
+static bool wait_direct(bcache_t *cache, uint32_t in_flight);
+
+/**
+ * @brief Direct request callback
+ */
+static void direct_complete(io_request_t *request);
+
+/**
+ * @brief Returns the cached block with the given number without touching it, or NULL
+ */
+static bcache_block_t *find_block(bcache_t *cache, uint64_t block);
+
+/**
+ * @brief Returns the unreferenced block used least recently, writing it back if dirty and
+ * removing it from the hash table
+ */
+static bcache_block_t *evict_block(bcache_t *cache);
+
+/**
+ * @brief Reads a block from the device, checking it against its checksum if checksums are enabled
+ * and re-reading once on a mismatch
+ */
+static bool read_block(bcache_t *cache, bcache_block_t *entry, uint64_t block);
+
+/**
+ * @brief Records the checksum of a block as read or written, forgetting the oldest one if every
+ * entry is taken
+ */
+static void set_checksum(bcache_t *cache, uint64_t block, uint32_t crc);
+
+/**
+ * @brief Forgets the checksum of a block rewritten behind the cache's back
+ */
+static void drop_checksum(bcache_t *cache, uint64_t block);
+
+/**
+ * @brief Returns the recorded checksum of a block, or NULL if it has none
+ */
+static bcache_checksum_t *find_checksum(bcache_t *cache, uint64_t block);
+
+/**
+ * @brief Writes a dirty block to the device
+ */
+static bool write_back(bcache_t *cache, bcache_block_t *block);
+
+/**
+ * @brief Moves a block to the front of the LRU list
+ */
+static void touch_block(bcache_t *cache, bcache_block_t *block);
+
+/**
+ * @brief Returns the number of sectors of a block that lie on the device, less than
+ * sectors_per_block only for the last block
+ */
+static uint32_t block_sectors(bcache_t *cache, uint64_t block);
+
+/**
+ * @brief Returns the hash table bucket of a block number
+ */
+static uint32_t hash_block(bcache_t *cache, uint64_t block);
+
+/**
+ * @brief Fibonacci hash of a block number into a power of two table with the given mask
+ */
+static uint32_t checksum_bucket(uint64_t block, uint32_t mask);
+
+#endif
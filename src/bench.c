@@ -0,0 +1,720 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "ramdisk.h"
+#include "raid.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "ext2.h"
+#include "zblk.h"
+#include "xts.h"
+#include "bench.h"
+
+static const char *job_names[2][2] = {
+    {"seqread", "seqwrite"},
+    {"randread", "randwrite"},
+};
+
+void bench_default_config(bench_config_t *config) {
+    memset(config, 0, sizeof(bench_config_t));
+    config->runtime_ms = BENCH_RUNTIME_MS;
+    config->byte_limit = BENCH_BYTE_LIMIT;
+    config->region_start = BENCH_REGION_START;
+    config->region_sectors = BENCH_REGION_SECTORS;
+    config->writes = BENCH_WRITES;
+    config->seed = BENCH_SEED;
+    config->output_file = BENCH_OUTPUT_FILE;
+    config->device_name = BENCH_DEVICE;
+
+    uint32_t block_sizes[] = {4096, 16384, 65536, 262144};
+    uint32_t queue_depths[] = {1, 4, 16, 32};
+    config->block_size_count = 4;
+    config->queue_depth_count = 4;
+    memcpy(config->block_sizes, block_sizes, sizeof(block_sizes));
+    memcpy(config->queue_depths, queue_depths, sizeof(queue_depths));
+}
+
+bool bench_parse_args(bench_config_t *config, int argc, char **argv) {
+    // argv[1] is "bench" itself
+    for (int i = 2; i < argc; i++) {
+        char *value = strchr(argv[i], '=');
+        if (value == NULL) {
+            handle_error("Benchmark arguments must be of the form key=value\n");
+            return false;
+        }
+        value++;
+
+        if (strncmp(argv[i], "dev=", 4) == 0) {
+            config->device_name = value;
+        } else if (strncmp(argv[i], "time=", 5) == 0) {
+            config->runtime_ms = parse_size(value, NULL);
+        } else if (strncmp(argv[i], "bytes=", 6) == 0) {
+            config->byte_limit = parse_size(value, NULL);
+        } else if (strncmp(argv[i], "start=", 6) == 0) {
+            config->region_start = parse_size(value, NULL);
+        } else if (strncmp(argv[i], "sectors=", 8) == 0) {
+            config->region_sectors = parse_size(value, NULL);
+        } else if (strncmp(argv[i], "bs=", 3) == 0) {
+            config->block_size_count = parse_list(value, config->block_sizes);
+        } else if (strncmp(argv[i], "qd=", 3) == 0) {
+            config->queue_depth_count = parse_list(value, config->queue_depths);
+        } else if (strncmp(argv[i], "writes=", 7) == 0) {
+            config->writes = parse_size(value, NULL) != 0;
+        } else if (strncmp(argv[i], "seed=", 5) == 0) {
+            config->seed = parse_size(value, NULL);
+        } else if (strncmp(argv[i], "out=", 4) == 0) {
+            config->output_file = strcmp(value, "none") == 0 ? NULL : value;
+        } else {
+            handle_error("Unknown benchmark argument\n");
+            return false;
+        }
+    }
+
+    if (config->runtime_ms == 0 && config->byte_limit == 0) {
+        handle_error("Benchmark needs a time or byte limit\n");
+        return false;
+    }
+    for (uint8_t i = 0; i < config->queue_depth_count; i++) {
+        if (config->queue_depths[i] == 0 || config->queue_depths[i] > BENCH_MAX_QUEUE_DEPTH) {
+            handle_error("Benchmark queue depth must be between 1 and 32\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool run_benchmarks(blk_device_t *device, bench_config_t *config) {
+    uint64_t region_start = config->region_start;
+    uint64_t region_sectors = config->region_sectors;
+    if (region_start >= device->sector_count) {
+        handle_error("Benchmark region starts beyond the end of the disk\n");
+        return false;
+    }
+    if (config->writes && (region_start == 0 || region_sectors == 0
+        || region_start + region_sectors > device->sector_count)) {
+        handle_error("Benchmark writes need start= and sectors= inside the disk, past LBA 0\n");
+        return false;
+    }
+    if (region_sectors == 0 || region_start + region_sectors > device->sector_count) {
+        region_sectors = device->sector_count - region_start;
+    }
+
+    uint32_t max_block_size = 0;
+    for (uint8_t i = 0; i < config->block_size_count; i++) {
+        if (config->block_sizes[i] > max_block_size) max_block_size = config->block_sizes[i];
+    }
+
+    // One buffer per request slot, shared by every job
+    size_t buffer_size = (size_t) max_block_size * BENCH_MAX_QUEUE_DEPTH;
+    uint8_t *buffers = dma_alloc(buffer_size);
+    bench_job_t *job = malloc(sizeof(bench_job_t));
+    if (buffers == NULL || job == NULL) {
+        handle_error("Could not allocate benchmark buffers\n");
+        dma_free(buffers, buffer_size);
+        free(job);
+        return false;
+    }
+    for (size_t i = 0; i < buffer_size; i++) {
+        buffers[i] = i * 31 + 7; // Incompressible enough for write jobs
+    }
+
+    FILE *output = NULL;
+    if (config->output_file != NULL) {
+        output = fopen(config->output_file, "w");
+        if (output == NULL) {
+            printf("Could not open benchmark output file, reporting on console only\n");
+        }
+    }
+
+    char *header = "bench,job,bs,qd,ios,bytes,errors,elapsed_us,iops,mbps,"
+        "lat_min_ns,lat_p50_ns,lat_p90_ns,lat_p99_ns,lat_p999_ns,lat_max_ns\n";
+    printf(header);
+    if (output != NULL) fprintf(output, header);
+
+    bool success = true;
+    uint8_t op_count = config->writes ? 2 : 1;
+    for (uint8_t pattern = BENCH_SEQUENTIAL; pattern <= BENCH_RANDOM; pattern++) {
+        for (uint8_t op = IO_OP_READ; op < op_count; op++) {
+            for (uint8_t b = 0; b < config->block_size_count; b++) {
+                for (uint8_t q = 0; q < config->queue_depth_count; q++) {
+                    uint32_t block_sectors = config->block_sizes[b] / device->sector_size;
+                    if (block_sectors == 0 || block_sectors > device->max_transfer) continue;
+
+                    memset(job, 0, sizeof(bench_job_t));
+                    job->device = device;
+                    job->pattern = pattern;
+                    job->op = op;
+                    job->block_sectors = block_sectors;
+                    job->queue_depth = config->queue_depths[q];
+                    job->region_start = region_start;
+                    job->region_blocks = region_sectors / block_sectors;
+                    job->rng = config->seed != 0 ? config->seed : BENCH_SEED;
+                    job->min_latency_ns = ~0ULL;
+                    if (job->region_blocks == 0) continue;
+
+                    for (uint32_t i = 0; i < job->queue_depth; i++) {
+                        io_request_t *request = &job->requests[i];
+                        request->buffer = buffers + (size_t) i * max_block_size;
+                        job->idle[job->idle_count++] = request;
+                    }
+
+                    uint64_t start = timer_ticks();
+                    run_job(job, config);
+                    uint64_t elapsed_ns = ticks_to_ns(timer_ticks() - start);
+
+                    report_job(job, elapsed_ns, output);
+                    if (job->errors != 0) success = false;
+                }
+            }
+        }
+    }
+
+    blk_print_stats(device);
+
+    if (output != NULL) fclose(output);
+    dma_free(buffers, buffer_size);
+    free(job);
+    return success;
+}
+
+blk_device_t *bench_find_device(char_t *name) {
+    blk_device_t *device = blk_find(name);
+    if (device != NULL) return device;
+
+    if (strncmp(name, "stripe:", 7) == 0 || strncmp(name, "mirror:", 7) == 0
+        || strncmp(name, "mirror-near:", 12) == 0) {
+        return create_volume(name);
+    }
+    if (strncmp(name, "lz4:", 4) == 0 || strncmp(name, "lz4new:", 7) == 0) {
+        return open_compressed(name);
+    }
+    if (strncmp(name, "xts:", 4) == 0) return create_encrypted(name);
+
+    ramdisk_config_t config;
+    if (strcmp(name, "ram") == 0) {
+        ramdisk_config_memory(&config, BENCH_RAMDISK_SECTORS);
+    } else if (strcmp(name, "ram-ssd") == 0) {
+        ramdisk_config_ssd(&config, BENCH_RAMDISK_SECTORS);
+    } else if (strcmp(name, "ram-hdd") == 0) {
+        ramdisk_config_hdd(&config, BENCH_RAMDISK_SECTORS);
+    } else {
+        return NULL;
+    }
+
+    ramdisk_t *ramdisk;
+    if (!init_ramdisk(&config, &ramdisk)) return NULL;
+    return &ramdisk->device;
+}
+
+bool bench_read_file(char_t *device_name, char_t *path) {
+    blk_device_t *device;
+    if (device_name != NULL) {
+        device = bench_find_device(device_name);
+    } else {
+        efi_guid_t esp = GPT_TYPE_ESP;
+        device = gpt_find_type(esp, 0);
+    }
+    if (device == NULL) {
+        handle_error("Could not find the device to read from\n");
+        return false;
+    }
+    if (ext2_probe(device)) return read_ext2_file(device, path);
+
+    fat32_t *fs;
+    if (!fat32_mount(device, &fs)) return false;
+    fat32_node_t *file = fat32_open(fs, path);
+    if (file == NULL || (file->attributes & FAT_ATTR_DIRECTORY)) {
+        fat32_unmount(fs);
+        handle_error("Could not find the file to read\n");
+        return false;
+    }
+
+    size_t size = file->size;
+    uint8_t *buffer = dma_alloc(size == 0 ? 1 : size);
+    if (buffer == NULL) {
+        fat32_unmount(fs);
+        handle_error("Could not allocate file buffer\n");
+        return false;
+    }
+
+    uint64_t bytes_read;
+    uint64_t start = timer_ticks();
+    bool success = fat32_read(fs, file, 0, size, buffer, &bytes_read);
+    uint64_t native_us = ticks_to_ns(timer_ticks() - start) / 1000;
+
+    // The same file through the firmware's SimpleFileSystem
+    char_t uefi_path[FAT32_NAME_LENGTH];
+    size_t length = 0;
+    for (; path[length] != '\0' && length < FAT32_NAME_LENGTH - 1; length++) {
+        uefi_path[length] = path[length] == '/' ? '\\' : path[length];
+    }
+    uefi_path[length] = '\0';
+
+    uint64_t uefi_us = 0;
+    FILE *stream = fopen(uefi_path, "r");
+    if (stream != NULL) {
+        start = timer_ticks();
+        fread(buffer, 1, size, stream);
+        uefi_us = ticks_to_ns(timer_ticks() - start) / 1000;
+        fclose(stream);
+    }
+
+    // Hundredths of a megabyte (10^6 bytes) per second
+    uint64_t native_x100 = native_us == 0 ? 0 : bytes_read * 100 / native_us;
+    uint64_t uefi_x100 = uefi_us == 0 ? 0 : (uint64_t) size * 100 / uefi_us;
+    printf("fsread,%s,%d,%d,%d,%d.%02d,%d.%02d\n", path, bytes_read, native_us, uefi_us,
+        native_x100 / 100, native_x100 % 100, uefi_x100 / 100, uefi_x100 % 100);
+    bcache_print_stats(fs->cache);
+
+    dma_free(buffer, size == 0 ? 1 : size);
+    fat32_unmount(fs);
+    return success && bytes_read == size;
+}
+
+static bool read_ext2_file(blk_device_t *device, char_t *path) {
+    ext2_t *fs;
+    if (!ext2_mount(device, &fs)) return false;
+    ext2_node_t *file = ext2_open(fs, path);
+    if (file == NULL || (file->mode & EXT2_MODE_TYPE) != EXT2_MODE_FILE) {
+        ext2_unmount(fs);
+        handle_error("Could not find the file to read\n");
+        return false;
+    }
+
+    size_t size = file->size;
+    uint8_t *buffer = dma_alloc(size == 0 ? 1 : size);
+    if (buffer == NULL) {
+        ext2_unmount(fs);
+        handle_error("Could not allocate file buffer\n");
+        return false;
+    }
+
+    uint64_t bytes_read;
+    uint64_t start = timer_ticks();
+    bool success = ext2_read(fs, file, 0, size, buffer, &bytes_read);
+    uint64_t native_us = ticks_to_ns(timer_ticks() - start) / 1000;
+
+    // The firmware has no ext2 driver, so there is nothing to compare against
+    uint64_t native_x100 = native_us == 0 ? 0 : bytes_read * 100 / native_us;
+    printf("fsread,%s,%d,%d,0,%d.%02d,0.00\n", path, bytes_read, native_us,
+        native_x100 / 100, native_x100 % 100);
+    bcache_print_stats(fs->cache);
+
+    dma_free(buffer, size == 0 ? 1 : size);
+    ext2_unmount(fs);
+    return success && bytes_read == size;
+}
+
+bool bench_kv(char_t *device_name, uint32_t record_count) {
+    blk_device_t *device = bench_find_device(device_name != NULL ? device_name : BENCH_KV_DEVICE);
+    if (device == NULL) {
+        handle_error("Could not find the key-value benchmark device\n");
+        return false;
+    }
+    if (record_count == 0) record_count = BENCH_KV_RECORDS;
+
+    kv_store_t *store;
+    if (!kv_format(device) || !kv_open(device, &store)) return false;
+    printf("kvbench,phase,ops,us,ops/s,MB/s,commits\n");
+
+    // Group commit: the same puts made durable after every record, every 16 and every 256
+    uint64_t rng = BENCH_SEED;
+    uint64_t record_bytes = record_count * (uint64_t) BENCH_KV_VALUE_BYTES;
+    uint32_t groups[3] = { 1, 16, 256 };
+    char *phases[3] = { "put-commit-1", "put-commit-16", "put-commit-256" };
+    bool success = true;
+    for (uint32_t i = 0; i < 3 && success; i++) {
+        uint64_t commits = store->stats.commits;
+        uint64_t start = timer_ticks();
+        success = put_kv_records(store, record_count, groups[i], false, &rng);
+        report_kv_phase(phases[i], record_count, record_bytes, ticks_to_ns(timer_ticks() - start),
+            store->stats.commits - commits);
+    }
+
+    uint8_t value[BENCH_KV_VALUE_BYTES];
+    char key[16];
+    uint64_t start = timer_ticks();
+    for (uint32_t i = 0; i < record_count && success; i++) {
+        uint32_t length;
+        sprintf(key, "key%08d", (uint64_t) (xorshift64(&rng) % record_count));
+        success = kv_get(store, key, strlen(key), value, sizeof(value), &length);
+    }
+    if (success) {
+        report_kv_phase("get", record_count, record_bytes, ticks_to_ns(timer_ticks() - start), 0);
+    }
+
+    // Random overwrites leave most of the log dead, so kv_poll keeps compacting
+    if (success) {
+        uint64_t commits = store->stats.commits;
+        uint64_t count = (uint64_t) record_count * BENCH_KV_OVERWRITE_PASSES;
+        start = timer_ticks();
+        success = put_kv_records(store, count, 0, true, &rng);
+        report_kv_phase("overwrite", count, count * BENCH_KV_VALUE_BYTES,
+            ticks_to_ns(timer_ticks() - start), store->stats.commits - commits);
+    }
+    kv_print_stats(store);
+
+    // Reopening loads the checkpoint written by kv_close
+    if (!kv_close(store)) success = false;
+    start = timer_ticks();
+    if (!kv_open(device, &store)) return false;
+    report_kv_phase("reopen", store->entry_count, 0, ticks_to_ns(timer_ticks() - start), 0);
+    kv_print_stats(store);
+    if (!kv_close(store)) success = false;
+    return success && check_torn_commit(device);
+}
+
+static bool check_torn_commit(blk_device_t *device) {
+    kv_store_t *store;
+    if (!kv_format(device) || !kv_open(device, &store)) return false;
+    uint32_t sector_size = store->sector_size;
+    uint64_t lba = store->log_lba;
+    uint8_t *sector = dma_alloc(sector_size);
+    if (sector == NULL) {
+        kv_discard(store);
+        handle_error("Could not allocate torn commit sector\n");
+        return false;
+    }
+
+    // A commit of several sectors from the start of the empty log, with the first put back as it
+    // was before, as if the crash had come before that write reached the device. The records are
+    // 128 bytes, so every later sector starts with one
+    uint8_t value[BENCH_KV_VALUE_BYTES];
+    uint32_t value_length = 128 - sizeof(kv_record_header_t) - 12;
+    char key[16];
+    uint32_t torn = 0;
+    uint64_t start = timer_ticks();
+    memset(value, 0xA5, sizeof(value));
+    bool success = blk_read(device, lba, 1, sector);
+    while (success && store->batch_length < 4 * sector_size) {
+        sprintf(key, "torn%08d", (uint64_t) torn++);
+        success = kv_put(store, key, strlen(key), value, value_length);
+    }
+    success = success && kv_commit(store) && blk_write(device, lba, 1, sector)
+        && blk_flush(device);
+    kv_discard(store);
+    dma_free(sector, sector_size);
+
+    // Replay stops at the lost sector and the next commit rewrites only that one
+    if (!success || !kv_open(device, &store)) return false;
+    success = kv_put(store, "after", 5, value, value_length) && kv_commit(store);
+    kv_discard(store);
+    if (!success || !kv_open(device, &store)) return false;
+
+    uint32_t length;
+    success = kv_get(store, "after", 5, value, sizeof(value), &length);
+    for (uint32_t i = 0; i < torn && success; i++) {
+        sprintf(key, "torn%08d", (uint64_t) i);
+        if (kv_get(store, key, strlen(key), value, sizeof(value), &length)) {
+            handle_error("Key-value replay brought back a torn commit\n");
+            success = false;
+        }
+    }
+    if (success) {
+        report_kv_phase("torn-commit", torn, 0, ticks_to_ns(timer_ticks() - start),
+            store->stats.commits);
+    }
+    return kv_close(store) && success;
+}
+
+static bool put_kv_records(kv_store_t *store, uint32_t record_count, uint32_t group, bool random,
+    uint64_t *rng) {
+    uint8_t value[BENCH_KV_VALUE_BYTES];
+    char key[16];
+    for (uint32_t i = 0; i < record_count; i++) {
+        uint64_t number = random ? xorshift64(rng) % record_count : i;
+        sprintf(key, "key%08d", number);
+        memset(value, (uint8_t) (number + i), sizeof(value));
+        if (!kv_put(store, key, strlen(key), value, sizeof(value))) return false;
+        if (random) {
+            if (!kv_poll(store)) return false;
+        } else if ((i + 1) % group == 0 || i + 1 == record_count) {
+            if (!kv_commit(store)) return false;
+        }
+    }
+    return true;
+}
+
+static void report_kv_phase(char *phase, uint64_t operations, uint64_t bytes, uint64_t elapsed_ns,
+    uint64_t commits) {
+    uint64_t us = elapsed_ns / 1000;
+    uint64_t mb_x100 = us == 0 ? 0 : bytes * 100 / us;
+    printf("kvbench,%s,%d,%d,%d,%d.%02d,%d\n", phase, operations, us,
+        us == 0 ? 0 : operations * 1000000 / us, mb_x100 / 100, mb_x100 % 100, commits);
+}
+
+static blk_device_t *create_volume(char_t *spec) {
+    blk_device_t *members[RAID_MAX_MEMBERS];
+    uint32_t member_count = 0;
+    char_t member_name[BLK_NAME_LENGTH];
+
+    char_t *list = strchr(spec, ':') + 1;
+    while (*list != '\0') {
+        char_t *end = strchr(list, ',');
+        size_t length = end == NULL ? strlen(list) : (size_t) (end - list);
+        if (length >= BLK_NAME_LENGTH || member_count == RAID_MAX_MEMBERS) return NULL;
+
+        memcpy(member_name, list, length);
+        member_name[length] = '\0';
+        // Members may themselves be RAM disks or volumes
+        members[member_count] = bench_find_device(member_name);
+        if (members[member_count] == NULL) return NULL;
+        member_count++;
+
+        list += length;
+        if (*list == ',') list++;
+    }
+
+    if (strncmp(spec, "stripe:", 7) == 0) {
+        return raid_create_stripe(members, member_count, 0);
+    }
+    uint8_t policy = strncmp(spec, "mirror-near:", 12) == 0
+        ? RAID_READ_NEAREST : RAID_READ_LEAST_QUEUED;
+    return raid_create_mirror(members, member_count, policy);
+}
+
+static blk_device_t *open_compressed(char_t *spec) {
+    bool format = strncmp(spec, "lz4new:", 7) == 0;
+    char_t *name = strchr(spec, ':') + 1;
+    char_t *region = strrchr(name, '@');
+    char_t backing_name[BENCH_SPEC_LENGTH];
+    size_t length = region == NULL ? strlen(name) : (size_t) (region - name);
+    if (length >= BENCH_SPEC_LENGTH) return NULL;
+    memcpy(backing_name, name, length);
+    backing_name[length] = '\0';
+
+    blk_device_t *backing = bench_find_device(backing_name);
+    if (backing == NULL) return NULL;
+    bool ram = is_ramdisk(backing);
+    if (region != NULL) {
+        char_t *end;
+        uint64_t start = parse_size(region + 1, &end);
+        if (*end != '+') {
+            handle_error("Compressed volume regions are written @<start>+<sectors>\n");
+            return NULL;
+        }
+        backing = gpt_create_region(backing, start, parse_size(end + 1, NULL));
+        if (backing == NULL) return NULL;
+    }
+    if (!format && zblk_probe(backing)) return zblk_open(backing);
+
+    // Formatting destroys the backing device, so only RAM disks are formatted without being asked
+    if (!ram && (!format || region == NULL)) {
+        handle_error("Compressed volumes are only created on a disk with "
+            "lz4new:<dev>@<start>+<sectors>\n");
+        return NULL;
+    }
+    if (!zblk_format(backing, 0)) return NULL;
+    blk_device_t *device = zblk_open(backing);
+    if (device == NULL || !fill_log_text(device)) return NULL;
+    return device;
+}
+
+static blk_device_t *create_encrypted(char_t *spec) {
+    blk_device_t *backing = bench_find_device(spec + 4);
+    if (backing == NULL) return NULL;
+
+    uint64_t rng = BENCH_SEED;
+    uint64_t key[8];
+    for (uint32_t i = 0; i < 8; i++) key[i] = xorshift64(&rng);
+    return xts_create(backing, (uint8_t *) key, sizeof(key));
+}
+
+static bool fill_log_text(blk_device_t *device) {
+    static char *levels[4] = { "INFO ", "INFO ", "DEBUG", "WARN " };
+    static char *paths[4] = { "/api/v1/items", "/api/v1/users", "/static/app.js", "/health" };
+    uint64_t piece_bytes = (uint64_t) device->max_transfer * device->sector_size;
+    char *buffer = dma_alloc(piece_bytes);
+    if (buffer == NULL) {
+        handle_error("Could not allocate log buffer\n");
+        return false;
+    }
+
+    uint64_t rng = BENCH_SEED;
+    uint64_t line = 0;
+    for (uint64_t lba = 0; lba < device->sector_count; lba += device->max_transfer) {
+        uint32_t count = device->max_transfer;
+        if (count > device->sector_count - lba) count = device->sector_count - lba;
+        uint64_t bytes = (uint64_t) count * device->sector_size;
+
+        // Whole lines, padded with spaces where the next would not fit
+        uint64_t used = 0;
+        while (used + BENCH_LOG_LINE <= bytes) {
+            uint64_t random = xorshift64(&rng);
+            used += sprintf(buffer + used,
+                "2026-10-19 %02d:%02d:%02d.%03d %s [worker-%d] %s id=%d status=%d bytes=%d\n",
+                line / 3600000 % 24, line / 60000 % 60, line / 1000 % 60, line % 1000,
+                levels[random & 3], (random >> 2) & 7, paths[(random >> 5) & 3], line,
+                (uint64_t) (((random >> 7) & 15) == 0 ? 404 : 200), (random >> 11) & 0xFFFF);
+            line++;
+        }
+        memset(buffer + used, ' ', bytes - used);
+
+        if (!blk_write(device, lba, count, buffer)) {
+            dma_free(buffer, piece_bytes);
+            return false;
+        }
+    }
+    dma_free(buffer, piece_bytes);
+    return blk_flush(device);
+}
+
+static void run_job(bench_job_t *job, bench_config_t *config) {
+    uint64_t deadline = config->runtime_ms == 0 ? ~0ULL
+        : timer_ticks() + ns_to_ticks(config->runtime_ms * 1000000);
+    uint64_t bytes_issued = 0;
+    uint64_t block_bytes = (uint64_t) job->block_sectors * job->device->sector_size;
+    bool stopping = false;
+
+    while (true) {
+        while (!stopping && job->idle_count > 0) {
+            if (config->byte_limit != 0 && bytes_issued >= config->byte_limit) {
+                stopping = true;
+                break;
+            }
+            issue_request(job, job->idle[--job->idle_count]);
+            bytes_issued += block_bytes;
+        }
+
+        blk_poll(job->device);
+
+        if (timer_ticks() >= deadline) stopping = true;
+        if (stopping && job->idle_count == job->queue_depth) break;
+    }
+}
+
+static void issue_request(bench_job_t *job, io_request_t *request) {
+    uint64_t block;
+    if (job->pattern == BENCH_RANDOM) {
+        // Multiply-shift maps the random value onto the region without a division
+        block = ((unsigned __int128) xorshift64(&job->rng) * job->region_blocks) >> 64;
+    } else {
+        block = job->next_block;
+    }
+
+    request->op = job->op;
+    request->flags = 0;
+    request->lba = job->region_start + block * job->block_sectors;
+    request->count = job->block_sectors;
+    request->callback = complete_request;
+    request->context = job;
+
+    if (job->pattern == BENCH_SEQUENTIAL) {
+        job->next_block = block + 1 == job->region_blocks ? 0 : block + 1;
+    }
+    blk_submit(job->device, request);
+}
+
+static void complete_request(io_request_t *request) {
+    bench_job_t *job = request->context;
+    uint64_t latency_ns = ticks_to_ns(request->complete_ticks - request->submit_ticks);
+
+    if (request->success) {
+        job->ios++;
+        job->bytes += (uint64_t) request->count * job->device->sector_size;
+    } else {
+        job->errors++;
+    }
+
+    if (latency_ns < job->min_latency_ns) job->min_latency_ns = latency_ns;
+    if (latency_ns > job->max_latency_ns) job->max_latency_ns = latency_ns;
+    job->histogram[latency_bucket(latency_ns)]++;
+
+    job->idle[job->idle_count++] = request;
+}
+
+static void report_job(bench_job_t *job, uint64_t elapsed_ns, FILE *output) {
+    uint64_t elapsed_us = elapsed_ns / 1000;
+    if (elapsed_us == 0) elapsed_us = 1;
+
+    uint64_t iops = job->ios * 1000000 / elapsed_us;
+    // Hundredths of a megabyte (10^6 bytes) per second
+    uint64_t mbps_x100 = job->bytes * 100 / elapsed_us;
+    if (job->ios == 0) job->min_latency_ns = 0;
+
+    char line[256];
+    snprintf(line, sizeof(line),
+        "bench,%s,%d,%d,%d,%d,%d,%d,%d,%d.%02d,%d,%d,%d,%d,%d,%d\n",
+        job_names[job->pattern][job->op],
+        (uint64_t) job->block_sectors * job->device->sector_size,
+        (uint64_t) job->queue_depth,
+        job->ios,
+        job->bytes,
+        job->errors,
+        elapsed_us,
+        iops,
+        mbps_x100 / 100, mbps_x100 % 100,
+        job->min_latency_ns,
+        latency_percentile(job, 500),
+        latency_percentile(job, 900),
+        latency_percentile(job, 990),
+        latency_percentile(job, 999),
+        job->max_latency_ns);
+
+    printf(line);
+    if (output != NULL) fprintf(output, line);
+}
+
+static uint64_t latency_percentile(bench_job_t *job, uint32_t per_mille) {
+    uint64_t total = job->ios + job->errors;
+    if (total == 0) return 0;
+
+    uint64_t target = (total * per_mille + 999) / 1000;
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < BENCH_LATENCY_BUCKETS; bucket++) {
+        seen += job->histogram[bucket];
+        if (seen >= target) return bucket_latency(bucket);
+    }
+    return job->max_latency_ns;
+}
+
+static uint32_t latency_bucket(uint64_t ns) {
+    if (ns < 8) return ns;
+    uint32_t msb = 63 - __builtin_clzll(ns);
+    return ((msb - 2) << 3) | ((ns >> (msb - 3)) & 0x7);
+}
+
+static uint64_t bucket_latency(uint32_t bucket) {
+    if (bucket < 8) return bucket;
+    uint32_t msb = (bucket >> 3) + 2;
+    return (uint64_t) (0x8 | (bucket & 0x7)) << (msb - 3);
+}
+
+static uint64_t parse_size(char *string, char **end) {
+    uint64_t value = 0;
+    while (*string >= '0' && *string <= '9') {
+        value = value * 10 + (*string - '0');
+        string++;
+    }
+    switch (*string) {
+        case 'k': case 'K':
+            value <<= 10;
+            string++;
+            break;
+        case 'm': case 'M':
+            value <<= 20;
+            string++;
+            break;
+        case 'g': case 'G':
+            value <<= 30;
+            string++;
+            break;
+    }
+    if (end != NULL) *end = string;
+    return value;
+}
+
+static uint8_t parse_list(char *string, uint32_t *values) {
+    uint8_t count = 0;
+    while (*string && count < BENCH_MAX_SWEEP) {
+        values[count++] = parse_size(string, &string);
+        if (*string != ',') break;
+        string++;
+    }
+    return count;
+}
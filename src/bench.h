@@ -0,0 +1,231 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#define BENCH_RUNTIME_MS 3000              // Time limit per job, 0 for none
+#define BENCH_BYTE_LIMIT 0                 // Byte limit per job, 0 for none
+#define BENCH_REGION_START 0               // First sector the jobs may touch
+#define BENCH_REGION_SECTORS 0             // Sectors the jobs may touch, 0 for the whole disk
+#define BENCH_WRITES false                 // Write jobs overwrite the benchmark region
+#define BENCH_SEED 0x9E3779B97F4A7C15
+#define BENCH_OUTPUT_FILE "\\bench.csv"    // Also written to the console, NULL to skip
+#define BENCH_DEVICE "sata0"
+#define BENCH_RAMDISK_SECTORS (256 * 2048) // 256MB RAM disk for dev=ram, ram-ssd or ram-hdd
+
+#define BENCH_MAX_SWEEP 8
+#define BENCH_MAX_QUEUE_DEPTH 32
+#define BENCH_LATENCY_BUCKETS 512          // 8 sub-buckets for each power of two
+
+#define BENCH_KV_DEVICE "ram"               // kv_format destroys the device's contents
+#define BENCH_KV_RECORDS 100000
+#define BENCH_KV_VALUE_BYTES 100
+#define BENCH_KV_OVERWRITE_PASSES 4
+
+#define BENCH_LOG_LINE 128                 // Longest synthetic log line written by fill_log_text
+#define BENCH_SPEC_LENGTH 64               // Longest device name inside an "lz4:" name
+
+#define BENCH_SEQUENTIAL 0
+#define BENCH_RANDOM 1
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+#include "kvstore.h"
+
+typedef struct bench_config {
+    /**
+     * @brief A job stops at whichever of the limits is reached first
+     */
+    uint64_t runtime_ms;
+    uint64_t byte_limit;
+    /**
+     * @brief Sectors the jobs touch, 0 sectors for the rest of the disk. Write jobs need a region
+     * with both set, not starting at LBA 0, so they cannot overwrite the partition table
+     */
+    uint64_t region_start;
+    uint64_t region_sectors;
+    /**
+     * @brief Block sizes in bytes and queue depths to sweep over, every combination is run
+     */
+    uint32_t block_sizes[BENCH_MAX_SWEEP];
+    uint8_t block_size_count;
+    uint32_t queue_depths[BENCH_MAX_SWEEP];
+    uint8_t queue_depth_count;
+    bool writes;
+    uint64_t seed;
+    char_t *output_file;
+    char_t *device_name;
+} bench_config_t;
+
+typedef struct bench_job {
+    blk_device_t *device;
+    uint8_t pattern;
+    uint8_t op;
+    uint32_t block_sectors;
+    uint32_t queue_depth;
+    uint64_t region_start;
+    uint64_t region_blocks;
+    uint64_t next_block;
+    uint64_t rng;
+    /**
+     * @brief Results, counted on completion
+     */
+    uint64_t ios;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t min_latency_ns;
+    uint64_t max_latency_ns;
+    uint32_t histogram[BENCH_LATENCY_BUCKETS];
+    /**
+     * @brief Requests not currently in flight
+     */
+    io_request_t *idle[BENCH_MAX_QUEUE_DEPTH];
+    uint32_t idle_count;
+    io_request_t requests[BENCH_MAX_QUEUE_DEPTH];
+} bench_job_t;
+
+/**
+ * @brief Fills config with the defaults above, sweeping 4K-256K blocks at queue depths 1-32
+ */
+void bench_default_config(bench_config_t *config);
+
+/**
+ * @brief Overrides config with key=value arguments given after "bench" on the command line:
+ * dev=<name> time=<ms> bytes=<n> start=<lba> sectors=<n> bs=<n>[,<n>...] qd=<n>[,<n>...]
+ * writes=<0|1> seed=<n> out=<path|none>. Sizes accept k, m and g suffixes
+ * 
+ * @return False if an argument could not be parsed
+ */
+bool bench_parse_args(bench_config_t *config, int argc, char **argv);
+
+/**
+ * @brief Runs sequential and random read (and optionally write) jobs for each block size and queue
+ * depth, reporting one CSV line per job prefixed with "bench,"
+ * 
+ * @return True if every job ran without I/O errors
+ */
+bool run_benchmarks(blk_device_t *device, bench_config_t *config);
+
+/**
+ * @brief Finds the block device with the given name. The names "ram", "ram-ssd" and "ram-hdd"
+ * create a RAM disk with no latency or emulated SSD or HDD timing, for benchmarking the layers
+ * above the driver without a physical disk. "stripe:<dev>,<dev>..." creates a striped volume over
+ * the named devices, and "mirror:" or "mirror-near:" a mirrored one balancing reads by queue depth
+ * or by nearest LBA. "lz4:<dev>[@<start>+<sectors>]" opens the compressed volume on the device or
+ * on that region of it. A RAM disk holding none is formatted and filled with log-like text first,
+ * other devices only with "lz4new:<dev>@<start>+<sectors>", which always formats the region.
+ * "xts:<dev>" encrypts the device with a fixed benchmark key
+ * 
+ * @return The device, or NULL if there is none
+ */
+blk_device_t *bench_find_device(char_t *name);
+
+/**
+ * @brief Reads a whole file with the native FAT32 driver and again through UEFI's file protocol,
+ * printing both times on one line prefixed with "fsread,". ext2/3/4 devices are read with the
+ * native driver only
+ * 
+ * @param device_name FAT32 or ext2/3/4 device, or NULL for the first EFI system partition
+ */
+bool bench_read_file(char_t *device_name, char_t *path);
+
+/**
+ * @brief Formats the device as a key-value store and times puts committed every 1, 16 and 256
+ * records, random gets, random overwrites driving compaction through kv_poll, and reopening the
+ * store, then checks recovery from a torn commit. Prints one CSV line per phase prefixed with
+ * "kvbench,"
+ * 
+ * @param device_name Device to format, or NULL for a RAM disk
+ * @param record_count Keys written by each phase, 0 for BENCH_KV_RECORDS
+ */
+bool bench_kv(char_t *device_name, uint32_t record_count);
+
+/**
+ * @brief The ext2/3/4 part of bench_read_file
+ */
+static bool read_ext2_file(blk_device_t *device, char_t *path);
+
+/**
+ * @brief Puts record_count keys with a commit every group records, or random keys with kv_poll
+ * after every put if random is set
+ */
+static bool put_kv_records(kv_store_t *store, uint32_t record_count, uint32_t group, bool random,
+    uint64_t *rng);
+
+/**
+ * @brief Formats the device again, tears a commit by restoring its first sector, and checks that
+ * none of its records come back after reopening and committing over the lost sector
+ */
+static bool check_torn_commit(blk_device_t *device);
+
+/**
+ * @brief Writes the results line for a kvbench phase
+ */
+static void report_kv_phase(char *phase, uint64_t operations, uint64_t bytes, uint64_t elapsed_ns,
+    uint64_t commits);
+
+/**
+ * @brief Creates the volume described by a "stripe:", "mirror:" or "mirror-near:" device name
+ */
+static blk_device_t *create_volume(char_t *spec);
+
+/**
+ * @brief Opens the compressed volume on the device or region named after "lz4:", or formats and
+ * fills it first if it is a RAM disk with no volume or the name starts with "lz4new:"
+ */
+static blk_device_t *open_compressed(char_t *spec);
+
+/**
+ * @brief Creates an encrypted volume over the device named after "xts:", with an XTS-AES-256 key
+ * derived from BENCH_SEED
+ */
+static blk_device_t *create_encrypted(char_t *spec);
+
+/**
+ * @brief Writes lines of synthetic server log over the whole device, so reads of a new compressed
+ * volume have realistic data to decompress
+ */
+static bool fill_log_text(blk_device_t *device);
+
+/**
+ * @brief Runs a single job until its time or byte limit is reached
+ */
+static void run_job(bench_job_t *job, bench_config_t *config);
+
+/**
+ * @brief Fills in the next request of the job and issues it
+ */
+static void issue_request(bench_job_t *job, io_request_t *request);
+
+/**
+ * @brief Records the latency of a completed benchmark request and returns it to the idle list
+ */
+static void complete_request(io_request_t *request);
+
+/**
+ * @brief Writes the results line for a job to the console and output file
+ */
+static void report_job(bench_job_t *job, uint64_t elapsed_ns, FILE *output);
+
+/**
+ * @brief Returns the latency below which the given fraction (in thousandths) of requests fall
+ */
+static uint64_t latency_percentile(bench_job_t *job, uint32_t per_mille);
+
+/**
+ * @brief Maps a latency to its histogram bucket, and back to the lowest latency in a bucket
+ */
+static uint32_t latency_bucket(uint64_t ns);
+static uint64_t bucket_latency(uint32_t bucket);
+
+/**
+ * @brief Parses a number with an optional k, m or g suffix
+ */
+static uint64_t parse_size(char *string, char **end);
+
+/**
+ * @brief Parses a comma separated list of sizes into values, returning how many were read
+ */
+static uint8_t parse_list(char *string, uint32_t *values);
+
+#endif
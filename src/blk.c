@@ -0,0 +1,347 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "trace.h"
+#include "blk.h"
+
+// Registry of all block devices, grown by doubling
+static blk_device_t **devices = NULL;
+static uint32_t device_count = 0;
+static uint32_t device_capacity = 0;
+
+bool blk_register(blk_device_t *device) {
+    if (device_count == device_capacity) {
+        uint32_t new_capacity = device_capacity == 0 ? 8 : device_capacity * 2;
+        void *new_pointer = realloc(devices, new_capacity * sizeof(blk_device_t *));
+        if (new_pointer == NULL) {
+            handle_error("Could not grow block device registry\n");
+            return false;
+        }
+        devices = new_pointer;
+        device_capacity = new_capacity;
+    }
+
+    device->id = device_count;
+    device->queue_head = NULL;
+    device->queue_tail = NULL;
+    memset(&device->stats, 0, sizeof(blk_stats_t));
+    devices[device_count++] = device;
+
+    if (BOOT_VERBOSE) {
+        printf("Registered block device %s\n", device->name);
+    }
+    return true;
+}
+
+uint32_t blk_device_count() {
+    return device_count;
+}
+
+blk_device_t *blk_get(uint32_t id) {
+    return id < device_count ? devices[id] : NULL;
+}
+
+blk_device_t *blk_find(char_t *name) {
+    for (uint32_t i = 0; i < device_count; i++) {
+        if (strncmp(devices[i]->name, name, BLK_NAME_LENGTH) == 0) return devices[i];
+    }
+    return NULL;
+}
+
+void blk_submit(blk_device_t *device, io_request_t *request) {
+    request->device = device;
+    request->next = NULL;
+
+    if (!validate_request(device, request)) {
+        complete_inline(device, request, false);
+        return;
+    }
+
+    // Devices without a volatile cache have nothing to flush
+    if (request->op == IO_OP_FLUSH && !(device->capabilities & BLK_CAP_FLUSH)) {
+        complete_inline(device, request, true);
+        return;
+    }
+
+    // Keep submission order, so only bypass the queue when it is empty
+    if (device->queue_head == NULL && submit_to_driver(device, request)) {
+        device->stats.in_flight++;
+        if (device->stats.in_flight > device->stats.max_in_flight) {
+            device->stats.max_in_flight = device->stats.in_flight;
+        }
+        return;
+    }
+
+    if (device->queue_tail == NULL) {
+        device->queue_head = request;
+    } else {
+        device->queue_tail->next = request;
+    }
+    device->queue_tail = request;
+}
+
+uint32_t blk_poll(blk_device_t *device) {
+    uint32_t completed = device->ops->poll(device);
+    dispatch_queue(device);
+    return completed;
+}
+
+void blk_complete(io_request_t *request) {
+    blk_device_t *device = request->device;
+
+    if (device != NULL) {
+        // Undo the translation done by submit_to_driver
+        request->lba -= device->lba_offset;
+
+        blk_stats_t *stats = &device->stats;
+        uint64_t latency_ns = ticks_to_ns(request->complete_ticks - request->submit_ticks);
+
+        stats->in_flight--;
+        stats->latency_total_ns += latency_ns;
+        if (latency_ns > stats->latency_max_ns) stats->latency_max_ns = latency_ns;
+
+        if (!request->success) {
+            stats->errors++;
+        } else {
+            switch (request->op) {
+                case IO_OP_READ:
+                    stats->reads++;
+                    stats->sectors_read += request->count;
+                    break;
+                case IO_OP_WRITE:
+                    stats->writes++;
+                    stats->sectors_written += request->count;
+                    break;
+                case IO_OP_FLUSH:
+                    stats->flushes++;
+                    break;
+                case IO_OP_DISCARD:
+                    stats->discards++;
+                    break;
+            }
+        }
+
+        trace_io(device->id, request);
+    }
+
+    if (request->callback != NULL) request->callback(request);
+}
+
+bool blk_read(blk_device_t *device, uint64_t lba, uint32_t count, void *buffer) {
+    io_request_t request = {0};
+    request.op = IO_OP_READ;
+    request.lba = lba;
+    request.count = count;
+    request.buffer = buffer;
+    return blk_submit_and_wait(device, &request);
+}
+
+bool blk_write(blk_device_t *device, uint64_t lba, uint32_t count, void *buffer) {
+    io_request_t request = {0};
+    request.op = IO_OP_WRITE;
+    request.lba = lba;
+    request.count = count;
+    request.buffer = buffer;
+    return blk_submit_and_wait(device, &request);
+}
+
+bool blk_flush(blk_device_t *device) {
+    io_request_t request = {0};
+    request.op = IO_OP_FLUSH;
+    return blk_submit_and_wait(device, &request);
+}
+
+bool blk_discard(blk_device_t *device, uint64_t lba, uint32_t count) {
+    io_request_t request = {0};
+    request.op = IO_OP_DISCARD;
+    request.lba = lba;
+    request.count = count;
+    return blk_submit_and_wait(device, &request);
+}
+
+bool blk_submit_and_wait(blk_device_t *device, io_request_t *request) {
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_TIMEOUT_MS * 1000000);
+    bool complete = false;
+    bool timed_out = false;
+    request->callback = blk_wait_complete;
+    request->context = &complete;
+
+    // The request usually lives on the caller's stack, so after a timeout the driver is aborted to
+    // get it back. A request still in the device queue is taken back instead
+    blk_submit(device, request);
+    while (!complete) {
+        blk_poll(device);
+        if (timer_ticks() <= deadline) continue;
+        if (timed_out) {
+            handle_error("Device kept a block request after being aborted\n");
+            return false;
+        }
+
+        // A request the driver has is taken back by failing everything the driver holds
+        handle_error("Block request timed out\n");
+        timed_out = true;
+        if (!blk_cancel(device, request)) blk_abort(device);
+        deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_ABORT_TIMEOUT_MS * 1000000);
+    }
+    return request->success && !timed_out;
+}
+
+bool blk_cancel(blk_device_t *device, io_request_t *request) {
+    io_request_t *previous = NULL;
+    io_request_t *queued = device->queue_head;
+    while (queued != NULL && queued != request) {
+        previous = queued;
+        queued = queued->next;
+    }
+    if (queued == NULL) return false;
+
+    if (previous == NULL) {
+        device->queue_head = request->next;
+    } else {
+        previous->next = request->next;
+    }
+    if (device->queue_tail == request) device->queue_tail = previous;
+    request->next = NULL;
+
+    // Never seen by the driver, so the LBA was not translated and nothing is in flight
+    request->success = false;
+    request->submit_ticks = timer_ticks();
+    request->complete_ticks = request->submit_ticks;
+    device->stats.errors++;
+    if (request->callback != NULL) request->callback(request);
+    return true;
+}
+
+void blk_abort(blk_device_t *device) {
+    device->ops->abort(device);
+}
+
+io_segment_t *blk_segments(io_request_t *request, io_segment_t *single, uint32_t *count) {
+    if (request->segment_count != 0) {
+        *count = request->segment_count;
+        return request->segments;
+    }
+    single->buffer = request->buffer;
+    single->length = request->count * request->device->sector_size;
+    *count = 1;
+    return single;
+}
+
+void blk_print_devices() {
+    for (uint32_t i = 0; i < device_count; i++) {
+        blk_device_t *device = devices[i];
+        printf("%s: %d sectors of %d bytes, max transfer %d, max segments %d, queue depth %d"
+            "%s%s%s\n",
+            device->name,
+            device->sector_count,
+            (uint64_t) device->sector_size,
+            (uint64_t) device->max_transfer,
+            (uint64_t) device->max_segments,
+            (uint64_t) device->queue_depth,
+            device->capabilities & BLK_CAP_FLUSH ? ", flush" : "",
+            device->capabilities & BLK_CAP_FUA ? ", FUA" : "",
+            device->capabilities & BLK_CAP_DISCARD ? ", discard" : "");
+    }
+}
+
+void blk_print_stats(blk_device_t *device) {
+    blk_stats_t *stats = &device->stats;
+    uint64_t completed = stats->reads + stats->writes + stats->flushes + stats->discards
+        + stats->errors;
+
+    printf("blkstat,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
+        device->name,
+        stats->reads,
+        stats->writes,
+        stats->flushes,
+        stats->discards,
+        stats->sectors_read,
+        stats->sectors_written,
+        stats->errors,
+        completed == 0 ? 0 : stats->latency_total_ns / completed,
+        stats->latency_max_ns,
+        (uint64_t) stats->max_in_flight);
+}
+
+static bool validate_request(blk_device_t *device, io_request_t *request) {
+    switch (request->op) {
+        case IO_OP_READ:
+        case IO_OP_WRITE:
+            if (request->count == 0 || request->count > device->max_transfer) return false;
+            break;
+        case IO_OP_DISCARD:
+            if (!(device->capabilities & BLK_CAP_DISCARD)) return false;
+            if (request->count == 0 || request->count > device->max_transfer) return false;
+            break;
+        case IO_OP_FLUSH:
+            return true;
+        default:
+            return false;
+    }
+
+    if (request->lba >= device->sector_count
+     || request->count > device->sector_count - request->lba) {
+        return false;
+    }
+
+    if (request->segment_count != 0) {
+        if (request->op != IO_OP_READ && request->op != IO_OP_WRITE) return false;
+        if (request->segment_count > device->max_segments) return false;
+
+        uint64_t bytes = 0;
+        for (uint32_t i = 0; i < request->segment_count; i++) {
+            io_segment_t *segment = &request->segments[i];
+            if (((uint64_t) segment->buffer | segment->length) & 0x3) return false;
+            bytes += segment->length;
+        }
+        if (bytes != (uint64_t) request->count * device->sector_size) return false;
+    }
+
+    // Without a volatile cache every write is already durable. With one, callers must flush
+    if ((request->flags & IO_FLAG_FUA) && !(device->capabilities & BLK_CAP_FUA)) {
+        if (device->capabilities & BLK_CAP_FLUSH) return false;
+        request->flags &= ~IO_FLAG_FUA;
+    }
+    return true;
+}
+
+static void dispatch_queue(blk_device_t *device) {
+    while (device->queue_head != NULL) {
+        io_request_t *request = device->queue_head;
+        if (!submit_to_driver(device, request)) break;
+
+        device->queue_head = request->next;
+        if (device->queue_head == NULL) device->queue_tail = NULL;
+        request->next = NULL;
+
+        device->stats.in_flight++;
+        if (device->stats.in_flight > device->stats.max_in_flight) {
+            device->stats.max_in_flight = device->stats.in_flight;
+        }
+    }
+}
+
+static bool submit_to_driver(blk_device_t *device, io_request_t *request) {
+    request->lba += device->lba_offset;
+    if (device->ops->submit(device, request)) return true;
+    request->lba -= device->lba_offset;
+    return false;
+}
+
+static void complete_inline(blk_device_t *device, io_request_t *request, bool success) {
+    // blk_complete undoes the translation done by submit_to_driver, so do it here as well
+    request->lba += device->lba_offset;
+    request->success = success;
+    request->submit_ticks = timer_ticks();
+    request->complete_ticks = request->submit_ticks;
+    device->stats.in_flight++;
+    blk_complete(request);
+}
+
+static void blk_wait_complete(io_request_t *request) {
+    *(bool *) request->context = true;
+}
@@ -0,0 +1,227 @@
+#ifndef _BLK_H_
+#define _BLK_H_
+
+#define BLK_CAP_FLUSH 0x1      // Device has a volatile cache which IO_OP_FLUSH writes back
+#define BLK_CAP_FUA 0x2        // Device honours IO_FLAG_FUA on writes
+#define BLK_CAP_DISCARD 0x4    // Device accepts IO_OP_DISCARD
+
+#define BLK_NAME_LENGTH 16
+#define BLK_TIMEOUT_MS 5000    // Synchronous helpers give up after this long
+#define BLK_ABORT_TIMEOUT_MS 1000 // Longest wait for an aborted driver to fail its requests
+
+#include <stdbool.h>
+
+#include "types.h"
+
+struct blk_device;
+
+/**
+ * @brief Entry points every block driver provides
+ */
+typedef struct blk_ops {
+    /**
+     * @brief Issues a request to the hardware. Returns false if the device queue is full, in which
+     * case the block layer keeps the request queued and retries after polling
+     */
+    bool (*submit)(struct blk_device *device, io_request_t *request);
+    /**
+     * @brief Completes finished requests through blk_complete, returning how many completed
+     */
+    uint32_t (*poll)(struct blk_device *device);
+    /**
+     * @brief Fails every request the driver holds through blk_complete, resetting the hardware
+     * first so it no longer touches their buffers. Called when a request has timed out
+     */
+    void (*abort)(struct blk_device *device);
+} blk_ops_t;
+
+typedef struct blk_stats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t flushes;
+    uint64_t discards;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t errors;
+    uint64_t latency_total_ns;
+    uint64_t latency_max_ns;
+    /**
+     * @brief Requests issued to the driver, and the highest that has been reached
+     */
+    uint32_t in_flight;
+    uint32_t max_in_flight;
+} blk_stats_t;
+
+typedef struct blk_device {
+    /**
+     * @brief Index in the registry, also used as the device number in traces
+     */
+    uint32_t id;
+    char_t name[BLK_NAME_LENGTH];
+    uint32_t sector_size;
+    uint64_t sector_count;
+    /**
+     * @brief Largest request the driver accepts, in sectors
+     */
+    uint32_t max_transfer;
+    /**
+     * @brief Most segments the driver accepts in a scatter-gather request, 0 if it takes none
+     */
+    uint32_t max_segments;
+    /**
+     * @brief Most requests the driver can have in flight at once
+     */
+    uint32_t queue_depth;
+    /**
+     * @brief Combination of BLK_CAP_* values
+     */
+    uint32_t capabilities;
+    /**
+     * @brief Added to request LBAs before they reach the driver and taken off again in
+     * blk_complete, so partitions can pass requests straight to their disk's driver
+     */
+    uint64_t lba_offset;
+    const blk_ops_t *ops;
+    void *driver;
+    /**
+     * @brief Requests waiting for the driver to have room, in submission order
+     */
+    io_request_t *queue_head;
+    io_request_t *queue_tail;
+    blk_stats_t stats;
+} blk_device_t;
+
+/**
+ * @brief Adds a device to the registry, assigning its id. The name, geometry, capabilities, ops
+ * and driver must already be filled in
+ * 
+ * @return False if the registry could not grow
+ */
+bool blk_register(blk_device_t *device);
+
+/**
+ * @brief Returns the number of registered devices
+ */
+uint32_t blk_device_count();
+
+/**
+ * @brief Returns the device with the given id, or NULL if there is none
+ */
+blk_device_t *blk_get(uint32_t id);
+
+/**
+ * @brief Returns the device with the given name, or NULL if there is none
+ */
+blk_device_t *blk_find(char_t *name);
+
+/**
+ * @brief Queues a request for the device. Requests which the device cannot take yet are held in
+ * the device queue and issued in order from blk_poll. Invalid requests complete immediately with
+ * success set to false
+ */
+void blk_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Polls the driver for completions, then issues queued requests
+ * 
+ * @return Number of requests completed
+ */
+uint32_t blk_poll(blk_device_t *device);
+
+/**
+ * @brief Called by drivers when a request has finished, after setting success. Updates the
+ * device statistics and trace before calling the request's callback
+ */
+void blk_complete(io_request_t *request);
+
+/**
+ * @brief Synchronously reads count sectors starting at lba into buffer
+ */
+bool blk_read(blk_device_t *device, uint64_t lba, uint32_t count, void *buffer);
+
+/**
+ * @brief Synchronously writes count sectors starting at lba from buffer
+ */
+bool blk_write(blk_device_t *device, uint64_t lba, uint32_t count, void *buffer);
+
+/**
+ * @brief Synchronously writes back the device's volatile cache
+ */
+bool blk_flush(blk_device_t *device);
+
+/**
+ * @brief Synchronously tells the device count sectors starting at lba are no longer in use
+ */
+bool blk_discard(blk_device_t *device, uint64_t lba, uint32_t count);
+
+/**
+ * @brief Submits the request and polls until it completes. After BLK_TIMEOUT_MS a request still
+ * in the device queue is cancelled, and one the driver has is failed by aborting the driver. If
+ * even that does not give it back within BLK_ABORT_TIMEOUT_MS it is left to the driver
+ * 
+ * @return False if the request failed or timed out
+ */
+bool blk_submit_and_wait(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Takes back a request that is still waiting in the device queue, completing it with
+ * success set to false. Requests already handed to the driver cannot be cancelled, so callers
+ * timing out abort the driver with blk_abort before reusing or freeing them
+ * 
+ * @return False if the request was not in the queue
+ */
+bool blk_cancel(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Resets the device, failing every request its driver holds. Requests still in the device
+ * queue are left there
+ */
+void blk_abort(blk_device_t *device);
+
+/**
+ * @brief Returns the segments of a read or write, wrapping a plain buffer in single so drivers
+ * only handle one form
+ * 
+ * @param count Output for the number of segments
+ */
+io_segment_t *blk_segments(io_request_t *request, io_segment_t *single, uint32_t *count);
+
+/**
+ * @brief Prints the registered devices and their capabilities
+ */
+void blk_print_devices();
+
+/**
+ * @brief Prints a "blkstat," CSV line with the statistics of the device
+ */
+void blk_print_stats(blk_device_t *device);
+
+/**
+ * @brief Checks the request against the device geometry and capabilities
+ */
+static bool validate_request(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Issues queued requests until the queue empties or the driver is full
+ */
+static void dispatch_queue(blk_device_t *device);
+
+/**
+ * @brief Hands a request to the driver, translating its LBA by the device's lba_offset
+ * 
+ * @return False if the driver has no room, with the LBA restored
+ */
+static bool submit_to_driver(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Completes a request without passing it to the driver, counting it as in flight and with
+ * its LBA translated so blk_complete finds it as if the driver had completed it
+ */
+static void complete_inline(blk_device_t *device, io_request_t *request, bool success);
+
+/**
+ * @brief Callback used by blk_submit_and_wait to flag its request as complete
+ */
+static void blk_wait_complete(io_request_t *request);
+
+#endif
@@ -6,6 +6,16 @@
 #include "std.h"
 #include "pci.h"
 #include "ahci.h"
+#include "nvme.h"
+#include "virtio.h"
+#include "gpt.h"
+#include "cpu.h"
+#include "blk.h"
+#include "timer.h"
+#include "bench.h"
+#include "zblk.h"
+#include "xts.h"
+#include "trace.h"
 
 /**
  * @brief Determine if two UEFI tables GUID's are identical
@@ -67,6 +77,55 @@ mcfg_t *get_mcfg_table(xsdt_t *xsdt) {
 
 int main(int argc, char **argv)
 {
+    bench_config_t bench_config;
+    bench_default_config(&bench_config);
+    bool bench = BENCH_MODE;
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench = true;
+        if (!bench_parse_args(&bench_config, argc, argv)) {
+            return 1;
+        }
+    }
+
+    // fsread <path> [dev=<name>] times the native FAT32 or ext driver against UEFI's file protocol
+    bool fsread = argc > 2 && strcmp(argv[1], "fsread") == 0;
+    char_t *fsread_device = NULL;
+    if (fsread && argc > 3 && strncmp(argv[3], "dev=", 4) == 0) {
+        fsread_device = argv[3] + 4;
+    }
+
+    // kvbench [dev=<name>] [records=<n>] formats the device as a key-value store and times it
+    bool kvbench = argc > 1 && strcmp(argv[1], "kvbench") == 0;
+    char_t *kvbench_device = NULL;
+    uint32_t kvbench_records = 0;
+    for (int i = 2; kvbench && i < argc; i++) {
+        if (strncmp(argv[i], "dev=", 4) == 0) {
+            kvbench_device = argv[i] + 4;
+        } else if (strncmp(argv[i], "records=", 8) == 0) {
+            kvbench_records = atoi(argv[i] + 8);
+        }
+    }
+
+    // pcibench [buses=<n>] times PCI enumeration over a synthetic topology
+    bool pcibench = argc > 1 && strcmp(argv[1], "pcibench") == 0;
+    uint32_t pcibench_buses = 0;
+    if (pcibench && argc > 2 && strncmp(argv[2], "buses=", 6) == 0) {
+        pcibench_buses = atoi(argv[2] + 6);
+    }
+
+    trace_replay_config_t replay_config;
+    bool replay = argc > 1 && strcmp(argv[1], "replay") == 0;
+    if (replay && !trace_parse_args(&replay_config, argc, argv)) {
+        return 1;
+    }
+
+    init_timer();
+    init_cpus();
+
+    if (TRACE_CAPTURE && !replay) {
+        trace_start(TRACE_CAPACITY);
+    }
+
     rsdp_t *rsdp = get_rsdp_table();
     if (rsdp == NULL) {
         // For now we require the v2 table for 64-bit support
@@ -151,12 +210,72 @@ int main(int argc, char **argv)
     }
 
     pci_device_list_t device_list = init_pci(mcfg);
-    bool success = init_ahci(device_list);
-    if (!success) {
+    if (pcibench) {
+        return pci_benchmark(pcibench_buses) ? 0 : 1;
+    }
+    if (PCI_TUNE) pci_tune_pcie(&device_list);
+    bool ahci = init_ahci(device_list);
+    bool nvme = init_nvme(device_list);
+    bool virtio = init_virtio(device_list);
+    bool success = ahci || nvme || virtio;
+    if (!success && !bench && !replay && !fsread && !kvbench) {
+        // Benchmarks and replays can still run against a RAM disk
         return 1;
     }
 
-    printf("Enter anything to continue: ");
-    char c = getchar();
-    return 0;
+    gpt_scan_all();
+
+    if (BOOT_VERBOSE) {
+        blk_print_devices();
+        gpt_print_partitions();
+        pci_print_links(&device_list);
+    }
+
+    if (replay) {
+        blk_device_t *device = bench_find_device(replay_config.device_name);
+        trace_t trace;
+        if (device == NULL) {
+            handle_error("Could not find replay device\n");
+            return 1;
+        }
+        if (!trace_load(replay_config.path, &trace)) {
+            return 1;
+        }
+        BS->SetWatchdogTimer(0, 0, 0, NULL);
+        success = trace_replay(device, &trace, &replay_config);
+        trace_free(&trace);
+        return success ? 0 : 1;
+    }
+
+    if (fsread) {
+        return bench_read_file(fsread_device, argv[2]) ? 0 : 1;
+    }
+
+    if (kvbench) {
+        BS->SetWatchdogTimer(0, 0, 0, NULL);
+        return bench_kv(kvbench_device, kvbench_records) ? 0 : 1;
+    }
+
+    if (bench) {
+        blk_device_t *device = bench_find_device(bench_config.device_name);
+        if (device == NULL) {
+            handle_error("Could not find benchmark device\n");
+            return 1;
+        }
+        // Benchmarks can run longer than the default 5 minute watchdog
+        BS->SetWatchdogTimer(0, 0, 0, NULL);
+        success = run_benchmarks(device, &bench_config);
+        zblk_print_stats(device);
+        xts_print_stats(device);
+        pci_print_interrupts();
+    } else {
+        printf("Enter anything to continue: ");
+        char c = getchar();
+    }
+
+    if (TRACE_CAPTURE && trace_get() != NULL) {
+        trace_stop();
+        trace_dump(trace_get(), TRACE_OUTPUT_FILE);
+    }
+    return success ? 0 : 1;
 }
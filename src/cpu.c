@@ -0,0 +1,70 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "cpu.h"
+
+static efi_mp_services_protocol_t *mp_services = NULL;
+static uint32_t enabled_cpus = 1;
+static uint32_t apic_ids[CPU_MAX];
+static uint8_t cpu_by_apic_id[256];     // CPUID only reports the low 8 bits of the APIC ID
+
+void init_cpus() {
+    efi_guid_t mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+    enabled_cpus = 1;
+    apic_ids[0] = read_apic_id();
+
+    efi_status_t status = BS->LocateProtocol(&mp_guid, NULL, (void **) &mp_services);
+    if (EFI_ERROR(status)) {
+        mp_services = NULL;
+        if (BOOT_VERBOSE) {
+            printf("No MP services, using the boot processor only\n");
+        }
+        return;
+    }
+
+    uintn_t total, enabled;
+    status = mp_services->get_number_of_processors(mp_services, &total, &enabled);
+    if (EFI_ERROR(status)) return;
+
+    // Number the enabled processors densely, keeping the firmware's order
+    uint32_t count = 0;
+    for (uintn_t i = 0; i < total && count < CPU_MAX; i++) {
+        efi_processor_information_t info;
+        status = mp_services->get_processor_info(mp_services, i, &info);
+        if (EFI_ERROR(status) || !(info.status_flag & 0x2)) continue;
+        apic_ids[count++] = info.processor_id;
+    }
+    if (count > 0) enabled_cpus = count;
+    for (uint32_t i = enabled_cpus; i-- > 0;) {
+        if (apic_ids[i] < 256) cpu_by_apic_id[apic_ids[i]] = i;
+    }
+
+    if (BOOT_VERBOSE) {
+        printf("Processors: %d enabled of %d\n", (uint64_t) enabled_cpus, (uint64_t) total);
+    }
+}
+
+uint32_t cpu_count() {
+    return enabled_cpus;
+}
+
+uint32_t cpu_current() {
+    return cpu_by_apic_id[read_apic_id()];
+}
+
+uint32_t cpu_apic_id(uint32_t cpu) {
+    return cpu < enabled_cpus ? apic_ids[cpu] : apic_ids[0];
+}
+
+efi_mp_services_protocol_t *cpu_mp_services() {
+    return mp_services;
+}
+
+static uint32_t read_apic_id() {
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+    return ebx >> 24; // Bits 24-31 of EBX
+}
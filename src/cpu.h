@@ -0,0 +1,43 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
+#define CPU_MAX 256
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/**
+ * @brief Finds the enabled processors and their local APIC IDs through the MP services protocol.
+ * If the protocol is missing only the current processor is used
+ */
+void init_cpus();
+
+/**
+ * @brief Returns the number of enabled processors
+ */
+uint32_t cpu_count();
+
+/**
+ * @brief Returns the index (0 to cpu_count() - 1) of the processor this is running on. Safe to call
+ * from application processors. Costs a CPUID, so callers on hot paths should avoid it when there
+ * is only one processor or queue to choose from
+ */
+uint32_t cpu_current();
+
+/**
+ * @brief Returns the local APIC ID of the processor with the given index
+ */
+uint32_t cpu_apic_id(uint32_t cpu);
+
+/**
+ * @brief Returns the MP services protocol, or NULL if the firmware does not provide it
+ */
+efi_mp_services_protocol_t *cpu_mp_services();
+
+/**
+ * @brief Reads the initial local APIC ID of the current processor with CPUID
+ */
+static uint32_t read_apic_id();
+
+#endif
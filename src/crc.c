@@ -0,0 +1,240 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "crc.h"
+
+// Slicing by 4: table[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crc32_table[4][256];
+static bool crc32_ready = false;
+
+uint32_t crc32(uint32_t crc, const void *data, size_t length) {
+    if (!crc32_ready) init_crc32_table();
+
+    const uint8_t *bytes = data;
+    crc = ~crc;
+
+    while (length >= 4) {
+        crc ^= bytes[0] | (uint32_t) bytes[1] << 8 | (uint32_t) bytes[2] << 16
+            | (uint32_t) bytes[3] << 24;
+        crc = crc32_table[3][crc & 0xFF] ^ crc32_table[2][(crc >> 8) & 0xFF]
+            ^ crc32_table[1][(crc >> 16) & 0xFF] ^ crc32_table[0][crc >> 24];
+        bytes += 4;
+        length -= 4;
+    }
+    while (length-- > 0) {
+        crc = crc32_table[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void init_crc32_table() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32_POLYNOMIAL : 0);
+        }
+        crc32_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (uint8_t k = 1; k < 4; k++) {
+            uint32_t previous = crc32_table[k - 1][i];
+            crc32_table[k][i] = (previous >> 8) ^ crc32_table[0][previous & 0xFF];
+        }
+    }
+    crc32_ready = true;
+}
+
+// Slicing by 4 like crc32_table, and tables moving the register past CRC32C_LONG or CRC32C_SHORT
+// zero bytes, which is how the three streams of crc32c_sse42 are joined
+static uint32_t crc32c_table[4][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static uint64_t crc32c_fold[4];
+static uint32_t (*crc32c_update)(uint32_t crc, const uint8_t *data, size_t length);
+static const char *crc32c_name;
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+    if (crc32c_update == NULL) init_crc32c();
+    return ~crc32c_update(~crc, data, length);
+}
+
+const char *crc32c_implementation() {
+    if (crc32c_update == NULL) init_crc32c();
+    return crc32c_name;
+}
+
+static void init_crc32c() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+        }
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (uint8_t k = 1; k < 4; k++) {
+            uint32_t previous = crc32c_table[k - 1][i];
+            crc32c_table[k][i] = (previous >> 8) ^ crc32c_table[0][previous & 0xFF];
+        }
+    }
+    init_shift_table(crc32c_long, CRC32C_LONG);
+    init_shift_table(crc32c_short, CRC32C_SHORT);
+
+    // Folding a lane forward by 512 bits (and 128 bits to merge the lanes) multiplies its low and
+    // high halves by x^(n+32) and x^(n-32), shifted left one for the reflected product
+    crc32c_fold[0] = (uint64_t) crc32c_power(4 * 128 + 32) << 1;
+    crc32c_fold[1] = (uint64_t) crc32c_power(4 * 128 - 32) << 1;
+    crc32c_fold[2] = (uint64_t) crc32c_power(128 + 32) << 1;
+    crc32c_fold[3] = (uint64_t) crc32c_power(128 - 32) << 1;
+
+    // CPUID leaf 1: ECX bit 20 is SSE4.2, bit 1 is PCLMULQDQ
+    uint32_t eax, ebx, ecx, edx;
+    __asm__ volatile ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+    if ((ecx & (1 << 20)) && (ecx & (1 << 1))) {
+        crc32c_name = "pclmul";
+        crc32c_update = crc32c_pclmul;
+    } else if (ecx & (1 << 20)) {
+        crc32c_name = "sse4.2";
+        crc32c_update = crc32c_sse42;
+    } else {
+        crc32c_name = "table";
+        crc32c_update = crc32c_software;
+    }
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length >= 4) {
+        crc ^= data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16
+            | (uint32_t) data[3] << 24;
+        crc = crc32c_table[3][crc & 0xFF] ^ crc32c_table[2][(crc >> 8) & 0xFF]
+            ^ crc32c_table[1][(crc >> 16) & 0xFF] ^ crc32c_table[0][crc >> 24];
+        data += 4;
+        length -= 4;
+    }
+    while (length-- > 0) {
+        crc = crc32c_table[0][(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+        length--;
+    }
+
+    // Each stream's result is moved past the bytes of the streams after it and combined
+    uint64_t crc0 = crc;
+    const size_t blocks[2] = { CRC32C_LONG, CRC32C_SHORT };
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        size_t block = blocks[pass];
+        while (length >= block * 3) {
+            uint64_t crc1 = 0;
+            uint64_t crc2 = 0;
+            const uint64_t *words = (const uint64_t *) data;
+            for (size_t i = 0; i < block / 8; i++) {
+                crc0 = __builtin_ia32_crc32di(crc0, words[i]);
+                crc1 = __builtin_ia32_crc32di(crc1, words[i + block / 8]);
+                crc2 = __builtin_ia32_crc32di(crc2, words[i + block / 4]);
+            }
+            uint32_t (*table)[256] = pass == 0 ? crc32c_long : crc32c_short;
+            crc0 = shift_crc32c(table, crc0) ^ crc1;
+            crc0 = shift_crc32c(table, crc0) ^ crc2;
+            data += block * 3;
+            length -= block * 3;
+        }
+    }
+
+    while (length >= 8) {
+        crc0 = __builtin_ia32_crc32di(crc0, *(const uint64_t *) data);
+        data += 8;
+        length -= 8;
+    }
+    crc = crc0;
+    while (length-- > 0) {
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_pclmul(uint32_t crc, const uint8_t *data, size_t length) {
+    if (length < CRC32C_FOLD_MIN) return crc32c_sse42(crc, data, length);
+
+    // The register is folded in as if it were the first four bytes of the data, so the lanes
+    // describe everything from here on and the final 16 bytes are hashed from a zero register
+    const crc_unaligned_t *input = (const crc_unaligned_t *) data;
+    crc_vector_t lane0 = input[0] ^ (crc_vector_t) { crc, 0 };
+    crc_vector_t lane1 = input[1];
+    crc_vector_t lane2 = input[2];
+    crc_vector_t lane3 = input[3];
+    input += 4;
+    length -= 64;
+
+    // Four independent lanes, named rather than in an array so they stay in registers
+    crc_vector_t constants = { crc32c_fold[0], crc32c_fold[1] };
+    while (length >= 64) {
+        lane0 = fold_lane(lane0, constants) ^ input[0];
+        lane1 = fold_lane(lane1, constants) ^ input[1];
+        lane2 = fold_lane(lane2, constants) ^ input[2];
+        lane3 = fold_lane(lane3, constants) ^ input[3];
+        input += 4;
+        length -= 64;
+    }
+
+    // Merge the lanes into one, then keep folding 16 bytes at a time
+    constants = (crc_vector_t) { crc32c_fold[2], crc32c_fold[3] };
+    crc_vector_t folded = fold_lane(lane0, constants) ^ lane1;
+    folded = fold_lane(folded, constants) ^ lane2;
+    folded = fold_lane(folded, constants) ^ lane3;
+    while (length >= 16) {
+        folded = fold_lane(folded, constants) ^ *input++;
+        length -= 16;
+    }
+
+    crc = __builtin_ia32_crc32di(0, folded[0]);
+    crc = __builtin_ia32_crc32di(crc, folded[1]);
+    return crc32c_sse42(crc, (const uint8_t *) input, length);
+}
+
+__attribute__((target("pclmul")))
+static crc_vector_t fold_lane(crc_vector_t lane, crc_vector_t constants) {
+    return __builtin_ia32_pclmulqdq128(lane, constants, 0x00)
+        ^ __builtin_ia32_pclmulqdq128(lane, constants, 0x11);
+}
+
+static uint32_t shift_crc32c(uint32_t table[4][256], uint32_t crc) {
+    return table[0][crc & 0xFF] ^ table[1][(crc >> 8) & 0xFF] ^ table[2][(crc >> 16) & 0xFF]
+        ^ table[3][crc >> 24];
+}
+
+static void init_shift_table(uint32_t table[4][256], uint64_t bytes) {
+    // Moving past zero bytes multiplies the register by x^(8 * bytes), which is linear, so each
+    // byte of the register can be looked up separately
+    uint32_t power = crc32c_power(8 * bytes);
+    for (uint32_t i = 0; i < 256; i++) {
+        for (uint8_t k = 0; k < 4; k++) {
+            table[k][i] = crc32c_multiply(i << (8 * k), power);
+        }
+    }
+}
+
+static uint32_t crc32c_power(uint64_t bits) {
+    // Bit 31 is x^0 in the reflected form
+    uint32_t power = 1U << 31;
+    while (bits-- > 0) {
+        power = (power >> 1) ^ (power & 1 ? CRC32C_POLYNOMIAL : 0);
+    }
+    return power;
+}
+
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t bit = 1U << 31; bit != 0; bit >>= 1) {
+        if (a & bit) product ^= b;
+        b = (b >> 1) ^ (b & 1 ? CRC32C_POLYNOMIAL : 0);
+    }
+    return product;
+}
@@ -0,0 +1,88 @@
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#define CRC32_POLYNOMIAL 0xEDB88320     // Reflected IEEE 802.3, as used by GPT and zlib
+#define CRC32C_POLYNOMIAL 0x82F63B78    // Reflected Castagnoli, as computed by the SSE4.2 instruction
+#define CRC32C_LONG 8192                // Bytes per stream of the 3-way interleaved loop
+#define CRC32C_SHORT 256                // ...and of its second pass over what is left
+#define CRC32C_FOLD_MIN 512             // Smallest buffer taking the PCLMULQDQ folding path
+
+#include "types.h"
+
+/**
+ * @brief 128-bit lane of the PCLMULQDQ folding loop, and the same for loads that may be unaligned
+ */
+typedef long long crc_vector_t __attribute__((vector_size(16)));
+typedef long long crc_unaligned_t __attribute__((vector_size(16), aligned(1)));
+
+/**
+ * @brief Continues a CRC32 over more data. Start with crc 0, the pre and post inversion is done
+ * internally so results can be chained
+ */
+uint32_t crc32(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Continues a CRC32C over more data, chained like crc32. Uses the SSE4.2 crc32 instruction,
+ * and PCLMULQDQ folding for large buffers, when the CPU has them
+ */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/**
+ * @brief Returns the name of the CRC32C implementation in use: "pclmul", "sse4.2" or "table"
+ */
+const char *crc32c_implementation();
+
+/**
+ * @brief Fills the lookup tables on first use
+ */
+static void init_crc32_table();
+
+/**
+ * @brief Fills the CRC32C tables and picks the fastest implementation the CPU supports
+ */
+static void init_crc32c();
+
+/**
+ * @brief Slicing by 4 CRC32C on the raw register, without the pre and post inversion
+ */
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length);
+
+/**
+ * @brief CRC32C with the crc32 instruction, running three independent streams over blocks of
+ * CRC32C_LONG and then CRC32C_SHORT bytes to hide its latency, and joining them with the shift
+ * tables
+ */
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length);
+
+/**
+ * @brief CRC32C that folds four 128-bit lanes at a time with carry-less multiplies, then hands the
+ * last 16 bytes and the tail to crc32c_sse42
+ */
+static uint32_t crc32c_pclmul(uint32_t crc, const uint8_t *data, size_t length);
+
+/**
+ * @brief Carry-less multiplies the low and high halves of a lane by the low and high constants
+ */
+static crc_vector_t fold_lane(crc_vector_t lane, crc_vector_t constants);
+
+/**
+ * @brief Advances a raw CRC32C register over the number of zero bytes a shift table was built for
+ */
+static uint32_t shift_crc32c(uint32_t table[4][256], uint32_t crc);
+
+/**
+ * @brief Builds the table that advances a register over a run of zero bytes
+ */
+static void init_shift_table(uint32_t table[4][256], uint64_t bytes);
+
+/**
+ * @brief Returns x^bits modulo the CRC32C polynomial, bit reflected
+ */
+static uint32_t crc32c_power(uint64_t bits);
+
+/**
+ * @brief Multiplies two bit reflected polynomials modulo the CRC32C polynomial
+ */
+static uint32_t crc32c_multiply(uint32_t a, uint32_t b);
+
+#endif
@@ -1,4 +1,8 @@
 #define BOOT_VERBOSE true
 #define PCI_VERBOSE false
+#define BENCH_MODE false // Run the storage benchmarks headless instead of waiting for input
+#define TRACE_CAPTURE false // Record every block request and dump the trace before exiting
+#define BCACHE_CHECKSUMS false // Check blocks read again from disk against their CRC32C
+#define PCI_TUNE false // Raise PCIe payload and read request sizes before starting the drivers
 #define EXIT_SUCCESS 0
 #define EXIT_FAILURE 1
\ No newline at end of file
@@ -0,0 +1,937 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "bcache.h"
+#include "ext2.h"
+
+bool ext2_probe(blk_device_t *device) {
+    // The superblock is the second kilobyte, whatever the sector size
+    uint32_t first = EXT2_SUPERBLOCK_OFFSET / device->sector_size;
+    uint32_t last = (EXT2_SUPERBLOCK_OFFSET + sizeof(ext2_superblock_t) - 1) / device->sector_size;
+    uint32_t size = (last - first + 1) * device->sector_size;
+    uint8_t *buffer = dma_alloc(size);
+    if (buffer == NULL) return false;
+
+    bool found = false;
+    if (blk_read(device, first, last - first + 1, buffer)) {
+        ext2_superblock_t *superblock = (ext2_superblock_t *)
+            (buffer + EXT2_SUPERBLOCK_OFFSET - (uint64_t) first * device->sector_size);
+        found = superblock->magic == EXT2_MAGIC;
+    }
+    dma_free(buffer, size);
+    return found;
+}
+
+bool ext2_mount(blk_device_t *device, ext2_t **fs) {
+    ext2_t *new_fs = malloc(sizeof(ext2_t));
+    if (new_fs == NULL) {
+        handle_error("Could not allocate ext2 volume\n");
+        return false;
+    }
+    memset(new_fs, 0, sizeof(ext2_t));
+    new_fs->device = device;
+    new_fs->cache = bcache_create(device, 0, 0);
+    if (new_fs->cache == NULL) {
+        free(new_fs);
+        return false;
+    }
+
+    ext2_superblock_t superblock;
+    if (!bcache_read(new_fs->cache, EXT2_SUPERBLOCK_OFFSET, sizeof(superblock), &superblock)) {
+        ext2_unmount(new_fs);
+        handle_error("Could not read ext2 superblock\n");
+        return false;
+    }
+
+    if (superblock.magic != EXT2_MAGIC || superblock.log_block_size > 6
+        || superblock.blocks_per_group == 0 || superblock.inodes_per_group == 0) {
+        ext2_unmount(new_fs);
+        handle_error("Not an ext2/3/4 volume\n");
+        return false;
+    }
+
+    new_fs->block_size = 1024 << superblock.log_block_size;
+    new_fs->inodes_per_group = superblock.inodes_per_group;
+    if (superblock.revision != 0) {
+        new_fs->inode_size = superblock.inode_size;
+        new_fs->incompat = superblock.feature_incompat;
+    } else {
+        new_fs->inode_size = sizeof(ext2_inode_t);
+    }
+    if (new_fs->inode_size < sizeof(ext2_inode_t) || new_fs->inode_size > new_fs->block_size) {
+        ext2_unmount(new_fs);
+        handle_error("ext2 inode size is invalid\n");
+        return false;
+    }
+
+    // Meta block groups move the group descriptors, which is not handled
+    uint32_t unsupported = new_fs->incompat & ~EXT2_INCOMPAT_SUPPORTED;
+    if (unsupported != 0 || (new_fs->incompat & EXT2_INCOMPAT_META_BG)) {
+        ext2_unmount(new_fs);
+        handle_error("ext2 volume has unsupported features\n");
+        return false;
+    }
+
+    new_fs->block_count = superblock.blocks_count_lo;
+    if (new_fs->incompat & EXT2_INCOMPAT_64BIT) {
+        new_fs->block_count |= (uint64_t) superblock.blocks_count_hi << 32;
+    }
+    uint64_t device_blocks = device->sector_count * device->sector_size / new_fs->block_size;
+    if (new_fs->block_count > device_blocks || new_fs->block_count <= superblock.first_data_block) {
+        ext2_unmount(new_fs);
+        handle_error("ext2 volume is larger than its device\n");
+        return false;
+    }
+    new_fs->group_count = (new_fs->block_count - superblock.first_data_block
+        + superblock.blocks_per_group - 1) / superblock.blocks_per_group;
+
+    memcpy(new_fs->hash_seed, superblock.hash_seed, sizeof(new_fs->hash_seed));
+    new_fs->hash_unsigned = (superblock.flags & 0x2) != 0;
+
+    // The descriptors follow the superblock's block, 32 bytes each unless the volume is 64-bit
+    uint32_t descriptor_size = 32;
+    if (new_fs->incompat & EXT2_INCOMPAT_64BIT) {
+        descriptor_size = superblock.descriptor_size;
+        if (descriptor_size < 32 || descriptor_size > new_fs->block_size
+            || (descriptor_size & (descriptor_size - 1)) != 0) {
+            ext2_unmount(new_fs);
+            handle_error("ext2 group descriptor size is invalid\n");
+            return false;
+        }
+    }
+    size_t table_size = (size_t) new_fs->group_count * descriptor_size;
+    uint8_t *descriptors = malloc(table_size);
+    new_fs->inode_tables = malloc(new_fs->group_count * sizeof(uint64_t));
+    if (descriptors == NULL || new_fs->inode_tables == NULL) {
+        free(descriptors);
+        ext2_unmount(new_fs);
+        handle_error("Could not allocate ext2 group descriptors\n");
+        return false;
+    }
+    uint64_t table_offset = ((uint64_t) superblock.first_data_block + 1) * new_fs->block_size;
+    if (!bcache_read(new_fs->cache, table_offset, table_size, descriptors)) {
+        free(descriptors);
+        ext2_unmount(new_fs);
+        handle_error("Could not read ext2 group descriptors\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < new_fs->group_count; i++) {
+        ext2_group_descriptor_t *descriptor =
+            (ext2_group_descriptor_t *) (descriptors + (size_t) i * descriptor_size);
+        new_fs->inode_tables[i] = descriptor->inode_table_lo;
+        if (descriptor_size >= sizeof(ext2_group_descriptor_t)) {
+            new_fs->inode_tables[i] |= (uint64_t) descriptor->inode_table_hi << 32;
+        }
+    }
+    free(descriptors);
+
+    new_fs->inode_mask = 63;
+    new_fs->inodes = malloc((new_fs->inode_mask + 1) * sizeof(ext2_node_t *));
+    if (new_fs->inodes == NULL) {
+        ext2_unmount(new_fs);
+        handle_error("Could not allocate ext2 inode cache\n");
+        return false;
+    }
+    memset(new_fs->inodes, 0, (new_fs->inode_mask + 1) * sizeof(ext2_node_t *));
+
+    if (BOOT_VERBOSE) {
+        printf("ext%d on %s: %d blocks of %d bytes in %d groups\n",
+            (uint64_t) ((new_fs->incompat & EXT2_INCOMPAT_EXTENTS) ? 4 : 2), device->name,
+            new_fs->block_count, (uint64_t) new_fs->block_size, (uint64_t) new_fs->group_count);
+        if (new_fs->incompat & EXT2_INCOMPAT_RECOVER) {
+            printf("ext2 journal needs recovery, reading without replaying it\n");
+        }
+    }
+    *fs = new_fs;
+    return true;
+}
+
+void ext2_unmount(ext2_t *fs) {
+    if (fs == NULL) return;
+    free_inodes(fs);
+    free(fs->inodes);
+    free(fs->inode_tables);
+    bcache_destroy(fs->cache);
+    free(fs);
+}
+
+ext2_node_t *ext2_open(ext2_t *fs, char_t *path) {
+    ext2_node_t *node = get_inode(fs, EXT2_ROOT_INODE);
+
+    while (node != NULL && *path != '\0') {
+        while (*path == '/') path++;
+        if (*path == '\0') break;
+
+        size_t length = 0;
+        while (path[length] != '\0' && path[length] != '/') length++;
+
+        if ((node->mode & EXT2_MODE_TYPE) != EXT2_MODE_DIRECTORY) return NULL;
+        uint32_t number = find_entry(fs, node, path, length);
+        if (number == 0) return NULL;
+        node = get_inode(fs, number);
+        path += length;
+    }
+    return node;
+}
+
+bool ext2_read(ext2_t *fs, ext2_node_t *file, uint64_t offset, uint64_t length, void *buffer,
+    uint64_t *bytes_read) {
+    *bytes_read = 0;
+    if ((file->mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY) return false;
+    if (offset >= file->size) return true;
+    if (length > file->size - offset) length = file->size - offset;
+    if (!map_blocks(fs, file)) return false;
+
+    blk_device_t *device = fs->device;
+    uint32_t sector_size = device->sector_size;
+    ext2_read_state_t *state = malloc(sizeof(ext2_read_state_t));
+    uint8_t *scratch = dma_alloc(2 * sector_size);
+    if (state == NULL || scratch == NULL) {
+        free(state);
+        dma_free(scratch, 2 * sector_size);
+        handle_error("Could not allocate ext2 read state\n");
+        return false;
+    }
+    memset(state, 0, sizeof(ext2_read_state_t));
+    for (uint32_t i = 0; i < EXT2_READ_DEPTH; i++) {
+        state->requests[i].callback = read_complete;
+        state->requests[i].context = state;
+        state->idle[state->idle_count++] = &state->requests[i];
+    }
+
+    // Partial sectors at the ends of the range land in scratch and are copied out at the end
+    uint8_t *head_output = NULL, *tail_output = NULL;
+    uint32_t head_offset = 0, head_length = 0, tail_length = 0;
+
+    uint8_t *output = buffer;
+    uint64_t position = offset;
+    uint64_t remaining = length;
+    uint32_t extent = 0;
+    bool success = true;
+
+    while (remaining > 0 && success && !state->failed) {
+        uint32_t file_block = position / fs->block_size;
+        uint32_t low = extent, high = file->extent_count;
+        while (high - low > 1) {
+            uint32_t middle = (low + high) / 2;
+            if (file->extents[middle].file_block <= file_block) low = middle;
+            else high = middle;
+        }
+        extent = low;
+
+        ext2_extent_t *run = extent < file->extent_count ? &file->extents[extent] : NULL;
+        uint64_t piece;
+        if (run == NULL || file_block < run->file_block
+            || file_block >= run->file_block + run->length || run->unwritten) {
+            // A hole or unwritten extent reads as zeros up to the next mapped block
+            uint64_t end = file->size;
+            if (run != NULL && file_block < run->file_block) {
+                end = (uint64_t) run->file_block * fs->block_size;
+            } else if (run != NULL && file_block < run->file_block + run->length) {
+                end = (uint64_t) (run->file_block + run->length) * fs->block_size;
+            } else if (extent + 1 < file->extent_count) {
+                end = (uint64_t) file->extents[extent + 1].file_block * fs->block_size;
+            }
+            piece = end - position < remaining ? end - position : remaining;
+            memset(output, 0, piece);
+            output += piece;
+            position += piece;
+            remaining -= piece;
+            continue;
+        }
+
+        uint64_t run_offset = position - (uint64_t) run->file_block * fs->block_size;
+        uint64_t run_left = (uint64_t) run->length * fs->block_size - run_offset;
+        uint64_t chunk = remaining < run_left ? remaining : run_left;
+        uint64_t disk_offset = run->block * fs->block_size + run_offset;
+
+        uint32_t head = disk_offset % sector_size;
+        uint64_t first_sector = disk_offset / sector_size;
+        uint64_t sectors = (head + chunk + sector_size - 1) / sector_size;
+        if (sectors > device->max_transfer) {
+            sectors = device->max_transfer;
+            chunk = sectors * sector_size - head;
+        }
+        uint32_t tail = (head + chunk) % sector_size;
+
+        // Bytes of the caller's buffer covered by whole sectors, between the partial ones
+        uint32_t head_part = head != 0 ? sector_size - head : 0;
+        uint32_t tail_part = tail;
+        if (head != 0 && chunk <= head_part) {
+            head_part = chunk;
+            tail_part = 0;
+        }
+        uint64_t middle = chunk - head_part - tail_part;
+        uint32_t segment_count = (head_part != 0) + (tail_part != 0) + (middle != 0);
+
+        // Whole sectors can only be read by DMA to a 4 byte aligned address, so a buffer that
+        // puts them anywhere else is read through the cache
+        if (((uint64_t) (output + head_part) & 0x3) != 0) {
+            if (!bcache_read(fs->cache, disk_offset, chunk, output)) success = false;
+            output += chunk;
+            position += chunk;
+            remaining -= chunk;
+            continue;
+        }
+
+        // Blocks smaller than sectors can leave partial sectors at every extent, but there is
+        // scratch for only one at each end
+        bool partial = head_part != 0 || tail_part != 0;
+        bool scatter = partial && middle != 0 && segment_count <= device->max_segments
+            && (head_part == 0 || head_output == NULL) && (tail_part == 0 || tail_output == NULL);
+        if (partial && !scatter) {
+            // Without scatter-gather the ends go through the cache and the middle is read alone
+            if (head_part != 0) {
+                piece = head_part;
+            } else if (middle == 0) {
+                piece = tail_part;
+            } else {
+                piece = middle;
+            }
+            if (piece != middle) {
+                if (!bcache_read(fs->cache, disk_offset, piece, output)) success = false;
+                output += piece;
+                position += piece;
+                remaining -= piece;
+                continue;
+            }
+            chunk = middle;
+            sectors = middle / sector_size;
+            head_part = tail_part = 0;
+            segment_count = 1;
+        }
+
+        if (state->idle_count == 0 && !wait_for_reads(device, state, EXT2_READ_DEPTH - 1)) {
+            success = false;
+            break;
+        }
+        io_request_t *request = state->idle[--state->idle_count];
+        uint32_t index = request - state->requests;
+        io_segment_t *segments = state->segments[index];
+        request->op = IO_OP_READ;
+        request->lba = first_sector;
+        request->count = sectors;
+        request->buffer = output;
+        request->segment_count = 0;
+        if (scatter) {
+            uint32_t count = 0;
+            if (head_part != 0) {
+                segments[count].buffer = scratch;
+                segments[count++].length = sector_size;
+                head_output = output;
+                head_offset = head;
+                head_length = head_part;
+            }
+            segments[count].buffer = output + head_part;
+            segments[count++].length = middle;
+            if (tail_part != 0) {
+                segments[count].buffer = scratch + sector_size;
+                segments[count++].length = sector_size;
+                tail_output = output + head_part + middle;
+                tail_length = tail_part;
+            }
+            request->segments = segments;
+            request->segment_count = count;
+        }
+        blk_submit(device, request);
+
+        output += chunk;
+        position += chunk;
+        remaining -= chunk;
+    }
+
+    if (!wait_for_reads(device, state, 0)) success = false;
+    if (state->failed) success = false;
+    if (success) {
+        if (head_output != NULL) memcpy(head_output, scratch + head_offset, head_length);
+        if (tail_output != NULL) memcpy(tail_output, scratch + sector_size, tail_length);
+        *bytes_read = length;
+    }
+
+    free(state);
+    dma_free(scratch, 2 * sector_size);
+    return success;
+}
+
+bool ext2_print_directory(ext2_t *fs, ext2_node_t *directory) {
+    if ((directory->mode & EXT2_MODE_TYPE) != EXT2_MODE_DIRECTORY) return false;
+    if (!map_blocks(fs, directory)) return false;
+
+    uint8_t *buffer = malloc(fs->block_size);
+    if (buffer == NULL) {
+        handle_error("Could not allocate ext2 directory buffer\n");
+        return false;
+    }
+
+    // Index nodes of hashed directories look like one empty entry, so a plain walk skips them
+    uint32_t blocks = (directory->size + fs->block_size - 1) / fs->block_size;
+    for (uint32_t b = 0; b < blocks; b++) {
+        if (!read_directory_block(fs, directory, b, buffer)) {
+            free(buffer);
+            return false;
+        }
+        uint32_t position = 0;
+        while (position + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+            ext2_dir_entry_t *entry = (ext2_dir_entry_t *) (buffer + position);
+            if (entry->record_length < sizeof(ext2_dir_entry_t)
+                || position + entry->record_length > fs->block_size) {
+                break;
+            }
+            position += entry->record_length;
+            if (entry->inode == 0 || entry->name_length == 0
+                || sizeof(ext2_dir_entry_t) + entry->name_length > entry->record_length) {
+                continue;
+            }
+            if (entry->name[0] == '.' && (entry->name_length == 1
+                || (entry->name_length == 2 && entry->name[1] == '.'))) {
+                continue;
+            }
+
+            char_t name[EXT2_NAME_LENGTH];
+            memcpy(name, entry->name, entry->name_length);
+            name[entry->name_length] = '\0';
+            ext2_node_t *node = get_inode(fs, entry->inode);
+            if (node == NULL) continue;
+            printf("%s%s %d\n", name,
+                (node->mode & EXT2_MODE_TYPE) == EXT2_MODE_DIRECTORY ? "/" : "", node->size);
+        }
+    }
+
+    free(buffer);
+    return true;
+}
+
+static ext2_node_t *get_inode(ext2_t *fs, uint32_t number) {
+    uint32_t hash = number * 0x9E3779B1u;
+    for (ext2_node_t *node = fs->inodes[hash & fs->inode_mask]; node != NULL;
+        node = node->hash_next) {
+        if (node->number == number) return node;
+    }
+
+    uint32_t group = (number - 1) / fs->inodes_per_group;
+    if (number == 0 || group >= fs->group_count) {
+        handle_error("ext2 inode number is out of range\n");
+        return NULL;
+    }
+    uint64_t index = (number - 1) % fs->inodes_per_group;
+    uint64_t inode_offset = fs->inode_tables[group] * fs->block_size + index * fs->inode_size;
+
+    ext2_inode_t inode;
+    if (!bcache_read(fs->cache, inode_offset, sizeof(inode), &inode)) return NULL;
+
+    // Grow the cache by doubling once it is as full as it has buckets
+    if (fs->inode_count > fs->inode_mask) {
+        uint32_t new_mask = fs->inode_mask * 2 + 1;
+        ext2_node_t **new_inodes = malloc((new_mask + 1) * sizeof(ext2_node_t *));
+        if (new_inodes == NULL) {
+            handle_error("Could not grow ext2 inode cache\n");
+            return NULL;
+        }
+        memset(new_inodes, 0, (new_mask + 1) * sizeof(ext2_node_t *));
+        for (uint32_t i = 0; i <= fs->inode_mask; i++) {
+            ext2_node_t *entry = fs->inodes[i];
+            while (entry != NULL) {
+                ext2_node_t *next = entry->hash_next;
+                uint32_t bucket = (entry->number * 0x9E3779B1u) & new_mask;
+                entry->hash_next = new_inodes[bucket];
+                new_inodes[bucket] = entry;
+                entry = next;
+            }
+        }
+        free(fs->inodes);
+        fs->inodes = new_inodes;
+        fs->inode_mask = new_mask;
+    }
+
+    ext2_node_t *node = malloc(sizeof(ext2_node_t));
+    if (node == NULL) {
+        handle_error("Could not allocate ext2 inode\n");
+        return NULL;
+    }
+    memset(node, 0, sizeof(ext2_node_t));
+    node->number = number;
+    node->mode = inode.mode;
+    node->flags = inode.flags;
+    node->size = inode.size_lo | (uint64_t) inode.size_hi << 32;
+    memcpy(node->block, inode.block, sizeof(node->block));
+
+    node->hash_next = fs->inodes[hash & fs->inode_mask];
+    fs->inodes[hash & fs->inode_mask] = node;
+    fs->inode_count++;
+    return node;
+}
+
+static bool map_blocks(ext2_t *fs, ext2_node_t *node) {
+    if (node->mapped) return true;
+    if (node->flags & (EXT2_INODE_INLINE_DATA | EXT2_INODE_ENCRYPTED)) {
+        handle_error("ext2 inline and encrypted data are not supported\n");
+        return false;
+    }
+
+    bool success;
+    if (node->flags & EXT2_INODE_EXTENTS) {
+        success = map_extent_node(fs, node, (uint8_t *) node->block, sizeof(node->block),
+            EXT4_EXTENT_MAX_DEPTH);
+    } else {
+        // 12 direct blocks, then single, double and triple indirect blocks, stopping at the size
+        uint32_t blocks = (node->size + fs->block_size - 1) / fs->block_size;
+        uint32_t file_block = 0;
+        success = true;
+        for (; file_block < 12 && file_block < blocks && success; file_block++) {
+            if (node->block[file_block] == 0) continue;
+            success = add_extent(node, file_block, node->block[file_block], 1, false);
+        }
+        for (uint32_t level = 0; level < 3 && file_block < blocks && success; level++) {
+            success = map_indirect(fs, node, node->block[12 + level], level, &file_block);
+        }
+    }
+
+    if (!success) {
+        free(node->extents);
+        node->extents = NULL;
+        node->extent_count = node->extent_capacity = 0;
+        return false;
+    }
+    node->mapped = true;
+    return true;
+}
+
+static bool map_extent_node(ext2_t *fs, ext2_node_t *node, uint8_t *data, uint32_t size,
+    uint32_t depth) {
+    ext4_extent_header_t *header = (ext4_extent_header_t *) data;
+    if (header->magic != EXT4_EXTENT_MAGIC || depth == 0 || header->depth >= depth
+        || sizeof(ext4_extent_header_t) + header->entries * sizeof(ext4_extent_t) > size) {
+        handle_error("ext4 extent tree is corrupt\n");
+        return false;
+    }
+
+    if (header->depth == 0) {
+        ext4_extent_t *extents = (ext4_extent_t *) (header + 1);
+        for (uint16_t i = 0; i < header->entries; i++) {
+            uint32_t length = extents[i].length;
+            bool unwritten = length > EXT4_EXTENT_UNWRITTEN;
+            if (unwritten) length -= EXT4_EXTENT_UNWRITTEN;
+            uint64_t block = extents[i].start_lo | (uint64_t) extents[i].start_hi << 32;
+            if (block + length > fs->block_count) {
+                handle_error("ext4 extent is outside the volume\n");
+                return false;
+            }
+            if (!add_extent(node, extents[i].block, block, length, unwritten)) return false;
+        }
+        return true;
+    }
+
+    uint8_t *child = malloc(fs->block_size);
+    if (child == NULL) {
+        handle_error("Could not allocate ext4 extent block\n");
+        return false;
+    }
+    ext4_extent_index_t *indexes = (ext4_extent_index_t *) (header + 1);
+    for (uint16_t i = 0; i < header->entries; i++) {
+        uint64_t leaf = indexes[i].leaf_lo | (uint64_t) indexes[i].leaf_hi << 32;
+        if (leaf >= fs->block_count
+            || !bcache_read(fs->cache, leaf * fs->block_size, fs->block_size, child)
+            || !map_extent_node(fs, node, child, fs->block_size, header->depth)) {
+            free(child);
+            return false;
+        }
+    }
+    free(child);
+    return true;
+}
+
+static bool map_indirect(ext2_t *fs, ext2_node_t *node, uint32_t block, uint32_t level,
+    uint32_t *file_block) {
+    uint32_t per_block = fs->block_size / 4;
+    uint64_t covered = per_block;
+    for (uint32_t i = 0; i < level; i++) covered *= per_block;
+
+    // A missing indirect block is a hole over everything it would map
+    if (block == 0) {
+        *file_block = covered > 0xFFFFFFFF - *file_block ? 0xFFFFFFFF : *file_block + covered;
+        return true;
+    }
+    if (block >= fs->block_count) {
+        handle_error("ext2 indirect block is outside the volume\n");
+        return false;
+    }
+
+    uint32_t *entries = malloc(fs->block_size);
+    if (entries == NULL) {
+        handle_error("Could not allocate ext2 indirect block\n");
+        return false;
+    }
+    if (!bcache_read(fs->cache, (uint64_t) block * fs->block_size, fs->block_size, entries)) {
+        free(entries);
+        return false;
+    }
+
+    uint32_t blocks = (node->size + fs->block_size - 1) / fs->block_size;
+    bool success = true;
+    for (uint32_t i = 0; i < per_block && *file_block < blocks && success; i++) {
+        if (level > 0) {
+            success = map_indirect(fs, node, entries[i], level - 1, file_block);
+            continue;
+        }
+        if (entries[i] != 0) success = add_extent(node, *file_block, entries[i], 1, false);
+        (*file_block)++;
+    }
+    free(entries);
+    return success;
+}
+
+static bool add_extent(ext2_node_t *node, uint32_t file_block, uint64_t block, uint32_t length,
+    bool unwritten) {
+    if (length == 0) return true;
+
+    if (node->extent_count > 0) {
+        ext2_extent_t *last = &node->extents[node->extent_count - 1];
+        if (last->file_block + last->length == file_block && last->block + last->length == block
+            && last->unwritten == unwritten && last->length <= 0xFFFFFFFF - length) {
+            last->length += length;
+            return true;
+        }
+        if (file_block < last->file_block + last->length) {
+            handle_error("ext2 block map is out of order\n");
+            return false;
+        }
+    }
+
+    if (node->extent_count == node->extent_capacity) {
+        uint32_t capacity = node->extent_capacity == 0 ? 4 : node->extent_capacity * 2;
+        void *new_pointer = realloc(node->extents, capacity * sizeof(ext2_extent_t));
+        if (new_pointer == NULL) {
+            handle_error("Could not allocate ext2 extents\n");
+            return false;
+        }
+        node->extents = new_pointer;
+        node->extent_capacity = capacity;
+    }
+    ext2_extent_t *extent = &node->extents[node->extent_count++];
+    extent->file_block = file_block;
+    extent->length = length;
+    extent->block = block;
+    extent->unwritten = unwritten;
+    return true;
+}
+
+static uint64_t file_block_address(ext2_node_t *node, uint32_t file_block) {
+    uint32_t low = 0, high = node->extent_count;
+    while (low < high) {
+        uint32_t middle = (low + high) / 2;
+        ext2_extent_t *extent = &node->extents[middle];
+        if (file_block < extent->file_block) {
+            high = middle;
+        } else if (file_block >= extent->file_block + extent->length) {
+            low = middle + 1;
+        } else {
+            return extent->unwritten ? 0 : extent->block + (file_block - extent->file_block);
+        }
+    }
+    return 0;
+}
+
+static bool read_directory_block(ext2_t *fs, ext2_node_t *directory, uint32_t file_block,
+    uint8_t *buffer) {
+    uint64_t block = file_block_address(directory, file_block);
+    if (block == 0) {
+        // A hole holds no entries
+        memset(buffer, 0, fs->block_size);
+        ((ext2_dir_entry_t *) buffer)->record_length = fs->block_size;
+        return true;
+    }
+    return bcache_read(fs->cache, block * fs->block_size, fs->block_size, buffer);
+}
+
+static uint32_t find_entry(ext2_t *fs, ext2_node_t *directory, char_t *name, size_t length) {
+    if (length >= EXT2_NAME_LENGTH || !map_blocks(fs, directory)) return 0;
+
+    // "." and ".." always lead the first block, where the index does not point
+    bool dots = name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.'));
+    uint32_t found;
+    if (!dots && (directory->flags & EXT2_INODE_INDEX)
+        && !(directory->flags & EXT2_INODE_CASEFOLD)
+        && find_entry_hashed(fs, directory, name, length, &found)) {
+        return found;
+    }
+
+    uint8_t *buffer = malloc(fs->block_size);
+    if (buffer == NULL) {
+        handle_error("Could not allocate ext2 directory buffer\n");
+        return 0;
+    }
+    found = 0;
+    uint32_t blocks = dots ? 1 : (directory->size + fs->block_size - 1) / fs->block_size;
+    for (uint32_t b = 0; b < blocks && found == 0; b++) {
+        if (!read_directory_block(fs, directory, b, buffer)) break;
+        found = search_block(fs, buffer, name, length);
+    }
+    free(buffer);
+    return found;
+}
+
+static bool find_entry_hashed(ext2_t *fs, ext2_node_t *directory, char_t *name, size_t length,
+    uint32_t *found) {
+    *found = 0;
+    uint8_t *node = malloc(fs->block_size);
+    uint8_t *leaf = malloc(fs->block_size);
+    if (node == NULL || leaf == NULL) {
+        free(node);
+        free(leaf);
+        return false;
+    }
+
+    // The root follows the 12 byte "." entry and the 12 byte header of ".."
+    bool success = false;
+    uint32_t max_levels = (fs->incompat & EXT2_INCOMPAT_LARGEDIR) ? EXT2_DX_MAX_LEVELS : 2;
+    ext2_dx_root_info_t *info = (ext2_dx_root_info_t *) (node + 24);
+    if (!read_directory_block(fs, directory, 0, node) || info->reserved != 0
+        || info->info_length != sizeof(ext2_dx_root_info_t)
+        || info->indirect_levels >= max_levels) {
+        goto done;
+    }
+
+    uint8_t version = info->hash_version;
+    if (version <= EXT2_HASH_TEA && fs->hash_unsigned) version += EXT2_HASH_UNSIGNED;
+    if (version > EXT2_HASH_TEA + EXT2_HASH_UNSIGNED) goto done;
+    uint32_t hash = directory_hash(fs, version, name, length);
+
+    uint32_t levels = info->indirect_levels;
+    uint32_t entries_offset = 24 + info->info_length;
+    ext2_dx_entry_t *entries;
+    uint16_t count;
+    uint32_t chosen;
+    for (uint32_t level = 0;; level++) {
+        // The first entry's hash field holds the limit and count instead
+        entries = (ext2_dx_entry_t *) (node + entries_offset);
+        uint16_t limit = *(uint16_t *) &entries[0];
+        count = *((uint16_t *) &entries[0] + 1);
+        if (count == 0 || count > limit
+            || entries_offset + limit * sizeof(ext2_dx_entry_t) > fs->block_size) {
+            goto done;
+        }
+
+        // Last entry whose hash is not above the name's
+        uint32_t low = 1, high = count;
+        while (low < high) {
+            uint32_t middle = (low + high) / 2;
+            if (entries[middle].hash > hash) high = middle;
+            else low = middle + 1;
+        }
+        chosen = low - 1;
+        if (level == levels) break;
+
+        // Interior nodes start with an empty entry spanning the block
+        if (!read_directory_block(fs, directory, entries[chosen].block & 0x0FFFFFFF, node)) {
+            goto done;
+        }
+        entries_offset = 8;
+    }
+
+    // Names sharing a hash may spill into following leaves, whose entries set the low bit
+    for (;;) {
+        if (!read_directory_block(fs, directory, entries[chosen].block & 0x0FFFFFFF, leaf)) {
+            goto done;
+        }
+        *found = search_block(fs, leaf, name, length);
+        if (*found != 0) break;
+        chosen++;
+        if (chosen >= count || (entries[chosen].hash & 1) == 0
+            || (entries[chosen].hash & ~1u) != hash) {
+            break;
+        }
+    }
+    success = true;
+
+done:
+    free(node);
+    free(leaf);
+    return success;
+}
+
+static uint32_t search_block(ext2_t *fs, uint8_t *buffer, char_t *name, size_t length) {
+    uint32_t position = 0;
+    while (position + sizeof(ext2_dir_entry_t) <= fs->block_size) {
+        ext2_dir_entry_t *entry = (ext2_dir_entry_t *) (buffer + position);
+        if (entry->record_length < sizeof(ext2_dir_entry_t)
+            || position + entry->record_length > fs->block_size) {
+            break;
+        }
+        if (entry->inode != 0 && entry->name_length == length
+            && sizeof(ext2_dir_entry_t) + length <= entry->record_length
+            && memcmp(entry->name, name, length) == 0) {
+            return entry->inode;
+        }
+        position += entry->record_length;
+    }
+    return 0;
+}
+
+static uint32_t directory_hash(ext2_t *fs, uint8_t version, char_t *name, size_t length) {
+    uint32_t buffer[4] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476 };
+    if (fs->hash_seed[0] | fs->hash_seed[1] | fs->hash_seed[2] | fs->hash_seed[3]) {
+        memcpy(buffer, fs->hash_seed, sizeof(buffer));
+    }
+
+    bool is_signed = version < EXT2_HASH_UNSIGNED;
+    uint32_t input[8];
+    uint32_t hash = 0;
+    switch (version % EXT2_HASH_UNSIGNED) {
+        case EXT2_HASH_LEGACY: {
+            uint32_t hash0 = 0x12A3FE2D, hash1 = 0x37ABE8F9;
+            for (size_t i = 0; i < length; i++) {
+                int32_t c = is_signed ? (int8_t) name[i] : (uint8_t) name[i];
+                uint32_t value = hash1 + (hash0 ^ (uint32_t) (c * 7152373));
+                if (value & 0x80000000) value -= 0x7FFFFFFF;
+                hash1 = hash0;
+                hash0 = value;
+            }
+            hash = hash0 << 1;
+            break;
+        }
+        case EXT2_HASH_HALF_MD4:
+            for (size_t done = 0; done < length; done += 32) {
+                pack_name(name + done, length - done, input, 8, is_signed);
+                half_md4_transform(buffer, input);
+            }
+            hash = buffer[1];
+            break;
+        case EXT2_HASH_TEA:
+            for (size_t done = 0; done < length; done += 16) {
+                pack_name(name + done, length - done, input, 4, is_signed);
+                tea_transform(buffer, input);
+            }
+            hash = buffer[0];
+            break;
+    }
+
+    hash &= ~1u;
+    if (hash == 0x7FFFFFFFu << 1) hash = 0x7FFFFFFEu << 1; // Reserved for end of directory
+    return hash;
+}
+
+static void tea_transform(uint32_t buffer[4], uint32_t *input) {
+    uint32_t sum = 0;
+    uint32_t b0 = buffer[0], b1 = buffer[1];
+    for (uint32_t i = 0; i < 16; i++) {
+        sum += 0x9E3779B9;
+        b0 += ((b1 << 4) + input[0]) ^ (b1 + sum) ^ ((b1 >> 5) + input[1]);
+        b1 += ((b0 << 4) + input[2]) ^ (b0 + sum) ^ ((b0 >> 5) + input[3]);
+    }
+    buffer[0] += b0;
+    buffer[1] += b1;
+}
+
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) \
+    (a += f(b, c, d) + (x), a = (a << (s)) | (a >> (32 - (s))))
+
+static void half_md4_transform(uint32_t buffer[4], uint32_t *input) {
+    const uint32_t k2 = 013240474631, k3 = 015666365641;
+    uint32_t a = buffer[0], b = buffer[1], c = buffer[2], d = buffer[3];
+
+    MD4_ROUND(MD4_F, a, b, c, d, input[0], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, input[1], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, input[2], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, input[3], 19);
+    MD4_ROUND(MD4_F, a, b, c, d, input[4], 3);
+    MD4_ROUND(MD4_F, d, a, b, c, input[5], 7);
+    MD4_ROUND(MD4_F, c, d, a, b, input[6], 11);
+    MD4_ROUND(MD4_F, b, c, d, a, input[7], 19);
+
+    MD4_ROUND(MD4_G, a, b, c, d, input[1] + k2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, input[3] + k2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, input[5] + k2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, input[7] + k2, 13);
+    MD4_ROUND(MD4_G, a, b, c, d, input[0] + k2, 3);
+    MD4_ROUND(MD4_G, d, a, b, c, input[2] + k2, 5);
+    MD4_ROUND(MD4_G, c, d, a, b, input[4] + k2, 9);
+    MD4_ROUND(MD4_G, b, c, d, a, input[6] + k2, 13);
+
+    MD4_ROUND(MD4_H, a, b, c, d, input[3] + k3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, input[7] + k3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, input[2] + k3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, input[6] + k3, 15);
+    MD4_ROUND(MD4_H, a, b, c, d, input[1] + k3, 3);
+    MD4_ROUND(MD4_H, d, a, b, c, input[5] + k3, 9);
+    MD4_ROUND(MD4_H, c, d, a, b, input[0] + k3, 11);
+    MD4_ROUND(MD4_H, b, c, d, a, input[4] + k3, 15);
+
+    buffer[0] += a;
+    buffer[1] += b;
+    buffer[2] += c;
+    buffer[3] += d;
+}
+
+static void pack_name(char_t *name, size_t length, uint32_t *words, uint32_t count,
+    bool is_signed) {
+    uint32_t pad = (uint32_t) length | (uint32_t) length << 8;
+    pad |= pad << 16;
+    uint32_t value = pad;
+    if (length > count * 4) length = count * 4;
+
+    uint32_t filled = 0;
+    for (size_t i = 0; i < length; i++) {
+        int32_t c = is_signed ? (int8_t) name[i] : (uint8_t) name[i];
+        value = (uint32_t) c + (value << 8);
+        if (i % 4 == 3) {
+            words[filled++] = value;
+            value = pad;
+        }
+    }
+    if (filled < count) words[filled++] = value;
+    while (filled < count) words[filled++] = pad;
+}
+
+static bool wait_for_reads(blk_device_t *device, ext2_read_state_t *state, uint32_t in_flight) {
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_TIMEOUT_MS * 1000000);
+    bool timed_out = false;
+    while (EXT2_READ_DEPTH - state->idle_count > in_flight) {
+        blk_poll(device);
+        if (timer_ticks() <= deadline) continue;
+        if (timed_out) {
+            handle_error("Device kept ext2 reads after being aborted\n");
+            return false;
+        }
+
+        // The caller frees the state and scratch buffer after a failure, so every read has to
+        // come back first. Reads still queued are cancelled, the driver is aborted to fail the rest
+        handle_error("ext2 read timed out\n");
+        timed_out = true;
+        in_flight = 0;
+        for (uint32_t i = 0; i < EXT2_READ_DEPTH; i++) {
+            blk_cancel(device, &state->requests[i]);
+        }
+        if (state->idle_count < EXT2_READ_DEPTH) blk_abort(device);
+        deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_ABORT_TIMEOUT_MS * 1000000);
+    }
+    return !timed_out;
+}
+
+static void read_complete(io_request_t *request) {
+    ext2_read_state_t *state = request->context;
+    if (!request->success) state->failed = true;
+    state->idle[state->idle_count++] = request;
+}
+
+static void free_inodes(ext2_t *fs) {
+    if (fs->inodes == NULL) return;
+    for (uint32_t i = 0; i <= fs->inode_mask; i++) {
+        ext2_node_t *node = fs->inodes[i];
+        while (node != NULL) {
+            ext2_node_t *next = node->hash_next;
+            free(node->extents);
+            free(node);
+            node = next;
+        }
+        fs->inodes[i] = NULL;
+    }
+    fs->inode_count = 0;
+}
@@ -0,0 +1,262 @@
+#ifndef _EXT2_H_
+#define _EXT2_H_
+
+#define EXT2_MAGIC 0xEF53
+#define EXT2_SUPERBLOCK_OFFSET 1024
+#define EXT2_ROOT_INODE 2
+#define EXT2_NAME_LENGTH 256
+#define EXT2_READ_DEPTH 8               // Requests ext2_read keeps in flight
+
+#define EXT2_MODE_TYPE 0xF000
+#define EXT2_MODE_DIRECTORY 0x4000
+#define EXT2_MODE_FILE 0x8000
+
+#define EXT2_INODE_INDEX 0x1000         // Directory is hashed
+#define EXT2_INODE_EXTENTS 0x80000      // Blocks are mapped by an extent tree
+#define EXT2_INODE_INLINE_DATA 0x10000000
+#define EXT2_INODE_ENCRYPTED 0x800
+#define EXT2_INODE_CASEFOLD 0x40000000
+
+#define EXT2_INCOMPAT_FILETYPE 0x2
+#define EXT2_INCOMPAT_RECOVER 0x4
+#define EXT2_INCOMPAT_META_BG 0x10
+#define EXT2_INCOMPAT_EXTENTS 0x40
+#define EXT2_INCOMPAT_64BIT 0x80
+#define EXT2_INCOMPAT_MMP 0x100
+#define EXT2_INCOMPAT_FLEX_BG 0x200
+#define EXT2_INCOMPAT_EA_INODE 0x400
+#define EXT2_INCOMPAT_CSUM_SEED 0x2000
+#define EXT2_INCOMPAT_LARGEDIR 0x4000
+#define EXT2_INCOMPAT_INLINE_DATA 0x8000
+#define EXT2_INCOMPAT_ENCRYPT 0x10000
+#define EXT2_INCOMPAT_CASEFOLD 0x20000
+#define EXT2_INCOMPAT_SUPPORTED (EXT2_INCOMPAT_FILETYPE | EXT2_INCOMPAT_RECOVER \
+    | EXT2_INCOMPAT_EXTENTS | EXT2_INCOMPAT_64BIT | EXT2_INCOMPAT_MMP | EXT2_INCOMPAT_FLEX_BG \
+    | EXT2_INCOMPAT_EA_INODE | EXT2_INCOMPAT_CSUM_SEED | EXT2_INCOMPAT_LARGEDIR \
+    | EXT2_INCOMPAT_INLINE_DATA | EXT2_INCOMPAT_ENCRYPT | EXT2_INCOMPAT_CASEFOLD)
+
+#define EXT4_EXTENT_MAGIC 0xF30A
+#define EXT4_EXTENT_MAX_DEPTH 5
+#define EXT4_EXTENT_UNWRITTEN 32768     // Lengths above this are unwritten extents
+
+#define EXT2_HASH_LEGACY 0
+#define EXT2_HASH_HALF_MD4 1
+#define EXT2_HASH_TEA 2
+#define EXT2_HASH_UNSIGNED 3            // Added to the above when the superblock says so
+#define EXT2_DX_MAX_LEVELS 3
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+#include "bcache.h"
+
+/**
+ * @brief A run of consecutive blocks in a file
+ */
+typedef struct ext2_extent {
+    uint32_t file_block;        // Position of the run in the file, in blocks
+    uint32_t length;            // Blocks in the run
+    uint64_t block;             // First block of the run on disk
+    bool unwritten;             // Allocated but reads as zeros
+} ext2_extent_t;
+
+/**
+ * @brief An inode, kept in the inode cache once it has been read
+ */
+typedef struct ext2_node {
+    uint32_t number;
+    struct ext2_node *hash_next;
+    uint16_t mode;
+    uint32_t flags;
+    uint64_t size;
+    uint32_t block[15];
+    /**
+     * @brief Block map as extents sorted by file block, built the first time the node is read.
+     * Holes are the gaps between them
+     */
+    ext2_extent_t *extents;
+    uint32_t extent_count;
+    uint32_t extent_capacity;
+    bool mapped;
+} ext2_node_t;
+
+typedef struct ext2 {
+    blk_device_t *device;
+    /**
+     * @brief Holds metadata blocks: inode tables, extent tree nodes and directories. File data is
+     * read straight into the caller's buffer
+     */
+    bcache_t *cache;
+    uint32_t block_size;
+    uint64_t block_count;
+    uint32_t inodes_per_group;
+    uint32_t inode_size;
+    uint32_t group_count;
+    uint32_t incompat;
+    uint32_t hash_seed[4];
+    bool hash_unsigned;         // Directory hashes treat name bytes as unsigned
+    /**
+     * @brief Inode table block of each group, from the group descriptors
+     */
+    uint64_t *inode_tables;
+    /**
+     * @brief Hash table of every inode read, keyed by number
+     */
+    ext2_node_t **inodes;
+    uint32_t inode_mask;
+    uint32_t inode_count;
+} ext2_t;
+
+/**
+ * @brief Requests of one ext2_read call
+ */
+typedef struct ext2_read_state {
+    io_request_t requests[EXT2_READ_DEPTH];
+    io_segment_t segments[EXT2_READ_DEPTH][3];
+    io_request_t *idle[EXT2_READ_DEPTH];
+    uint32_t idle_count;
+    bool failed;
+} ext2_read_state_t;
+
+/**
+ * @brief Returns true if the device holds an ext2/3/4 superblock
+ */
+bool ext2_probe(blk_device_t *device);
+
+/**
+ * @brief Reads the superblock and group descriptors of an ext2/3/4 volume, read-only
+ * 
+ * @param fs Output for the mounted volume
+ */
+bool ext2_mount(blk_device_t *device, ext2_t **fs);
+
+/**
+ * @brief Frees the volume, its cache and every cached inode
+ */
+void ext2_unmount(ext2_t *fs);
+
+/**
+ * @brief Finds a file or directory by path, with '/' separators and case sensitive names. Hashed
+ * directories are searched through their index, others by scanning every block
+ * 
+ * @return The node, or NULL if the path does not exist
+ */
+ext2_node_t *ext2_open(ext2_t *fs, char_t *path);
+
+/**
+ * @brief Reads from a file. Each extent becomes requests of up to max_transfer sectors straight
+ * into buffer, with up to EXT2_READ_DEPTH in flight. A partial sector at either end of the range
+ * is added as a scatter-gather segment of the same request when the device takes them, so buffer
+ * should be 4 byte aligned, device reachable memory (see dma_alloc). Ranges whose whole sectors
+ * would land at an unaligned address are read through the block cache instead
+ * 
+ * @param bytes_read Output for the bytes read, fewer than length at the end of the file
+ */
+bool ext2_read(ext2_t *fs, ext2_node_t *file, uint64_t offset, uint64_t length, void *buffer,
+    uint64_t *bytes_read);
+
+/**
+ * @brief Prints the entries of a directory
+ */
+bool ext2_print_directory(ext2_t *fs, ext2_node_t *directory);
+
+/**
+ * @brief Returns the cached inode, reading it from its group's inode table on a miss
+ */
+static ext2_node_t *get_inode(ext2_t *fs, uint32_t number);
+
+/**
+ * @brief Builds the extent list of a node from its extent tree or indirect blocks
+ */
+static bool map_blocks(ext2_t *fs, ext2_node_t *node);
+
+/**
+ * @brief Adds the leaves of an extent tree node, descending through index nodes
+ */
+static bool map_extent_node(ext2_t *fs, ext2_node_t *node, uint8_t *data, uint32_t size,
+    uint32_t depth);
+
+/**
+ * @brief Adds the blocks an indirect block points to, level 0 being a block of data blocks
+ */
+static bool map_indirect(ext2_t *fs, ext2_node_t *node, uint32_t block, uint32_t level,
+    uint32_t *file_block);
+
+/**
+ * @brief Appends a run to the extent list, merging it with the last one when both are contiguous
+ */
+static bool add_extent(ext2_node_t *node, uint32_t file_block, uint64_t block, uint32_t length,
+    bool unwritten);
+
+/**
+ * @brief Returns the disk block holding a block of a file, 0 for a hole
+ */
+static uint64_t file_block_address(ext2_node_t *node, uint32_t file_block);
+
+/**
+ * @brief Reads one block of a directory through the cache
+ */
+static bool read_directory_block(ext2_t *fs, ext2_node_t *directory, uint32_t file_block,
+    uint8_t *buffer);
+
+/**
+ * @brief Looks a name up in one directory, through its hash index if it has one
+ * 
+ * @return The inode number, or 0 if there is no such entry
+ */
+static uint32_t find_entry(ext2_t *fs, ext2_node_t *directory, char_t *name, size_t length);
+
+/**
+ * @brief Walks the hash index of a directory to the leaf block that would hold the name, then
+ * searches it and any following leaves continuing the same hash
+ * 
+ * @param found Output for the inode number, 0 if there is no such entry
+ * @return False if the index could not be used, in which case the caller scans the directory
+ */
+static bool find_entry_hashed(ext2_t *fs, ext2_node_t *directory, char_t *name, size_t length,
+    uint32_t *found);
+
+/**
+ * @brief Searches one directory block for a name
+ */
+static uint32_t search_block(ext2_t *fs, uint8_t *buffer, char_t *name, size_t length);
+
+/**
+ * @brief Computes the directory hash of a name as the kernel does, with the low bit cleared
+ */
+static uint32_t directory_hash(ext2_t *fs, uint8_t version, char_t *name, size_t length);
+
+/**
+ * @brief One round of TEA over four words of the name
+ */
+static void tea_transform(uint32_t buffer[4], uint32_t *input);
+
+/**
+ * @brief The three round MD4 variant over eight words of the name
+ */
+static void half_md4_transform(uint32_t buffer[4], uint32_t *input);
+
+/**
+ * @brief Packs up to words * 4 bytes of a name into words padded with its length
+ */
+static void pack_name(char_t *name, size_t length, uint32_t *words, uint32_t count,
+    bool is_signed);
+
+/**
+ * @brief Polls the device until at most in_flight of the read's requests are outstanding. On a
+ * timeout it waits for all of them, so none is left in flight when it returns false
+ */
+static bool wait_for_reads(blk_device_t *device, ext2_read_state_t *state, uint32_t in_flight);
+
+/**
+ * @brief Completion callback of ext2_read requests, returning them to the idle list
+ */
+static void read_complete(io_request_t *request);
+
+/**
+ * @brief Frees every cached inode
+ */
+static void free_inodes(ext2_t *fs);
+
+#endif
@@ -0,0 +1,443 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "blk.h"
+#include "bcache.h"
+#include "fat32.h"
+
+bool fat32_mount(blk_device_t *device, fat32_t **fs) {
+    fat32_t *new_fs = malloc(sizeof(fat32_t));
+    if (new_fs == NULL) {
+        handle_error("Could not allocate FAT32 volume\n");
+        return false;
+    }
+    memset(new_fs, 0, sizeof(fat32_t));
+    new_fs->device = device;
+    new_fs->cache = bcache_create(device, 0, 0);
+    if (new_fs->cache == NULL) {
+        free(new_fs);
+        return false;
+    }
+
+    uint8_t sector[512];
+    fat32_boot_sector_t *boot = (fat32_boot_sector_t *) sector;
+    if (!bcache_read(new_fs->cache, 0, sizeof(sector), sector)) {
+        fat32_unmount(new_fs);
+        handle_error("Could not read FAT32 boot sector\n");
+        return false;
+    }
+
+    uint8_t spc = boot->sectors_per_cluster;
+    if (*(uint16_t *) &sector[510] != 0xAA55 || boot->bytes_per_sector != device->sector_size
+        || spc == 0 || (spc & (spc - 1)) != 0 || boot->reserved_sectors == 0
+        || boot->fat_count == 0 || boot->fat_size_16 != 0 || boot->fat_size_32 == 0
+        || boot->root_entry_count != 0) {
+        fat32_unmount(new_fs);
+        handle_error("Not a FAT32 volume\n");
+        return false;
+    }
+
+    new_fs->sector_size = boot->bytes_per_sector;
+    new_fs->sectors_per_cluster = spc;
+    new_fs->cluster_size = spc * boot->bytes_per_sector;
+    new_fs->fat_start = boot->reserved_sectors;
+    new_fs->data_start = boot->reserved_sectors + (uint64_t) boot->fat_count * boot->fat_size_32;
+
+    uint64_t total_sectors = boot->total_sectors_32;
+    if (total_sectors > device->sector_count) total_sectors = device->sector_count;
+    if (total_sectors <= new_fs->data_start) {
+        fat32_unmount(new_fs);
+        handle_error("FAT32 volume has no data area\n");
+        return false;
+    }
+    new_fs->cluster_count = (total_sectors - new_fs->data_start) / spc;
+
+    new_fs->root.name = "";
+    new_fs->root.first_cluster = boot->root_cluster;
+    new_fs->root.attributes = FAT_ATTR_DIRECTORY;
+
+    new_fs->index_mask = 63;
+    new_fs->index = malloc((new_fs->index_mask + 1) * sizeof(fat32_node_t *));
+    if (new_fs->index == NULL) {
+        fat32_unmount(new_fs);
+        handle_error("Could not allocate FAT32 directory index\n");
+        return false;
+    }
+    memset(new_fs->index, 0, (new_fs->index_mask + 1) * sizeof(fat32_node_t *));
+
+    if (BOOT_VERBOSE) {
+        printf("FAT32 on %s: %d clusters of %d bytes\n", device->name,
+            (uint64_t) new_fs->cluster_count, (uint64_t) new_fs->cluster_size);
+    }
+    *fs = new_fs;
+    return true;
+}
+
+void fat32_unmount(fat32_t *fs) {
+    if (fs == NULL) return;
+    free_nodes(fs);
+    free(fs->index);
+    free(fs->root.extents);
+    bcache_destroy(fs->cache);
+    free(fs);
+}
+
+fat32_node_t *fat32_open(fat32_t *fs, char_t *path) {
+    fat32_node_t *node = &fs->root;
+
+    while (*path != '\0') {
+        while (*path == '/' || *path == '\\') path++;
+        if (*path == '\0') break;
+
+        size_t length = 0;
+        while (path[length] != '\0' && path[length] != '/' && path[length] != '\\') length++;
+
+        if (!(node->attributes & FAT_ATTR_DIRECTORY)) return NULL;
+        if (!node->indexed && !index_directory(fs, node)) return NULL;
+        node = find_child(fs, node, path, length);
+        if (node == NULL) return NULL;
+        path += length;
+    }
+    return node;
+}
+
+bool fat32_read(fat32_t *fs, fat32_node_t *file, uint64_t offset, uint64_t length, void *buffer,
+    uint64_t *bytes_read) {
+    *bytes_read = 0;
+    if (file->attributes & FAT_ATTR_DIRECTORY) return false;
+    if (offset >= file->size) return true;
+    if (length > file->size - offset) length = file->size - offset;
+    if (!build_extents(fs, file)) return false;
+
+    uint8_t *output = buffer;
+    uint64_t position = offset;
+    uint64_t remaining = length;
+    uint32_t extent = 0;
+
+    while (remaining > 0) {
+        // Extents are sorted by file position, so a binary search finds the one holding position
+        uint32_t file_cluster = position / fs->cluster_size;
+        uint32_t low = extent, high = file->extent_count;
+        while (high - low > 1) {
+            uint32_t middle = (low + high) / 2;
+            if (file->extents[middle].file_cluster <= file_cluster) low = middle;
+            else high = middle;
+        }
+        extent = low;
+        if (extent >= file->extent_count) {
+            handle_error("FAT32 file is shorter than its size\n");
+            return false;
+        }
+        fat32_extent_t *run = &file->extents[extent];
+        if (file_cluster >= run->file_cluster + run->length) {
+            handle_error("FAT32 file is shorter than its size\n");
+            return false;
+        }
+
+        uint64_t run_offset = position - (uint64_t) run->file_cluster * fs->cluster_size;
+        uint64_t run_left = (uint64_t) run->length * fs->cluster_size - run_offset;
+        uint64_t chunk = remaining < run_left ? remaining : run_left;
+        uint64_t disk_offset = cluster_sector(fs, run->cluster) * fs->sector_size + run_offset;
+
+        // File data skips the cache, so a long read leaves the FAT and directories cached
+        if (!bcache_transfer(fs->cache, false, disk_offset, chunk, output, BCACHE_IO_DIRECT)) {
+            return false;
+        }
+
+        output += chunk;
+        position += chunk;
+        remaining -= chunk;
+        *bytes_read += chunk;
+    }
+    return true;
+}
+
+bool fat32_print_directory(fat32_t *fs, fat32_node_t *directory) {
+    if (!(directory->attributes & FAT_ATTR_DIRECTORY)) return false;
+    if (!directory->indexed && !index_directory(fs, directory)) return false;
+
+    for (uint32_t i = 0; i <= fs->index_mask; i++) {
+        for (fat32_node_t *node = fs->index[i]; node != NULL; node = node->hash_next) {
+            if (node->parent != directory) continue;
+            printf("%s%s %d\n", node->name,
+                (node->attributes & FAT_ATTR_DIRECTORY) ? "/" : "", (uint64_t) node->size);
+        }
+    }
+    return true;
+}
+
+static bool build_extents(fat32_t *fs, fat32_node_t *node) {
+    if (node->extents != NULL || node->first_cluster == 0) return true;
+
+    uint32_t capacity = 4;
+    fat32_extent_t *extents = malloc(capacity * sizeof(fat32_extent_t));
+    if (extents == NULL) {
+        handle_error("Could not allocate FAT32 extents\n");
+        return false;
+    }
+
+    uint32_t count = 0;
+    uint32_t cluster = node->first_cluster;
+    uint32_t file_cluster = 0;
+    bcache_block_t *fat_block = NULL;
+    uint32_t block_size = fs->cache->block_size;
+
+    // Consecutive entries share a cached FAT block, which stays referenced while the chain is in it
+    while (cluster >= 2 && cluster < FAT32_EOC) {
+        if (cluster > fs->cluster_count + 1 || file_cluster > fs->cluster_count) {
+            break;
+        }
+
+        if (count > 0 && extents[count - 1].cluster + extents[count - 1].length == cluster) {
+            extents[count - 1].length++;
+        } else {
+            if (count == capacity) {
+                capacity *= 2;
+                void *new_pointer = realloc(extents, capacity * sizeof(fat32_extent_t));
+                if (new_pointer == NULL) break;
+                extents = new_pointer;
+            }
+            extents[count].file_cluster = file_cluster;
+            extents[count].cluster = cluster;
+            extents[count].length = 1;
+            count++;
+        }
+
+        uint64_t entry = fs->fat_start * fs->sector_size + (uint64_t) cluster * 4;
+        uint64_t block_number = entry / block_size;
+        if (fat_block == NULL || fat_block->block != block_number) {
+            bcache_put(fs->cache, fat_block);
+            fat_block = bcache_get(fs->cache, block_number);
+            if (fat_block == NULL) break;
+        }
+        cluster = *(uint32_t *) (fat_block->data + entry % block_size) & FAT32_MASK;
+        file_cluster++;
+    }
+    bcache_put(fs->cache, fat_block);
+
+    if (cluster < FAT32_EOC) {
+        free(extents);
+        handle_error("FAT32 cluster chain is corrupt\n");
+        return false;
+    }
+    node->extents = extents;
+    node->extent_count = count;
+    return true;
+}
+
+static bool index_directory(fat32_t *fs, fat32_node_t *directory) {
+    if (!build_extents(fs, directory)) return false;
+
+    uint8_t *buffer = malloc(fs->cluster_size);
+    if (buffer == NULL) {
+        handle_error("Could not allocate FAT32 directory buffer\n");
+        return false;
+    }
+
+    char_t name[FAT32_NAME_LENGTH];
+    uint8_t lfn_next = 0;       // Sequence number expected from the next long name entry
+    uint8_t lfn_checksum_value = 0;
+    bool end = false;
+
+    for (uint32_t e = 0; e < directory->extent_count && !end; e++) {
+        fat32_extent_t *run = &directory->extents[e];
+        for (uint32_t c = 0; c < run->length && !end; c++) {
+            uint64_t offset = cluster_sector(fs, run->cluster + c) * fs->sector_size;
+            if (!bcache_read(fs->cache, offset, fs->cluster_size, buffer)) {
+                free(buffer);
+                return false;
+            }
+
+            fat_dir_entry_t *entries = (fat_dir_entry_t *) buffer;
+            for (uint32_t i = 0; i < fs->cluster_size / sizeof(fat_dir_entry_t); i++) {
+                fat_dir_entry_t *entry = &entries[i];
+                if (entry->name[0] == 0x00) {
+                    end = true;
+                    break;
+                }
+                if (entry->name[0] == 0xE5) {
+                    lfn_next = 0;
+                    continue;
+                }
+
+                if (entry->attributes == FAT_ATTR_LFN) {
+                    fat_lfn_entry_t *lfn = (fat_lfn_entry_t *) entry;
+                    uint8_t sequence = lfn->order & 0x1F;
+                    if (lfn->order & 0x40) {
+                        lfn_next = sequence;
+                        lfn_checksum_value = lfn->checksum;
+                        memset(name, 0, sizeof(name));
+                    }
+                    if (sequence == 0 || sequence != lfn_next || sequence > 20
+                        || lfn->checksum != lfn_checksum_value) {
+                        lfn_next = 0;
+                        continue;
+                    }
+
+                    // Thirteen UTF-16 characters per entry, kept as ASCII
+                    uint16_t characters[13];
+                    memcpy(characters, lfn->name1, sizeof(lfn->name1));
+                    memcpy(characters + 5, lfn->name2, sizeof(lfn->name2));
+                    memcpy(characters + 11, lfn->name3, sizeof(lfn->name3));
+                    for (uint8_t k = 0; k < 13; k++) {
+                        uint32_t position = (sequence - 1) * 13 + k;
+                        if (characters[k] == 0 || characters[k] == 0xFFFF) break;
+                        if (position < FAT32_NAME_LENGTH - 1) {
+                            name[position] = characters[k] < 0x80 ? characters[k] : '?';
+                        }
+                    }
+                    lfn_next--;
+                    if (lfn_next == 0) lfn_next = 0x80; // Complete, waiting for the 8.3 entry
+                    continue;
+                }
+
+                bool has_long_name = lfn_next == 0x80
+                    && lfn_checksum(entry->name) == lfn_checksum_value;
+                lfn_next = 0;
+                if (entry->attributes & FAT_ATTR_VOLUME_ID) continue;
+                if (entry->name[0] == '.') continue; // "." and ".."
+
+                if (!has_long_name) short_name(entry, name);
+
+                fat32_node_t *node = malloc(sizeof(fat32_node_t));
+                size_t length = strlen(name);
+                char_t *node_name = malloc(length + 1);
+                if (node == NULL || node_name == NULL) {
+                    free(node);
+                    free(node_name);
+                    free(buffer);
+                    handle_error("Could not allocate FAT32 node\n");
+                    return false;
+                }
+                memset(node, 0, sizeof(fat32_node_t));
+                memcpy(node_name, name, length + 1);
+                node->name = node_name;
+                node->parent = directory;
+                node->first_cluster = (uint32_t) entry->cluster_high << 16 | entry->cluster_low;
+                node->size = entry->size;
+                node->attributes = entry->attributes;
+                node->hash = hash_name(directory, name, length);
+                if (!insert_node(fs, node)) {
+                    free(node_name);
+                    free(node);
+                    free(buffer);
+                    return false;
+                }
+            }
+        }
+    }
+
+    free(buffer);
+    directory->indexed = true;
+    return true;
+}
+
+static bool insert_node(fat32_t *fs, fat32_node_t *node) {
+    if (fs->node_count > fs->index_mask) {
+        uint32_t new_mask = fs->index_mask * 2 + 1;
+        fat32_node_t **new_index = malloc((new_mask + 1) * sizeof(fat32_node_t *));
+        if (new_index == NULL) {
+            handle_error("Could not grow FAT32 directory index\n");
+            return false;
+        }
+        memset(new_index, 0, (new_mask + 1) * sizeof(fat32_node_t *));
+        for (uint32_t i = 0; i <= fs->index_mask; i++) {
+            fat32_node_t *entry = fs->index[i];
+            while (entry != NULL) {
+                fat32_node_t *next = entry->hash_next;
+                entry->hash_next = new_index[entry->hash & new_mask];
+                new_index[entry->hash & new_mask] = entry;
+                entry = next;
+            }
+        }
+        free(fs->index);
+        fs->index = new_index;
+        fs->index_mask = new_mask;
+    }
+
+    node->hash_next = fs->index[node->hash & fs->index_mask];
+    fs->index[node->hash & fs->index_mask] = node;
+    fs->node_count++;
+    return true;
+}
+
+static fat32_node_t *find_child(fat32_t *fs, fat32_node_t *directory, char_t *name,
+    size_t length) {
+    uint32_t hash = hash_name(directory, name, length);
+    for (fat32_node_t *node = fs->index[hash & fs->index_mask]; node != NULL;
+        node = node->hash_next) {
+        if (node->hash != hash || node->parent != directory) continue;
+
+        size_t i;
+        for (i = 0; i < length; i++) {
+            char_t a = node->name[i], b = name[i];
+            if (a >= 'A' && a <= 'Z') a += 'a' - 'A';
+            if (b >= 'A' && b <= 'Z') b += 'a' - 'A';
+            if (a != b) break;
+        }
+        if (i == length && node->name[length] == '\0') return node;
+    }
+    return NULL;
+}
+
+static uint32_t hash_name(fat32_node_t *parent, char_t *name, size_t length) {
+    // FNV-1a over the lower case name, mixed with the parent so equal names in different
+    // directories land apart
+    uint32_t hash = 2166136261u ^ (uint32_t) ((uint64_t) parent >> 4) * 0x9E3779B1u;
+    for (size_t i = 0; i < length; i++) {
+        char_t c = name[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        hash = (hash ^ (uint8_t) c) * 16777619u;
+    }
+    return hash;
+}
+
+static void short_name(fat_dir_entry_t *entry, char_t *name) {
+    size_t length = 0;
+    for (uint8_t i = 0; i < 8 && entry->name[i] != ' '; i++) {
+        char_t c = entry->name[i];
+        if (i == 0 && (uint8_t) c == 0x05) c = 0xE5; // Escaped first byte
+        if ((entry->case_flags & 0x08) && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        name[length++] = c;
+    }
+    if (entry->name[8] != ' ') {
+        name[length++] = '.';
+        for (uint8_t i = 8; i < 11 && entry->name[i] != ' '; i++) {
+            char_t c = entry->name[i];
+            if ((entry->case_flags & 0x10) && c >= 'A' && c <= 'Z') c += 'a' - 'A';
+            name[length++] = c;
+        }
+    }
+    name[length] = '\0';
+}
+
+static uint8_t lfn_checksum(uint8_t *short_name) {
+    uint8_t sum = 0;
+    for (uint8_t i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + short_name[i];
+    }
+    return sum;
+}
+
+static uint64_t cluster_sector(fat32_t *fs, uint32_t cluster) {
+    return fs->data_start + (uint64_t) (cluster - 2) * fs->sectors_per_cluster;
+}
+
+static void free_nodes(fat32_t *fs) {
+    if (fs->index == NULL) return;
+    for (uint32_t i = 0; i <= fs->index_mask; i++) {
+        fat32_node_t *node = fs->index[i];
+        while (node != NULL) {
+            fat32_node_t *next = node->hash_next;
+            free(node->name);
+            free(node->extents);
+            free(node);
+            node = next;
+        }
+        fs->index[i] = NULL;
+    }
+    fs->node_count = 0;
+}
@@ -0,0 +1,157 @@
+#ifndef _FAT32_H_
+#define _FAT32_H_
+
+#define FAT32_MASK 0x0FFFFFFF           // Top 4 bits of FAT entries are reserved
+#define FAT32_BAD 0x0FFFFFF7
+#define FAT32_EOC 0x0FFFFFF8            // This and above end a chain
+#define FAT32_NAME_LENGTH 256
+
+#define FAT_ATTR_READ_ONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_LFN 0x0F
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+#include "bcache.h"
+
+/**
+ * @brief A run of consecutive clusters in a file
+ */
+typedef struct fat32_extent {
+    uint32_t file_cluster;      // Position of the run in the file, in clusters
+    uint32_t cluster;           // First cluster of the run on disk
+    uint32_t length;            // Clusters in the run
+} fat32_extent_t;
+
+/**
+ * @brief A file or directory, kept in the directory index once its parent has been read
+ */
+typedef struct fat32_node {
+    char_t *name;
+    uint32_t hash;
+    struct fat32_node *parent;
+    struct fat32_node *hash_next;
+    uint32_t first_cluster;
+    uint32_t size;
+    uint8_t attributes;
+    /**
+     * @brief For directories, set once every entry has been added to the index
+     */
+    bool indexed;
+    /**
+     * @brief Cluster chain as extents, built the first time the node is read
+     */
+    fat32_extent_t *extents;
+    uint32_t extent_count;
+} fat32_node_t;
+
+typedef struct fat32 {
+    blk_device_t *device;
+    /**
+     * @brief Holds FAT sectors and directory clusters. File data is read straight into the
+     * caller's buffer where possible
+     */
+    bcache_t *cache;
+    uint32_t sector_size;
+    uint32_t sectors_per_cluster;
+    uint32_t cluster_size;
+    uint64_t fat_start;         // Sector of the first FAT
+    uint64_t data_start;        // Sector of cluster 2
+    uint32_t cluster_count;
+    fat32_node_t root;
+    /**
+     * @brief Hash table of every node found, keyed by parent and case folded name
+     */
+    fat32_node_t **index;
+    uint32_t index_mask;
+    uint32_t node_count;
+} fat32_t;
+
+/**
+ * @brief Reads the boot sector of a FAT32 volume and prepares it for lookups
+ * 
+ * @param fs Output for the mounted volume
+ */
+bool fat32_mount(blk_device_t *device, fat32_t **fs);
+
+/**
+ * @brief Frees the volume, its cache and every node
+ */
+void fat32_unmount(fat32_t *fs);
+
+/**
+ * @brief Finds a file or directory by path, with '/' or '\\' separators and case insensitive
+ * names. Each directory on the path is indexed the first time it is searched, after which lookups
+ * in it are a hash table probe
+ * 
+ * @return The node, or NULL if the path does not exist
+ */
+fat32_node_t *fat32_open(fat32_t *fs, char_t *path);
+
+/**
+ * @brief Reads from a file. Whole sectors are read straight into buffer, each run of consecutive
+ * clusters as one request, so buffer should be device reachable memory (see dma_alloc)
+ * 
+ * @param bytes_read Output for the bytes read, fewer than length at the end of the file
+ */
+bool fat32_read(fat32_t *fs, fat32_node_t *file, uint64_t offset, uint64_t length, void *buffer,
+    uint64_t *bytes_read);
+
+/**
+ * @brief Prints the entries of a directory
+ */
+bool fat32_print_directory(fat32_t *fs, fat32_node_t *directory);
+
+/**
+ * @brief Walks the cluster chain of a node through the cached FAT, merging consecutive clusters
+ * into extents
+ */
+static bool build_extents(fat32_t *fs, fat32_node_t *node);
+
+/**
+ * @brief Reads every entry of a directory into the index
+ */
+static bool index_directory(fat32_t *fs, fat32_node_t *directory);
+
+/**
+ * @brief Adds a node to the index, doubling the table when it becomes full
+ */
+static bool insert_node(fat32_t *fs, fat32_node_t *node);
+
+/**
+ * @brief Finds a direct child of a directory in the index
+ */
+static fat32_node_t *find_child(fat32_t *fs, fat32_node_t *directory, char_t *name,
+    size_t length);
+
+/**
+ * @brief Hashes a case folded name together with its parent
+ */
+static uint32_t hash_name(fat32_node_t *parent, char_t *name, size_t length);
+
+/**
+ * @brief Formats an 8.3 name as "name.ext", applying the lower case flags
+ */
+static void short_name(fat_dir_entry_t *entry, char_t *name);
+
+/**
+ * @brief Checksum of an 8.3 name, which its long name entries must carry
+ */
+static uint8_t lfn_checksum(uint8_t *short_name);
+
+/**
+ * @brief Returns the first sector of a cluster
+ */
+static uint64_t cluster_sector(fat32_t *fs, uint32_t cluster);
+
+/**
+ * @brief Frees every node in the index
+ */
+static void free_nodes(fat32_t *fs);
+
+#endif
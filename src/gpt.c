@@ -0,0 +1,292 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "crc.h"
+#include "timer.h"
+#include "blk.h"
+#include "gpt.h"
+
+static const blk_ops_t gpt_ops = {gpt_submit, gpt_poll, gpt_abort};
+
+// Partition map of every disk scanned, grown by doubling
+static gpt_partition_t **partitions = NULL;
+static uint32_t partition_count = 0;
+static uint32_t partition_capacity = 0;
+
+uint32_t gpt_scan(blk_device_t *disk) {
+    if (disk->sector_size < sizeof(gpt_header_t) || disk->sector_count < 3) return 0;
+
+    uint8_t *sector = dma_alloc(disk->sector_size);
+    if (sector == NULL) {
+        handle_error("Could not allocate GPT sector buffer\n");
+        return 0;
+    }
+
+    // A GPT disk carries a protective MBR so older tools see it as in use
+    mbr_t *mbr = (mbr_t *) sector;
+    bool protective = false;
+    if (blk_read(disk, 0, 1, sector) && mbr->signature == GPT_MBR_SIGNATURE) {
+        for (uint8_t i = 0; i < 4; i++) {
+            if (mbr->partitions[i].type == GPT_MBR_PROTECTIVE) protective = true;
+        }
+    }
+    if (!protective) {
+        dma_free(sector, disk->sector_size);
+        return 0;
+    }
+
+    uint8_t *entries;
+    size_t entries_size;
+    if (!read_gpt(disk, 1, sector, &entries, &entries_size)) {
+        if (BOOT_VERBOSE) {
+            printf("%s: primary GPT is invalid, trying the backup\n", disk->name);
+        }
+        if (!read_gpt(disk, disk->sector_count - 1, sector, &entries, &entries_size)) {
+            dma_free(sector, disk->sector_size);
+            handle_error("No valid GPT found\n");
+            return 0;
+        }
+    }
+
+    gpt_header_t *header = (gpt_header_t *) sector;
+    uint32_t added = 0;
+    for (uint32_t i = 0; i < header->entry_count; i++) {
+        gpt_entry_t *entry = (gpt_entry_t *) (entries + (size_t) i * header->entry_size);
+        efi_guid_t unused = {0};
+        if (memcmp(&entry->type_guid, &unused, sizeof(efi_guid_t)) == 0) continue;
+
+        if (entry->first_lba < header->first_usable_lba || entry->last_lba < entry->first_lba
+            || entry->last_lba > header->last_usable_lba) {
+            if (BOOT_VERBOSE) {
+                printf("%s: partition %d is outside the usable area\n", disk->name,
+                    (uint64_t) i + 1);
+            }
+            continue;
+        }
+        if (add_partition(disk, entry, i + 1)) added++;
+    }
+
+    dma_free(entries, entries_size);
+    dma_free(sector, disk->sector_size);
+    return added;
+}
+
+void gpt_scan_all() {
+    // Partitions are appended to the registry as they are found, so only scan what exists now
+    uint32_t count = blk_device_count();
+    for (uint32_t i = 0; i < count; i++) {
+        blk_device_t *device = blk_get(i);
+        if (device->ops == &gpt_ops) continue;
+        gpt_scan(device);
+    }
+}
+
+uint32_t gpt_partition_count() {
+    return partition_count;
+}
+
+gpt_partition_t *gpt_get_partition(uint32_t index) {
+    return index < partition_count ? partitions[index] : NULL;
+}
+
+blk_device_t *gpt_find_type(efi_guid_t type, uint32_t index) {
+    for (uint32_t i = 0; i < partition_count; i++) {
+        if (memcmp(&partitions[i]->type_guid, &type, sizeof(efi_guid_t)) != 0) continue;
+        if (index-- == 0) return &partitions[i]->device;
+    }
+    return NULL;
+}
+
+void gpt_print_partitions() {
+    for (uint32_t i = 0; i < partition_count; i++) {
+        gpt_partition_t *partition = partitions[i];
+        printf("%s: sectors %d-%d of %s, type %x, \"%s\"\n", partition->device.name,
+            partition->device.lba_offset,
+            partition->device.lba_offset + partition->device.sector_count - 1,
+            partition->disk->name, (uint64_t) partition->type_guid.Data1, partition->label);
+    }
+}
+
+static bool read_gpt(blk_device_t *disk, uint64_t lba, uint8_t *sector, uint8_t **entries,
+    size_t *entries_size) {
+    gpt_header_t *header = (gpt_header_t *) sector;
+    if (!blk_read(disk, lba, 1, sector)) return false;
+
+    if (header->signature != GPT_SIGNATURE || header->header_size < sizeof(gpt_header_t)
+        || header->header_size > disk->sector_size || header->current_lba != lba) {
+        return false;
+    }
+
+    uint32_t expected = header->header_crc32;
+    header->header_crc32 = 0;
+    uint32_t actual = crc32(0, header, header->header_size);
+    header->header_crc32 = expected;
+    if (actual != expected) return false;
+
+    if (header->entry_size < sizeof(gpt_entry_t) || header->entry_size % 8 != 0
+        || header->entry_count == 0 || header->entry_count > GPT_MAX_ENTRIES) {
+        return false;
+    }
+
+    // The whole entry array is read at once, rounded up to whole sectors
+    size_t bytes = (size_t) header->entry_count * header->entry_size;
+    uint32_t sectors = (bytes + disk->sector_size - 1) / disk->sector_size;
+    if (header->entries_lba + sectors > disk->sector_count) return false;
+
+    size_t size = (size_t) sectors * disk->sector_size;
+    uint8_t *buffer = dma_alloc(size);
+    if (buffer == NULL) {
+        handle_error("Could not allocate GPT entry buffer\n");
+        return false;
+    }
+    if (!blk_read(disk, header->entries_lba, sectors, buffer)
+        || crc32(0, buffer, bytes) != header->entries_crc32) {
+        dma_free(buffer, size);
+        return false;
+    }
+
+    *entries = buffer;
+    *entries_size = size;
+    return true;
+}
+
+static bool add_partition(blk_device_t *disk, gpt_entry_t *entry, uint32_t number) {
+    if (partition_count == partition_capacity) {
+        uint32_t new_capacity = partition_capacity == 0 ? 8 : partition_capacity * 2;
+        void *new_pointer = realloc(partitions, new_capacity * sizeof(gpt_partition_t *));
+        if (new_pointer == NULL) {
+            handle_error("Could not grow partition map\n");
+            return false;
+        }
+        partitions = new_pointer;
+        partition_capacity = new_capacity;
+    }
+
+    gpt_partition_t *partition = create_partition(disk, entry->first_lba,
+        entry->last_lba - entry->first_lba + 1);
+    if (partition == NULL) return false;
+    partition->number = number;
+    partition->type_guid = entry->type_guid;
+    partition->unique_guid = entry->unique_guid;
+    partition->attributes = entry->attributes;
+    for (uint8_t i = 0; i < GPT_LABEL_LENGTH - 1 && entry->name[i] != 0; i++) {
+        partition->label[i] = entry->name[i] < 0x80 ? entry->name[i] : '?';
+    }
+
+    snprintf(partition->device.name, BLK_NAME_LENGTH, "%sp%d", disk->name, (uint64_t) number);
+    if (!blk_register(&partition->device)) {
+        free(partition);
+        return false;
+    }
+
+    partitions[partition_count++] = partition;
+    return true;
+}
+
+blk_device_t *gpt_create_region(blk_device_t *disk, uint64_t first_lba, uint64_t sector_count) {
+    if (first_lba == 0 || sector_count == 0 || first_lba >= disk->sector_count
+        || sector_count > disk->sector_count - first_lba) {
+        handle_error("Region must lie inside the disk, past LBA 0\n");
+        return NULL;
+    }
+
+    gpt_partition_t *partition = create_partition(disk, first_lba, sector_count);
+    if (partition == NULL) return NULL;
+    snprintf(partition->device.name, BLK_NAME_LENGTH, "%s@%d", disk->name, first_lba);
+    if (!blk_register(&partition->device)) {
+        free(partition);
+        return NULL;
+    }
+    return &partition->device;
+}
+
+static gpt_partition_t *create_partition(blk_device_t *disk, uint64_t first_lba,
+    uint64_t sector_count) {
+    gpt_partition_t *partition = malloc(sizeof(gpt_partition_t));
+    if (partition == NULL) {
+        handle_error("Could not allocate partition\n");
+        return NULL;
+    }
+    memset(partition, 0, sizeof(gpt_partition_t));
+    partition->disk = disk;
+    for (uint32_t i = 0; i < GPT_QUEUE_DEPTH; i++) {
+        partition->requests[i].partition = partition;
+        partition->idle[i] = &partition->requests[i];
+    }
+    partition->idle_count = GPT_QUEUE_DEPTH;
+
+    // Geometry, limits and capabilities are all the disk's, only the LBA range differs
+    blk_device_t *device = &partition->device;
+    device->sector_size = disk->sector_size;
+    device->sector_count = sector_count;
+    device->max_transfer = disk->max_transfer;
+    device->max_segments = disk->max_segments;
+    device->queue_depth = disk->queue_depth < GPT_QUEUE_DEPTH ? disk->queue_depth
+        : GPT_QUEUE_DEPTH;
+    device->capabilities = disk->capabilities;
+    device->lba_offset = first_lba;
+    device->ops = &gpt_ops;
+    device->driver = partition;
+    return partition;
+}
+
+static void gpt_child_complete(io_request_t *child) {
+    gpt_request_t *gpt_request = child->context;
+    gpt_partition_t *partition = gpt_request->partition;
+    io_request_t *parent = gpt_request->parent;
+    gpt_request->parent = NULL;
+    partition->idle[partition->idle_count++] = gpt_request;
+    partition->completed++;
+
+    parent->success = child->success;
+    parent->complete_ticks = timer_ticks();
+    blk_complete(parent);
+}
+
+static bool gpt_submit(blk_device_t *device, io_request_t *request) {
+    gpt_partition_t *partition = device->driver;
+    if (partition->idle_count == 0) return false;
+
+    gpt_request_t *gpt_request = partition->idle[--partition->idle_count];
+    gpt_request->parent = request;
+
+    // The block layer has already added the partition start through lba_offset, so the child is
+    // in the disk's LBA space and gets the disk's own queueing, checks and stats
+    io_request_t *child = &gpt_request->request;
+    memset(child, 0, sizeof(io_request_t));
+    child->op = request->op;
+    child->flags = request->flags;
+    child->lba = request->lba;
+    child->count = request->count;
+    child->buffer = request->buffer;
+    child->segments = request->segments;
+    child->segment_count = request->segment_count;
+    child->callback = gpt_child_complete;
+    child->context = gpt_request;
+    child->device = partition->disk;
+
+    request->submit_ticks = timer_ticks();
+    blk_submit(partition->disk, child);
+    return true;
+}
+
+static uint32_t gpt_poll(blk_device_t *device) {
+    gpt_partition_t *partition = device->driver;
+    partition->completed = 0;
+    blk_poll(partition->disk);
+    return partition->completed;
+}
+
+static void gpt_abort(blk_device_t *device) {
+    gpt_partition_t *partition = device->driver;
+    // Cancelling a child completes its partition request, so only those the disk's driver holds
+    // are left for the disk to fail
+    for (uint32_t i = 0; i < GPT_QUEUE_DEPTH; i++) {
+        gpt_request_t *gpt_request = &partition->requests[i];
+        if (gpt_request->parent != NULL) blk_cancel(partition->disk, &gpt_request->request);
+    }
+    blk_abort(partition->disk);
+}
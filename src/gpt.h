@@ -0,0 +1,141 @@
+#ifndef _GPT_H_
+#define _GPT_H_
+
+#define GPT_SIGNATURE 0x5452415020494645ULL // "EFI PART"
+#define GPT_MBR_SIGNATURE 0xAA55
+#define GPT_MBR_PROTECTIVE 0xEE
+#define GPT_MAX_ENTRIES 1024
+#define GPT_LABEL_LENGTH 37
+#define GPT_QUEUE_DEPTH 32              // Partition requests in flight at once
+
+#define GPT_TYPE_ESP \
+    { 0xC12A7328, 0xF81F, 0x11D2, {0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B} }
+#define GPT_TYPE_LINUX_DATA \
+    { 0x0FC63DAF, 0x8483, 0x4772, {0x8E, 0x79, 0x3D, 0x69, 0xD8, 0x47, 0x7D, 0xE4} }
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief A partition request in flight and the request it became on the disk
+ */
+typedef struct gpt_request {
+    io_request_t request;
+    io_request_t *parent;
+    struct gpt_partition *partition;
+} gpt_request_t;
+
+/**
+ * @brief A GPT partition, registered as a block device named after its disk ("sata0p1"), or a
+ * region of a disk. Requests are resubmitted to the disk through the block layer with the
+ * partition start added to the LBA
+ */
+typedef struct gpt_partition {
+    blk_device_t device;
+    blk_device_t *disk;
+    gpt_request_t requests[GPT_QUEUE_DEPTH];
+    gpt_request_t *idle[GPT_QUEUE_DEPTH];
+    uint32_t idle_count;
+    /**
+     * @brief Partition requests completed during the current poll
+     */
+    uint32_t completed;
+    uint32_t number;            // 1 based position in the partition entry array, 0 for regions
+    efi_guid_t type_guid;
+    efi_guid_t unique_guid;
+    uint64_t attributes;
+    char_t label[GPT_LABEL_LENGTH];
+} gpt_partition_t;
+
+/**
+ * @brief Reads the protective MBR and GPT of a disk, falling back to the backup GPT if the primary
+ * fails its CRC checks, and registers every used entry as a partition
+ * 
+ * @return Number of partitions registered, 0 if the disk has no valid GPT
+ */
+uint32_t gpt_scan(blk_device_t *disk);
+
+/**
+ * @brief Scans every registered block device which is not itself a partition
+ */
+void gpt_scan_all();
+
+/**
+ * @brief Returns the number of partitions in the partition map
+ */
+uint32_t gpt_partition_count();
+
+/**
+ * @brief Returns a partition from the partition map, or NULL if index is out of range
+ */
+gpt_partition_t *gpt_get_partition(uint32_t index);
+
+/**
+ * @brief Finds the nth (from 0) partition of the given type across all scanned disks
+ * 
+ * @return The partition's block device, or NULL if there is none
+ */
+blk_device_t *gpt_find_type(efi_guid_t type, uint32_t index);
+
+/**
+ * @brief Prints the partition map
+ */
+void gpt_print_partitions();
+
+/**
+ * @brief Registers sector_count sectors of a disk from first_lba as a block device named
+ * "<disk>@<first_lba>", so a volume can be put on part of a disk without a partition for it. The
+ * region is not added to the partition map
+ * 
+ * @return The region's block device, or NULL if it does not lie inside the disk past LBA 0
+ */
+blk_device_t *gpt_create_region(blk_device_t *disk, uint64_t first_lba, uint64_t sector_count);
+
+/**
+ * @brief Reads and checks the GPT header at lba and its entry array
+ * 
+ * @param sector Buffer of one sector, which holds the header on success
+ * @param entries Output for the entry array, allocated with dma_alloc
+ * @param entries_size Output for the size passed to dma_alloc
+ */
+static bool read_gpt(blk_device_t *disk, uint64_t lba, uint8_t *sector, uint8_t **entries,
+    size_t *entries_size);
+
+/**
+ * @brief Adds a partition to the partition map and block device registry
+ */
+static bool add_partition(blk_device_t *disk, gpt_entry_t *entry, uint32_t number);
+
+/**
+ * @brief Allocates a partition covering part of the disk, with its block device filled in but not
+ * named or registered
+ */
+static gpt_partition_t *create_partition(blk_device_t *disk, uint64_t first_lba,
+    uint64_t sector_count);
+
+/**
+ * @brief Disk request callback, returning the partition request to the idle list and completing
+ * its parent
+ */
+static void gpt_child_complete(io_request_t *child);
+
+/**
+ * @brief Submits the request, already in the disk's LBA space, to the disk through the block layer
+ * 
+ * @return False if the partition is out of requests
+ */
+static bool gpt_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Polls the disk, which completes the partition's requests
+ */
+static uint32_t gpt_poll(blk_device_t *device);
+
+/**
+ * @brief Cancels the children still queued on the disk and aborts the disk, failing the rest
+ */
+static void gpt_abort(blk_device_t *device);
+
+#endif
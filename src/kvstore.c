@@ -0,0 +1,796 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "crc.h"
+#include "kvstore.h"
+
+bool kv_format(blk_device_t *device) {
+    uint32_t sector_size = device->sector_size;
+    uint64_t slot_sectors = device->sector_count / KV_CHECKPOINT_SLOT_DIVISOR;
+    if (slot_sectors > (1 << 30) / sector_size) slot_sectors = (1 << 30) / sector_size;
+    if (slot_sectors == 0 || sector_size < sizeof(kv_superblock_t) || sector_size % 8 != 0
+        || (device->sector_count - 1 - 2 * slot_sectors) * sector_size < 2 * KV_BATCH_BYTES) {
+        handle_error("Device is too small for a key-value store\n");
+        return false;
+    }
+
+    uint8_t *sector = dma_alloc(sector_size);
+    if (sector == NULL) {
+        handle_error("Could not allocate key-value superblock\n");
+        return false;
+    }
+
+    // Checkpoints and records of an older store carry a different id, so only sector 0 is written
+    kv_superblock_t *superblock = (kv_superblock_t *) sector;
+    uint64_t ticks = timer_ticks();
+    superblock->magic = KV_MAGIC;
+    superblock->version = KV_VERSION;
+    superblock->store_id = (uint32_t) (ticks ^ (ticks >> 32)) | 1;
+    superblock->sector_size = sector_size;
+    superblock->checkpoint_lba[0] = 1;
+    superblock->checkpoint_lba[1] = 1 + slot_sectors;
+    superblock->checkpoint_sectors = slot_sectors;
+    superblock->log_lba = 1 + 2 * slot_sectors;
+    superblock->log_sectors = device->sector_count - superblock->log_lba;
+    superblock->crc = crc32c(0, superblock, sizeof(kv_superblock_t));
+
+    bool success = blk_write(device, 0, 1, sector) && blk_flush(device);
+    dma_free(sector, sector_size);
+    if (!success) handle_error("Could not write key-value superblock\n");
+    return success;
+}
+
+bool kv_open(blk_device_t *device, kv_store_t **store) {
+    kv_store_t *new_store = malloc(sizeof(kv_store_t));
+    if (new_store == NULL) {
+        handle_error("Could not allocate key-value store\n");
+        return false;
+    }
+    memset(new_store, 0, sizeof(kv_store_t));
+    new_store->device = device;
+    new_store->sector_size = device->sector_size;
+    new_store->batch = dma_alloc(KV_BATCH_BYTES);
+    new_store->window = dma_alloc(KV_WINDOW_BYTES);
+    new_store->index_mask = 255;
+    new_store->index = malloc((new_store->index_mask + 1) * sizeof(kv_entry_t *));
+    if (new_store->batch == NULL || new_store->window == NULL || new_store->index == NULL) {
+        free_store(new_store);
+        handle_error("Could not allocate key-value store\n");
+        return false;
+    }
+    memset(new_store->index, 0, (new_store->index_mask + 1) * sizeof(kv_entry_t *));
+    // Nothing is batched yet, so every position is read from the device
+    new_store->batch_position = ~0ULL;
+
+    kv_superblock_t *superblock = (kv_superblock_t *) new_store->window;
+    if (!blk_read(device, 0, 1, new_store->window)) {
+        free_store(new_store);
+        handle_error("Could not read key-value superblock\n");
+        return false;
+    }
+    uint32_t crc = superblock->crc;
+    superblock->crc = 0;
+    if (superblock->magic != KV_MAGIC || superblock->version != KV_VERSION
+        || crc32c(0, superblock, sizeof(kv_superblock_t)) != crc
+        || superblock->sector_size != device->sector_size || superblock->log_sectors == 0
+        || superblock->log_lba + superblock->log_sectors > device->sector_count) {
+        free_store(new_store);
+        handle_error("Not a key-value store\n");
+        return false;
+    }
+    new_store->store_id = superblock->store_id;
+    new_store->checkpoint_lba[0] = superblock->checkpoint_lba[0];
+    new_store->checkpoint_lba[1] = superblock->checkpoint_lba[1];
+    new_store->checkpoint_sectors = superblock->checkpoint_sectors;
+    new_store->log_lba = superblock->log_lba;
+    new_store->log_bytes = superblock->log_sectors * device->sector_size;
+
+    // Try the newer checkpoint first, falling back to the other if it was torn
+    uint64_t sequences[2] = { 0, 0 };
+    for (uint32_t slot = 0; slot < 2; slot++) {
+        kv_checkpoint_header_t *header = (kv_checkpoint_header_t *) new_store->window;
+        if (blk_read(device, new_store->checkpoint_lba[slot], 1, new_store->window)
+            && header->magic == KV_CHECKPOINT_MAGIC && header->store_id == new_store->store_id) {
+            sequences[slot] = header->sequence;
+        }
+    }
+    uint32_t newest = sequences[1] > sequences[0] ? 1 : 0;
+    if (sequences[newest] != 0 && !load_checkpoint(new_store, newest)) {
+        free_index(new_store);
+        if (sequences[1 - newest] != 0 && !load_checkpoint(new_store, 1 - newest)) {
+            free_index(new_store);
+        }
+    }
+
+    uint64_t start = timer_ticks();
+    if (!replay_log(new_store)) {
+        free_store(new_store);
+        return false;
+    }
+
+    if (BOOT_VERBOSE) {
+        printf("Key-value store on %s: %d keys, checkpoint %d, replayed %d records in %d us\n",
+            device->name, (uint64_t) new_store->entry_count, new_store->checkpoint_sequence,
+            new_store->stats.replayed_records, ticks_to_ns(timer_ticks() - start) / 1000);
+    }
+    *store = new_store;
+    return true;
+}
+
+bool kv_close(kv_store_t *store) {
+    bool success = kv_checkpoint(store);
+    free_store(store);
+    return success;
+}
+
+void kv_discard(kv_store_t *store) {
+    free_store(store);
+}
+
+bool kv_put(kv_store_t *store, const void *key, uint8_t key_length, const void *value,
+    uint32_t value_length) {
+    if (key_length == 0 || value_length > KV_MAX_VALUE) {
+        handle_error("Key-value record is too large\n");
+        return false;
+    }
+
+    uint64_t position;
+    if (!append_record(store, KV_RECORD_PUT, key, key_length, value, value_length, &position)) {
+        return false;
+    }
+    if (!index_insert(store, key, key_length, position, value_length)) return false;
+    store->stats.puts++;
+    return true;
+}
+
+bool kv_delete(kv_store_t *store, const void *key, uint8_t key_length) {
+    if (index_find(store, key, key_length, NULL) == NULL) return false;
+
+    uint64_t position;
+    if (!append_record(store, KV_RECORD_DELETE, key, key_length, NULL, 0, &position)) {
+        return false;
+    }
+    index_remove(store, key, key_length);
+    store->stats.deletes++;
+    return true;
+}
+
+bool kv_get(kv_store_t *store, const void *key, uint8_t key_length, void *value,
+    uint32_t capacity, uint32_t *value_length) {
+    kv_entry_t *entry = index_find(store, key, key_length, NULL);
+    if (entry == NULL) return false;
+
+    kv_record_header_t *header = read_record(store, entry->position);
+    if (header == NULL || header->type != KV_RECORD_PUT || header->key_length != key_length
+        || memcmp(header + 1, key, key_length) != 0) {
+        handle_error("Key-value record is corrupt\n");
+        return false;
+    }
+
+    *value_length = header->value_length;
+    memcpy(value, (uint8_t *) (header + 1) + key_length,
+        header->value_length < capacity ? header->value_length : capacity);
+    store->stats.gets++;
+    return true;
+}
+
+bool kv_commit(kv_store_t *store) {
+    if (store->batch_length == 0 && store->tail == store->batch_position) return true;
+    if (store->tail % store->sector_size != 0 && !append_padding(store, false)) return false;
+
+    uint64_t sectors = (store->batch_length + store->sector_size - 1) / store->sector_size;
+    uint64_t lba = store->log_lba + store->batch_position % store->log_bytes / store->sector_size;
+    if (sectors > 0 && !write_durable(store, lba, store->batch, sectors)) {
+        handle_error("Could not commit key-value records\n");
+        return false;
+    }
+
+    // The window may hold what was on the device before this commit
+    if (store->window_position + store->window_length > store->batch_position) {
+        store->window_length = 0;
+    }
+    store->stats.commits++;
+    store->stats.committed_bytes += store->batch_length;
+    store->batch_position = store->tail;
+    store->batch_length = 0;
+    store->batch_records = 0;
+    return true;
+}
+
+bool kv_checkpoint(kv_store_t *store) {
+    if (!kv_commit(store)) return false;
+
+    uint64_t bytes = sizeof(kv_checkpoint_header_t);
+    for (uint32_t i = 0; i <= store->index_mask; i++) {
+        for (kv_entry_t *entry = store->index[i]; entry != NULL; entry = entry->next) {
+            bytes += sizeof(kv_checkpoint_entry_t) + entry->key_length;
+        }
+    }
+    uint64_t sectors = (bytes + store->sector_size - 1) / store->sector_size;
+    if (sectors > store->checkpoint_sectors) {
+        handle_error("Key-value index is too large for a checkpoint\n");
+        return false;
+    }
+    uint8_t *buffer = dma_alloc(sectors * store->sector_size);
+    if (buffer == NULL) {
+        handle_error("Could not allocate key-value checkpoint\n");
+        return false;
+    }
+
+    kv_checkpoint_header_t *header = (kv_checkpoint_header_t *) buffer;
+    header->magic = KV_CHECKPOINT_MAGIC;
+    header->store_id = store->store_id;
+    header->sequence = store->checkpoint_sequence + 1;
+    header->head = store->compacted > store->head ? store->compacted : store->head;
+    header->position = store->tail;
+    header->bytes = bytes;
+    uint8_t *output = (uint8_t *) (header + 1);
+    for (uint32_t i = 0; i <= store->index_mask; i++) {
+        for (kv_entry_t *entry = store->index[i]; entry != NULL; entry = entry->next) {
+            kv_checkpoint_entry_t *saved = (kv_checkpoint_entry_t *) output;
+            saved->position = entry->position;
+            saved->value_length = entry->value_length;
+            saved->key_length = entry->key_length;
+            memcpy(saved->key, entry->key, entry->key_length);
+            output += sizeof(kv_checkpoint_entry_t) + entry->key_length;
+            header->entry_count++;
+        }
+    }
+    header->crc = crc32c(0, &header->store_id, bytes - 12);
+
+    // Alternate slots, so a torn checkpoint leaves the previous one intact
+    uint32_t slot = header->sequence % 2;
+    bool success = write_durable(store, store->checkpoint_lba[slot], buffer, sectors);
+    if (success) {
+        store->checkpoint_sequence = header->sequence;
+        store->checkpoint_position = header->position;
+        store->head = header->head;
+        store->stats.checkpoints++;
+    } else {
+        handle_error("Could not write key-value checkpoint\n");
+    }
+    dma_free(buffer, sectors * store->sector_size);
+    return success;
+}
+
+bool kv_poll(kv_store_t *store) {
+    bool success = true;
+    if (store->batch_records > 0 && ticks_to_ns(timer_ticks() - store->batch_ticks)
+        >= (uint64_t) KV_COMMIT_INTERVAL_US * 1000) {
+        success = kv_commit(store);
+    }
+
+    uint64_t used = store->tail - store->head;
+    uint64_t garbage = used > store->live_bytes ? used - store->live_bytes : 0;
+    if (success && used * 100 >= store->log_bytes * KV_COMPACT_MIN_USED
+        && garbage * 100 >= used * KV_COMPACT_GARBAGE) {
+        success = compact_step(store, KV_COMPACT_STEP);
+    }
+
+    // Compacted space only becomes free once a checkpoint no longer needs it
+    if (success && (store->tail - store->checkpoint_position >= KV_CHECKPOINT_INTERVAL
+        || store->compacted - store->head >= store->log_bytes / 8)) {
+        success = kv_checkpoint(store);
+    }
+    return success;
+}
+
+void kv_print_stats(kv_store_t *store) {
+    kv_stats_t *stats = &store->stats;
+    printf("kvstat,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
+        store->device->name,
+        stats->puts,
+        stats->deletes,
+        stats->gets,
+        stats->commits,
+        stats->committed_bytes,
+        stats->checkpoints,
+        stats->compacted_records,
+        stats->compacted_bytes,
+        stats->replayed_records,
+        (uint64_t) store->entry_count,
+        store->live_bytes,
+        store->tail - store->head);
+}
+
+static bool append_record(kv_store_t *store, uint8_t type, const void *key, uint8_t key_length,
+    const void *value, uint32_t value_length, uint64_t *position) {
+    uint64_t size = record_size(key_length, value_length);
+    uint32_t header_size = sizeof(kv_record_header_t);
+
+    for (;;) {
+        // Padding needed first: the rest of a sector too small for the header, or the rest of
+        // the log if the record would cross its end
+        uint64_t offset = store->tail % store->log_bytes;
+        uint32_t room = store->sector_size - offset % store->sector_size;
+        uint64_t skip = 0;
+        bool wrap = false;
+        if (room < header_size) {
+            skip = room;
+        } else if (offset + size > store->log_bytes) {
+            skip = store->log_bytes - offset;
+            wrap = true;
+        }
+
+        if (store->tail + skip + size - store->head > store->log_bytes) {
+            if (store->compacting || !make_space(store, skip + size)) {
+                if (!store->compacting) handle_error("Key-value store is full\n");
+                return false;
+            }
+            continue;
+        }
+        // The batch is written as one range, so it cannot continue past the end of the log
+        if (store->batch_length + store->sector_size + size > KV_BATCH_BYTES
+            || (offset == 0 && store->tail != store->batch_position)) {
+            if (!kv_commit(store)) return false;
+            continue;
+        }
+        if (skip == 0) break;
+        if (!append_padding(store, wrap)) return false;
+    }
+
+    kv_record_header_t *header = (kv_record_header_t *) (store->batch + store->batch_length);
+    memset(header, 0, size);
+    header->type = type;
+    header->key_length = key_length;
+    header->value_length = value_length;
+    header->store_id = store->store_id;
+    header->position = store->tail;
+    memcpy(header + 1, key, key_length);
+    if (value_length > 0) memcpy((uint8_t *) (header + 1) + key_length, value, value_length);
+    header->crc = record_crc(header);
+
+    if (store->batch_records == 0) store->batch_ticks = timer_ticks();
+    store->batch_records++;
+    store->batch_length += size;
+    *position = store->tail;
+    store->tail += size;
+    return true;
+}
+
+static bool append_padding(kv_store_t *store, bool to_log_end) {
+    uint64_t offset = store->tail % store->log_bytes;
+    uint32_t room = store->sector_size - offset % store->sector_size;
+    uint64_t skip = to_log_end ? store->log_bytes - offset : room;
+
+    // Too little room for a header is skipped by readers without one
+    uint8_t *output = store->batch + store->batch_length;
+    memset(output, 0, room);
+    if (room >= sizeof(kv_record_header_t)) {
+        kv_record_header_t *header = (kv_record_header_t *) output;
+        header->type = KV_RECORD_PAD;
+        header->value_length = skip - sizeof(kv_record_header_t);
+        header->store_id = store->store_id;
+        header->position = store->tail;
+        header->crc = record_crc(header);
+    }
+    store->batch_length += room;
+    store->tail += skip;
+
+    // Skipping to the end of the log leaves a gap the batch cannot describe, so write it now
+    return skip == room || kv_commit(store);
+}
+
+static bool make_space(kv_store_t *store, uint64_t size) {
+    for (uint32_t attempt = 0; attempt < 2; attempt++) {
+        if (!kv_commit(store)) return false;
+        if (!compact_step(store, store->batch_position - store->compacted)) return false;
+        if (!kv_checkpoint(store)) return false;
+        if (store->tail + size - store->head <= store->log_bytes) return true;
+    }
+    return false;
+}
+
+static bool compact_step(kv_store_t *store, uint64_t budget) {
+    if (store->compacted < store->head) store->compacted = store->head;
+    uint64_t end = store->compacted + budget;
+    if (end > store->batch_position) end = store->batch_position;
+
+    uint64_t position = store->compacted;
+    bool success = true;
+    store->compacting = true;
+    while (position < end) {
+        uint32_t room = store->sector_size - position % store->sector_size;
+        if (room < sizeof(kv_record_header_t)) {
+            position += room;
+            continue;
+        }
+
+        kv_record_header_t *header = read_record(store, position);
+        if (header == NULL) {
+            handle_error("Key-value log is corrupt\n");
+            success = false;
+            break;
+        }
+        if (header->type == KV_RECORD_PAD) {
+            position += sizeof(kv_record_header_t) + header->value_length;
+            continue;
+        }
+
+        // Only the record the index points at is live, anything older or deleted is dropped
+        uint8_t *key = (uint8_t *) (header + 1);
+        kv_entry_t *entry = index_find(store, key, header->key_length, NULL);
+        if (header->type == KV_RECORD_PUT && entry != NULL && entry->position == position) {
+            uint64_t new_position;
+            if (!append_record(store, KV_RECORD_PUT, key, header->key_length,
+                key + header->key_length, header->value_length, &new_position)) {
+                // Out of room, the rest waits for the next step
+                break;
+            }
+            entry->position = new_position;
+            store->stats.compacted_records++;
+        }
+        position += record_size(header->key_length, header->value_length);
+    }
+    store->compacting = false;
+
+    store->stats.compacted_bytes += position - store->compacted;
+    store->compacted = position;
+    return success;
+}
+
+static kv_record_header_t *read_record(kv_store_t *store, uint64_t position) {
+    kv_record_header_t *header;
+    uint32_t header_size = sizeof(kv_record_header_t);
+    if (position >= store->batch_position) {
+        if (position + header_size > store->batch_position + store->batch_length) return NULL;
+        header = (kv_record_header_t *) (store->batch + (position - store->batch_position));
+    } else {
+        header = (kv_record_header_t *) load_window(store, position, header_size);
+        if (header == NULL) return NULL;
+    }
+
+    if (header->store_id != store->store_id || header->position != position) return NULL;
+    uint64_t size;
+    uint64_t room = store->log_bytes - position % store->log_bytes;
+    switch (header->type) {
+        case KV_RECORD_PAD:
+            if (header->value_length > room - header_size) return NULL;
+            return record_crc(header) == header->crc ? header : NULL;
+        case KV_RECORD_PUT:
+        case KV_RECORD_DELETE:
+            if (header->key_length == 0 || header->value_length > KV_MAX_VALUE) return NULL;
+            size = record_size(header->key_length, header->value_length);
+            if (size > room) return NULL;
+            break;
+        default:
+            return NULL;
+    }
+
+    // Make sure the whole record is in memory before checking it
+    if (position >= store->batch_position) {
+        if (position + size > store->batch_position + store->batch_length) return NULL;
+    } else {
+        header = (kv_record_header_t *) load_window(store, position, size);
+        if (header == NULL) return NULL;
+    }
+    return record_crc(header) == header->crc ? header : NULL;
+}
+
+static uint8_t *load_window(kv_store_t *store, uint64_t position, uint32_t length) {
+    if (store->window_length != 0 && position >= store->window_position
+        && position + length <= store->window_position + store->window_length) {
+        return store->window + (position - store->window_position);
+    }
+
+    uint64_t offset = position % store->log_bytes;
+    if (offset + length > store->log_bytes) return NULL;
+
+    // Start at the record's sector and read ahead up to the window size or the end of the log
+    uint64_t start = position - offset % store->sector_size;
+    uint64_t bytes = store->log_bytes - start % store->log_bytes;
+    if (bytes > KV_WINDOW_BYTES) bytes = KV_WINDOW_BYTES;
+    uint64_t lba = store->log_lba + start % store->log_bytes / store->sector_size;
+    uint64_t sectors = bytes / store->sector_size;
+
+    store->window_length = 0;
+    for (uint64_t done = 0; done < sectors;) {
+        uint32_t count = sectors - done > store->device->max_transfer
+            ? store->device->max_transfer : sectors - done;
+        if (!blk_read(store->device, lba + done, count,
+            store->window + done * store->sector_size)) {
+            return NULL;
+        }
+        done += count;
+    }
+    store->window_position = start;
+    store->window_length = bytes;
+    return store->window + (position - start);
+}
+
+static bool write_durable(kv_store_t *store, uint64_t lba, uint8_t *buffer, uint64_t sectors) {
+    blk_device_t *device = store->device;
+    bool fua = device->capabilities & BLK_CAP_FUA;
+    store->write_failed = false;
+
+    uint64_t done = 0;
+    while (done < sectors) {
+        for (uint32_t i = 0; i < KV_WRITE_DEPTH && done < sectors; i++) {
+            io_request_t *request = &store->write_requests[i];
+            memset(request, 0, sizeof(io_request_t));
+            request->op = IO_OP_WRITE;
+            request->flags = fua ? IO_FLAG_FUA : 0;
+            request->lba = lba + done;
+            request->count = sectors - done > device->max_transfer
+                ? device->max_transfer : sectors - done;
+            request->buffer = buffer + done * store->sector_size;
+            request->callback = write_complete;
+            request->context = store;
+            store->writes_pending++;
+            done += request->count;
+            blk_submit(device, request);
+        }
+
+        // The requests are reused by the next call, so none is given up while the driver has it.
+        // After a timeout the writes still queued are cancelled and the driver is aborted to fail
+        // the rest
+        uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_TIMEOUT_MS * 1000000);
+        bool timed_out = false;
+        while (store->writes_pending > 0) {
+            blk_poll(device);
+            if (timer_ticks() <= deadline) continue;
+            if (timed_out) {
+                handle_error("Device kept key-value writes after being aborted\n");
+                return false;
+            }
+            handle_error("Key-value write timed out\n");
+            timed_out = true;
+            for (uint32_t i = 0; i < KV_WRITE_DEPTH; i++) {
+                blk_cancel(device, &store->write_requests[i]);
+            }
+            if (store->writes_pending > 0) blk_abort(device);
+            deadline = timer_ticks() + ns_to_ticks((uint64_t) BLK_ABORT_TIMEOUT_MS * 1000000);
+        }
+        if (timed_out) return false;
+    }
+
+    if (store->write_failed) return false;
+    return fua || blk_flush(device);
+}
+
+static void write_complete(io_request_t *request) {
+    kv_store_t *store = request->context;
+    if (!request->success) store->write_failed = true;
+    store->writes_pending--;
+}
+
+static bool load_checkpoint(kv_store_t *store, uint32_t slot) {
+    uint32_t sector_size = store->sector_size;
+    if (!blk_read(store->device, store->checkpoint_lba[slot], 1, store->window)) return false;
+    store->window_length = 0;
+    kv_checkpoint_header_t header = *(kv_checkpoint_header_t *) store->window;
+    uint64_t sectors = (header.bytes + sector_size - 1) / sector_size;
+    if (header.bytes < sizeof(kv_checkpoint_header_t) || sectors > store->checkpoint_sectors
+        || header.head > header.position) {
+        return false;
+    }
+
+    uint8_t *buffer = dma_alloc(sectors * sector_size);
+    if (buffer == NULL) return false;
+    bool success = true;
+    for (uint64_t done = 0; done < sectors && success;) {
+        uint32_t count = sectors - done > store->device->max_transfer
+            ? store->device->max_transfer : sectors - done;
+        success = blk_read(store->device, store->checkpoint_lba[slot] + done, count,
+            buffer + done * sector_size);
+        done += count;
+    }
+    if (!success || crc32c(0, buffer + 12, header.bytes - 12) != header.crc) {
+        dma_free(buffer, sectors * sector_size);
+        return false;
+    }
+
+    uint8_t *input = buffer + sizeof(kv_checkpoint_header_t);
+    uint8_t *end = buffer + header.bytes;
+    for (uint64_t i = 0; i < header.entry_count && success; i++) {
+        kv_checkpoint_entry_t *entry = (kv_checkpoint_entry_t *) input;
+        if (input + sizeof(kv_checkpoint_entry_t) > end
+            || input + sizeof(kv_checkpoint_entry_t) + entry->key_length > end) {
+            success = false;
+            break;
+        }
+        success = index_insert(store, entry->key, entry->key_length, entry->position,
+            entry->value_length);
+        input += sizeof(kv_checkpoint_entry_t) + entry->key_length;
+    }
+    dma_free(buffer, sectors * sector_size);
+    if (!success) return false;
+
+    store->checkpoint_sequence = header.sequence;
+    store->checkpoint_position = header.position;
+    store->head = header.head;
+    store->compacted = header.head;
+    store->tail = header.position;
+    return true;
+}
+
+static bool replay_log(kv_store_t *store) {
+    uint64_t position = store->tail;
+    uint32_t header_size = sizeof(kv_record_header_t);
+
+    while (position - store->head < store->log_bytes) {
+        uint32_t room = store->sector_size - position % store->sector_size;
+        if (room < header_size) {
+            position += room;
+            continue;
+        }
+
+        kv_record_header_t *header = read_record(store, position);
+        if (header == NULL) break;
+        if (header->type == KV_RECORD_PAD) {
+            position += header_size + header->value_length;
+            continue;
+        }
+
+        uint8_t *key = (uint8_t *) (header + 1);
+        if (header->type == KV_RECORD_PUT) {
+            if (!index_insert(store, key, header->key_length, position, header->value_length)) {
+                return false;
+            }
+        } else {
+            index_remove(store, key, header->key_length);
+        }
+        store->stats.replayed_records++;
+        position += record_size(header->key_length, header->value_length);
+    }
+
+    if (!clear_torn_commit(store, position)) return false;
+
+    // Appends continue after the last valid record, rewriting the rest of its sector
+    store->tail = position;
+    store->batch_position = position - position % store->sector_size;
+    store->batch_length = position - store->batch_position;
+    if (store->batch_length > 0) {
+        uint8_t *data = load_window(store, store->batch_position, store->batch_length);
+        if (data == NULL) {
+            handle_error("Could not read key-value log\n");
+            return false;
+        }
+        memcpy(store->batch, data, store->batch_length);
+    }
+    if (store->compacted < store->head) store->compacted = store->head;
+    return true;
+}
+
+static bool clear_torn_commit(kv_store_t *store, uint64_t position) {
+    // The commit in flight at a crash started at or before the sector of position, fits in the
+    // batch and never runs past the end of the log or into the records kept from head
+    uint32_t sector_size = store->sector_size;
+    uint64_t start = position + (sector_size - position % sector_size) % sector_size;
+    uint64_t end = position - position % sector_size + KV_BATCH_BYTES;
+    uint64_t log_end = start - start % store->log_bytes + store->log_bytes;
+    if (end > log_end) end = log_end;
+    if (end > store->head + store->log_bytes) end = store->head + store->log_bytes;
+    if (start >= end) return true;
+
+    memset(store->batch, 0, end - start);
+    uint64_t lba = store->log_lba + start % store->log_bytes / sector_size;
+    if (!write_durable(store, lba, store->batch, (end - start) / sector_size)) {
+        handle_error("Could not clear key-value log\n");
+        return false;
+    }
+    store->window_length = 0;
+    return true;
+}
+
+static bool index_insert(kv_store_t *store, const uint8_t *key, uint8_t key_length,
+    uint64_t position, uint32_t value_length) {
+    kv_entry_t *entry = index_find(store, key, key_length, NULL);
+    if (entry != NULL) {
+        store->live_bytes -= record_size(key_length, entry->value_length);
+        store->live_bytes += record_size(key_length, value_length);
+        entry->position = position;
+        entry->value_length = value_length;
+        return true;
+    }
+
+    // Grow the table by doubling once it is as full as it has buckets
+    if (store->entry_count > store->index_mask) {
+        uint32_t new_mask = store->index_mask * 2 + 1;
+        kv_entry_t **new_index = malloc((new_mask + 1) * sizeof(kv_entry_t *));
+        if (new_index == NULL) {
+            handle_error("Could not grow key-value index\n");
+            return false;
+        }
+        memset(new_index, 0, (new_mask + 1) * sizeof(kv_entry_t *));
+        for (uint32_t i = 0; i <= store->index_mask; i++) {
+            kv_entry_t *old = store->index[i];
+            while (old != NULL) {
+                kv_entry_t *next = old->next;
+                old->next = new_index[old->hash & new_mask];
+                new_index[old->hash & new_mask] = old;
+                old = next;
+            }
+        }
+        free(store->index);
+        store->index = new_index;
+        store->index_mask = new_mask;
+    }
+
+    entry = malloc(sizeof(kv_entry_t) + key_length);
+    if (entry == NULL) {
+        handle_error("Could not allocate key-value index entry\n");
+        return false;
+    }
+    entry->hash = hash_key(key, key_length);
+    entry->position = position;
+    entry->value_length = value_length;
+    entry->key_length = key_length;
+    memcpy(entry->key, key, key_length);
+    entry->next = store->index[entry->hash & store->index_mask];
+    store->index[entry->hash & store->index_mask] = entry;
+    store->entry_count++;
+    store->live_bytes += record_size(key_length, value_length);
+    return true;
+}
+
+static kv_entry_t *index_find(kv_store_t *store, const uint8_t *key, uint8_t key_length,
+    kv_entry_t ***link) {
+    uint32_t hash = hash_key(key, key_length);
+    kv_entry_t **previous = &store->index[hash & store->index_mask];
+    for (kv_entry_t *entry = *previous; entry != NULL; entry = entry->next) {
+        if (entry->hash == hash && entry->key_length == key_length
+            && memcmp(entry->key, key, key_length) == 0) {
+            if (link != NULL) *link = previous;
+            return entry;
+        }
+        previous = &entry->next;
+    }
+    return NULL;
+}
+
+static bool index_remove(kv_store_t *store, const uint8_t *key, uint8_t key_length) {
+    kv_entry_t **link;
+    kv_entry_t *entry = index_find(store, key, key_length, &link);
+    if (entry == NULL) return false;
+    *link = entry->next;
+    store->live_bytes -= record_size(key_length, entry->value_length);
+    store->entry_count--;
+    free(entry);
+    return true;
+}
+
+static uint32_t record_crc(kv_record_header_t *header) {
+    // Padding covers bytes that are never written, so only its header is checked
+    size_t length = sizeof(kv_record_header_t) - 4;
+    if (header->type != KV_RECORD_PAD) length += header->key_length + header->value_length;
+    return crc32c(0, (uint8_t *) header + 4, length);
+}
+
+static uint64_t record_size(uint8_t key_length, uint32_t value_length) {
+    return (sizeof(kv_record_header_t) + key_length + value_length + 7) & ~7ULL;
+}
+
+static uint32_t hash_key(const uint8_t *key, uint8_t key_length) {
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < key_length; i++) hash = (hash ^ key[i]) * 16777619u;
+    return hash;
+}
+
+static void free_store(kv_store_t *store) {
+    free_index(store);
+    free(store->index);
+    dma_free(store->batch, KV_BATCH_BYTES);
+    dma_free(store->window, KV_WINDOW_BYTES);
+    free(store);
+}
+
+static void free_index(kv_store_t *store) {
+    if (store->index == NULL) return;
+    for (uint32_t i = 0; i <= store->index_mask; i++) {
+        kv_entry_t *entry = store->index[i];
+        while (entry != NULL) {
+            kv_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+        store->index[i] = NULL;
+    }
+    store->entry_count = 0;
+    store->live_bytes = 0;
+}
@@ -0,0 +1,337 @@
+#ifndef _KVSTORE_H_
+#define _KVSTORE_H_
+
+#define KV_MAGIC 0x3145524F5453564B             // "KVSTORE1"
+#define KV_CHECKPOINT_MAGIC 0x3154504B4843564B  // "KVCHKPT1"
+#define KV_VERSION 2                    // 2: checksums are CRC32C
+
+#define KV_RECORD_PUT 1
+#define KV_RECORD_DELETE 2
+#define KV_RECORD_PAD 3             // Skips to the end of its sector or of the log
+
+#define KV_MAX_KEY 255
+#define KV_MAX_VALUE (64 * 1024)
+#define KV_BATCH_BYTES (1024 * 1024)            // Records buffered before a commit is forced
+#define KV_WINDOW_BYTES (256 * 1024)            // Read-ahead for gets, replay and compaction
+#define KV_WRITE_DEPTH 8                        // Commit requests kept in flight
+#define KV_CHECKPOINT_SLOT_DIVISOR 16           // Each checkpoint slot is 1/16 of the device
+#define KV_CHECKPOINT_INTERVAL (16 * 1024 * 1024) // Log bytes between periodic checkpoints
+#define KV_COMMIT_INTERVAL_US 1000              // kv_poll commits records older than this
+#define KV_COMPACT_STEP (1024 * 1024)           // Log bytes compaction examines per kv_poll
+#define KV_COMPACT_GARBAGE 50                   // Compact when this percent of the log is dead
+#define KV_COMPACT_MIN_USED 25                  // ...and at least this percent is in use
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief Sector 0 of the device, written once by kv_format
+ */
+typedef struct kv_superblock {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t crc;                   // CRC32C of the superblock with this field 0
+    uint32_t store_id;              // Tags every record, so data left by an older store is ignored
+    uint32_t sector_size;
+    uint64_t checkpoint_lba[2];
+    uint32_t checkpoint_sectors;    // Size of each checkpoint slot
+    uint32_t reserved;
+    uint64_t log_lba;
+    uint64_t log_sectors;
+} __attribute__((packed)) kv_superblock_t;
+
+/**
+ * @brief Header of every log record, followed by the key and value and padded to 8 bytes. A
+ * header never crosses a sector boundary and a record never crosses the end of the log
+ */
+typedef struct kv_record_header {
+    uint32_t crc;                   // CRC32C of the rest of the header, the key and the value
+    uint8_t type;
+    uint8_t key_length;
+    uint16_t reserved;
+    uint32_t value_length;          // For padding, the bytes skipped after the header
+    uint32_t store_id;
+    /**
+     * @brief Log position of the record, which never repeats, so records left from an earlier
+     * pass over the log fail to match
+     */
+    uint64_t position;
+} __attribute__((packed)) kv_record_header_t;
+
+/**
+ * @brief Header of a checkpoint slot, followed by entry_count packed kv_checkpoint_entry_t
+ */
+typedef struct kv_checkpoint_header {
+    uint64_t magic;
+    uint32_t crc;                   // CRC32C of the rest of the header and the entries
+    uint32_t store_id;
+    uint64_t sequence;              // The slot with the highest valid sequence is current
+    uint64_t head;                  // Oldest log position still referenced
+    uint64_t position;              // Log position replay continues from
+    uint64_t entry_count;
+    uint64_t bytes;                 // Header and entries
+} __attribute__((packed)) kv_checkpoint_header_t;
+
+typedef struct kv_checkpoint_entry {
+    uint64_t position;
+    uint32_t value_length;
+    uint8_t key_length;
+    uint8_t key[];
+} __attribute__((packed)) kv_checkpoint_entry_t;
+
+/**
+ * @brief Index entry of a live key, pointing at its latest record
+ */
+typedef struct kv_entry {
+    struct kv_entry *next;
+    uint32_t hash;
+    uint32_t value_length;
+    uint64_t position;
+    uint8_t key_length;
+    uint8_t key[];
+} kv_entry_t;
+
+typedef struct kv_stats {
+    uint64_t puts;
+    uint64_t deletes;
+    uint64_t gets;
+    uint64_t commits;
+    uint64_t committed_bytes;
+    uint64_t checkpoints;
+    uint64_t compacted_records;     // Live records copied forward by compaction
+    uint64_t compacted_bytes;       // Log bytes compaction has passed over
+    uint64_t replayed_records;      // Records replayed by kv_open after the checkpoint
+} kv_stats_t;
+
+/**
+ * @brief An open store. The log is addressed by position, a byte offset that only grows and is
+ * mapped onto the log area modulo its size
+ */
+typedef struct kv_store {
+    blk_device_t *device;
+    uint32_t sector_size;
+    uint32_t store_id;
+    uint64_t checkpoint_lba[2];
+    uint32_t checkpoint_sectors;
+    uint64_t log_lba;
+    uint64_t log_bytes;
+    /**
+     * @brief Oldest position the index or checkpoint may reference, and the next append
+     */
+    uint64_t head;
+    uint64_t tail;
+    /**
+     * @brief Records before this have been copied forward, and are released at the next
+     * checkpoint
+     */
+    uint64_t compacted;
+    bool compacting;                // Appends made by compaction must not compact again
+    uint64_t live_bytes;            // Log bytes of records the index points at
+    uint64_t checkpoint_sequence;
+    uint64_t checkpoint_position;
+    /**
+     * @brief Records appended but not yet committed, starting at the sector aligned position
+     * batch_position. A commit pads the batch out to a whole sector
+     */
+    uint8_t *batch;
+    uint64_t batch_position;
+    uint32_t batch_length;
+    uint32_t batch_records;
+    uint64_t batch_ticks;           // When the oldest uncommitted record was appended
+    /**
+     * @brief Committed log data around the last read
+     */
+    uint8_t *window;
+    uint64_t window_position;
+    uint32_t window_length;
+    /**
+     * @brief Hash table of live keys
+     */
+    kv_entry_t **index;
+    uint32_t index_mask;
+    uint32_t entry_count;
+    io_request_t write_requests[KV_WRITE_DEPTH];
+    uint32_t writes_pending;
+    bool write_failed;
+    kv_stats_t stats;
+} kv_store_t;
+
+/**
+ * @brief Creates an empty store over the whole device, destroying its contents
+ */
+bool kv_format(blk_device_t *device);
+
+/**
+ * @brief Opens a store, loading the newest valid checkpoint and replaying the log after it
+ * 
+ * @param store Output for the open store
+ */
+bool kv_open(blk_device_t *device, kv_store_t **store);
+
+/**
+ * @brief Commits, writes a checkpoint so the next open is quick, and frees the store
+ */
+bool kv_close(kv_store_t *store);
+
+/**
+ * @brief Frees the store without committing or checkpointing it, losing the records appended
+ * since the last commit as a crash would
+ */
+void kv_discard(kv_store_t *store);
+
+/**
+ * @brief Sets a key. The record is durable after the next kv_commit, which happens automatically
+ * when the batch fills or from kv_poll
+ */
+bool kv_put(kv_store_t *store, const void *key, uint8_t key_length, const void *value,
+    uint32_t value_length);
+
+/**
+ * @brief Removes a key, durable after the next commit like kv_put
+ * 
+ * @return False if the key does not exist
+ */
+bool kv_delete(kv_store_t *store, const void *key, uint8_t key_length);
+
+/**
+ * @brief Reads the value of a key, checking its record's CRC
+ * 
+ * @param capacity Bytes available in value, which receives at most that many
+ * @param value_length Output for the full length of the value
+ * @return False if the key does not exist or its record could not be read
+ */
+bool kv_get(kv_store_t *store, const void *key, uint8_t key_length, void *value,
+    uint32_t capacity, uint32_t *value_length);
+
+/**
+ * @brief Makes every record appended so far durable with one batch of writes, using FUA where the
+ * device has it and a single flush otherwise
+ */
+bool kv_commit(kv_store_t *store);
+
+/**
+ * @brief Writes the index to the older checkpoint slot, after which log space compacted so far
+ * can be reused
+ */
+bool kv_checkpoint(kv_store_t *store);
+
+/**
+ * @brief Background work, to be called while idle: commits records waiting longer than
+ * KV_COMMIT_INTERVAL_US, runs a step of compaction when enough of the log is dead, and
+ * checkpoints periodically
+ */
+bool kv_poll(kv_store_t *store);
+
+/**
+ * @brief Prints the counters of a store as a "kvstat," CSV line
+ */
+void kv_print_stats(kv_store_t *store);
+
+/**
+ * @brief Appends a record to the batch, committing first if it is full. Fails if the log has no
+ * room even after compacting
+ */
+static bool append_record(kv_store_t *store, uint8_t type, const void *key, uint8_t key_length,
+    const void *value, uint32_t value_length, uint64_t *position);
+
+/**
+ * @brief Appends padding, either to the end of the current sector or to the end of the log, in
+ * which case the batch is committed
+ */
+static bool append_padding(kv_store_t *store, bool to_log_end);
+
+/**
+ * @brief Compacts and checkpoints until a record of the given size fits
+ */
+static bool make_space(kv_store_t *store, uint64_t size);
+
+/**
+ * @brief Copies the live records of up to budget log bytes after compacted to the tail
+ */
+static bool compact_step(kv_store_t *store, uint64_t budget);
+
+/**
+ * @brief Returns the record at a log position, from the batch or through the window, or NULL if
+ * it is not a valid record
+ */
+static kv_record_header_t *read_record(kv_store_t *store, uint64_t position);
+
+/**
+ * @brief Makes the window hold committed log bytes [position, position + length)
+ */
+static uint8_t *load_window(kv_store_t *store, uint64_t position, uint32_t length);
+
+/**
+ * @brief Writes sectors with up to KV_WRITE_DEPTH requests in flight, each FUA, or followed by a
+ * flush if the device has no FUA
+ */
+static bool write_durable(kv_store_t *store, uint64_t lba, uint8_t *buffer, uint64_t sectors);
+
+/**
+ * @brief Completion callback of write_durable requests
+ */
+static void write_complete(io_request_t *request);
+
+/**
+ * @brief Reads a checkpoint slot into the index if it is valid and newer than the current one
+ */
+static bool load_checkpoint(kv_store_t *store, uint32_t slot);
+
+/**
+ * @brief Replays the records from the checkpoint position onwards, setting the tail after the
+ * last valid one
+ */
+static bool replay_log(kv_store_t *store);
+
+/**
+ * @brief Zeroes the log a commit torn by a crash may have reached past position, the end of
+ * replay. Its later sectors can land while an earlier one is lost, and appends overwrite only
+ * part of them, so a later replay would run on into records that were never acknowledged
+ */
+static bool clear_torn_commit(kv_store_t *store, uint64_t position);
+
+/**
+ * @brief Sets a key's index entry, replacing the previous one
+ */
+static bool index_insert(kv_store_t *store, const uint8_t *key, uint8_t key_length,
+    uint64_t position, uint32_t value_length);
+
+/**
+ * @brief Finds a key's index entry, and optionally the link pointing at it
+ */
+static kv_entry_t *index_find(kv_store_t *store, const uint8_t *key, uint8_t key_length,
+    kv_entry_t ***link);
+
+/**
+ * @brief Removes a key's index entry, returning false if there was none
+ */
+static bool index_remove(kv_store_t *store, const uint8_t *key, uint8_t key_length);
+
+/**
+ * @brief CRC of a record from the field after crc to the end of its value
+ */
+static uint32_t record_crc(kv_record_header_t *header);
+
+/**
+ * @brief Bytes a record takes in the log, header and padding included
+ */
+static uint64_t record_size(uint8_t key_length, uint32_t value_length);
+
+/**
+ * @brief FNV-1a hash of a key
+ */
+static uint32_t hash_key(const uint8_t *key, uint8_t key_length);
+
+/**
+ * @brief Frees a store without checkpointing it
+ */
+static void free_store(kv_store_t *store);
+
+/**
+ * @brief Frees every entry of the index, leaving it empty
+ */
+static void free_index(kv_store_t *store);
+
+#endif
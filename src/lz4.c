@@ -0,0 +1,191 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "types.h"
+#include "lz4.h"
+
+uint32_t lz4_compress(const void *input, uint32_t length, void *output, uint32_t capacity,
+    uint32_t *table) {
+    const uint8_t *start = input;
+    const uint8_t *anchor = start;
+    uint8_t *out = output;
+    uint8_t *out_end = out + capacity;
+
+    // Inputs too short to hold a match are a single run of literals
+    if (length > LZ4_MATCH_LIMIT) {
+        const uint8_t *match_end = start + length - LZ4_LAST_LITERALS;
+        const uint8_t *search_end = start + length - LZ4_MATCH_LIMIT;
+        memset(table, 0, LZ4_HASH_SIZE * sizeof(uint32_t));
+
+        const uint8_t *position = start + 1;
+        while (position < search_end) {
+            uint32_t sequence = *(const lz4_word_t *) position;
+            uint32_t hash = hash_sequence(sequence);
+            const uint8_t *candidate = start + table[hash];
+            table[hash] = position - start;
+
+            if (position - candidate > LZ4_MAX_OFFSET || *(const lz4_word_t *) candidate != sequence
+                || candidate == position) {
+                // Skip ahead faster the longer nothing has matched
+                position += 1 + ((position - anchor) >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+
+            // Extend the match backwards over literals that also match
+            while (position > anchor && candidate > start && position[-1] == candidate[-1]) {
+                position--;
+                candidate--;
+            }
+            uint32_t matched = LZ4_MIN_MATCH + match_length(position + LZ4_MIN_MATCH,
+                candidate + LZ4_MIN_MATCH, match_end);
+
+            out = write_sequence(out, out_end, anchor, position - anchor, position - candidate,
+                matched);
+            if (out == NULL) return 0;
+            position += matched;
+            anchor = position;
+
+            // Index a position inside the match so the next one can be found from it
+            if (position - 2 > start && position < search_end) {
+                table[hash_sequence(*(const lz4_word_t *) (position - 2))] = position - 2 - start;
+            }
+        }
+    }
+
+    // The last literals form a sequence without a match
+    uint32_t literal_length = start + length - anchor;
+    uint32_t needed = 1 + literal_length
+        + (literal_length >= 15 ? (literal_length - 15) / 255 + 1 : 0);
+    if (needed > (uint32_t) (out_end - out)) return 0;
+    *out++ = (literal_length >= 15 ? 15 : literal_length) << 4;
+    if (literal_length >= 15) out = write_length(out, literal_length - 15);
+    memcpy(out, anchor, literal_length);
+    out += literal_length;
+    return out - (uint8_t *) output;
+}
+
+bool lz4_decompress(const void *input, uint32_t length, void *output, uint32_t capacity,
+    uint32_t *output_length) {
+    const uint8_t *in = input;
+    const uint8_t *in_end = in + length;
+    uint8_t *out = output;
+    uint8_t *out_start = out;
+    uint8_t *out_end = out + capacity;
+
+    while (in < in_end) {
+        uint8_t token = *in++;
+        uint32_t literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(&in, in_end, &literal_length)) return false;
+        if (literal_length > (uint32_t) (in_end - in)
+            || literal_length > (uint32_t) (out_end - out)) {
+            return false;
+        }
+
+        // Copying in whole blocks may run past the literals, which is fine while both buffers
+        // have a block to spare, since the match or next literals overwrite the excess
+        if (in_end - in >= literal_length + LZ4_WILD_COPY
+            && out_end - out >= literal_length + LZ4_WILD_COPY) {
+            for (uint32_t done = 0; done < literal_length; done += LZ4_WILD_COPY) {
+                *(lz4_block_t *) (out + done) = *(const lz4_block_t *) (in + done);
+            }
+        } else {
+            memcpy(out, in, literal_length);
+        }
+        in += literal_length;
+        out += literal_length;
+
+        // The last sequence has no match
+        if (in == in_end) break;
+        if (in_end - in < 2) return false;
+        uint32_t offset = in[0] | (uint32_t) in[1] << 8;
+        in += 2;
+        if (offset == 0 || offset > (uint32_t) (out - out_start)) return false;
+
+        uint32_t matched = token & 15;
+        if (matched == 15 && !read_length(&in, in_end, &matched)) return false;
+        matched += LZ4_MIN_MATCH;
+        if (matched > (uint32_t) (out_end - out)) return false;
+
+        // A short offset repeats a pattern. Copying the first bytes one at a time extends it until
+        // a whole multiple of the offset at least one block long lies behind, and copying from
+        // that far back gives the same bytes without a block overlapping itself
+        uint8_t *copy = out;
+        uint8_t *copy_end = out + matched;
+        uint32_t distance = offset;
+        if (offset < LZ4_WILD_COPY) {
+            distance = (LZ4_WILD_COPY + offset - 1) / offset * offset;
+            for (uint32_t i = offset; i < distance && copy < copy_end; i++, copy++) {
+                *copy = *(copy - offset);
+            }
+        }
+
+        // Whole blocks while they fit in the output, then the last few bytes one at a time
+        while (copy < copy_end && out_end - copy >= LZ4_WILD_COPY) {
+            *(lz4_block_t *) copy = *(const lz4_block_t *) (copy - distance);
+            copy += LZ4_WILD_COPY;
+        }
+        for (; copy < copy_end; copy++) *copy = *(copy - distance);
+        out = copy_end;
+    }
+
+    *output_length = out - out_start;
+    return true;
+}
+
+static uint8_t *write_sequence(uint8_t *output, uint8_t *end, const uint8_t *literals,
+    uint32_t literal_length, uint16_t offset, uint32_t match_length) {
+    // Token, lengths of up to 255 per continuation byte, literals and offset
+    uint32_t extra = match_length - LZ4_MIN_MATCH;
+    uint64_t needed = 1 + literal_length + 2
+        + (literal_length >= 15 ? (literal_length - 15) / 255 + 1 : 0)
+        + (extra >= 15 ? (extra - 15) / 255 + 1 : 0);
+    if (needed > (uint64_t) (end - output)) return NULL;
+
+    *output++ = (literal_length >= 15 ? 15 : literal_length) << 4 | (extra >= 15 ? 15 : extra);
+    if (literal_length >= 15) output = write_length(output, literal_length - 15);
+    memcpy(output, literals, literal_length);
+    output += literal_length;
+    *output++ = offset & 0xFF;
+    *output++ = offset >> 8;
+    if (extra >= 15) output = write_length(output, extra - 15);
+    return output;
+}
+
+static uint8_t *write_length(uint8_t *output, uint32_t length) {
+    while (length >= 255) {
+        *output++ = 255;
+        length -= 255;
+    }
+    *output++ = length;
+    return output;
+}
+
+static bool read_length(const uint8_t **input, const uint8_t *end, uint32_t *length) {
+    uint8_t byte;
+    do {
+        if (*input == end) return false;
+        byte = *(*input)++;
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+static uint32_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit) {
+    const uint8_t *start = a;
+    while (a + 8 <= limit) {
+        uint64_t difference = *(const lz4_long_t *) a ^ *(const lz4_long_t *) b;
+        // Little endian, so the lowest set bit is in the first differing byte
+        if (difference != 0) return a - start + (__builtin_ctzll(difference) >> 3);
+        a += 8;
+        b += 8;
+    }
+    while (a < limit && *a == *b) {
+        a++;
+        b++;
+    }
+    return a - start;
+}
+
+static uint32_t hash_sequence(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
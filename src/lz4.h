@@ -0,0 +1,75 @@
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+#define LZ4_HASH_BITS 12
+#define LZ4_HASH_SIZE (1 << LZ4_HASH_BITS)
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_LAST_LITERALS 5             // The block format ends with at least this many literals
+#define LZ4_MATCH_LIMIT 12              // ...and no match starts closer than this to its end
+#define LZ4_WILD_COPY 16                // Bytes moved per step by the decoder's copy loops
+#define LZ4_SKIP_TRIGGER 6              // Search step grows by one every 2^6 bytes without a match
+
+#include <stdbool.h>
+
+#include "types.h"
+
+/**
+ * @brief 16 bytes moved as one unaligned load and store by the decoder's copy loops, and the
+ * unaligned words the match finder compares
+ */
+typedef uint8_t lz4_block_t __attribute__((vector_size(16), aligned(1)));
+typedef uint32_t lz4_word_t __attribute__((aligned(1)));
+typedef uint64_t lz4_long_t __attribute__((aligned(1)));
+
+/**
+ * @brief Compresses input into an LZ4 block (the raw block format, without a frame header)
+ * 
+ * @param table LZ4_HASH_SIZE entries of scratch space for the match finder
+ * @return The compressed length, or 0 if it would not fit in capacity bytes
+ */
+uint32_t lz4_compress(const void *input, uint32_t length, void *output, uint32_t capacity,
+    uint32_t *table);
+
+/**
+ * @brief Decompresses an LZ4 block, checking every length and offset against both buffers so a
+ * corrupt block fails instead of overrunning them. Literals and matches are moved 16 bytes at a
+ * time while there is room, and byte by byte only near the end of the output
+ * 
+ * @param output_length Output for the decompressed length
+ * @return False if the block is malformed or does not fit in capacity bytes
+ */
+bool lz4_decompress(const void *input, uint32_t length, void *output, uint32_t capacity,
+    uint32_t *output_length);
+
+/**
+ * @brief Writes a sequence: the token, the literals since the last match and the match itself
+ * 
+ * @return The new output position, or NULL if the sequence would not fit before end
+ */
+static uint8_t *write_sequence(uint8_t *output, uint8_t *end, const uint8_t *literals,
+    uint32_t literal_length, uint16_t offset, uint32_t match_length);
+
+/**
+ * @brief Writes the 255 valued continuation bytes of a length over 15
+ */
+static uint8_t *write_length(uint8_t *output, uint32_t length);
+
+/**
+ * @brief Reads the continuation bytes of a length whose token nibble was 15
+ * 
+ * @return False if the input ends first
+ */
+static bool read_length(const uint8_t **input, const uint8_t *end, uint32_t *length);
+
+/**
+ * @brief Returns the number of equal bytes at a and b, comparing 8 bytes at a time up to limit
+ */
+static uint32_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *limit);
+
+/**
+ * @brief Hashes the 4 bytes at a position into the match finder table
+ */
+static uint32_t hash_sequence(uint32_t sequence);
+
+#endif
@@ -0,0 +1,552 @@
+#include "nvme.h"
+#include "std.h"
+#include "defs.h"
+#include "pci.h"
+#include "timer.h"
+#include "blk.h"
+#include "cpu.h"
+
+static const blk_ops_t nvme_ops = {nvme_submit, nvme_poll, nvme_abort};
+
+bool init_nvme(pci_device_list_t device_list) {
+    if (BOOT_VERBOSE) {
+        printf("Starting initialisation for NVMe\n");
+    }
+
+    // Mass storage, non-volatile memory controller, NVM Express
+    pci_match_t match = {PCI_ANY, PCI_ANY, 0x01, 0x08, 0x02, 0x0};
+    uint32_t matches[PCI_MAX_MATCHES];
+    uint32_t match_count = pci_find(&device_list, &match, matches, PCI_MAX_MATCHES);
+    if (match_count > PCI_MAX_MATCHES) match_count = PCI_MAX_MATCHES;
+
+    uint32_t controller_count = 0;
+    for (uint32_t i = 0; i < match_count; i++) {
+        pci_header_t *pci_header = device_list.all_devices[matches[i]];
+
+        nvme_controller_t *controller = malloc(sizeof(nvme_controller_t));
+        if (controller == NULL) {
+            handle_error("Could not allocate NVMe controller\n");
+            return controller_count > 0;
+        }
+        memset(controller, 0, sizeof(nvme_controller_t));
+        controller->pci_header = (pci_header_0_t *) pci_header;
+        controller->pci_header->command |= 0x6; // Memory space and bus master
+        controller->registers = (nvme_registers_t *) pci_bar_address(controller->pci_header, 0);
+        controller->device.ops = &nvme_ops;
+        controller->device.driver = controller;
+
+        if (controller->registers == NULL || !init_controller(controller)) {
+            free(controller);
+            continue;
+        }
+        if (device_list.capabilities[matches[i]].msix != 0) {
+            init_msix(controller, &device_list, matches[i]);
+        }
+
+        blk_device_t *device = &controller->device;
+        snprintf(device->name, BLK_NAME_LENGTH, "nvme%d", (uint64_t) controller_count);
+        if (!blk_register(device)) {
+            free(controller);
+            continue;
+        }
+
+        if (BOOT_VERBOSE) {
+            printf("%s: %d sectors of %d bytes, %d queue pairs of depth %d, %s\n",
+                device->name, device->sector_count, (uint64_t) device->sector_size,
+                (uint64_t) controller->io_queue_count, (uint64_t) device->queue_depth,
+                controller->sgl ? "SGL" : "PRP");
+            if (controller->msix.entries > 0) {
+                printf("%s: MSI-X vectors %x to %x, masked\n", device->name,
+                    (uint64_t) controller->msix.first_vector,
+                    (uint64_t) controller->msix.first_vector + controller->msix.entries - 1);
+            }
+        }
+        controller_count++;
+    }
+
+    if (controller_count == 0 && BOOT_VERBOSE) {
+        printf("No NVMe controllers found\n");
+    }
+    return controller_count > 0;
+}
+
+static bool init_controller(nvme_controller_t *controller) {
+    nvme_registers_t *registers = controller->registers;
+    uint64_t capabilities = registers->capabilities;
+
+    controller->doorbell_stride = 4 << ((capabilities >> 32) & 0xF);
+    controller->timeout_ms = ((capabilities >> 24) & 0xFF) * 500;
+    if (controller->timeout_ms == 0) controller->timeout_ms = 500;
+
+    // Queues and PRP lists are built from 4KB pages
+    if (((capabilities >> 48) & 0xF) != 0) {
+        handle_error("NVMe controller does not support 4KB pages\n");
+        return false;
+    }
+
+    registers->configuration &= ~NVME_CC_ENABLE;
+    if (!wait_ready(controller, false)) {
+        handle_error("NVMe controller did not reset\n");
+        return false;
+    }
+
+    uint32_t max_entries = (capabilities & 0xFFFF) + 1;
+    uint16_t admin_depth = max_entries < NVME_ADMIN_QUEUE_DEPTH
+        ? max_entries : NVME_ADMIN_QUEUE_DEPTH;
+    if (!alloc_queue(controller, &controller->admin, 0, admin_depth)) {
+        return false;
+    }
+
+    if (!enable_controller(controller)) {
+        return false;
+    }
+
+    if (!identify(controller)) {
+        return false;
+    }
+
+    // Ask for one queue pair per processor, the controller may grant fewer
+    uint32_t wanted = cpu_count() < NVME_MAX_IO_QUEUES ? cpu_count() : NVME_MAX_IO_QUEUES;
+    if (!request_queues(controller, &wanted)) {
+        return false;
+    }
+
+    controller->io_queues = malloc(wanted * sizeof(nvme_queue_t));
+    if (controller->io_queues == NULL) {
+        handle_error("Could not allocate NVMe queues\n");
+        return false;
+    }
+    memset(controller->io_queues, 0, wanted * sizeof(nvme_queue_t));
+
+    uint16_t io_depth = max_entries < NVME_IO_QUEUE_DEPTH ? max_entries : NVME_IO_QUEUE_DEPTH;
+    for (uint32_t i = 0; i < wanted; i++) {
+        nvme_queue_t *queue = &controller->io_queues[i];
+        if (!alloc_queue(controller, queue, i + 1, io_depth)
+            || !create_io_queue(controller, queue)) {
+            break;
+        }
+        controller->io_queue_count++;
+    }
+    if (controller->io_queue_count == 0) {
+        handle_error("Could not create any NVMe I/O queues\n");
+        return false;
+    }
+
+    // One identifier per queue is held back so a full submission queue is never ambiguous
+    controller->device.queue_depth = io_depth - 1;
+    return true;
+}
+
+static void init_msix(nvme_controller_t *controller, pci_device_list_t *list, uint32_t index) {
+    // Processor n submits to I/O queue n + 1, and the admin queue is only used from this one.
+    // The round-robin default would aim every entry one processor off
+    uint32_t cpus[NVME_MAX_IO_QUEUES + 1];
+    cpus[0] = cpu_current();
+    for (uint32_t i = 0; i < controller->io_queue_count; i++) {
+        cpus[i + 1] = i;
+    }
+    pci_enable_msix(list, index, controller->io_queue_count + 1, cpus, &controller->msix);
+}
+
+static bool wait_ready(nvme_controller_t *controller, bool ready) {
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) controller->timeout_ms * 1000000);
+    while (((controller->registers->status & NVME_CSTS_READY) != 0) != ready) {
+        if (controller->registers->status & NVME_CSTS_FATAL) return false;
+        if (timer_ticks() > deadline) return false;
+    }
+    return true;
+}
+
+static bool enable_controller(nvme_controller_t *controller) {
+    nvme_registers_t *registers = controller->registers;
+    uint16_t admin_depth = controller->admin.depth;
+    registers->admin_queue_attributes = (admin_depth - 1) << 16 | (admin_depth - 1);
+    registers->admin_sq_base = (uint64_t) controller->admin.sq;
+    registers->admin_cq_base = (uint64_t) controller->admin.cq;
+    // NVM command set, 4KB pages, 64 byte submission and 16 byte completion entries
+    registers->configuration = 4 << 20 | 6 << 16 | NVME_CC_ENABLE;
+    if (!wait_ready(controller, true)) {
+        handle_error("NVMe controller did not become ready\n");
+        return false;
+    }
+    return true;
+}
+
+static bool request_queues(nvme_controller_t *controller, uint32_t *count) {
+    nvme_command_t command = {0};
+    command.command_dword0 = NVME_ADMIN_SET_FEATURES;
+    command.command_dword10 = NVME_FEATURE_NUMBER_OF_QUEUES;
+    command.command_dword11 = (*count - 1) << 16 | (*count - 1);
+    uint32_t granted;
+    if (!admin_command(controller, &command, &granted)) {
+        handle_error("NVMe controller rejected the number of queues\n");
+        return false;
+    }
+    uint32_t granted_sq = (granted & 0xFFFF) + 1;
+    uint32_t granted_cq = (granted >> 16) + 1;
+    if (granted_sq < *count) *count = granted_sq;
+    if (granted_cq < *count) *count = granted_cq;
+    return true;
+}
+
+static bool restart_controller(nvme_controller_t *controller) {
+    // The queues are emptied even if the controller does not stop, so nothing it completes
+    // afterwards is mistaken for a request that has since been failed
+    controller->registers->configuration &= ~NVME_CC_ENABLE;
+    bool stopped = wait_ready(controller, false);
+    reset_queue(&controller->admin);
+    for (uint32_t i = 0; i < controller->io_queue_count; i++) {
+        reset_queue(&controller->io_queues[i]);
+    }
+    if (!stopped) {
+        handle_error("NVMe controller did not reset\n");
+        return false;
+    }
+    if (!enable_controller(controller)) {
+        return false;
+    }
+
+    // The queues were granted once already, so the controller grants them again
+    uint32_t count = controller->io_queue_count;
+    if (!request_queues(controller, &count) || count < controller->io_queue_count) {
+        return false;
+    }
+    for (uint32_t i = 0; i < controller->io_queue_count; i++) {
+        if (!create_io_queue(controller, &controller->io_queues[i])) return false;
+    }
+    return true;
+}
+
+static bool alloc_queue(nvme_controller_t *controller, nvme_queue_t *queue, uint16_t id,
+    uint16_t depth) {
+    queue->id = id;
+    queue->depth = depth;
+    queue->sq = dma_alloc(depth * sizeof(nvme_command_t));
+    queue->cq = dma_alloc(depth * sizeof(nvme_completion_t));
+    queue->requests = malloc(depth * sizeof(io_request_t *));
+    queue->aborted = malloc(depth * sizeof(io_request_t *));
+    queue->free_ids = malloc(depth * sizeof(uint16_t));
+    queue->command_pages = dma_alloc(depth * NVME_PAGE_SIZE);
+    if (queue->sq == NULL || queue->cq == NULL || queue->requests == NULL
+        || queue->aborted == NULL || queue->free_ids == NULL || queue->command_pages == NULL) {
+        handle_error("Could not allocate NVMe queue\n");
+        return false;
+    }
+
+    uint8_t *doorbells = (uint8_t *) controller->registers + 0x1000;
+    queue->sq_doorbell = (uint32_t *) (doorbells + (2 * id) * controller->doorbell_stride);
+    queue->cq_doorbell = (uint32_t *) (doorbells + (2 * id + 1) * controller->doorbell_stride);
+    reset_queue(queue);
+    return true;
+}
+
+static void reset_queue(nvme_queue_t *queue) {
+    queue->sq_tail = 0;
+    queue->cq_head = 0;
+    queue->phase = 1;
+    // Stale entries would otherwise match the phase again after it wraps
+    memset(queue->cq, 0, queue->depth * sizeof(nvme_completion_t));
+
+    // Hand out low identifiers first, keeping their command pages warm
+    queue->free_count = queue->depth - 1;
+    for (uint16_t i = 0; i < queue->free_count; i++) {
+        queue->free_ids[i] = queue->free_count - 1 - i;
+        queue->requests[i] = NULL;
+    }
+}
+
+static bool admin_command(nvme_controller_t *controller, nvme_command_t *command,
+    uint32_t *result) {
+    nvme_queue_t *admin = &controller->admin;
+    push_command(admin, command);
+
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) NVME_ADMIN_TIMEOUT_MS * 1000000);
+    volatile nvme_completion_t *completion = &admin->cq[admin->cq_head];
+    while ((completion->status & 0x1) != admin->phase) {
+        if (timer_ticks() > deadline) return false;
+    }
+
+    if (result != NULL) *result = completion->result;
+    bool success = ((completion->status >> 1) & 0x7FF) == 0;
+
+    admin->cq_head++;
+    if (admin->cq_head == admin->depth) {
+        admin->cq_head = 0;
+        admin->phase ^= 1;
+    }
+    *admin->cq_doorbell = admin->cq_head;
+    return success;
+}
+
+static bool identify(nvme_controller_t *controller) {
+    uint8_t *data = dma_alloc(NVME_PAGE_SIZE);
+    if (data == NULL) {
+        handle_error("Could not allocate NVMe identify buffer\n");
+        return false;
+    }
+
+    nvme_command_t command = {0};
+    command.command_dword0 = NVME_ADMIN_IDENTIFY;
+    command.data_pointer[0] = (uint64_t) data;
+    command.command_dword10 = 1; // Controller
+    if (!admin_command(controller, &command, NULL)) {
+        dma_free(data, NVME_PAGE_SIZE);
+        handle_error("NVMe identify controller failed\n");
+        return false;
+    }
+
+    uint8_t mdts = data[77];
+    uint16_t oncs = *(uint16_t *) &data[520];
+    bool volatile_cache = data[525] & 0x1;
+    uint32_t sgls = *(uint32_t *) &data[536];
+    controller->sgl = (sgls & 0x3) != 0;
+    controller->device.max_segments = controller->sgl ? NVME_MAX_SEGMENTS : 0;
+
+    controller->device.capabilities = BLK_CAP_FUA;
+    if (volatile_cache) controller->device.capabilities |= BLK_CAP_FLUSH;
+    if (oncs & (1 << 2)) controller->device.capabilities |= BLK_CAP_DISCARD;
+
+    // Only the first namespace is exposed
+    controller->namespace_id = 1;
+    memset(data, 0, NVME_PAGE_SIZE);
+    command.namespace_id = controller->namespace_id;
+    command.command_dword10 = 0; // Namespace
+    if (!admin_command(controller, &command, NULL)) {
+        dma_free(data, NVME_PAGE_SIZE);
+        handle_error("NVMe identify namespace failed\n");
+        return false;
+    }
+
+    uint64_t sector_count = *(uint64_t *) &data[0];
+    uint8_t format = data[26] & 0xF;
+    uint32_t format_descriptor = *(uint32_t *) &data[128 + 4 * format];
+    uint8_t sector_shift = (format_descriptor >> 16) & 0xFF;
+    dma_free(data, NVME_PAGE_SIZE);
+
+    if (sector_count == 0 || sector_shift < 9 || sector_shift > 12) {
+        handle_error("NVMe namespace 1 is not usable\n");
+        return false;
+    }
+    controller->device.sector_count = sector_count;
+    controller->device.sector_size = 1 << sector_shift;
+
+    // MDTS is a power of two of the minimum page size, with 0 meaning no limit
+    uint64_t max_bytes = (uint64_t) NVME_MAX_TRANSFER_PAGES * NVME_PAGE_SIZE;
+    if (mdts != 0 && ((uint64_t) NVME_PAGE_SIZE << mdts) < max_bytes) {
+        max_bytes = (uint64_t) NVME_PAGE_SIZE << mdts;
+    }
+    controller->device.max_transfer = max_bytes >> sector_shift;
+    return true;
+}
+
+static bool create_io_queue(nvme_controller_t *controller, nvme_queue_t *queue) {
+    // Completions are polled for now, so interrupts stay off. The vector is still set to the
+    // queue number so enabling them later only needs IEN
+    nvme_command_t command = {0};
+    command.command_dword0 = NVME_ADMIN_CREATE_CQ;
+    command.data_pointer[0] = (uint64_t) queue->cq;
+    command.command_dword10 = (queue->depth - 1) << 16 | queue->id;
+    command.command_dword11 = (uint32_t) queue->id << 16 | 0x1; // Physically contiguous
+    if (!admin_command(controller, &command, NULL)) {
+        handle_error("Could not create NVMe completion queue\n");
+        return false;
+    }
+
+    memset(&command, 0, sizeof(nvme_command_t));
+    command.command_dword0 = NVME_ADMIN_CREATE_SQ;
+    command.data_pointer[0] = (uint64_t) queue->sq;
+    command.command_dword10 = (queue->depth - 1) << 16 | queue->id;
+    command.command_dword11 = (uint32_t) queue->id << 16 | 0x1;
+    if (!admin_command(controller, &command, NULL)) {
+        handle_error("Could not create NVMe submission queue\n");
+        return false;
+    }
+    return true;
+}
+
+static void build_data_pointer(nvme_controller_t *controller, nvme_queue_t *queue,
+    uint16_t command_id, nvme_command_t *command, io_segment_t *segments, uint32_t count) {
+    // Memory is identity mapped and contiguous, so one data block descriptor covers a segment
+    if (controller->sgl) {
+        nvme_sgl_descriptor_t *descriptor = (nvme_sgl_descriptor_t *) command->data_pointer;
+        command->command_dword0 |= 1 << 14;
+        if (count == 1) {
+            descriptor->address = (uint64_t) segments[0].buffer;
+            descriptor->length = segments[0].length;
+            descriptor->type = 0;
+            return;
+        }
+
+        // More than one segment goes in a list in the command's page, which the command points
+        // at with a last segment descriptor
+        nvme_sgl_descriptor_t *list =
+            (nvme_sgl_descriptor_t *) (queue->command_pages + command_id * NVME_PAGE_SIZE);
+        for (uint32_t i = 0; i < count; i++) {
+            memset(&list[i], 0, sizeof(nvme_sgl_descriptor_t));
+            list[i].address = (uint64_t) segments[i].buffer;
+            list[i].length = segments[i].length;
+        }
+        descriptor->address = (uint64_t) list;
+        descriptor->length = count * sizeof(nvme_sgl_descriptor_t);
+        descriptor->type = 0x30;
+        return;
+    }
+
+    // Without SGLs the device takes no scatter-gather requests, so there is a single segment
+    uint64_t address = (uint64_t) segments[0].buffer;
+    uint64_t bytes = segments[0].length;
+    command->data_pointer[0] = address;
+    uint64_t first = NVME_PAGE_SIZE - (address & (NVME_PAGE_SIZE - 1));
+    if (bytes <= first) return;
+
+    uint64_t next = address + first;
+    uint64_t remaining = bytes - first;
+    if (remaining <= NVME_PAGE_SIZE) {
+        command->data_pointer[1] = next;
+        return;
+    }
+
+    uint64_t *list = (uint64_t *) (queue->command_pages + command_id * NVME_PAGE_SIZE);
+    uint32_t entries = 0;
+    while (remaining > 0) {
+        list[entries++] = next;
+        next += NVME_PAGE_SIZE;
+        remaining = remaining > NVME_PAGE_SIZE ? remaining - NVME_PAGE_SIZE : 0;
+    }
+    command->data_pointer[1] = (uint64_t) list;
+}
+
+static void push_command(nvme_queue_t *queue, nvme_command_t *command) {
+    queue->sq[queue->sq_tail] = *command;
+    queue->sq_tail++;
+    if (queue->sq_tail == queue->depth) queue->sq_tail = 0;
+    // The command must be in memory before the controller is told to fetch it
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *queue->sq_doorbell = queue->sq_tail;
+}
+
+static uint32_t reap_queue(nvme_queue_t *queue) {
+    uint64_t now = 0;
+    uint32_t completed = 0;
+
+    for (;;) {
+        volatile nvme_completion_t *completion = &queue->cq[queue->cq_head];
+        uint16_t status = completion->status;
+        if ((status & 0x1) != queue->phase) break;
+
+        uint16_t command_id = completion->command_id;
+        queue->cq_head++;
+        if (queue->cq_head == queue->depth) {
+            queue->cq_head = 0;
+            queue->phase ^= 1;
+        }
+
+        io_request_t *request = queue->requests[command_id];
+        queue->requests[command_id] = NULL;
+        queue->free_ids[queue->free_count++] = command_id;
+        if (request == NULL) continue;
+
+        if (now == 0) now = timer_ticks();
+        request->success = ((status >> 1) & 0x7FF) == 0;
+        request->complete_ticks = now;
+        blk_complete(request);
+        completed++;
+    }
+
+    // One doorbell write releases every entry consumed above
+    if (completed > 0) *queue->cq_doorbell = queue->cq_head;
+    return completed;
+}
+
+static bool nvme_submit(blk_device_t *device, io_request_t *request) {
+    nvme_controller_t *controller = device->driver;
+    nvme_queue_t *queue = &controller->io_queues[0];
+    if (controller->io_queue_count > 1) {
+        queue = &controller->io_queues[cpu_current() % controller->io_queue_count];
+    }
+    if (queue->free_count == 0) return false;
+
+    uint16_t command_id = queue->free_ids[--queue->free_count];
+    nvme_command_t command = {0};
+    command.namespace_id = controller->namespace_id;
+
+    switch (request->op) {
+        case IO_OP_READ:
+        case IO_OP_WRITE: {
+            command.command_dword0 = request->op == IO_OP_READ ? NVME_CMD_READ : NVME_CMD_WRITE;
+            command.command_dword10 = request->lba;
+            command.command_dword11 = request->lba >> 32;
+            command.command_dword12 = request->count - 1;
+            if (request->flags & IO_FLAG_FUA) command.command_dword12 |= 1 << 30;
+            io_segment_t single;
+            uint32_t segment_count;
+            io_segment_t *segments = blk_segments(request, &single, &segment_count);
+            build_data_pointer(controller, queue, command_id, &command, segments, segment_count);
+            break;
+        }
+        case IO_OP_FLUSH:
+            command.command_dword0 = NVME_CMD_FLUSH;
+            break;
+        case IO_OP_DISCARD: {
+            nvme_dsm_range_t *range =
+                (nvme_dsm_range_t *) (queue->command_pages + command_id * NVME_PAGE_SIZE);
+            range->attributes = 0;
+            range->length = request->count;
+            range->lba = request->lba;
+            command.command_dword0 = NVME_CMD_DSM;
+            command.data_pointer[0] = (uint64_t) range;
+            command.command_dword10 = 0;      // One range
+            command.command_dword11 = 1 << 2; // Deallocate
+            break;
+        }
+    }
+    command.command_dword0 |= (uint32_t) command_id << 16;
+
+    queue->requests[command_id] = request;
+    request->submit_ticks = timer_ticks();
+    push_command(queue, &command);
+    return true;
+}
+
+static uint32_t nvme_poll(blk_device_t *device) {
+    nvme_controller_t *controller = device->driver;
+    uint32_t completed = 0;
+    for (uint32_t i = 0; i < controller->io_queue_count; i++) {
+        uint32_t reaped = reap_queue(&controller->io_queues[i]);
+        // Each batch is counted against the queue's MSI-X entry, though no interrupt was raised
+        if (reaped > 0 && controller->msix.entries > 0) {
+            pci_count_poll(controller->msix.first_vector + i + 1);
+        }
+        completed += reaped;
+    }
+    return completed;
+}
+
+static void nvme_abort(blk_device_t *device) {
+    nvme_controller_t *controller = device->driver;
+
+    // Resetting the queues forgets their requests, and callbacks may submit again, so every
+    // request is taken off before the reset and failed after it
+    uint32_t counts[NVME_MAX_IO_QUEUES];
+    for (uint32_t i = 0; i < controller->io_queue_count; i++) {
+        nvme_queue_t *queue = &controller->io_queues[i];
+        counts[i] = 0;
+        for (uint16_t id = 0; id < queue->depth; id++) {
+            if (queue->requests[id] != NULL) queue->aborted[counts[i]++] = queue->requests[id];
+        }
+    }
+
+    if (!restart_controller(controller)) {
+        handle_error("NVMe controller did not come back after a reset\n");
+    }
+
+    uint64_t now = timer_ticks();
+    for (uint32_t i = 0; i < controller->io_queue_count; i++) {
+        nvme_queue_t *queue = &controller->io_queues[i];
+        for (uint32_t j = 0; j < counts[i]; j++) {
+            queue->aborted[j]->success = false;
+            queue->aborted[j]->complete_ticks = now;
+            blk_complete(queue->aborted[j]);
+        }
+    }
+}
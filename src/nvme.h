@@ -0,0 +1,192 @@
+#ifndef _NVME_H_
+#define _NVME_H_
+
+#define NVME_ADMIN_QUEUE_DEPTH 32
+#define NVME_IO_QUEUE_DEPTH 64
+#define NVME_MAX_IO_QUEUES 64
+#define NVME_MAX_TRANSFER_PAGES 256        // One PRP list page per command covers this
+#define NVME_PAGE_SIZE 4096
+#define NVME_MAX_SEGMENTS 64               // SGL descriptors in one command page
+#define NVME_ADMIN_TIMEOUT_MS 5000
+
+#define NVME_CC_ENABLE 0x1
+#define NVME_CSTS_READY 0x1
+#define NVME_CSTS_FATAL 0x2
+
+#define NVME_ADMIN_CREATE_SQ 0x01
+#define NVME_ADMIN_CREATE_CQ 0x05
+#define NVME_ADMIN_IDENTIFY 0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_CMD_FLUSH 0x00
+#define NVME_CMD_WRITE 0x01
+#define NVME_CMD_READ 0x02
+#define NVME_CMD_DSM 0x09
+
+#define NVME_FEATURE_NUMBER_OF_QUEUES 0x07
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief A submission queue and the completion queue it posts to
+ */
+typedef struct nvme_queue {
+    uint16_t id;
+    uint16_t depth;
+    nvme_command_t *sq;
+    nvme_completion_t *cq;
+    volatile uint32_t *sq_doorbell;
+    volatile uint32_t *cq_doorbell;
+    uint16_t sq_tail;
+    uint16_t cq_head;
+    uint8_t phase;
+    /**
+     * @brief Request using each command identifier, and the identifiers not in use
+     */
+    io_request_t **requests;
+    uint16_t *free_ids;
+    uint16_t free_count;
+    /**
+     * @brief Requests taken off the queue by nvme_abort, failed once the queues are back
+     */
+    io_request_t **aborted;
+    /**
+     * @brief One page per command identifier, holding its PRP list or DSM range
+     */
+    uint8_t *command_pages;
+} nvme_queue_t;
+
+typedef struct nvme_controller {
+    blk_device_t device;
+    pci_header_0_t *pci_header;
+    nvme_registers_t *registers;
+    uint32_t doorbell_stride;
+    uint32_t timeout_ms;
+    uint32_t namespace_id;
+    /**
+     * @brief True if the controller accepts SGLs for I/O commands, which avoid PRP lists
+     */
+    bool sgl;
+    nvme_queue_t admin;
+    /**
+     * @brief One I/O queue pair per processor, up to what the controller allows. Processor n
+     * submits to queue n modulo the queue count
+     */
+    nvme_queue_t *io_queues;
+    uint32_t io_queue_count;
+    /**
+     * @brief Entry 0 for the admin queue and entry n for I/O queue n, no entries without MSI-X
+     */
+    pci_msix_t msix;
+} nvme_controller_t;
+
+/**
+ * @brief Initialises every NVMe controller in a list of PCI devices, registering the first
+ * namespace of each as a block device named "nvmeN"
+ * 
+ * @return True if at least one controller was initialised
+ */
+bool init_nvme(pci_device_list_t device_list);
+
+/**
+ * @brief Resets and enables the controller, creating the admin queue and I/O queue pairs
+ */
+static bool init_controller(nvme_controller_t *controller);
+
+/**
+ * @brief Gives each completion queue its own MSI-X entry aimed at the processor that submits to
+ * it. Completions are polled, so the queues keep their interrupts off and the entries stay masked
+ */
+static void init_msix(nvme_controller_t *controller, pci_device_list_t *list, uint32_t index);
+
+/**
+ * @brief Waits for CSTS.RDY to reach the given value
+ */
+static bool wait_ready(nvme_controller_t *controller, bool ready);
+
+/**
+ * @brief Points the controller at the admin queue, then enables it and waits until it is ready
+ */
+static bool enable_controller(nvme_controller_t *controller);
+
+/**
+ * @brief Asks for count I/O queue pairs, lowering count to the number the controller grants
+ */
+static bool request_queues(nvme_controller_t *controller, uint32_t *count);
+
+/**
+ * @brief Disables the controller, which deletes every queue and stops it touching their buffers,
+ * then enables it again and recreates the I/O queues empty
+ */
+static bool restart_controller(nvme_controller_t *controller);
+
+/**
+ * @brief Allocates a queue pair and points it at its doorbells
+ */
+static bool alloc_queue(nvme_controller_t *controller, nvme_queue_t *queue, uint16_t id,
+    uint16_t depth);
+
+/**
+ * @brief Empties a queue pair, as the controller sees it after a reset, freeing every identifier
+ */
+static void reset_queue(nvme_queue_t *queue);
+
+/**
+ * @brief Issues an admin command and polls for its completion
+ * 
+ * @param result Output for dword 0 of the completion, may be NULL
+ */
+static bool admin_command(nvme_controller_t *controller, nvme_command_t *command,
+    uint32_t *result);
+
+/**
+ * @brief Sends the identify commands to find the namespace geometry and controller features
+ */
+static bool identify(nvme_controller_t *controller);
+
+/**
+ * @brief Creates the I/O completion and submission queues of a queue pair
+ */
+static bool create_io_queue(nvme_controller_t *controller, nvme_queue_t *queue);
+
+/**
+ * @brief Fills in the data pointer of a command. With SGLs a single segment gets one data block
+ * descriptor and several get a descriptor list in the command's page. Otherwise the one segment
+ * is described by PRP entries, with a PRP list in the command's page past two pages
+ */
+static void build_data_pointer(nvme_controller_t *controller, nvme_queue_t *queue,
+    uint16_t command_id, nvme_command_t *command, io_segment_t *segments, uint32_t count);
+
+/**
+ * @brief Copies a command to the tail of the submission queue and rings its doorbell
+ */
+static void push_command(nvme_queue_t *queue, nvme_command_t *command);
+
+/**
+ * @brief Completes every new entry in the completion queue
+ * 
+ * @return Number of requests completed
+ */
+static uint32_t reap_queue(nvme_queue_t *queue);
+
+/**
+ * @brief Issues a request on the queue pair of the current processor
+ * 
+ * @return False if that queue is full
+ */
+static bool nvme_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Completes finished requests on every queue pair through blk_complete
+ */
+static uint32_t nvme_poll(blk_device_t *device);
+
+/**
+ * @brief Resets the controller and fails every request that was on its queues
+ */
+static void nvme_abort(blk_device_t *device);
+
+#endif
@@ -4,20 +4,34 @@
 #include "defs.h"
 #include "types.h"
 #include "std.h"
+#include "timer.h"
+#include "cpu.h"
 #include "pci.h"
 
-// Keep track of the initial locations of the PCI header space
-static uint8_t *base_address;
-static uint8_t start_bus_no;
+// The configuration space window of every MCFG entry
+static pci_segment_t segments[PCI_MAX_SEGMENTS];
+static uint32_t segment_count = 0;
 
-// Keep a list of all devices
-static size_t device_list_size = 0;
-static pci_header_t **all_devices = NULL;
+// Keep a table of all devices, grown geometrically so enumeration stays linear
+static pci_device_list_t devices;
+static uint32_t table_growths = 0;
+
+// Interrupt vectors not yet given to a device
+static uint16_t next_vector = PCI_FIRST_VECTOR;
+
+// The processor each programmed vector is aimed at, and what is aimed at each processor
+static uint8_t vector_cpus[256];
+static bool vector_steered[256];
+static pci_cpu_interrupts_t cpu_interrupts[CPU_MAX];
+
+// Configuration space reads, each an uncached MMIO transaction
+static uint64_t mmio_reads = 0;
 
 pci_device_list_t init_pci(mcfg_t *mcfg) {
     uint32_t no_entries = (mcfg->length-44)/16; // Fixed header is 44 bytes, entry length 16
     mcfg_entry_t *entry_ptr = (mcfg_entry_t *) &mcfg->entry;
     // Each entry to the MCFG contains a PCI root
+    segment_count = 0;
     for (size_t i = 0; i < no_entries; i++) {
         mcfg_entry_t *entry = &entry_ptr[i];
 
@@ -30,10 +44,27 @@ pci_device_list_t init_pci(mcfg_t *mcfg) {
             printf("\n");
         }
 
-        base_address = (uint8_t *) entry->base_address;
-        start_bus_no = entry->start_bus_no;
+        if (entry->end_bus_no < entry->start_bus_no) {
+            handle_error("MCFG entry has an empty bus range\n");
+            continue;
+        }
+        if (segment_count == PCI_MAX_SEGMENTS) {
+            handle_error("Too many MCFG entries, ignoring the rest\n");
+            break;
+        }
+        pci_segment_t *segment = &segments[segment_count++];
+        memset(segment, 0, sizeof(pci_segment_t));
+        segment->base_address = (uint8_t *) entry->base_address;
+        segment->number = entry->pci_segment_group_number;
+        segment->start_bus = entry->start_bus_no;
+        segment->end_bus = entry->end_bus_no;
+    }
 
-        check_all_buses();
+    // Every processor takes buses when there are several, otherwise the buses are walked in order
+    if (cpu_count() == 1 || !check_all_buses_parallel(segments, segment_count)) {
+        for (uint32_t i = 0; i < segment_count; i++) {
+            check_all_buses(&segments[i]);
+        }
     }
 
     if (BOOT_VERBOSE & PCI_VERBOSE) {
@@ -41,10 +72,13 @@ pci_device_list_t init_pci(mcfg_t *mcfg) {
     }
 
     // Iterate over all the devices found
-    for (size_t i = 0; i < device_list_size; i++) {
-        pci_header_t *pci_header = all_devices[i];
-
+    for (size_t i = 0; i < devices.device_list_size; i++) {
         if (BOOT_VERBOSE & PCI_VERBOSE) {
+            // Decode from a copy of the header, read with 16 dword loads
+            uint32_t shadow[PCI_HEADER_BYTES / 4];
+            pci_read_config(devices.all_devices[i], 0, PCI_HEADER_BYTES, shadow);
+            pci_header_t *pci_header = (pci_header_t *) shadow;
+
             printf("\nDevice found:\n");
             printf("Device ID: %x\n", pci_header->device_id);
             printf("Vendor ID: %x\n", pci_header->vendor_id);
@@ -152,104 +186,832 @@ pci_device_list_t init_pci(mcfg_t *mcfg) {
         printf("PCI loading complete\n\n");
     }
 
-    pci_device_list_t device_list = {all_devices, device_list_size};
+    return devices;
+}
 
-    return device_list;
+bool enable_msi(const pci_device_list_t *list, uint32_t index, uint8_t vector) {
+    uint8_t offset = list->capabilities[index].msi;
+    if (offset == 0) {
+        handle_error("Device has no MSI capability\n");
+        return false;
+    }
+    pci_header_t *header = list->all_devices[index];
+
+    // Message control is the upper half of the capability's first dword. A 64-bit capable function
+    // has the upper address dword before the data, and with per-vector masking the mask bits follow
+    uint32_t first = pci_read_config32(header, offset);
+    uint16_t control = first >> 16;
+    uint16_t data_offset = offset + ((control & 0x80) ? 0xC : 0x8);
+    pci_write_config32(header, offset + 4, PCI_MSI_ADDRESS | cpu_apic_id(cpu_current()) << 12);
+    if (control & 0x80) pci_write_config32(header, offset + 8, 0);
+    pci_write_config32(header, data_offset, vector);
+    steer_vector(vector, cpu_current());
+    if (control & 0x100) {
+        uint32_t mask = pci_read_config32(header, data_offset + 4);
+        pci_write_config32(header, data_offset + 4, mask & ~0x1);
+    }
+
+    // A single message, then INTx off. Status bits are cleared by writing 1, so only the command
+    // half of its dword is written back
+    control = (control & ~0x70) | 0x1;
+    pci_write_config32(header, offset, (uint32_t) control << 16 | (first & 0xFFFF));
+    uint32_t command = pci_read_config32(header, 0x4) & 0xFFFF;
+    pci_write_config32(header, 0x4, command | PCI_COMMAND_INTX_DISABLE);
+    return true;
 }
 
-bool enable_msi(pci_header_0_t *header) {
-    // TODO handle MSI-X
-    if (!(header->status & 0x10)) {
-        handle_error("Capability reading for this device is disabled\n");
+bool pci_enable_msix(const pci_device_list_t *list, uint32_t index, uint16_t entries,
+    const uint32_t *cpus, pci_msix_t *msix) {
+    uint8_t offset = list->capabilities[index].msix;
+    if (offset == 0) {
+        handle_error("Device has no MSI-X capability\n");
+        return false;
+    }
+    pci_header_t *header = list->all_devices[index];
+    uint32_t first = pci_read_config32(header, offset);
+    uint16_t control = first >> 16;
+    if (entries == 0 || entries > (control & 0x7FF) + 1) {
+        handle_error("Device has too few MSI-X entries\n");
         return false;
     }
-    void *capabilities_pointer = header->capabilities_pointer & 0xFC; // All but last 2 bits
-    pci_msi_capabilities_t *capabilities = (uint32_t) header + (uint32_t) capabilities_pointer;
-    uint8_t first_id = capabilities->id;
-    bool msi_found = false;
 
-    if (first_id == PCI_CAP_MSI) {
-        msi_found = true;
-    } else {
-        capabilities_pointer = capabilities->next & 0xFC;
-        capabilities = (uint32_t) header + (uint32_t) capabilities_pointer;
+    // The table and pending bits each sit at an offset into the BAR named by the low 3 bits
+    uint32_t table_location = pci_read_config32(header, offset + 4);
+    uint32_t pending_location = pci_read_config32(header, offset + 8);
+    uint64_t table_bar = (table_location & 0x7) < 6
+        ? pci_bar_address((pci_header_0_t *) header, table_location & 0x7) : 0;
+    uint64_t pending_bar = (pending_location & 0x7) < 6
+        ? pci_bar_address((pci_header_0_t *) header, pending_location & 0x7) : 0;
+    if (table_bar == 0 || pending_bar == 0) {
+        handle_error("MSI-X table is not in memory space\n");
+        return false;
+    }
 
-        while (capabilities->id != first_id) {
-            if (capabilities->id == PCI_CAP_MSI) {
-                msi_found = true;
-                break;
+    uint8_t vector = pci_allocate_vectors(entries);
+    if (vector == 0) {
+        handle_error("Out of interrupt vectors\n");
+        return false;
+    }
+    msix->header = header;
+    msix->table = (volatile uint32_t *) (table_bar + (table_location & ~0x7));
+    msix->pending = (volatile uint64_t *) (pending_bar + (pending_location & ~0x7));
+    msix->offset = offset;
+    msix->entries = entries;
+    msix->first_vector = vector;
+
+    // Memory space has to be on to reach the table. The whole function stays masked while the
+    // entries are written, and each entry stays masked after
+    uint32_t command = pci_read_config32(header, 0x4) & 0xFFFF;
+    pci_write_config32(header, 0x4, command | PCI_COMMAND_INTX_DISABLE | 0x2);
+    control |= PCI_MSIX_ENABLE | PCI_MSIX_FUNCTION_MASK;
+    pci_write_config32(header, offset, (uint32_t) control << 16 | (first & 0xFFFF));
+    for (uint16_t entry = 0; entry < entries; entry++) {
+        volatile uint32_t *words = msix->table + entry * PCI_MSIX_ENTRY_BYTES / 4;
+        uint32_t cpu = cpus != NULL ? cpus[entry] : entry % cpu_count();
+        words[3] |= PCI_MSIX_MASKED;
+        words[0] = PCI_MSI_ADDRESS | cpu_apic_id(cpu) << 12;
+        words[1] = 0;
+        words[2] = vector + entry;
+        steer_vector(vector + entry, cpu);
+    }
+    control &= ~PCI_MSIX_FUNCTION_MASK;
+    pci_write_config32(header, offset, (uint32_t) control << 16 | (first & 0xFFFF));
+    return true;
+}
+
+void pci_msix_mask(pci_msix_t *msix, uint16_t entry) {
+    volatile uint32_t *words = msix->table + entry * PCI_MSIX_ENTRY_BYTES / 4;
+    words[3] |= PCI_MSIX_MASKED;
+    // Reading the entry back makes sure the write has reached the device
+    (void) words[3];
+}
+
+void pci_msix_unmask(pci_msix_t *msix, uint16_t entry) {
+    volatile uint32_t *words = msix->table + entry * PCI_MSIX_ENTRY_BYTES / 4;
+    words[3] &= ~PCI_MSIX_MASKED;
+}
+
+bool pci_msix_pending(pci_msix_t *msix, uint16_t entry) {
+    return msix->pending[entry / 64] >> (entry % 64) & 0x1;
+}
+
+bool pci_set_msi_affinity(const pci_device_list_t *list, uint32_t index, uint32_t cpu) {
+    uint8_t offset = list->capabilities[index].msi;
+    pci_header_t *header = list->all_devices[index];
+    uint16_t control = offset == 0 ? 0 : pci_read_config32(header, offset) >> 16;
+    if (!(control & 0x1)) {
+        handle_error("MSI is not enabled on the device\n");
+        return false;
+    }
+
+    // The lower address dword holds the destination, so one write moves the message
+    uint16_t data_offset = offset + ((control & 0x80) ? 0xC : 0x8);
+    pci_write_config32(header, offset + 4, PCI_MSI_ADDRESS | cpu_apic_id(cpu) << 12);
+    steer_vector(pci_read_config32(header, data_offset) & 0xFF, cpu);
+    return true;
+}
+
+void pci_set_msix_affinity(pci_msix_t *msix, uint16_t entry, uint32_t cpu) {
+    volatile uint32_t *words = msix->table + entry * PCI_MSIX_ENTRY_BYTES / 4;
+    bool masked = words[3] & PCI_MSIX_MASKED;
+    if (!masked) pci_msix_mask(msix, entry);
+    words[0] = PCI_MSI_ADDRESS | cpu_apic_id(cpu) << 12;
+    if (!masked) pci_msix_unmask(msix, entry);
+    steer_vector(msix->first_vector + entry, cpu);
+}
+
+uint32_t pci_vector_cpu(uint8_t vector) {
+    return vector_cpus[vector];
+}
+
+void pci_count_interrupt(uint8_t vector) {
+    pci_cpu_interrupts_t *target = &cpu_interrupts[vector_cpus[vector]];
+    target->interrupts++;
+    if (cpu_current() != vector_cpus[vector]) target->remote++;
+}
+
+void pci_count_poll(uint8_t vector) {
+    pci_cpu_interrupts_t *target = &cpu_interrupts[vector_cpus[vector]];
+    target->polled++;
+    if (cpu_current() != vector_cpus[vector]) target->polled_remote++;
+}
+
+void pci_print_interrupts() {
+    for (uint32_t cpu = 0; cpu < cpu_count(); cpu++) {
+        pci_cpu_interrupts_t *counts = &cpu_interrupts[cpu];
+        if (counts->vectors == 0) continue;
+        printf("irq,%d,%d,%d,%d,%d\n", (uint64_t) cpu, (uint64_t) cpu_apic_id(cpu),
+            (uint64_t) counts->vectors, counts->interrupts, counts->remote);
+        printf("poll,%d,%d,%d,%d,%d\n", (uint64_t) cpu, (uint64_t) cpu_apic_id(cpu),
+            (uint64_t) counts->vectors, counts->polled, counts->polled_remote);
+    }
+}
+
+uint8_t pci_allocate_vectors(uint16_t count) {
+    if (count == 0 || next_vector + count > PCI_LAST_VECTOR + 1) return 0;
+    uint8_t first = next_vector;
+    next_vector += count;
+    return first;
+}
+
+uint64_t pci_bar_address(pci_header_0_t *header, uint8_t bar) {
+    uint16_t offset = PCI_BAR_OFFSET + bar * 4;
+    uint32_t low = pci_read_config32(header, offset);
+
+    if (low & 0x1) return 0; // I/O space
+    uint64_t address = low & ~0xF;
+    if (((low >> 1) & 0x3) == 0x2 && bar < 5) { // 64-bit memory BAR
+        address |= (uint64_t) pci_read_config32(header, offset + 4) << 32;
+    }
+    return address;
+}
+
+uint8_t pci_find_capability(pci_header_0_t *header, uint8_t id, uint8_t offset) {
+    // Status is the upper half of the dword holding the command register
+    if (!(pci_read_config32(header, 0x4) >> 16 & PCI_STATUS_CAPABILITIES)) return 0;
+
+    // Each capability starts with a dword holding its ID and the offset of the next one
+    uint8_t next = offset == 0 ? pci_read_config32(header, PCI_CAPABILITIES_OFFSET) & 0xFF
+        : pci_read_config32(header, offset) >> 8 & 0xFF;
+
+    // Capabilities live above the 64 byte header, so a valid list has at most 48 entries
+    for (uint8_t i = 0; i < PCI_MAX_CAPABILITIES; i++) {
+        next &= 0xFC;
+        if (next < PCI_HEADER_BYTES) return 0;
+        uint32_t capability = pci_read_config32(header, next);
+        if ((capability & 0xFF) == id) return next;
+        next = capability >> 8 & 0xFF;
+    }
+    return 0;
+}
+
+bool pci_tune_pcie(const pci_device_list_t *list) {
+    size_t count = list->device_list_size;
+    if (count == 0) return true;
+    pci_pcie_node_t *nodes = malloc(count * sizeof(pci_pcie_node_t));
+    if (nodes == NULL) {
+        handle_error("Could not allocate PCIe tuning\n");
+        return false;
+    }
+
+    // Bridges come before everything behind them in the table, so one pass finds every parent.
+    // Only PCIe functions take part, the functions behind a conventional bridge have no PCIe link
+    uint32_t bus_bridges[256];
+    for (size_t i = 0; i < count; i++) {
+        if (i == 0 || list->segment[i] != list->segment[i - 1]) {
+            memset(bus_bridges, 0xFF, sizeof(bus_bridges));
+        }
+        pci_pcie_node_t *node = &nodes[i];
+        uint8_t offset = list->capabilities[i].pcie;
+        node->parent = PCI_NO_PARENT;
+        node->tuned = false;
+        if (offset == 0) continue;
+
+        pci_header_t *header = list->all_devices[i];
+        node->type = pci_read_config32(header, offset + PCI_EXP_CAPABILITIES) >> 20 & 0xF;
+        node->supported = pci_read_config32(header, offset + PCI_EXP_DEVICE_CAPABILITIES) & 0x7;
+        if (node->supported > PCI_EXP_MAX_SIZE) node->supported = PCI_EXP_MAX_SIZE;
+
+        uint32_t parent = bus_bridges[list->bus[i]];
+        if (parent != PCI_NO_PARENT && list->capabilities[parent].pcie != 0) {
+            node->parent = parent;
+            node->tuned = nodes[parent].tuned;
+        } else {
+            node->tuned = node->type == PCI_EXP_TYPE_ROOT_PORT;
+        }
+        if ((list->header_type[i] & 0x7F) == 1) {
+            uint32_t bus_numbers = pci_read_config32(header, PCI_BUS_NUMBERS_OFFSET);
+            uint8_t secondary_bus = bus_numbers >> 8 & 0xFF;
+            if (secondary_bus > list->bus[i]) bus_bridges[secondary_bus] = i;
+        }
+    }
+
+    // Children come after their parents, so walking backwards gathers each subtree's minimum into
+    // its root port before walking forwards hands it back down
+    for (size_t i = count; i-- > 0;) {
+        uint32_t parent = nodes[i].parent;
+        if (!nodes[i].tuned || parent == PCI_NO_PARENT) continue;
+        if (nodes[i].supported < nodes[parent].supported) {
+            nodes[parent].supported = nodes[i].supported;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        pci_pcie_node_t *node = &nodes[i];
+        if (!node->tuned) continue;
+        node->payload = node->supported;
+        if (node->parent != PCI_NO_PARENT && nodes[node->parent].payload < node->payload) {
+            node->payload = nodes[node->parent].payload;
+        }
+
+        // Status bits are cleared by writing 1, so only the control half is written back
+        pci_header_t *header = list->all_devices[i];
+        uint16_t offset = list->capabilities[i].pcie + PCI_EXP_DEVICE_CONTROL;
+        uint16_t control = pci_read_config32(header, offset) & 0xFFFF;
+        control = (control & ~0xE0) | node->payload << 5;
+        if (node->type == PCI_EXP_TYPE_ENDPOINT || node->type == PCI_EXP_TYPE_LEGACY_ENDPOINT) {
+            control = (control | PCI_EXP_RELAXED_ORDERING) & ~PCI_EXP_NO_SNOOP;
+            if (list->class_code[i] == 0x1) {
+                control = (control & ~0x7000) | PCI_EXP_MAX_SIZE << 12;
+            }
+        }
+        pci_write_config32(header, offset, control);
+    }
+
+    free(nodes);
+    return true;
+}
+
+void pci_print_links(const pci_device_list_t *list) {
+    static const char *speeds[] = {"?", "2.5", "5", "8", "16", "32", "64"};
+    for (size_t i = 0; i < list->device_list_size; i++) {
+        uint8_t offset = list->capabilities[i].pcie;
+        if (offset == 0) continue;
+        pci_header_t *header = list->all_devices[i];
+        uint8_t type = pci_read_config32(header, offset + PCI_EXP_CAPABILITIES) >> 20 & 0xF;
+        if (type == PCI_EXP_TYPE_INTEGRATED || type == PCI_EXP_TYPE_EVENT_COLLECTOR) continue;
+
+        uint16_t control = pci_read_config32(header, offset + PCI_EXP_DEVICE_CONTROL) & 0xFFFF;
+        uint32_t link_capabilities = pci_read_config32(header, offset + PCI_EXP_LINK_CAPABILITIES);
+        uint16_t link_status = pci_read_config32(header, offset + PCI_EXP_LINK_CONTROL) >> 16;
+        uint8_t speed = link_status & 0xF;
+        uint8_t max_speed = link_capabilities & 0xF;
+        if (speed > 6) speed = 0;
+        if (max_speed > 6) max_speed = 0;
+        printf("pcie,%x:%02x:%02x.%d,%x:%x,%x,%d,%d,%s,x%d,%s,x%d\n", (uint64_t) list->segment[i],
+            (uint64_t) list->bus[i], (uint64_t) list->device[i], (uint64_t) list->function[i],
+            (uint64_t) list->vendor_id[i], (uint64_t) list->device_id[i], (uint64_t) type,
+            (uint64_t) 128 << (control >> 5 & 0x7), (uint64_t) 128 << (control >> 12 & 0x7),
+            speeds[speed], (uint64_t) (link_status >> 4 & 0x3F), speeds[max_speed],
+            (uint64_t) (link_capabilities >> 4 & 0x3F));
+    }
+}
+
+uint32_t pci_read_config32(volatile void *header, uint16_t offset) {
+    mmio_reads++;
+    return *(volatile uint32_t *) ((volatile uint8_t *) header + offset);
+}
+
+void pci_read_config(volatile void *header, uint16_t offset, uint16_t length, void *shadow) {
+    volatile uint32_t *config = (volatile uint32_t *) ((volatile uint8_t *) header + offset);
+    uint32_t *output = shadow;
+    for (uint16_t i = 0; i < length / 4; i++) {
+        output[i] = config[i];
+    }
+    mmio_reads += length / 4;
+}
+
+void pci_write_config32(volatile void *header, uint16_t offset, uint32_t value) {
+    *(volatile uint32_t *) ((volatile uint8_t *) header + offset) = value;
+}
+
+uint64_t pci_mmio_reads() {
+    return mmio_reads;
+}
+
+bool pci_benchmark(uint32_t buses) {
+    if (buses == 0) buses = PCI_BENCH_BUSES;
+    if (buses > 255) buses = 255;
+
+    // Functions that are not written read as all ones, like an empty slot
+    size_t bytes = (size_t) (buses + 1) << 20;
+    uint8_t *ecam = malloc(bytes);
+    if (ecam == NULL) {
+        handle_error("Could not allocate synthetic PCI configuration space\n");
+        return false;
+    }
+    memset(ecam, 0xFF, bytes);
+
+    // Bus p holds the bridges to buses 31p + 1 to 31p + 31 in devices 1 to 31, so every bus is
+    // reached, and device 0 and any slot not taken by a bridge hold an endpoint. Device 0 of every
+    // bus but the first is a multi-function endpoint with all 8 functions
+    fake_function(ecam, 0, 0x6, 0x0); // Host bridge
+    for (uint32_t bus = 0; bus <= buses; bus++) {
+        for (uint32_t device = bus == 0 ? 1 : 0; device < 32; device++) {
+            uint8_t *config = ecam + (bus << 20 | device << 15);
+            uint32_t child = bus * 31 + device;
+            if (device == 0) {
+                for (uint32_t function = 0; function < 8; function++) {
+                    fake_function(config + (function << 12), function == 0 ? PCI_MULTI_FUNCTION : 0,
+                        0x2, 0x0);
+                }
+                continue;
             }
+            if (child > buses) {
+                fake_function(config, 0x0, 0x2, 0x0); // Ethernet controller
+                continue;
+            }
+            fake_function(config, 0x1, 0x6, 0x4);
+            pci_header_1_t *bridge = (pci_header_1_t *) config;
+            bridge->primary_bus_number = bus;
+            bridge->secondary_bus_number = child;
+            bridge->subordinate_bus_number = child;
+        }
+    }
+
+    // Swap the real devices out for the scans
+    pci_segment_t segment;
+    memset(&segment, 0, sizeof(pci_segment_t));
+    segment.base_address = ecam;
+    segment.end_bus = buses;
+    pci_device_list_t saved_devices = devices;
+    uint32_t saved_growths = table_growths;
+
+    uint64_t total_ticks = 0;
+    uint32_t growths = 0;
+    uint64_t reads = 0;
+    for (uint32_t run = 0; run < PCI_BENCH_RUNS; run++) {
+        memset(&devices, 0, sizeof(pci_device_list_t));
+        table_growths = 0;
+        uint64_t first_read = mmio_reads;
+        uint64_t start = timer_ticks();
+        check_all_buses(&segment);
+        total_ticks += timer_ticks() - start;
+        growths = table_growths;
+        reads = mmio_reads - first_read;
+        if (run + 1 < PCI_BENCH_RUNS) free(devices.all_devices);
+    }
+    size_t found = devices.device_list_size;
+
+    // Searching the table for every endpoint looks at each entry without touching the ECAM
+    pci_match_t match = {PCI_ANY, PCI_ANY, 0x2, 0x0, PCI_ANY, 0x0};
+    uint32_t endpoints = 0;
+    uint64_t start = timer_ticks();
+    for (uint32_t run = 0; run < PCI_BENCH_RUNS; run++) {
+        endpoints = pci_find(&devices, &match, NULL, 0);
+    }
+    uint64_t find_ticks = timer_ticks() - start;
+
+    // The same topology scanned by every processor has to come out in the same order
+    pci_device_list_t serial = devices;
+    uint64_t parallel_ticks = 0;
+    bool same = true;
+    for (uint32_t run = 0; run < PCI_BENCH_RUNS && same; run++) {
+        memset(&devices, 0, sizeof(pci_device_list_t));
+        start = timer_ticks();
+        if (!check_all_buses_parallel(&segment, 1)) {
+            handle_error("Could not allocate the parallel PCI scan\n");
+            same = false;
+            break;
+        }
+        parallel_ticks += timer_ticks() - start;
+        same = same_devices(&serial, &devices);
+        if (!same) handle_error("Parallel PCI scan found the devices in a different order\n");
+        free(devices.all_devices);
+    }
+    free(serial.all_devices);
+
+    devices = saved_devices;
+    table_growths = saved_growths;
+    free(ecam);
+    if (!same) return false;
+
+    uint64_t speedup_x100 = parallel_ticks == 0 ? 0 : total_ticks * 100 / parallel_ticks;
+    printf("pcibench,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d.%02d\n", (uint64_t) buses, (uint64_t) found,
+        ticks_to_ns(total_ticks / PCI_BENCH_RUNS) / 1000, (uint64_t) growths, reads,
+        (uint64_t) endpoints, ticks_to_ns(find_ticks / PCI_BENCH_RUNS), (uint64_t) cpu_count(),
+        ticks_to_ns(parallel_ticks / PCI_BENCH_RUNS) / 1000, speedup_x100 / 100,
+        speedup_x100 % 100);
+    return true;
+}
+
+uint32_t pci_find(const pci_device_list_t *list, const pci_match_t *match, uint32_t *matches,
+    uint32_t max_matches) {
+    uint32_t found = 0;
+    for (size_t first = 0; first < list->device_list_size; first += PCI_TABLE_LANES) {
+        // One bit per entry of this group of PCI_TABLE_LANES, cleared by each field that differs
+        uint32_t mask = 0xFFFF;
+        if (match->vendor_id != PCI_ANY) {
+            mask &= match_words(list->vendor_id + first, match->vendor_id);
+        }
+        if (match->device_id != PCI_ANY) {
+            mask &= match_words(list->device_id + first, match->device_id);
+        }
+        if (match->class_code != PCI_ANY) {
+            mask &= match_bytes(list->class_code + first, match->class_code, 0xFF);
+        }
+        if (match->subclass != PCI_ANY) {
+            mask &= match_bytes(list->subclass + first, match->subclass, 0xFF);
+        }
+        if (match->prog_if != PCI_ANY) {
+            mask &= match_bytes(list->prog_if + first, match->prog_if, 0xFF);
+        }
+        if (match->header_type != PCI_ANY) {
+            mask &= match_bytes(list->header_type + first, match->header_type, 0x7F);
+        }
 
-            capabilities_pointer = capabilities->next & 0xFC;
-            capabilities = (uint32_t) header + (uint32_t) capabilities_pointer;
+        // Entries past the end are padding
+        size_t left = list->device_list_size - first;
+        if (left < PCI_TABLE_LANES) mask &= (1 << left) - 1;
+        while (mask != 0) {
+            uint32_t lane = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (found < max_matches) matches[found] = first + lane;
+            found++;
         }
     }
+    return found;
+}
+
+static void steer_vector(uint8_t vector, uint32_t cpu) {
+    if (vector_steered[vector]) cpu_interrupts[vector_cpus[vector]].vectors--;
+    vector_steered[vector] = true;
+    vector_cpus[vector] = cpu;
+    cpu_interrupts[cpu].vectors++;
+}
+
+static uint32_t match_bytes(const uint8_t *values, uint8_t wanted, uint8_t value_mask) {
+    pci_lanes_t lanes = *(const pci_unaligned_lanes_t *) values & value_mask;
+    pci_lanes_t equal = (pci_lanes_t) (lanes == wanted);
+    return __builtin_ia32_pmovmskb128((pci_mask_t) equal);
+}
+
+static uint32_t match_words(const uint16_t *values, uint16_t wanted) {
+    pci_word_lanes_t low = *(const pci_unaligned_word_lanes_t *) values;
+    pci_word_lanes_t high = *(const pci_unaligned_word_lanes_t *) (values + 8);
+    // Each comparison leaves 0 or -1 per word, which packs down to one byte per entry
+    pci_mask_t equal = __builtin_ia32_packsswb128((pci_short_lanes_t) (low == wanted),
+        (pci_short_lanes_t) (high == wanted));
+    return __builtin_ia32_pmovmskb128(equal);
+}
+
+static bool add_device(pci_header_t *header, pci_header_t *shadow,
+    const pci_capabilities_t *capabilities, uint16_t segment, uint8_t bus, uint8_t device,
+    uint8_t function) {
+    if (devices.device_list_size == devices.capacity && !grow_table(&devices)) return false;
 
-    if (!msi_found) {
-        handle_error("First capability entry is not MSI\n");
+    size_t i = devices.device_list_size++;
+    devices.all_devices[i] = header;
+    devices.capabilities[i] = *capabilities;
+    devices.segment[i] = segment;
+    devices.bus[i] = bus;
+    devices.device[i] = device;
+    devices.function[i] = function;
+    devices.vendor_id[i] = shadow->vendor_id;
+    devices.device_id[i] = shadow->device_id;
+    devices.class_code[i] = shadow->class_code;
+    devices.subclass[i] = shadow->subclass;
+    devices.prog_if[i] = shadow->prog_if;
+    devices.header_type[i] = shadow->header_type;
+    return true;
+}
+
+static bool grow_table(pci_device_list_t *list) {
+    size_t capacity = list->capacity == 0 ? PCI_TABLE_INITIAL : list->capacity * 2;
+    pci_device_list_t grown;
+    grown.device_list_size = list->device_list_size;
+    grown.capacity = capacity;
+    uint8_t *block = malloc(capacity * PCI_TABLE_ENTRY_BYTES);
+    if (block == NULL) {
+        handle_error("Could not allocate PCI device table\n");
         return false;
     }
+    memset(block, 0, capacity * PCI_TABLE_ENTRY_BYTES);
 
+    // Widest arrays first, so each stays aligned to its element size
+    grown.all_devices = (pci_header_t **) block;
+    grown.capabilities = (pci_capabilities_t *) (block + capacity * sizeof(pci_header_t *));
+    grown.segment = (uint16_t *) (grown.capabilities + capacity);
+    grown.vendor_id = grown.segment + capacity;
+    grown.device_id = grown.vendor_id + capacity;
+    grown.bus = (uint8_t *) (grown.device_id + capacity);
+    grown.device = grown.bus + capacity;
+    grown.function = grown.device + capacity;
+    grown.class_code = grown.function + capacity;
+    grown.subclass = grown.class_code + capacity;
+    grown.prog_if = grown.subclass + capacity;
+    grown.header_type = grown.prog_if + capacity;
 
+    size_t count = list->device_list_size;
+    if (count > 0) {
+        memcpy(grown.all_devices, list->all_devices, count * sizeof(pci_header_t *));
+        memcpy(grown.capabilities, list->capabilities, count * sizeof(pci_capabilities_t));
+        memcpy(grown.segment, list->segment, count * sizeof(uint16_t));
+        memcpy(grown.vendor_id, list->vendor_id, count * sizeof(uint16_t));
+        memcpy(grown.device_id, list->device_id, count * sizeof(uint16_t));
+        memcpy(grown.bus, list->bus, count);
+        memcpy(grown.device, list->device, count);
+        memcpy(grown.function, list->function, count);
+        memcpy(grown.class_code, list->class_code, count);
+        memcpy(grown.subclass, list->subclass, count);
+        memcpy(grown.prog_if, list->prog_if, count);
+        memcpy(grown.header_type, list->header_type, count);
+    }
+    free(list->all_devices);
+    *list = grown;
+    table_growths++;
+    return true;
 }
 
-static pci_header_t *get_pci_header_at(uint8_t bus, uint8_t device, uint8_t function) {
-    // Each bus contains 32 devices of up to 8 functions
+static bool same_devices(const pci_device_list_t *a, const pci_device_list_t *b) {
+    if (a->device_list_size != b->device_list_size) return false;
+    for (size_t i = 0; i < a->device_list_size; i++) {
+        if (a->all_devices[i] != b->all_devices[i] || a->segment[i] != b->segment[i]
+            || a->vendor_id[i] != b->vendor_id[i] || a->device_id[i] != b->device_id[i]
+            || a->header_type[i] != b->header_type[i]
+            || memcmp(&a->capabilities[i], &b->capabilities[i], sizeof(pci_capabilities_t)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void fake_function(uint8_t *config, uint8_t header_type, uint8_t class_code,
+    uint8_t subclass) {
+    pci_header_t *header = (pci_header_t *) config;
+    header->vendor_id = 0x1234;
+    header->device_id = 0x0001 + header_type;
+    header->status = 0;
+    header->class_code = class_code;
+    header->subclass = subclass;
+    header->prog_if = 0;
+    header->header_type = header_type;
+
+    // Power management, MSI-X and PCIe capabilities, and AER in extended configuration space
+    header->status = PCI_STATUS_CAPABILITIES;
+    uint32_t *dwords = (uint32_t *) config;
+    dwords[PCI_CAPABILITIES_OFFSET / 4] = 0x40;
+    dwords[0x40 / 4] = 0x5000 | PCI_CAP_POWER;
+    dwords[0x50 / 4] = 0x6000 | PCI_CAP_MSIX;
+    dwords[0x60 / 4] = 0x20000 | PCI_CAP_PCIE;
+    dwords[PCI_EXT_CAPABILITIES_OFFSET / 4] = 0x10000 | PCI_EXT_CAP_AER;
+}
+
+static uint32_t parse_capabilities(volatile uint32_t *config, uint16_t status,
+    pci_capabilities_t *capabilities) {
+    memset(capabilities, 0, sizeof(pci_capabilities_t));
+    if (!(status & PCI_STATUS_CAPABILITIES)) return 0;
+
+    // Each capability starts with a dword holding its ID and the offset of the next one. Only the
+    // first of each kind is kept, the one pci_find_capability would find
+    uint32_t reads = 1;
+    uint8_t next = config[PCI_CAPABILITIES_OFFSET / 4] & 0xFF;
+    for (uint32_t i = 0; i < PCI_MAX_CAPABILITIES; i++) {
+        next &= 0xFC;
+        if (next < PCI_HEADER_BYTES) break;
+        uint32_t capability = config[next / 4];
+        reads++;
+        uint8_t *field = NULL;
+        switch (capability & 0xFF) {
+            case PCI_CAP_POWER: field = &capabilities->power; break;
+            case PCI_CAP_MSI: field = &capabilities->msi; break;
+            case PCI_CAP_MSIX: field = &capabilities->msix; break;
+            case PCI_CAP_PCIE: field = &capabilities->pcie; break;
+            case PCI_CAP_VENDOR: field = &capabilities->vendor; break;
+        }
+        if (field != NULL && *field == 0) *field = next;
+        next = capability >> 8 & 0xFF;
+    }
+
+    // Only PCIe functions have extended configuration space. Its dwords hold a 16-bit ID, a
+    // version and the offset of the next, and an empty list starts with a 0
+    if (capabilities->pcie == 0) return reads;
+    uint16_t offset = PCI_EXT_CAPABILITIES_OFFSET;
+    for (uint32_t i = 0; i < PCI_MAX_EXT_CAPABILITIES; i++) {
+        uint32_t capability = config[offset / 4];
+        reads++;
+        if (capability == 0 || capability == 0xFFFFFFFF) break;
+        if ((capability & 0xFFFF) == PCI_EXT_CAP_AER && capabilities->aer == 0) {
+            capabilities->aer = offset;
+        }
+        offset = capability >> 20 & 0xFFC;
+        if (offset < PCI_EXT_CAPABILITIES_OFFSET) break;
+    }
+    return reads;
+}
+
+static pci_header_t *get_pci_header_at(pci_segment_t *segment, uint8_t bus, uint8_t device,
+    uint8_t function) {
+    // Each bus contains 32 devices of up to 8 functions. The base address is where bus 0 would be,
+    // even when the segment's range starts above it
     return (pci_header_t *)
-        (base_address + ((bus - start_bus_no) << 20 | device << 15 | function << 12));
+        (segment->base_address + ((uint64_t) bus << 20 | device << 15 | function << 12));
+}
+
+static void check_device(pci_segment_t *segment, uint8_t bus, uint8_t device) {
+    uint8_t header_type;
+    // Device doesn't exist
+    if (!check_function(segment, bus, device, 0, &header_type)) return;
+
+    // Functions 1 to 7 are only implemented by multi-function devices
+    if (!(header_type & PCI_MULTI_FUNCTION)) return;
+    for (uint8_t function = 1; function < 8; function++) {
+        check_function(segment, bus, device, function, &header_type);
+    }
 }
 
-static void check_device(uint8_t bus, uint8_t device) {
-    pci_header_t *header = get_pci_header_at(bus, device, 0);
+static bool check_function(pci_segment_t *segment, uint8_t bus, uint8_t device, uint8_t function,
+    uint8_t *header_type) {
+    pci_header_t *header = get_pci_header_at(segment, bus, device, function);
 
-    uint16_t vendor_id = header->vendor_id;
-    if (vendor_id == 0xFFFF) return; // Device doesn't exist
+    // The identifying dwords of the header: IDs, command and status, class, header type
+    uint32_t shadow[PCI_HEADER_BYTES / 4];
+    shadow[0] = pci_read_config32(header, 0);
+    if ((shadow[0] & 0xFFFF) == 0xFFFF) return false;
+    pci_read_config(header, 4, PCI_IDENTITY_BYTES - 4, shadow + 1);
+    pci_header_t *fields = (pci_header_t *) shadow;
+    *header_type = fields->header_type;
+    pci_capabilities_t capabilities;
+    mmio_reads += parse_capabilities((volatile uint32_t *) header, fields->status, &capabilities);
 
-    // Add the device to the list
-    void *new_pointer = realloc(all_devices, (device_list_size+1) * sizeof(pci_header_t *));
-    if (new_pointer == NULL) {
-        handle_error("Could not allocate array\n");
+    if (!add_device(header, fields, &capabilities, segment->number, bus, device, function)) {
         exit(EXIT_FAILURE);
     }
-    all_devices = new_pointer;
-    all_devices[device_list_size] = header;
-    device_list_size++;
-    
-    // If PCI-to-PCI, secondary bus will be another valid PCI bus
-    if ((header->class_code == 0x6)
-     && (header->subclass == 0x4)
-     && (swap_byte(header->header_type) == 1)) {
-        pci_header_1_t *header_1 = (pci_header_1_t *) header;
-        uint8_t secondary_bus = header_1->secondary_bus_number;
-        check_bus(secondary_bus);
+
+    // PCI-to-PCI and CardBus bridges keep their secondary and subordinate bus numbers in the same
+    // place. A bridge firmware left unconfigured has no range below its own bus, and one pointing
+    // outside the segment's range cannot be reached through its window
+    uint8_t type = PCI_HEADER_TYPE(fields);
+    if (type != 1 && type != 2) return true;
+    uint32_t bus_numbers = pci_read_config32(header, PCI_BUS_NUMBERS_OFFSET);
+    uint8_t secondary_bus = bus_numbers >> 8 & 0xFF;
+    uint8_t subordinate_bus = bus_numbers >> 16 & 0xFF;
+    if (secondary_bus > bus && secondary_bus <= subordinate_bus
+        && secondary_bus <= segment->end_bus) {
+        check_bus(segment, secondary_bus);
     }
+    return true;
+}
+
+static void check_bus(pci_segment_t *segment, uint8_t bus) {
+    if (bus < segment->start_bus || bus > segment->end_bus) return;
+    uint64_t bit = 1ULL << (bus % 64);
+    if (segment->visited[bus / 64] & bit) return;
+    segment->visited[bus / 64] |= bit;
+
+    for (uint8_t device = 0; device < 32; device++) {
+        check_device(segment, bus, device);
+    }
+}
 
-    // Check all functions for PCI-to-CardBus bridges
-    if (swap_byte(header->header_type) == 2) {
-        for (uint8_t function = 1; function < 8; function++) {
-            header = get_pci_header_at(0, 0, function);
-            if (header->vendor_id == 0xFFFF) break;
-            check_bus(function);
+static void check_all_buses(pci_segment_t *segment) {
+    memset(segment->visited, 0, sizeof(segment->visited));
+
+    // The tree below the first bus, then any bus of the range it did not reach, which is the root
+    // bus of another host bridge if it has anything on it
+    for (uint32_t bus = segment->start_bus; bus <= segment->end_bus; bus++) {
+        check_bus(segment, bus);
+    }
+}
+
+static bool check_all_buses_parallel(pci_segment_t *segments, uint32_t count) {
+    pci_scan_t scan;
+    memset(&scan, 0, sizeof(pci_scan_t));
+    for (uint32_t i = 0; i < count; i++) {
+        scan.bus_count += segments[i].end_bus - segments[i].start_bus + 1;
+    }
+    scan.buses = malloc((size_t) scan.bus_count * sizeof(pci_scanned_bus_t));
+    if (scan.buses == NULL) return false;
+
+    // Every bus of every segment is a piece of work, numbered in the order check_all_buses would
+    // start on them. The processors cannot allocate, so each bus has room for all 256 functions
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        for (uint32_t bus = segments[i].start_bus; bus <= segments[i].end_bus; bus++) {
+            scan.buses[next].segment = &segments[i];
+            scan.buses[next].bus = bus;
+            next++;
+        }
+    }
+
+    // MP services only notices non-blocking work has finished on a slow timer, so the boot
+    // processor waits for the application processors and then takes any buses they left, all of
+    // them if there are none
+    efi_mp_services_protocol_t *mp_services = cpu_mp_services();
+    if (mp_services != NULL) {
+        mp_services->startup_all_aps(mp_services, scan_buses, false, NULL, 0, &scan, NULL);
+    }
+    scan_buses(&scan);
+
+    // Every bus in a segment's range is scanned either way, so walking the scanned buses from the
+    // first the way the serial scan follows bridges gives its order exactly
+    pci_scanned_bus_t *first = scan.buses;
+    for (uint32_t i = 0; i < count; i++) {
+        pci_segment_t *segment = &segments[i];
+        memset(segment->visited, 0, sizeof(segment->visited));
+        for (uint32_t bus = segment->start_bus; bus <= segment->end_bus; bus++) {
+            if (!merge_bus(first, bus)) exit(EXIT_FAILURE);
         }
+        first += segment->end_bus - segment->start_bus + 1;
     }
+    free(scan.buses);
+    return true;
 }
 
-static void check_bus(uint8_t bus) {
-    for (uint8_t device = 0; device < 32; device++) {
-        check_device(bus, device);
+static void EFIAPI scan_buses(void *argument) {
+    pci_scan_t *scan = argument;
+    while (true) {
+        uint32_t i = __atomic_fetch_add(&scan->next, 1, __ATOMIC_RELAXED);
+        if (i >= scan->bus_count) return;
+        scan_bus(&scan->buses[i]);
     }
 }
 
-static void check_all_buses() {
-    pci_header_t *root_header = get_pci_header_at(0, 0, 0);
-    if (swap_byte(root_header->header_type) != 2) {
-        check_bus(0);
-    } else {
-        // If root header has multiple functions, check those too
+static void scan_bus(pci_scanned_bus_t *scanned) {
+    scanned->count = 0;
+    scanned->reads = 0;
+    for (uint8_t device = 0; device < 32; device++) {
         for (uint8_t function = 0; function < 8; function++) {
-            root_header = get_pci_header_at(0, 0, function);
-            if (root_header->vendor_id == 0xFFFF) break; // Device doesn't exist
-            check_bus(function);
+            // The same reads check_function makes, counted per bus since the shared count is not
+            // safe to update from several processors
+            volatile uint32_t *config = (volatile uint32_t *)
+                get_pci_header_at(scanned->segment, scanned->bus, device, function);
+            uint32_t ids = config[0];
+            scanned->reads++;
+            if ((ids & 0xFFFF) == 0xFFFF) {
+                if (function == 0) break;
+                continue;
+            }
+
+            pci_scanned_function_t *found = &scanned->functions[scanned->count++];
+            found->identity[0] = ids;
+            for (uint32_t i = 1; i < PCI_IDENTITY_BYTES / 4; i++) {
+                found->identity[i] = config[i];
+            }
+            scanned->reads += PCI_IDENTITY_BYTES / 4 - 1;
+            scanned->reads += parse_capabilities(config, found->identity[1] >> 16,
+                &found->capabilities);
+            found->device = device;
+            found->function = function;
+            found->secondary_bus = 0;
+            found->subordinate_bus = 0;
+
+            pci_header_t *fields = (pci_header_t *) found->identity;
+            uint8_t type = PCI_HEADER_TYPE(fields);
+            if (type == 1 || type == 2) {
+                uint32_t bus_numbers = config[PCI_BUS_NUMBERS_OFFSET / 4];
+                scanned->reads++;
+                found->secondary_bus = bus_numbers >> 8 & 0xFF;
+                found->subordinate_bus = bus_numbers >> 16 & 0xFF;
+            }
+
+            // Functions 1 to 7 are only implemented by multi-function devices
+            if (function == 0 && !(fields->header_type & PCI_MULTI_FUNCTION)) break;
         }
     }
-}
\ No newline at end of file
+}
+
+static bool merge_bus(pci_scanned_bus_t *first, uint8_t bus) {
+    pci_segment_t *segment = first->segment;
+    if (bus < segment->start_bus || bus > segment->end_bus) return true;
+    uint64_t bit = 1ULL << (bus % 64);
+    if (segment->visited[bus / 64] & bit) return true;
+    segment->visited[bus / 64] |= bit;
+
+    pci_scanned_bus_t *scanned = &first[bus - segment->start_bus];
+    mmio_reads += scanned->reads;
+    for (uint16_t i = 0; i < scanned->count; i++) {
+        pci_scanned_function_t *found = &scanned->functions[i];
+        pci_header_t *header = get_pci_header_at(segment, bus, found->device, found->function);
+        if (!add_device(header, (pci_header_t *) found->identity, &found->capabilities,
+            segment->number, bus, found->device, found->function)) {
+            return false;
+        }
+
+        // Left at 0 for functions that are not bridges
+        if (found->secondary_bus > bus && found->secondary_bus <= found->subordinate_bus
+            && !merge_bus(first, found->secondary_bus)) {
+            return false;
+        }
+    }
+    return true;
+}
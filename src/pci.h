@@ -1,43 +1,448 @@
 #ifndef _PCI_H_
 #define _PCI_H_
 
+#define PCI_CAP_POWER 0x1
 #define PCI_CAP_MSI 0x5
+#define PCI_CAP_VENDOR 0x9
+#define PCI_CAP_PCIE 0x10
+#define PCI_CAP_MSIX 0x11
+#define PCI_EXT_CAP_AER 0x1
+
+#define PCI_STATUS_CAPABILITIES 0x10    // Status bit set when the capability list is valid
+#define PCI_COMMAND_INTX_DISABLE 0x400
+#define PCI_MAX_CAPABILITIES 48         // Dwords between the header and the end of 256 bytes
+#define PCI_EXT_CAPABILITIES_OFFSET 0x100
+#define PCI_MAX_EXT_CAPABILITIES 960    // Dwords between 0x100 and the end of 4096 bytes
+#define PCI_MSI_ADDRESS 0xFEE00000      // Local APIC message address, destination in bits 12-19
+#define PCI_MSIX_ENABLE 0x8000          // Message control bits of the MSI-X capability
+#define PCI_MSIX_FUNCTION_MASK 0x4000
+#define PCI_MSIX_ENTRY_BYTES 16
+#define PCI_MSIX_MASKED 0x1             // Vector control bit of a table entry
+#define PCI_EXP_CAPABILITIES 0x0       // Registers of the PCIe capability, from its offset
+#define PCI_EXP_DEVICE_CAPABILITIES 0x4
+#define PCI_EXP_DEVICE_CONTROL 0x8      // Device status in the upper half
+#define PCI_EXP_LINK_CAPABILITIES 0xC
+#define PCI_EXP_LINK_CONTROL 0x10       // Link status in the upper half
+#define PCI_EXP_TYPE_ENDPOINT 0x0       // Device/port types
+#define PCI_EXP_TYPE_LEGACY_ENDPOINT 0x1
+#define PCI_EXP_TYPE_ROOT_PORT 0x4
+#define PCI_EXP_TYPE_INTEGRATED 0x9
+#define PCI_EXP_TYPE_EVENT_COLLECTOR 0xA
+#define PCI_EXP_RELAXED_ORDERING 0x10   // Device control bits
+#define PCI_EXP_NO_SNOOP 0x800
+#define PCI_EXP_MAX_SIZE 5              // Encoding of 4096 bytes, for payloads and read requests
+#define PCI_NO_PARENT 0xFFFFFFFF
+
+#define PCI_FIRST_VECTOR 0x40           // Vectors handed out, above the exceptions and legacy IRQs
+#define PCI_LAST_VECTOR 0xEF            // and below the local APIC's own
+
+#define PCI_HEADER_BYTES 64             // The standard header, before any capabilities
+#define PCI_IDENTITY_BYTES 16           // IDs, command, status, class and header type
+#define PCI_HEADER_TYPE_OFFSET 0xC      // Dword holding the header type in bits 16-23
+#define PCI_BAR_OFFSET 0x10
+#define PCI_BUS_NUMBERS_OFFSET 0x18     // Primary, secondary and subordinate bus of a bridge
+#define PCI_CAPABILITIES_OFFSET 0x34
+
+#define PCI_MAX_SEGMENTS 16             // MCFG entries enumerated
+#define PCI_BUS_FUNCTIONS 256           // 32 devices of 8 functions
+#define PCI_TABLE_INITIAL 64            // Devices the table holds before it first grows
+#define PCI_TABLE_LANES 16              // Table entries compared at once by pci_find
+#define PCI_TABLE_ENTRY_BYTES 30        // Header pointer, capabilities, 3 words and 7 bytes
+#define PCI_MAX_MATCHES 32              // Devices of one kind a driver looks at
+#define PCI_ANY 0xFFFF                  // Matches any value of a pci_match_t field
+#define PCI_BENCH_BUSES 32              // Default buses behind bridges in the synthetic topology
+#define PCI_BENCH_RUNS 100              // Scans of the synthetic topology timed by pci_benchmark
+
+/**
+ * @brief Header layout (0 endpoint, 1 PCI-to-PCI bridge, 2 CardBus bridge), without the
+ * multi-function bit
+ */
+#define PCI_HEADER_TYPE(header) ((header)->header_type & 0x7F)
+#define PCI_MULTI_FUNCTION 0x80         // Header type bit set when functions 1-7 may exist
+
+#include <stdbool.h>
 
 #include "types.h"
 
+/**
+ * @brief 16 table entries of byte fields, or 8 of word fields, as SSE2 compares them
+ */
+typedef uint8_t pci_lanes_t __attribute__((vector_size(16)));
+typedef uint8_t pci_unaligned_lanes_t __attribute__((vector_size(16), aligned(1)));
+typedef uint16_t pci_word_lanes_t __attribute__((vector_size(16)));
+typedef uint16_t pci_unaligned_word_lanes_t __attribute__((vector_size(16), aligned(1)));
+typedef short pci_short_lanes_t __attribute__((vector_size(16)));
+typedef char pci_mask_t __attribute__((vector_size(16)));
+
+/**
+ * @brief Interrupt steering of one processor: the vectors aimed at it, the interrupts counted on
+ * them and how many of those were handled on another processor. Completion batches found by
+ * polling a vector's queue are counted apart, since no interrupt was raised for them
+ */
+typedef struct pci_cpu_interrupts {
+    uint32_t vectors;
+    uint64_t interrupts;
+    uint64_t remote;
+    uint64_t polled;
+    uint64_t polled_remote;
+} pci_cpu_interrupts_t;
+
+/**
+ * @brief Where a PCIe function sits in its hierarchy, used while the payload sizes are worked out
+ */
+typedef struct pci_pcie_node {
+    /**
+     * @brief Index of the bridge whose secondary bus the function is on, PCI_NO_PARENT for
+     * functions on a root bus or below a bridge that is not PCIe
+     */
+    uint32_t parent;
+    uint8_t type;
+    /**
+     * @brief Largest payload supported by the function and everything below it, then the payload
+     * programmed, both encoded as 128 << n bytes
+     */
+    uint8_t supported;
+    uint8_t payload;
+    /**
+     * @brief True below a root port. Integrated endpoints have no link and are left alone
+     */
+    bool tuned;
+} pci_pcie_node_t;
+
+/**
+ * @brief The configuration space window of one MCFG entry: a segment group and the range of buses
+ * its host bridge decodes
+ */
+typedef struct pci_segment {
+    /**
+     * @brief ECAM address of bus 0 of the segment, whether or not the range includes it
+     */
+    uint8_t *base_address;
+    uint16_t number;
+    uint8_t start_bus;
+    uint8_t end_bus;
+    /**
+     * @brief Buses already scanned, one bit each, so every bus is scanned once however it is
+     * reached
+     */
+    uint64_t visited[256 / 64];
+} pci_segment_t;
+
+/**
+ * @brief A function found by a parallel scan: its identifying dwords and, for bridges, the bus
+ * numbers that decide where a serial scan would have gone next
+ */
+typedef struct pci_scanned_function {
+    uint32_t identity[PCI_IDENTITY_BYTES / 4];
+    pci_capabilities_t capabilities;
+    uint8_t device;
+    uint8_t function;
+    uint8_t secondary_bus;
+    uint8_t subordinate_bus;
+} pci_scanned_function_t;
+
+/**
+ * @brief The functions of one bus in the order a serial scan finds them, written only by the
+ * processor that took the bus
+ */
+typedef struct pci_scanned_bus {
+    pci_segment_t *segment;
+    uint8_t bus;
+    uint16_t count;
+    uint32_t reads;
+    pci_scanned_function_t functions[PCI_BUS_FUNCTIONS];
+} pci_scanned_bus_t;
+
+/**
+ * @brief Work shared by the processors of a parallel scan, which take buses in order from next
+ */
+typedef struct pci_scan {
+    pci_scanned_bus_t *buses;
+    uint32_t bus_count;
+    uint32_t next;
+} pci_scan_t;
+
 /**
  * @brief Searches for all PCI entries in the MCFG, returning a list of pointers  
  */
 pci_device_list_t init_pci(mcfg_t *mcfg);
 
 /**
- * @brief Enabled message signaled interrupts for the given PCI entry
+ * @brief Searches the device list for functions with the given fields, comparing
+ * PCI_TABLE_LANES entries at a time from the table in RAM rather than reading configuration space
+ * 
+ * @param matches Output for the indices of the first max_matches functions found in list order,
+ * may be NULL if max_matches is 0
+ * @return The number of functions that match, which may be more than max_matches
+ */
+uint32_t pci_find(const pci_device_list_t *list, const pci_match_t *match, uint32_t *matches,
+    uint32_t max_matches);
+
+/**
+ * @brief Enables MSI for a function of the device list, with a single message carrying the given
+ * vector to the boot processor, and turns its INTx interrupt off
+ * 
+ * @param index Index of the function in the list
+ * @return False if the function has no MSI capability
+ */
+bool enable_msi(const pci_device_list_t *list, uint32_t index, uint8_t vector);
+
+/**
+ * @brief Enables MSI-X for a function of the device list. Allocates a vector per entry, maps the
+ * table and pending bit array and programs entries 0 to entries - 1, entry n sending vector
+ * first_vector + n to processor cpus[n]. The entries are left masked, so a message only sets its
+ * pending bit until the entry is unmasked. INTx is turned off
+ * 
+ * @param cpus Processor index (0 to cpu_count() - 1) for each entry, or NULL to spread the entries
+ * round-robin, entry n to processor n modulo cpu_count()
+ * @param msix Output for the mapped table and the vectors
+ * @return False if the function has no MSI-X capability, fewer entries, a table outside memory
+ * space or the vectors ran out
+ */
+bool pci_enable_msix(const pci_device_list_t *list, uint32_t index, uint16_t entries,
+    const uint32_t *cpus, pci_msix_t *msix);
+
+/**
+ * @brief Masks an MSI-X entry, so its messages only set its pending bit
+ */
+void pci_msix_mask(pci_msix_t *msix, uint16_t entry);
+
+/**
+ * @brief Unmasks an MSI-X entry. A message held back while it was masked is sent straight away
+ */
+void pci_msix_unmask(pci_msix_t *msix, uint16_t entry);
+
+/**
+ * @brief Returns true if a masked MSI-X entry has a message waiting
+ */
+bool pci_msix_pending(pci_msix_t *msix, uint16_t entry);
+
+/**
+ * @brief Aims a function's MSI message at the given processor's local APIC
+ * 
+ * @return False if MSI is not enabled on the function
+ */
+bool pci_set_msi_affinity(const pci_device_list_t *list, uint32_t index, uint32_t cpu);
+
+/**
+ * @brief Aims an MSI-X entry at the given processor's local APIC, masking the entry while its
+ * address changes so no message goes out half written
+ */
+void pci_set_msix_affinity(pci_msix_t *msix, uint16_t entry, uint32_t cpu);
+
+/**
+ * @brief Returns the processor a vector programmed by enable_msi or pci_enable_msix is aimed at
+ */
+uint32_t pci_vector_cpu(uint8_t vector);
+
+/**
+ * @brief Counts an interrupt on a vector against the processor it is aimed at, as remote if the
+ * processor calling this is another one. For interrupt handlers only
+ */
+void pci_count_interrupt(uint8_t vector);
+
+/**
+ * @brief Counts a batch of completions found by polling the queue a vector belongs to against the
+ * processor the vector is aimed at, as remote if the processor polling is another one
+ */
+void pci_count_poll(uint8_t vector);
+
+/**
+ * @brief Prints an "irq," CSV line for every processor with vectors aimed at it: its index, local
+ * APIC ID, vectors, interrupts counted and how many of those were handled elsewhere. A "poll,"
+ * line with the same first three columns follows with the polled batches and remote ones
+ */
+void pci_print_interrupts();
+
+/**
+ * @brief Allocates a block of consecutive interrupt vectors between PCI_FIRST_VECTOR and
+ * PCI_LAST_VECTOR. Vectors are never freed
  * 
- * @return True if interrupts successfully enabled
+ * @return The first vector of the block, or 0 if there are not enough left
  */
-bool enable_msi(pci_header_0_t *header);
+uint8_t pci_allocate_vectors(uint16_t count);
 
 /**
- * @brief Finds the PCI header located at the given bus for the given device using the given
- * function
+ * @brief Returns the memory address held in the given BAR (0-5) of the header, combining the
+ * following BAR for 64-bit BARs. Returns 0 for I/O space BARs
  */
-static pci_header_t *get_pci_header_at(uint8_t bus, uint8_t device, uint8_t function);
+uint64_t pci_bar_address(pci_header_0_t *header, uint8_t bar);
 
 /**
- * @brief Checks the given bus of the given device and adds it to the device list
+ * @brief Walks the capability list of the header for a capability with the given ID
+ * 
+ * @param offset Offset of the capability to continue after, or 0 to start from the beginning
+ * @return Config space offset of the capability, or 0 if there are no more
  */
-static void check_device(uint8_t bus, uint8_t device);
+uint8_t pci_find_capability(pci_header_0_t *header, uint8_t id, uint8_t offset);
 
 /**
- * @brief Checks the given bus, adding devices found to the device list, and checks any buses that
- * are attached/at different functions of the device
+ * @brief Programs the max payload size of every PCIe function below a root port to the largest
+ * every function in that hierarchy supports, from the root port down, so no port ever receives a
+ * TLP bigger than it accepts. Mass storage endpoints also get 4096 byte read requests. Endpoints
+ * get relaxed ordering, and no-snoop is turned off since DMA buffers are not flushed from the
+ * caches
+ * 
+ * @return False if memory runs out, leaving every function as firmware set it
  */
-static void check_bus(uint8_t bus);
+bool pci_tune_pcie(const pci_device_list_t *list);
 
 /**
- * @brief Recursively checks for any entries in every bus in the PCI address space, adding devices
- * found to the device list
+ * @brief Prints a "pcie," CSV line for every PCIe function with a link: its address, vendor and
+ * device, device/port type, payload and read request sizes, negotiated link speed and width, and
+ * the fastest and widest the link supports
+ */
+void pci_print_links(const pci_device_list_t *list);
+
+/**
+ * @brief Reads the aligned configuration space dword at offset as one MMIO transaction
+ */
+uint32_t pci_read_config32(volatile void *header, uint16_t offset);
+
+/**
+ * @brief Copies length bytes of configuration space from offset into shadow with aligned dword
+ * reads, so the fields in them can be decoded from RAM. Offset and length must be multiples of 4,
+ * up to the 4096 bytes of a PCIe function
+ */
+void pci_read_config(volatile void *header, uint16_t offset, uint16_t length, void *shadow);
+
+/**
+ * @brief Writes the aligned configuration space dword at offset
+ */
+void pci_write_config32(volatile void *header, uint16_t offset, uint32_t value);
+
+/**
+ * @brief Returns the number of configuration space reads made so far
+ */
+uint64_t pci_mmio_reads();
+
+/**
+ * @brief Times enumeration of a synthetic topology held in RAM: a host bridge and a tree of
+ * PCI-to-PCI bridges leading to the given number of buses, every free slot holding an endpoint and
+ * device 0 of each bus behind a bridge holding 8 functions.
+ * Prints a "pcibench," CSV line with the buses, devices found, average scan time, how often the
+ * device table grew, the configuration space reads of one scan, and the endpoints pci_find matched
+ * and its time, then the processors, the average time of a parallel scan and its speedup over the
+ * serial one. The devices found by init_pci are left as they were
+ * 
+ * @return False if memory runs out or the parallel scan lists the devices in a different order
+ * 
+ * @param buses Buses behind bridges, 0 for PCI_BENCH_BUSES, at most 255
+ */
+bool pci_benchmark(uint32_t buses);
+
+/**
+ * @brief Records that a vector is now aimed at the given processor, moving it from the one it
+ * was aimed at before
+ */
+static void steer_vector(uint8_t vector, uint32_t cpu);
+
+/**
+ * @brief Returns a bit per entry of PCI_TABLE_LANES byte fields, set where the field masked with
+ * value_mask equals wanted
+ */
+static uint32_t match_bytes(const uint8_t *values, uint8_t wanted, uint8_t value_mask);
+
+/**
+ * @brief Returns a bit per entry of PCI_TABLE_LANES word fields, set where the field equals wanted
+ */
+static uint32_t match_words(const uint16_t *values, uint16_t wanted);
+
+/**
+ * @brief Appends a function to the device list, copying its identifying fields into the table
+ * from a shadow of its header
+ */
+static bool add_device(pci_header_t *header, pci_header_t *shadow,
+    const pci_capabilities_t *capabilities, uint16_t segment, uint8_t bus, uint8_t device,
+    uint8_t function);
+
+/**
+ * @brief Moves the table into an allocation with twice the capacity, or PCI_TABLE_INITIAL
+ * entries if it has none
+ */
+static bool grow_table(pci_device_list_t *list);
+
+/**
+ * @brief Returns true if two device lists hold the same functions in the same order
+ */
+static bool same_devices(const pci_device_list_t *a, const pci_device_list_t *b);
+
+/**
+ * @brief Writes a function with the given header type and class into synthetic configuration
+ * space, with power management, MSI-X, PCIe and AER capabilities
+ */
+static void fake_function(uint8_t *config, uint8_t header_type, uint8_t class_code,
+    uint8_t subclass);
+
+/**
+ * @brief Walks the capability list and, for PCIe functions, the extended capabilities from 0x100,
+ * recording the offsets of the ones in pci_capabilities_t. Each walk ends after as many entries as
+ * fit in its part of configuration space, so a list that loops cannot hang it
+ * 
+ * @param status The status register, whose capability list bit says whether there is a list
+ * @return The configuration space reads made
+ */
+static uint32_t parse_capabilities(volatile uint32_t *config, uint16_t status,
+    pci_capabilities_t *capabilities);
+
+/**
+ * @brief Finds the PCI header of the given function in a segment's configuration space
+ */
+static pci_header_t *get_pci_header_at(pci_segment_t *segment, uint8_t bus, uint8_t device,
+    uint8_t function);
+
+/**
+ * @brief Adds every function of a device to the device list, function 0 only unless it has the
+ * multi-function bit set
+ */
+static void check_device(pci_segment_t *segment, uint8_t bus, uint8_t device);
+
+/**
+ * @brief Adds a function to the device list and scans the secondary bus if it is a bridge
+ * 
+ * @param header_type Output for the function's header type byte
+ * @return False if the function does not exist
+ */
+static bool check_function(pci_segment_t *segment, uint8_t bus, uint8_t device, uint8_t function,
+    uint8_t *header_type);
+
+/**
+ * @brief Checks every device on the given bus, unless the bus has already been scanned or lies
+ * outside the segment's range
+ */
+static void check_bus(pci_segment_t *segment, uint8_t bus);
+
+/**
+ * @brief Checks every bus in the segment's range, following bridges from the first bus and then
+ * scanning the buses they did not reach, adding each function found to the device list once
+ */
+static void check_all_buses(pci_segment_t *segment);
+
+/**
+ * @brief Enumerates the segments with every processor, each taking whole buses, and merges the
+ * buses into the device list in the order check_all_buses would find them
+ * 
+ * @return False if the scan buffers could not be allocated, leaving the device list untouched
+ */
+static bool check_all_buses_parallel(pci_segment_t *segments, uint32_t count);
+
+/**
+ * @brief Scans buses until none are left. Runs on the application processors, so it only touches
+ * configuration space and its own buses
+ */
+static void EFIAPI scan_buses(void *argument);
+
+/**
+ * @brief Records every function of a bus, in device and function order
+ */
+static void scan_bus(pci_scanned_bus_t *scanned);
+
+/**
+ * @brief Adds the functions of a scanned bus to the device list, followed by the buses behind any
+ * bridge among them the way check_function follows them
+ * 
+ * @param first The scanned buses of the segment, indexed from its start bus
  */
-static void check_all_buses();
+static bool merge_bus(pci_scanned_bus_t *first, uint8_t bus);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "raid.h"
+
+static const blk_ops_t raid_ops = {raid_submit, raid_poll, raid_abort};
+static uint8_t volume_count = 0;
+
+blk_device_t *raid_create_stripe(blk_device_t **members, uint32_t member_count,
+    uint32_t chunk_sectors) {
+    raid_volume_t *volume = alloc_volume(RAID_STRIPE, members, member_count);
+    if (volume == NULL) return NULL;
+
+    if (chunk_sectors == 0) chunk_sectors = RAID_CHUNK_SECTORS;
+    blk_device_t *device = &volume->device;
+    for (uint32_t i = 0; i < member_count; i++) {
+        if (members[i]->max_transfer < chunk_sectors) {
+            free(volume);
+            handle_error("Stripe chunk is larger than a member's maximum transfer\n");
+            return NULL;
+        }
+    }
+    volume->chunk_sectors = chunk_sectors;
+
+    // Only whole stripes are usable, and a request may span at most one stripe
+    uint64_t stripe_sectors = (uint64_t) chunk_sectors * member_count;
+    device->sector_count = device->sector_count / chunk_sectors * stripe_sectors;
+    device->max_transfer = stripe_sectors;
+    device->queue_depth = RAID_QUEUE_DEPTH;
+
+    if (!blk_register(device)) {
+        free(volume);
+        return NULL;
+    }
+    return device;
+}
+
+blk_device_t *raid_create_mirror(blk_device_t **members, uint32_t member_count,
+    uint8_t read_policy) {
+    raid_volume_t *volume = alloc_volume(RAID_MIRROR, members, member_count);
+    if (volume == NULL) return NULL;
+
+    blk_device_t *device = &volume->device;
+    volume->read_policy = read_policy;
+    device->queue_depth = RAID_QUEUE_DEPTH;
+
+    if (!blk_register(device)) {
+        free(volume);
+        return NULL;
+    }
+    return device;
+}
+
+static raid_volume_t *alloc_volume(uint8_t level, blk_device_t **members, uint32_t member_count) {
+    if (member_count < 2 || member_count > RAID_MAX_MEMBERS) {
+        handle_error("A volume needs between 2 and 8 members\n");
+        return NULL;
+    }
+    for (uint32_t i = 0; i < member_count; i++) {
+        if (members[i] == NULL || members[i]->sector_size != members[0]->sector_size) {
+            handle_error("Volume members must exist and share a sector size\n");
+            return NULL;
+        }
+    }
+
+    raid_volume_t *volume = malloc(sizeof(raid_volume_t));
+    if (volume == NULL) {
+        handle_error("Could not allocate volume\n");
+        return NULL;
+    }
+    memset(volume, 0, sizeof(raid_volume_t));
+    volume->level = level;
+    volume->member_count = member_count;
+    for (uint32_t i = 0; i < RAID_QUEUE_DEPTH; i++) {
+        volume->requests[i].volume = volume;
+        volume->idle[i] = &volume->requests[i];
+    }
+    volume->idle_count = RAID_QUEUE_DEPTH;
+
+    // The volume is limited by its smallest member. A flush goes to every member with a cache,
+    // and FUA is only offered if no cached member would have to drop it
+    blk_device_t *device = &volume->device;
+    device->sector_size = members[0]->sector_size;
+    device->sector_count = members[0]->sector_count;
+    device->max_transfer = members[0]->max_transfer;
+    device->capabilities = BLK_CAP_FUA | BLK_CAP_DISCARD;
+    for (uint32_t i = 0; i < member_count; i++) {
+        blk_device_t *member = members[i];
+        volume->members[i] = member;
+        if (member->sector_count < device->sector_count) {
+            device->sector_count = member->sector_count;
+        }
+        if (member->max_transfer < device->max_transfer) {
+            device->max_transfer = member->max_transfer;
+        }
+        if (member->capabilities & BLK_CAP_FLUSH) {
+            device->capabilities |= BLK_CAP_FLUSH;
+            if (!(member->capabilities & BLK_CAP_FUA)) device->capabilities &= ~BLK_CAP_FUA;
+        }
+        if (!(member->capabilities & BLK_CAP_DISCARD)) device->capabilities &= ~BLK_CAP_DISCARD;
+    }
+
+    volume->number = volume_count++;
+    snprintf(device->name, BLK_NAME_LENGTH, "md%d", (uint64_t) volume->number);
+    device->ops = &raid_ops;
+    device->driver = volume;
+    return volume;
+}
+
+static void add_child(raid_request_t *raid_request, blk_device_t *member, uint64_t lba,
+    uint32_t count, void *buffer) {
+    io_request_t *child = &raid_request->children[raid_request->pending++];
+    io_request_t *parent = raid_request->parent;
+
+    memset(child, 0, sizeof(io_request_t));
+    child->op = parent->op;
+    child->flags = parent->flags;
+    child->lba = lba;
+    child->count = count;
+    child->buffer = buffer;
+    child->callback = raid_child_complete;
+    child->context = raid_request;
+    child->device = member;
+}
+
+static void split_stripe(raid_volume_t *volume, raid_request_t *raid_request) {
+    io_request_t *parent = raid_request->parent;
+    uint64_t lba = parent->lba;
+    uint32_t remaining = parent->count;
+    uint8_t *buffer = parent->buffer;
+
+    while (remaining > 0) {
+        uint64_t chunk = lba / volume->chunk_sectors;
+        uint32_t offset = lba - chunk * volume->chunk_sectors;
+        uint32_t count = volume->chunk_sectors - offset;
+        if (count > remaining) count = remaining;
+
+        uint32_t member = chunk % volume->member_count;
+        uint64_t member_lba = chunk / volume->member_count * volume->chunk_sectors + offset;
+        add_child(raid_request, volume->members[member], member_lba, count, buffer);
+
+        lba += count;
+        remaining -= count;
+        if (buffer != NULL) buffer += (uint64_t) count * volume->device.sector_size;
+    }
+}
+
+static uint32_t pick_mirror(raid_volume_t *volume, uint64_t lba) {
+    uint32_t best = 0;
+    uint64_t best_primary = ~0ULL;
+    uint64_t best_secondary = ~0ULL;
+
+    for (uint32_t i = 0; i < volume->member_count; i++) {
+        uint64_t queued = volume->members[i]->stats.in_flight;
+        uint64_t last = volume->last_lba[i];
+        uint64_t distance = lba > last ? lba - last : last - lba;
+
+        // Ties on the primary key fall back to the other key
+        uint64_t primary = volume->read_policy == RAID_READ_NEAREST ? distance : queued;
+        uint64_t secondary = volume->read_policy == RAID_READ_NEAREST ? queued : distance;
+        if (primary < best_primary || (primary == best_primary && secondary < best_secondary)) {
+            best = i;
+            best_primary = primary;
+            best_secondary = secondary;
+        }
+    }
+    return best;
+}
+
+static void raid_child_complete(io_request_t *child) {
+    raid_request_t *raid_request = child->context;
+    if (!child->success) raid_request->success = false;
+    if (--raid_request->pending == 0) finish_request(raid_request);
+}
+
+static void finish_request(raid_request_t *raid_request) {
+    raid_volume_t *volume = raid_request->volume;
+    io_request_t *parent = raid_request->parent;
+    raid_request->parent = NULL;
+    volume->idle[volume->idle_count++] = raid_request;
+    volume->completed++;
+
+    parent->success = raid_request->success;
+    parent->complete_ticks = timer_ticks();
+    blk_complete(parent);
+}
+
+static bool raid_submit(blk_device_t *device, io_request_t *request) {
+    raid_volume_t *volume = device->driver;
+    if (volume->idle_count == 0) return false;
+
+    raid_request_t *raid_request = volume->idle[--volume->idle_count];
+    raid_request->parent = request;
+    raid_request->pending = 0;
+    raid_request->success = true;
+
+    if (request->op == IO_OP_FLUSH) {
+        for (uint32_t i = 0; i < volume->member_count; i++) {
+            if (volume->members[i]->capabilities & BLK_CAP_FLUSH) {
+                add_child(raid_request, volume->members[i], 0, 0, NULL);
+            }
+        }
+    } else if (volume->level == RAID_STRIPE) {
+        split_stripe(volume, raid_request);
+    } else if (request->op == IO_OP_READ) {
+        uint32_t member = pick_mirror(volume, request->lba);
+        volume->last_lba[member] = request->lba + request->count;
+        add_child(raid_request, volume->members[member], request->lba, request->count,
+            request->buffer);
+    } else {
+        for (uint32_t i = 0; i < volume->member_count; i++) {
+            volume->last_lba[i] = request->lba + request->count;
+            add_child(raid_request, volume->members[i], request->lba, request->count,
+                request->buffer);
+        }
+    }
+
+    // A member may complete a piece inside blk_submit, so hold an extra reference until every
+    // piece is submitted
+    request->submit_ticks = timer_ticks();
+    uint32_t children = raid_request->pending++;
+    for (uint32_t i = 0; i < children; i++) {
+        io_request_t *child = &raid_request->children[i];
+        blk_submit(child->device, child);
+    }
+    if (--raid_request->pending == 0) finish_request(raid_request);
+    return true;
+}
+
+static uint32_t raid_poll(blk_device_t *device) {
+    raid_volume_t *volume = device->driver;
+    volume->completed = 0;
+    for (uint32_t i = 0; i < volume->member_count; i++) {
+        blk_poll(volume->members[i]);
+    }
+    return volume->completed;
+}
+
+static void raid_abort(blk_device_t *device) {
+    raid_volume_t *volume = device->driver;
+    for (uint32_t i = 0; i < RAID_QUEUE_DEPTH; i++) {
+        raid_request_t *raid_request = &volume->requests[i];
+        for (uint32_t j = 0; raid_request->parent != NULL && j <= RAID_MAX_MEMBERS; j++) {
+            io_request_t *child = &raid_request->children[j];
+            if (child->device != NULL) blk_cancel(child->device, child);
+        }
+    }
+    for (uint32_t i = 0; i < volume->member_count; i++) {
+        blk_abort(volume->members[i]);
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef _RAID_H_
+#define _RAID_H_
+
+#define RAID_STRIPE 0                   // RAID-0, chunks rotate across the members
+#define RAID_MIRROR 1                   // RAID-1, every member holds a full copy
+
+#define RAID_READ_LEAST_QUEUED 0        // Mirror reads go to the member with the fewest in flight
+#define RAID_READ_NEAREST 1             // Mirror reads go to the member whose last read ended closest
+
+#define RAID_MAX_MEMBERS 8
+#define RAID_QUEUE_DEPTH 32             // Volume requests in flight at once
+#define RAID_CHUNK_SECTORS 128          // Default stripe chunk, 64KB of 512 byte sectors
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+struct raid_volume;
+
+/**
+ * @brief A volume request in flight, with the member requests it was split into
+ */
+typedef struct raid_request {
+    io_request_t *parent;
+    struct raid_volume *volume;
+    uint32_t pending;
+    bool success;
+    /**
+     * @brief A stripe request of at most one full stripe touches each member once, plus once more
+     * when it does not start on a chunk boundary
+     */
+    io_request_t children[RAID_MAX_MEMBERS + 1];
+} raid_request_t;
+
+typedef struct raid_volume {
+    blk_device_t device;
+    uint8_t number;
+    uint8_t level;
+    uint8_t read_policy;
+    uint32_t member_count;
+    blk_device_t *members[RAID_MAX_MEMBERS];
+    uint32_t chunk_sectors;
+    /**
+     * @brief Sector after the last request issued to each member, for RAID_READ_NEAREST
+     */
+    uint64_t last_lba[RAID_MAX_MEMBERS];
+    raid_request_t requests[RAID_QUEUE_DEPTH];
+    raid_request_t *idle[RAID_QUEUE_DEPTH];
+    uint32_t idle_count;
+    /**
+     * @brief Volume requests completed during the current poll
+     */
+    uint32_t completed;
+} raid_volume_t;
+
+/**
+ * @brief Creates a striped volume over the members and registers it as a block device named
+ * "mdN". Requests are split at chunk boundaries and the pieces issued to the members in parallel
+ * 
+ * @param chunk_sectors Sectors per chunk, 0 for RAID_CHUNK_SECTORS
+ * @return The volume's block device, or NULL on failure
+ */
+blk_device_t *raid_create_stripe(blk_device_t **members, uint32_t member_count,
+    uint32_t chunk_sectors);
+
+/**
+ * @brief Creates a mirrored volume over the members and registers it as a block device named
+ * "mdN". Writes, flushes and discards go to every member, each read to one member chosen by the
+ * read policy
+ * 
+ * @param read_policy One of RAID_READ_*
+ * @return The volume's block device, or NULL on failure
+ */
+blk_device_t *raid_create_mirror(blk_device_t **members, uint32_t member_count,
+    uint8_t read_policy);
+
+/**
+ * @brief Checks the members are usable together and allocates a volume with the geometry and
+ * capabilities they share
+ */
+static raid_volume_t *alloc_volume(uint8_t level, blk_device_t **members, uint32_t member_count);
+
+/**
+ * @brief Fills in the next member request of a volume request
+ */
+static void add_child(raid_request_t *raid_request, blk_device_t *member, uint64_t lba,
+    uint32_t count, void *buffer);
+
+/**
+ * @brief Splits a striped volume request at chunk boundaries
+ */
+static void split_stripe(raid_volume_t *volume, raid_request_t *raid_request);
+
+/**
+ * @brief Picks the mirror member to read from under the volume's read policy
+ */
+static uint32_t pick_mirror(raid_volume_t *volume, uint64_t lba);
+
+/**
+ * @brief Member request callback, completing the volume request once all its pieces are done
+ */
+static void raid_child_complete(io_request_t *child);
+
+/**
+ * @brief Returns the volume request to the idle list and completes its parent
+ */
+static void finish_request(raid_request_t *raid_request);
+
+/**
+ * @brief Splits the request and submits the pieces to the members
+ * 
+ * @return False if RAID_QUEUE_DEPTH requests are already in flight
+ */
+static bool raid_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Polls every member, completing volume requests whose pieces have all finished
+ */
+static uint32_t raid_poll(blk_device_t *device);
+
+/**
+ * @brief Cancels the member requests still queued and aborts every member, failing the rest
+ */
+static void raid_abort(blk_device_t *device);
+
+#endif
@@ -0,0 +1,247 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "ramdisk.h"
+
+static uint8_t ramdisk_count = 0;
+
+static const blk_ops_t ramdisk_ops = {ramdisk_submit, ramdisk_poll, ramdisk_abort};
+
+void ramdisk_config_memory(ramdisk_config_t *config, uint64_t sector_count) {
+    memset(config, 0, sizeof(ramdisk_config_t));
+    config->sector_count = sector_count;
+    config->sector_size = 512;
+    config->queue_depth = 32;
+    config->seed = 0x9E3779B97F4A7C15;
+}
+
+void ramdisk_config_ssd(ramdisk_config_t *config, uint64_t sector_count) {
+    ramdisk_config_memory(config, sector_count);
+
+    config->read.distribution = RAMDISK_LATENCY_UNIFORM;
+    config->read.min_ns = 60000;
+    config->read.max_ns = 100000;
+    config->read.per_sector_ns = 966; // 530MB/s
+    config->read.tail_per_mille = 1;
+    config->read.tail_ns = 2000000;
+
+    config->write.distribution = RAMDISK_LATENCY_UNIFORM;
+    config->write.min_ns = 15000;
+    config->write.max_ns = 25000;
+    config->write.per_sector_ns = 1024; // 500MB/s
+    config->write.tail_per_mille = 5;
+    config->write.tail_ns = 2000000;
+
+    config->flush.distribution = RAMDISK_LATENCY_FIXED;
+    config->flush.min_ns = 500000;
+}
+
+void ramdisk_config_hdd(ramdisk_config_t *config, uint64_t sector_count) {
+    ramdisk_config_memory(config, sector_count);
+    config->serial = true;
+
+    // Rotational delay is uniform over one revolution at 7200rpm
+    config->read.distribution = RAMDISK_LATENCY_UNIFORM;
+    config->read.min_ns = 0;
+    config->read.max_ns = 8333333;
+    config->read.per_sector_ns = 2844; // 180MB/s
+    config->read.seek_ns_per_gb = 20000;
+    config->write = config->read;
+
+    config->flush.distribution = RAMDISK_LATENCY_FIXED;
+    config->flush.min_ns = 10000000;
+}
+
+bool init_ramdisk(ramdisk_config_t *config, ramdisk_t **ramdisk) {
+    if (config->queue_depth == 0 || config->queue_depth > RAMDISK_MAX_QUEUE_DEPTH) {
+        handle_error("RAM disk queue depth must be between 1 and 256\n");
+        return false;
+    }
+
+    ramdisk_t *new_disk = malloc(sizeof(ramdisk_t));
+    if (new_disk == NULL) {
+        handle_error("Could not allocate RAM disk\n");
+        return false;
+    }
+    memset(new_disk, 0, sizeof(ramdisk_t));
+    new_disk->config = *config;
+    new_disk->rng = config->seed != 0 ? config->seed : 0x9E3779B97F4A7C15;
+
+    efi_physical_address_t address;
+    uint64_t size = config->sector_count * config->sector_size;
+    efi_status_t status = BS->AllocatePages(
+        AllocateAnyPages, EfiLoaderData, EFI_SIZE_TO_PAGES(size), &address);
+    if (EFI_ERROR(status)) {
+        free(new_disk);
+        handle_error("Could not allocate RAM disk memory\n");
+        return false;
+    }
+    new_disk->data = (uint8_t *) address;
+    memset(new_disk->data, 0, size);
+    new_disk->number = ramdisk_count++;
+
+    blk_device_t *device = &new_disk->device;
+    snprintf(device->name, BLK_NAME_LENGTH, "ram%d", (uint64_t) new_disk->number);
+    device->sector_size = config->sector_size;
+    device->sector_count = config->sector_count;
+    device->max_transfer = 0xFFFFFFFF / config->sector_size;
+    device->max_segments = RAMDISK_MAX_SEGMENTS;
+    device->queue_depth = config->queue_depth;
+    device->capabilities = BLK_CAP_FLUSH | BLK_CAP_FUA | BLK_CAP_DISCARD;
+    device->ops = &ramdisk_ops;
+    device->driver = new_disk;
+    if (!blk_register(device)) {
+        BS->FreePages(address, EFI_SIZE_TO_PAGES(size));
+        free(new_disk);
+        return false;
+    }
+
+    *ramdisk = new_disk;
+    return true;
+}
+
+bool is_ramdisk(blk_device_t *device) {
+    return device->ops == &ramdisk_ops;
+}
+
+static bool ramdisk_submit(blk_device_t *device, io_request_t *request) {
+    ramdisk_t *ramdisk = device->driver;
+    if (ramdisk->in_flight_count == ramdisk->config.queue_depth) return false;
+
+    uint64_t now = timer_ticks();
+    uint64_t start = now;
+    if (ramdisk->config.serial && ramdisk->busy_until > start) {
+        start = ramdisk->busy_until;
+    }
+    uint64_t due = start + ns_to_ticks(sample_latency(ramdisk, request));
+    ramdisk->busy_until = due;
+
+    request->submit_ticks = now;
+    ramdisk->in_flight[ramdisk->in_flight_count] = request;
+    ramdisk->due_ticks[ramdisk->in_flight_count] = due;
+    ramdisk->in_flight_count++;
+    return true;
+}
+
+static uint32_t ramdisk_poll(blk_device_t *device) {
+    ramdisk_t *ramdisk = device->driver;
+    uint64_t now = timer_ticks();
+    uint32_t completed = 0;
+
+    while (ramdisk->in_flight_count > 0) {
+        // Complete the earliest deadline first, so completion order is deterministic
+        uint32_t earliest = 0;
+        for (uint32_t i = 1; i < ramdisk->in_flight_count; i++) {
+            if (ramdisk->due_ticks[i] < ramdisk->due_ticks[earliest]) earliest = i;
+        }
+        if (ramdisk->due_ticks[earliest] > now) break;
+
+        io_request_t *request = ramdisk->in_flight[earliest];
+        ramdisk->in_flight_count--;
+        ramdisk->in_flight[earliest] = ramdisk->in_flight[ramdisk->in_flight_count];
+        ramdisk->due_ticks[earliest] = ramdisk->due_ticks[ramdisk->in_flight_count];
+
+        request->success = transfer(ramdisk, request);
+        request->complete_ticks = timer_ticks();
+        blk_complete(request);
+        completed++;
+    }
+    return completed;
+}
+
+static void ramdisk_abort(blk_device_t *device) {
+    ramdisk_t *ramdisk = device->driver;
+
+    // Callbacks may submit again, so the requests are taken off the disk before any completes
+    io_request_t *aborted[RAMDISK_MAX_QUEUE_DEPTH];
+    uint32_t count = ramdisk->in_flight_count;
+    memcpy(aborted, ramdisk->in_flight, count * sizeof(io_request_t *));
+    ramdisk->in_flight_count = 0;
+    ramdisk->busy_until = 0;
+
+    uint64_t now = timer_ticks();
+    for (uint32_t i = 0; i < count; i++) {
+        aborted[i]->success = false;
+        aborted[i]->complete_ticks = now;
+        blk_complete(aborted[i]);
+    }
+}
+
+static uint64_t sample_latency(ramdisk_t *ramdisk, io_request_t *request) {
+    ramdisk_latency_t *model;
+    switch (request->op) {
+        case IO_OP_READ:
+            model = &ramdisk->config.read;
+            break;
+        case IO_OP_WRITE:
+        case IO_OP_DISCARD:
+            model = &ramdisk->config.write;
+            break;
+        default:
+            model = &ramdisk->config.flush;
+            break;
+    }
+
+    uint64_t latency = 0;
+    switch (model->distribution) {
+        case RAMDISK_LATENCY_FIXED:
+            latency = model->min_ns;
+            break;
+        case RAMDISK_LATENCY_UNIFORM:
+            if (model->max_ns > model->min_ns) {
+                uint64_t range = model->max_ns - model->min_ns;
+                latency = model->min_ns
+                    + (((unsigned __int128) xorshift64(&ramdisk->rng) * range) >> 64);
+            } else {
+                latency = model->min_ns;
+            }
+            break;
+        default:
+            return 0;
+    }
+
+    latency += model->per_sector_ns * request->count;
+
+    if (model->tail_per_mille != 0 && xorshift64(&ramdisk->rng) % 1000 < model->tail_per_mille) {
+        latency += model->tail_ns;
+    }
+
+    if (model->seek_ns_per_gb != 0 && request->op != IO_OP_FLUSH) {
+        uint64_t distance = request->lba > ramdisk->last_lba
+            ? request->lba - ramdisk->last_lba : ramdisk->last_lba - request->lba;
+        latency += distance * ramdisk->config.sector_size / (1024 * 1024) * model->seek_ns_per_gb
+            / 1024;
+        ramdisk->last_lba = request->lba + request->count;
+    }
+    return latency;
+}
+
+static bool transfer(ramdisk_t *ramdisk, io_request_t *request) {
+    if (request->op == IO_OP_FLUSH) return true;
+    if (request->lba + request->count > ramdisk->config.sector_count) return false;
+
+    uint8_t *disk = ramdisk->data + request->lba * ramdisk->config.sector_size;
+    size_t bytes = (size_t) request->count * ramdisk->config.sector_size;
+    if (request->op == IO_OP_DISCARD) {
+        memset(disk, 0, bytes);
+        return true;
+    }
+
+    io_segment_t single;
+    uint32_t segment_count;
+    io_segment_t *segments = blk_segments(request, &single, &segment_count);
+    for (uint32_t i = 0; i < segment_count; i++) {
+        if (request->op == IO_OP_WRITE) {
+            memcpy(disk, segments[i].buffer, segments[i].length);
+        } else {
+            memcpy(segments[i].buffer, disk, segments[i].length);
+        }
+        disk += segments[i].length;
+    }
+    return true;
+}
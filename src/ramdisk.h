@@ -0,0 +1,135 @@
+#ifndef _RAMDISK_H_
+#define _RAMDISK_H_
+
+#define RAMDISK_LATENCY_NONE 0      // Complete on the next poll, at memory speed
+#define RAMDISK_LATENCY_FIXED 1     // Always min_ns
+#define RAMDISK_LATENCY_UNIFORM 2   // Uniform between min_ns and max_ns
+
+#define RAMDISK_MAX_QUEUE_DEPTH 256
+#define RAMDISK_MAX_SEGMENTS 256
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief How long one kind of operation takes to complete
+ */
+typedef struct ramdisk_latency {
+    uint8_t distribution;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    /**
+     * @brief Added for every sector transferred, to emulate the device bandwidth
+     */
+    uint64_t per_sector_ns;
+    /**
+     * @brief Fraction of requests (in thousandths) which take an extra tail_ns, to emulate
+     * garbage collection stalls or retries
+     */
+    uint32_t tail_per_mille;
+    uint64_t tail_ns;
+    /**
+     * @brief Added per GB between the end of the previous request and the start of this one, to
+     * emulate head movement
+     */
+    uint64_t seek_ns_per_gb;
+} ramdisk_latency_t;
+
+typedef struct ramdisk_config {
+    uint64_t sector_count;
+    uint32_t sector_size;
+    /**
+     * @brief Maximum requests in flight, further submissions are refused
+     */
+    uint32_t queue_depth;
+    /**
+     * @brief If true, a request only starts once the previous one has finished, like a single
+     * disk head. Otherwise requests are serviced in parallel, like flash channels
+     */
+    bool serial;
+    uint64_t seed;
+    ramdisk_latency_t read;
+    ramdisk_latency_t write;
+    ramdisk_latency_t flush;
+} ramdisk_config_t;
+
+typedef struct ramdisk {
+    blk_device_t device;
+    uint8_t number;
+    ramdisk_config_t config;
+    uint8_t *data;
+    uint64_t rng;
+    uint64_t last_lba;
+    uint64_t busy_until;
+    /**
+     * @brief Requests in flight and the timestamp counter value each may complete at
+     */
+    io_request_t *in_flight[RAMDISK_MAX_QUEUE_DEPTH];
+    uint64_t due_ticks[RAMDISK_MAX_QUEUE_DEPTH];
+    uint32_t in_flight_count;
+} ramdisk_t;
+
+/**
+ * @brief Fills config for a disk of the given size without any latency
+ */
+void ramdisk_config_memory(ramdisk_config_t *config, uint64_t sector_count);
+
+/**
+ * @brief Fills config with timings resembling a SATA SSD: ~80us reads, ~20us writes, 530MB/s and
+ * occasional 2ms stalls, 32 requests serviced in parallel
+ */
+void ramdisk_config_ssd(ramdisk_config_t *config, uint64_t sector_count);
+
+/**
+ * @brief Fills config with timings resembling a 7200rpm hard drive: 0-8.3ms rotation plus seeks
+ * by distance, 180MB/s, one request at a time
+ */
+void ramdisk_config_hdd(ramdisk_config_t *config, uint64_t sector_count);
+
+/**
+ * @brief Allocates and initialises a RAM disk, registering it as a block device named "ramN"
+ * 
+ * @param config Size, queue depth and latency model of the disk, copied into the disk
+ * @param ramdisk Output disk
+ * @return True if the backing memory could be allocated
+ */
+bool init_ramdisk(ramdisk_config_t *config, ramdisk_t **ramdisk);
+
+/**
+ * @brief Returns true if the block device is a RAM disk
+ */
+bool is_ramdisk(blk_device_t *device);
+
+/**
+ * @brief Issues a request to the disk without waiting for it to complete
+ * 
+ * @return False if the queue is full
+ */
+static bool ramdisk_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Completes any requests whose latency has elapsed, oldest deadline first
+ * 
+ * @return Number of requests completed
+ */
+static uint32_t ramdisk_poll(blk_device_t *device);
+
+/**
+ * @brief Fails every request in flight without transferring its data
+ */
+static void ramdisk_abort(blk_device_t *device);
+
+/**
+ * @brief Draws the service time of a request from the latency model of its operation
+ */
+static uint64_t sample_latency(ramdisk_t *ramdisk, io_request_t *request);
+
+/**
+ * @brief Copies the data of a request between its buffer and the disk, returning false if it is
+ * out of range
+ */
+static bool transfer(ramdisk_t *ramdisk, io_request_t *request);
+
+#endif
@@ -1,4 +1,7 @@
+#include <stdbool.h>
+
 #include "std.h"
+#include "defs.h"
 
 uint8_t swap_byte(uint8_t byte) {
     uint8_t new_byte;
@@ -22,6 +25,33 @@ uint16_t swap_int16(uint16_t int16) {
 
 void handle_error(char *string) {
     printf(string);
+    if (BENCH_MODE) return; // Nobody is attached to answer when running headless
     printf("Enter anything to continue: ");
     char c = getchar();
 }
+
+uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+void *dma_alloc(size_t size) {
+    // Identity mapped, so the physical address is also the pointer
+    efi_physical_address_t address = 0xFFFFFFFF;
+    efi_status_t status = BS->AllocatePages(
+        AllocateMaxAddress, EfiLoaderData, EFI_SIZE_TO_PAGES(size), &address);
+    if (EFI_ERROR(status)) {
+        return NULL;
+    }
+    memset((void *) address, 0, size);
+    return (void *) address;
+}
+
+void dma_free(void *pointer, size_t size) {
+    if (pointer == NULL) return;
+    BS->FreePages((efi_physical_address_t) pointer, EFI_SIZE_TO_PAGES(size));
+}
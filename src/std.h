@@ -15,4 +15,21 @@ uint16_t swap_int16(uint16_t int16);
 
 void handle_error(char *string);
 
+/**
+ * @brief Fast xorshift64* pseudo-random generator. The state must be seeded with a non-zero value
+ */
+uint64_t xorshift64(uint64_t *state);
+
+/**
+ * @brief Allocates zeroed, page aligned memory below 4GB which any bus master can address
+ * 
+ * @return Pointer to the memory, or NULL if none could be allocated
+ */
+void *dma_alloc(size_t size);
+
+/**
+ * @brief Frees memory returned by dma_alloc. Size must match the size it was allocated with
+ */
+void dma_free(void *pointer, size_t size);
+
 #endif
@@ -0,0 +1,44 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "timer.h"
+
+// Calibrate over 50ms, which keeps boot fast while giving a sub-0.1% error
+#define CALIBRATION_US 50000
+
+static uint64_t ticks_per_second = 0;
+
+void init_timer() {
+    uint64_t start = timer_ticks();
+    BS->Stall(CALIBRATION_US);
+    uint64_t end = timer_ticks();
+
+    ticks_per_second = (end - start) * (1000000 / CALIBRATION_US);
+
+    if (BOOT_VERBOSE) {
+        printf("Timestamp counter frequency: %d kHz\n", ticks_per_second / 1000);
+    }
+}
+
+uint64_t timer_ticks() {
+    uint32_t low, high;
+    __asm__ volatile ("rdtsc" : "=a" (low), "=d" (high));
+    return ((uint64_t) high << 32) | low;
+}
+
+uint64_t timer_frequency() {
+    return ticks_per_second;
+}
+
+uint64_t ticks_to_ns(uint64_t ticks) {
+    if (ticks_per_second == 0) return 0;
+    // Split the division so the multiplication cannot overflow 64 bits
+    return (ticks / ticks_per_second) * 1000000000
+        + (ticks % ticks_per_second) * 1000000000 / ticks_per_second;
+}
+
+uint64_t ns_to_ticks(uint64_t ns) {
+    return (ns / 1000000000) * ticks_per_second
+        + (ns % 1000000000) * ticks_per_second / 1000000000;
+}
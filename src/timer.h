@@ -0,0 +1,32 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+#include <uefi/uefi.h>
+
+/**
+ * @brief Calibrates the timestamp counter against the UEFI stall service. Must be called before
+ * any of the conversion functions are used
+ */
+void init_timer();
+
+/**
+ * @brief Reads the current value of the timestamp counter
+ */
+uint64_t timer_ticks();
+
+/**
+ * @brief Returns the number of timestamp counter ticks per second found during calibration
+ */
+uint64_t timer_frequency();
+
+/**
+ * @brief Converts a number of timestamp counter ticks to nanoseconds
+ */
+uint64_t ticks_to_ns(uint64_t ticks);
+
+/**
+ * @brief Converts a number of nanoseconds to timestamp counter ticks
+ */
+uint64_t ns_to_ticks(uint64_t ns);
+
+#endif
@@ -0,0 +1,403 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "trace.h"
+
+static trace_t capture;
+static bool capturing = false;
+
+typedef struct replay_state {
+    uint32_t sector_size;
+    uint64_t ios;
+    uint64_t bytes;
+    uint64_t errors;
+    uint64_t latency_total_ns;
+    io_request_t *idle[TRACE_REPLAY_MAX_QUEUE_DEPTH];
+    uint32_t idle_count;
+    io_request_t requests[TRACE_REPLAY_MAX_QUEUE_DEPTH];
+} replay_state_t;
+
+bool trace_start(size_t capacity) {
+    trace_stop();
+    free(capture.records);
+    memset(&capture, 0, sizeof(trace_t));
+
+    capture.records = malloc(capacity * sizeof(trace_record_t));
+    if (capture.records == NULL) {
+        handle_error("Could not allocate trace buffer\n");
+        return false;
+    }
+    capture.capacity = capacity;
+    capture.start_ticks = timer_ticks();
+    capturing = true;
+    return true;
+}
+
+void trace_stop() {
+    if (!capturing) return;
+    capturing = false;
+
+    // Ids are registry indices, so the names are saved while they still mean the same devices
+    uint32_t count = blk_device_count();
+    if (count > TRACE_MAX_DEVICES) count = TRACE_MAX_DEVICES;
+    for (uint32_t i = 0; i < count; i++) {
+        strncpy(capture.device_names[i], blk_get(i)->name, BLK_NAME_LENGTH - 1);
+    }
+    capture.device_count = count;
+}
+
+trace_t *trace_get() {
+    return capture.records == NULL ? NULL : &capture;
+}
+
+void trace_io(uint8_t device, io_request_t *request) {
+    if (!capturing) return;
+
+    size_t index = capture.head + capture.count;
+    if (index >= capture.capacity) index -= capture.capacity;
+    if (capture.count == capture.capacity) {
+        capture.head = capture.head + 1 == capture.capacity ? 0 : capture.head + 1;
+        capture.overwritten++;
+    } else {
+        capture.count++;
+    }
+
+    uint64_t latency_ns = ticks_to_ns(request->complete_ticks - request->submit_ticks);
+    trace_record_t *record = &capture.records[index];
+    record->timestamp_ns = ticks_to_ns(request->submit_ticks - capture.start_ticks);
+    record->lba_device_op = (request->lba & 0xFFFFFFFFFFFF)
+        | (uint64_t) device << 48
+        | (uint64_t) (request->op & 0xF) << 56
+        | (uint64_t) (request->flags & 0xF) << 60;
+    record->count = request->count;
+    record->latency_ns = latency_ns > 0xFFFFFFFF ? 0xFFFFFFFF : latency_ns;
+}
+
+trace_record_t *trace_at(trace_t *trace, size_t i) {
+    size_t index = trace->head + i;
+    if (index >= trace->capacity) index -= trace->capacity;
+    return &trace->records[index];
+}
+
+bool trace_dump(trace_t *trace, char_t *path) {
+    sort_by_submission(trace);
+    FILE *file = path == NULL ? NULL : fopen(path, "w");
+
+    if (file != NULL) {
+        trace_file_header_t header = {
+            TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t), trace->count, trace->device_count
+        };
+        bool success = fwrite(&header, sizeof(header), 1, file) == 1;
+        if (success && trace->device_count > 0) {
+            success = fwrite(trace->device_names, BLK_NAME_LENGTH, trace->device_count, file)
+                == trace->device_count;
+        }
+
+        // The ring may wrap, so write it as up to two contiguous runs
+        size_t first = trace->capacity - trace->head;
+        if (first > trace->count) first = trace->count;
+        size_t second = trace->count - first;
+        if (success && first > 0) {
+            success = fwrite(&trace->records[trace->head], sizeof(trace_record_t), first, file)
+                == first;
+        }
+        if (success && second > 0) {
+            success = fwrite(trace->records, sizeof(trace_record_t), second, file) == second;
+        }
+        fclose(file);
+
+        if (success) {
+            if (BOOT_VERBOSE) {
+                printf("Wrote %d trace records (%d overwritten)\n", (uint64_t) trace->count,
+                    trace->overwritten);
+            }
+            return true;
+        }
+        printf("Could not write trace file, dumping to console\n");
+    }
+
+    printf("trace_device,id,name\n");
+    for (uint32_t i = 0; i < trace->device_count; i++) {
+        printf("trace_device,%d,%s\n", (uint64_t) i, trace->device_names[i]);
+    }
+    printf("trace,timestamp_ns,device,op,flags,lba,count,latency_ns\n");
+    for (size_t i = 0; i < trace->count; i++) {
+        trace_record_t *record = trace_at(trace, i);
+        printf("trace,%d,%d,%d,%d,%d,%d,%d\n",
+            record->timestamp_ns,
+            (record->lba_device_op >> 48) & 0xFF,
+            (record->lba_device_op >> 56) & 0xF,
+            record->lba_device_op >> 60,
+            record->lba_device_op & 0xFFFFFFFFFFFF,
+            (uint64_t) record->count,
+            (uint64_t) record->latency_ns);
+    }
+    return true;
+}
+
+bool trace_load(char_t *path, trace_t *trace) {
+    memset(trace, 0, sizeof(trace_t));
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        handle_error("Could not open trace file\n");
+        return false;
+    }
+
+    trace_file_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+     || header.magic != TRACE_MAGIC
+     || header.version != TRACE_VERSION
+     || header.record_size != sizeof(trace_record_t)
+     || header.device_count > TRACE_MAX_DEVICES) {
+        fclose(file);
+        handle_error("Not a valid trace file\n");
+        return false;
+    }
+    if (header.device_count > 0
+     && fread(trace->device_names, BLK_NAME_LENGTH, header.device_count, file)
+        != header.device_count) {
+        fclose(file);
+        handle_error("Trace file is truncated\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < header.device_count; i++) {
+        trace->device_names[i][BLK_NAME_LENGTH - 1] = 0;
+    }
+    trace->device_count = header.device_count;
+
+    trace->records = malloc(header.count * sizeof(trace_record_t));
+    if (trace->records == NULL) {
+        fclose(file);
+        handle_error("Could not allocate trace buffer\n");
+        return false;
+    }
+    trace->capacity = header.count;
+    trace->count = fread(trace->records, sizeof(trace_record_t), header.count, file);
+    fclose(file);
+
+    if (trace->count != header.count) {
+        trace_free(trace);
+        handle_error("Trace file is truncated\n");
+        return false;
+    }
+    sort_by_submission(trace);
+    return true;
+}
+
+void trace_free(trace_t *trace) {
+    free(trace->records);
+    memset(trace, 0, sizeof(trace_t));
+}
+
+bool trace_parse_args(trace_replay_config_t *config, int argc, char **argv) {
+    config->path = TRACE_OUTPUT_FILE;
+    config->device_name = "sata0";
+    config->traced_id = -1;
+    config->mode = TRACE_REPLAY_FAST;
+    config->queue_depth = TRACE_REPLAY_MAX_QUEUE_DEPTH;
+    config->writes = false;
+    config->region_start = 0;
+    config->region_sectors = 0;
+
+    // argv[1] is "replay" itself
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "mode=fast") == 0) {
+            config->mode = TRACE_REPLAY_FAST;
+        } else if (strcmp(argv[i], "mode=timed") == 0) {
+            config->mode = TRACE_REPLAY_TIMED;
+        } else if (strncmp(argv[i], "dev=", 4) == 0) {
+            config->device_name = argv[i] + 4;
+        } else if (strncmp(argv[i], "id=", 3) == 0) {
+            config->traced_id = atol(argv[i] + 3);
+            if (config->traced_id < 0 || config->traced_id >= TRACE_MAX_DEVICES) {
+                handle_error("Traced device id must be between 0 and 255\n");
+                return false;
+            }
+        } else if (strncmp(argv[i], "writes=", 7) == 0) {
+            config->writes = atol(argv[i] + 7) != 0;
+        } else if (strncmp(argv[i], "start=", 6) == 0) {
+            config->region_start = atol(argv[i] + 6);
+        } else if (strncmp(argv[i], "sectors=", 8) == 0) {
+            config->region_sectors = atol(argv[i] + 8);
+        } else if (strncmp(argv[i], "qd=", 3) == 0) {
+            config->queue_depth = atol(argv[i] + 3);
+            if (config->queue_depth == 0 || config->queue_depth > TRACE_REPLAY_MAX_QUEUE_DEPTH) {
+                handle_error("Replay queue depth must be between 1 and 32\n");
+                return false;
+            }
+        } else if (strchr(argv[i], '=') == NULL) {
+            config->path = argv[i];
+        } else {
+            handle_error("Unknown replay argument\n");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool trace_replay(blk_device_t *device, trace_t *trace, trace_replay_config_t *config) {
+    uint8_t mode = config->mode;
+    uint32_t queue_depth = config->queue_depth;
+    if (queue_depth > TRACE_REPLAY_MAX_QUEUE_DEPTH) queue_depth = TRACE_REPLAY_MAX_QUEUE_DEPTH;
+
+    uint64_t region_start = config->region_start;
+    uint64_t region_end = region_start + config->region_sectors;
+    if (config->writes && (region_start == 0 || config->region_sectors == 0
+        || region_end > device->sector_count)) {
+        handle_error("Replayed writes need start= and sectors= inside the disk, past LBA 0\n");
+        return false;
+    }
+    uint8_t traced_id;
+    if (!find_traced_device(trace, config, &traced_id)) return false;
+
+    uint32_t max_count = 1;
+    uint64_t original_latency_ns = 0;
+    uint64_t original_count = 0;
+    for (size_t i = 0; i < trace->count; i++) {
+        trace_record_t *record = trace_at(trace, i);
+        if (((record->lba_device_op >> 48) & 0xFF) != traced_id) continue;
+        if (record->count > max_count) max_count = record->count;
+        original_latency_ns += record->latency_ns;
+        original_count++;
+    }
+    if (max_count > device->max_transfer) max_count = device->max_transfer;
+
+    // Written data is zeroes, only the access pattern is reproduced
+    size_t buffer_size = (size_t) max_count * device->sector_size;
+    uint8_t *buffers = dma_alloc(buffer_size * queue_depth);
+    replay_state_t *state = malloc(sizeof(replay_state_t));
+    if (buffers == NULL || state == NULL) {
+        handle_error("Could not allocate replay buffers\n");
+        dma_free(buffers, buffer_size * queue_depth);
+        free(state);
+        return false;
+    }
+    memset(buffers, 0, buffer_size * queue_depth);
+    memset(state, 0, sizeof(replay_state_t));
+    state->sector_size = device->sector_size;
+    for (uint32_t i = 0; i < queue_depth; i++) {
+        io_request_t *request = &state->requests[i];
+        request->buffer = buffers + i * buffer_size;
+        request->callback = replay_complete;
+        request->context = state;
+        state->idle[state->idle_count++] = request;
+    }
+
+    uint64_t skipped = 0;
+    uint64_t other_device = 0;
+    uint64_t refused = 0;
+    uint64_t start = timer_ticks();
+    size_t next = 0;
+    while (next < trace->count || state->idle_count < queue_depth) {
+        while (next < trace->count && state->idle_count > 0) {
+            trace_record_t *record = trace_at(trace, next);
+            uint64_t lba = record->lba_device_op & 0xFFFFFFFFFFFF;
+            uint8_t op = (record->lba_device_op >> 56) & 0xF;
+
+            if (((record->lba_device_op >> 48) & 0xFF) != traced_id) {
+                other_device++;
+                next++;
+                continue;
+            }
+            if ((op == IO_OP_WRITE || op == IO_OP_DISCARD) && (!config->writes
+                || lba < region_start || lba + record->count > region_end)) {
+                refused++;
+                next++;
+                continue;
+            }
+            if (lba + record->count > device->sector_count || record->count > max_count
+             || op > IO_OP_DISCARD) {
+                skipped++;
+                next++;
+                continue;
+            }
+            if (mode == TRACE_REPLAY_TIMED
+             && timer_ticks() - start < ns_to_ticks(record->timestamp_ns)) {
+                break;
+            }
+
+            io_request_t *request = state->idle[--state->idle_count];
+            request->op = op;
+            request->flags = record->lba_device_op >> 60;
+            request->lba = lba;
+            request->count = record->count;
+            blk_submit(device, request);
+            next++;
+        }
+        blk_poll(device);
+    }
+    uint64_t elapsed_us = ticks_to_ns(timer_ticks() - start) / 1000;
+    if (elapsed_us == 0) elapsed_us = 1;
+
+    uint64_t completed = state->ios + state->errors;
+    uint64_t original_us = trace->count == 0
+        ? 0 : trace_at(trace, trace->count - 1)->timestamp_ns / 1000;
+    printf("replay,traced_device,mode,qd,ios,errors,skipped,other_device,refused,elapsed_us,"
+        "original_us,iops,mbps,avg_lat_ns,original_avg_lat_ns\n");
+    printf("replay,%s,%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d\n",
+        traced_id < trace->device_count ? trace->device_names[traced_id] : "?",
+        mode == TRACE_REPLAY_TIMED ? "timed" : "fast",
+        (uint64_t) queue_depth,
+        state->ios,
+        state->errors,
+        skipped,
+        other_device,
+        refused,
+        elapsed_us,
+        original_us,
+        state->ios * 1000000 / elapsed_us,
+        state->bytes / elapsed_us,
+        completed == 0 ? 0 : state->latency_total_ns / completed,
+        original_count == 0 ? 0 : original_latency_ns / original_count);
+
+    bool success = state->errors == 0;
+    dma_free(buffers, buffer_size * queue_depth);
+    free(state);
+    return success;
+}
+
+static void sort_by_submission(trace_t *trace) {
+    for (size_t i = 1; i < trace->count; i++) {
+        trace_record_t record = *trace_at(trace, i);
+        size_t j = i;
+        while (j > 0 && trace_at(trace, j - 1)->timestamp_ns > record.timestamp_ns) {
+            *trace_at(trace, j) = *trace_at(trace, j - 1);
+            j--;
+        }
+        *trace_at(trace, j) = record;
+    }
+}
+
+static bool find_traced_device(trace_t *trace, trace_replay_config_t *config, uint8_t *id) {
+    if (config->traced_id >= 0) {
+        *id = config->traced_id;
+        return true;
+    }
+    for (uint32_t i = 0; i < trace->device_count; i++) {
+        if (strncmp(trace->device_names[i], config->device_name, BLK_NAME_LENGTH) == 0) {
+            *id = i;
+            return true;
+        }
+    }
+    handle_error("Trace has no device of that name, pass id= to pick one\n");
+    return false;
+}
+
+static void replay_complete(io_request_t *request) {
+    replay_state_t *state = request->context;
+
+    if (request->success) {
+        state->ios++;
+        state->bytes += (uint64_t) request->count * state->sector_size;
+    } else {
+        state->errors++;
+    }
+    state->latency_total_ns += ticks_to_ns(request->complete_ticks - request->submit_ticks);
+    state->idle[state->idle_count++] = request;
+}
@@ -0,0 +1,171 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#define TRACE_CAPACITY 65536               // Records kept before the oldest are overwritten
+#define TRACE_OUTPUT_FILE "\\trace.bin"    // Dumped as text on the console if not writable
+#define TRACE_MAGIC 0x31435254             // "TRC1"
+#define TRACE_VERSION 2
+#define TRACE_MAX_DEVICES 256              // Device ids are 8 bits in a record
+
+#define TRACE_REPLAY_FAST 0                // Issue as soon as a queue slot is free
+#define TRACE_REPLAY_TIMED 1               // Issue at the original offsets from the start
+#define TRACE_REPLAY_MAX_QUEUE_DEPTH 32
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief One completed block request, packed into 24 bytes
+ */
+typedef struct trace_record {
+    /**
+     * @brief Time the request was submitted, relative to the start of the capture
+     */
+    uint64_t timestamp_ns;
+    /**
+     * Bit 0-47  - LBA
+     * Bit 48-55 - Device
+     * Bit 56-59 - Operation (IO_OP_*)
+     * Bit 60-63 - Flags (IO_FLAG_*)
+     */
+    uint64_t lba_device_op;
+    uint32_t count;
+    /**
+     * @brief Time from submission to completion, saturating at ~4.3s
+     */
+    uint32_t latency_ns;
+} __attribute__((packed)) trace_record_t;
+
+/**
+ * @brief Header at the start of a trace file, followed by the names of device_count devices
+ * (BLK_NAME_LENGTH bytes each, indexed by device id), then count records in submission order
+ */
+typedef struct trace_file_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t count;
+    uint32_t device_count;
+} __attribute__((packed)) trace_file_header_t;
+
+/**
+ * @brief Ring of trace records. Once full, new records overwrite the oldest
+ */
+typedef struct trace {
+    trace_record_t *records;
+    size_t capacity;
+    size_t head;        // Index of the oldest record
+    size_t count;
+    uint64_t overwritten;
+    uint64_t start_ticks;
+    /**
+     * @brief Names of the block devices the records refer to, indexed by device id
+     */
+    char_t device_names[TRACE_MAX_DEVICES][BLK_NAME_LENGTH];
+    uint32_t device_count;
+} trace_t;
+
+typedef struct trace_replay_config {
+    char_t *path;
+    char_t *device_name;
+    /**
+     * @brief Device id whose records are replayed, -1 for the traced device named device_name
+     */
+    int32_t traced_id;
+    uint8_t mode;
+    uint32_t queue_depth;
+    /**
+     * @brief Writes and discards are only replayed if set, and then only inside the region
+     */
+    bool writes;
+    uint64_t region_start;
+    uint64_t region_sectors;
+} trace_replay_config_t;
+
+/**
+ * @brief Starts capturing every completed request into a ring of the given number of records,
+ * discarding any previous capture
+ */
+bool trace_start(size_t capacity);
+
+/**
+ * @brief Stops capturing and saves the names of the registered block devices with the capture.
+ * The captured records stay available through trace_get
+ */
+void trace_stop();
+
+/**
+ * @brief Returns the current capture, or NULL if none was started
+ */
+trace_t *trace_get();
+
+/**
+ * @brief Records a completed request. Called by the block layer as requests complete, and does
+ * nothing unless a capture is running. The ring is therefore in completion order until
+ * trace_dump sorts it
+ * 
+ * @param device Block device id
+ */
+void trace_io(uint8_t device, io_request_t *request);
+
+/**
+ * @brief Returns the i-th oldest record of the trace
+ */
+trace_record_t *trace_at(trace_t *trace, size_t i);
+
+/**
+ * @brief Sorts the trace into submission order, then writes it to a binary file on the boot
+ * volume. If path is NULL or the file cannot be written, the device names and records are printed
+ * as CSV lines prefixed with "trace_device," and "trace," instead
+ */
+bool trace_dump(trace_t *trace, char_t *path);
+
+/**
+ * @brief Loads a trace written by trace_dump, sorting it into submission order if it is not
+ */
+bool trace_load(char_t *path, trace_t *trace);
+
+/**
+ * @brief Frees the records of a trace returned by trace_load
+ */
+void trace_free(trace_t *trace);
+
+/**
+ * @brief Parses the arguments following "replay" on the command line:
+ * <path> [dev=<name>] [id=<n>] [mode=fast|timed] [qd=<n>] [writes=1 start=<lba> sectors=<n>]
+ */
+bool trace_parse_args(trace_replay_config_t *config, int argc, char **argv);
+
+/**
+ * @brief Re-issues the records of one traced device against the device, either as fast as the
+ * queue depth allows or at the original submission times, then prints a "replay," CSV summary
+ * comparing the latencies with the original run. Records of other devices are skipped, since every
+ * layer under a partition or volume traces the same I/O again. Writes and discards are refused
+ * unless the config allows them, and then only inside its region
+ * 
+ * @return True if every request completed successfully
+ */
+bool trace_replay(blk_device_t *device, trace_t *trace, trace_replay_config_t *config);
+
+/**
+ * @brief Sorts the records by submission time. Completion order is nearly that already, so an
+ * insertion sort only moves each record past the few submitted after it that finished first
+ */
+static void sort_by_submission(trace_t *trace);
+
+/**
+ * @brief Finds the id of the traced device to replay, config->traced_id if set, otherwise the
+ * traced device with the name config->device_name
+ * 
+ * @return False if the trace has no such device
+ */
+static bool find_traced_device(trace_t *trace, trace_replay_config_t *config, uint8_t *id);
+
+/**
+ * @brief Completion callback for replayed requests
+ */
+static void replay_complete(io_request_t *request);
+
+#endif
@@ -2,6 +2,7 @@
 #define _TYPES_H
 
 #include <uefi/uefi.h>
+#include <stdbool.h>
 
 volatile struct rsdp {
     /**
@@ -341,11 +342,87 @@ typedef volatile struct pci_header_2 {
     uint32_t pc_card_legacy_mode_base_address;
 } pci_header_2_t;
 
-typedef volatile struct pci_device_list {
-    struct pci_header **all_devices;
+/**
+ * @brief Configuration space offsets of the capabilities a driver looks for, found once when the
+ * function is enumerated. 0 where the function does not have the capability
+ */
+typedef struct pci_capabilities {
+    uint8_t power;
+    uint8_t msi;
+    uint8_t msix;
+    uint8_t pcie;
+    /**
+     * @brief The first vendor specific capability, pci_find_capability finds the others
+     */
+    uint8_t vendor;
+    uint8_t reserved;
+    /**
+     * @brief Advanced error reporting, an extended capability at 0x100 or above
+     */
+    uint16_t aer;
+} pci_capabilities_t;
+
+/**
+ * @brief Functions found by init_pci. The fields that identify each function are copied out of
+ * configuration space into parallel arrays, so drivers can search them without MMIO reads. Every
+ * array lives in the one allocation starting at all_devices and has room for capacity entries, a
+ * multiple of 16 so they can be compared a vector at a time
+ */
+typedef struct pci_device_list {
+    pci_header_t **all_devices;
+    pci_capabilities_t *capabilities;
     size_t device_list_size;
+    size_t capacity;
+    uint16_t *segment;
+    uint16_t *vendor_id;
+    uint16_t *device_id;
+    uint8_t *bus;
+    uint8_t *device;
+    uint8_t *function;
+    uint8_t *class_code;
+    uint8_t *subclass;
+    uint8_t *prog_if;
+    /**
+     * @brief As read, including the multi-function bit
+     */
+    uint8_t *header_type;
 } pci_device_list_t;
 
+/**
+ * @brief Fields a device must have to match a search of the device list, each PCI_ANY to match
+ * anything. The header type is compared without the multi-function bit
+ */
+typedef struct pci_match {
+    uint16_t vendor_id;
+    uint16_t device_id;
+    uint16_t class_code;
+    uint16_t subclass;
+    uint16_t prog_if;
+    uint16_t header_type;
+} pci_match_t;
+
+/**
+ * @brief A function's MSI-X table and pending bit array, mapped through the BARs the capability
+ * names, and the block of vectors its entries carry
+ */
+typedef struct pci_msix {
+    pci_header_t *header;
+    /**
+     * @brief 4 dwords per entry: message address, upper address, data and vector control
+     */
+    volatile uint32_t *table;
+    /**
+     * @brief One bit per entry, set while a masked entry has a message waiting
+     */
+    volatile uint64_t *pending;
+    uint16_t offset;
+    /**
+     * @brief Entries programmed, from entry 0, with vectors first_vector onwards
+     */
+    uint16_t entries;
+    uint8_t first_vector;
+} pci_msix_t;
+
 typedef struct pci_msi_capabilities {
     uint8_t id;
     uint8_t next;
@@ -640,4 +717,600 @@ typedef struct hba_cmd_tbl
 	hba_prdt_entry_t prdt_entry;	// Physical region descriptor table entries, 0 ~ 65535
 } hba_cmd_tbl_t;
 
+typedef volatile struct nvme_registers {
+    /**
+     * Bit 0-15  - Maximum queue entries supported, minus one
+     * Bit 16    - Contiguous queues required
+     * Bit 24-31 - Timeout for CSTS.RDY changes, in 500ms units
+     * Bit 32-35 - Doorbell stride, as a power of two of 4 bytes
+     * Bit 37-44 - Command sets supported
+     * Bit 48-51 - Minimum memory page size, as a power of two of 4KB
+     */
+    uint64_t capabilities;          // 0x00
+    uint32_t version;               // 0x08
+    uint32_t interrupt_mask_set;    // 0x0C
+    uint32_t interrupt_mask_clear;  // 0x10
+    /**
+     * Bit 0     - Enable
+     * Bit 4-6   - I/O command set selected
+     * Bit 7-10  - Memory page size, as a power of two of 4KB
+     * Bit 11-13 - Arbitration mechanism selected
+     * Bit 14-15 - Shutdown notification
+     * Bit 16-19 - I/O submission queue entry size, as a power of two
+     * Bit 20-23 - I/O completion queue entry size, as a power of two
+     */
+    uint32_t configuration;         // 0x14
+    uint32_t reserved;              // 0x18
+    /**
+     * Bit 0     - Ready
+     * Bit 1     - Controller fatal status
+     * Bit 2-3   - Shutdown status
+     */
+    uint32_t status;                // 0x1C
+    uint32_t subsystem_reset;       // 0x20
+    uint32_t admin_queue_attributes;// 0x24
+    uint64_t admin_sq_base;         // 0x28
+    uint64_t admin_cq_base;         // 0x30
+} nvme_registers_t;
+
+typedef struct nvme_command {
+    /**
+     * Bit 0-7   - Opcode
+     * Bit 8-9   - Fused operation
+     * Bit 14-15 - PRP or SGL for data transfer
+     * Bit 16-31 - Command identifier
+     */
+    uint32_t command_dword0;
+    uint32_t namespace_id;
+    uint64_t reserved;
+    uint64_t metadata_pointer;
+    /**
+     * @brief Either two PRP entries or one SGL descriptor
+     */
+    uint64_t data_pointer[2];
+    uint32_t command_dword10;
+    uint32_t command_dword11;
+    uint32_t command_dword12;
+    uint32_t command_dword13;
+    uint32_t command_dword14;
+    uint32_t command_dword15;
+} nvme_command_t;
+
+typedef struct nvme_completion {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t command_id;
+    /**
+     * Bit 0     - Phase tag
+     * Bit 1-8   - Status code
+     * Bit 9-11  - Status code type
+     * Bit 14    - More
+     * Bit 15    - Do not retry
+     */
+    uint16_t status;
+} nvme_completion_t;
+
+typedef struct nvme_sgl_descriptor {
+    uint64_t address;
+    uint32_t length;
+    uint8_t reserved[3];
+    /**
+     * Bit 0-3   - Descriptor sub type
+     * Bit 4-7   - Descriptor type, 0 for a data block
+     */
+    uint8_t type;
+} nvme_sgl_descriptor_t;
+
+typedef struct nvme_dsm_range {
+    uint32_t attributes;
+    uint32_t length;
+    uint64_t lba;
+} nvme_dsm_range_t;
+
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+    { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08} }
+
+typedef struct efi_processor_information {
+    /**
+     * @brief Local APIC ID of the processor
+     */
+    uint64_t processor_id;
+    /**
+     * Bit 0     - Processor is the BSP
+     * Bit 1     - Processor is enabled
+     * Bit 2     - Processor is healthy
+     */
+    uint32_t status_flag;
+    uint32_t package;
+    uint32_t core;
+    uint32_t thread;
+} efi_processor_information_t;
+
+typedef void (EFIAPI *efi_ap_procedure_t)(void *argument);
+
+/**
+ * @brief EFI_MP_SERVICES_PROTOCOL from the UEFI PI specification, used to start application
+ * processors while boot services are still running
+ */
+typedef struct efi_mp_services_protocol {
+    efi_status_t (EFIAPI *get_number_of_processors)(struct efi_mp_services_protocol *this,
+        uintn_t *number_of_processors, uintn_t *number_of_enabled_processors);
+    efi_status_t (EFIAPI *get_processor_info)(struct efi_mp_services_protocol *this,
+        uintn_t processor_number, efi_processor_information_t *buffer);
+    efi_status_t (EFIAPI *startup_all_aps)(struct efi_mp_services_protocol *this,
+        efi_ap_procedure_t procedure, boolean_t single_thread, efi_event_t wait_event,
+        uintn_t timeout_us, void *argument, uintn_t **failed_cpu_list);
+    efi_status_t (EFIAPI *startup_this_ap)(struct efi_mp_services_protocol *this,
+        efi_ap_procedure_t procedure, uintn_t processor_number, efi_event_t wait_event,
+        uintn_t timeout_us, void *argument, boolean_t *finished);
+    efi_status_t (EFIAPI *switch_bsp)(struct efi_mp_services_protocol *this,
+        uintn_t processor_number, boolean_t enable_old_bsp);
+    efi_status_t (EFIAPI *enable_disable_ap)(struct efi_mp_services_protocol *this,
+        uintn_t processor_number, boolean_t enable_ap, uint32_t *health_flag);
+    efi_status_t (EFIAPI *who_am_i)(struct efi_mp_services_protocol *this,
+        uintn_t *processor_number);
+} efi_mp_services_protocol_t;
+
+/**
+ * @brief Vendor specific PCI capability (ID 0x09) locating a virtio configuration structure
+ */
+typedef volatile struct virtio_pci_cap {
+    uint8_t id;
+    uint8_t next;
+    uint8_t length;
+    /**
+     * 1 - Common configuration
+     * 2 - Notifications, followed by the notify offset multiplier
+     * 3 - ISR status
+     * 4 - Device specific configuration
+     * 5 - PCI configuration access
+     */
+    uint8_t config_type;
+    uint8_t bar;
+    uint8_t reserved[3];
+    uint32_t offset;                // Within the BAR
+    uint32_t size;
+    uint32_t notify_off_multiplier; // Only present for notification capabilities
+} virtio_pci_cap_t;
+
+typedef volatile struct virtio_pci_common_cfg {
+    uint32_t device_feature_select; // 0x00
+    uint32_t device_feature;        // 0x04
+    uint32_t driver_feature_select; // 0x08
+    uint32_t driver_feature;        // 0x0C
+    uint16_t msix_config;           // 0x10
+    uint16_t num_queues;            // 0x12
+    /**
+     * Bit 0     - Acknowledge
+     * Bit 1     - Driver
+     * Bit 2     - Driver OK
+     * Bit 3     - Features OK
+     * Bit 6     - Device needs reset
+     * Bit 7     - Failed
+     */
+    uint8_t device_status;          // 0x14
+    uint8_t config_generation;      // 0x15
+    uint16_t queue_select;          // 0x16
+    uint16_t queue_size;            // 0x18
+    uint16_t queue_msix_vector;     // 0x1A
+    uint16_t queue_enable;          // 0x1C
+    uint16_t queue_notify_off;      // 0x1E
+    uint64_t queue_desc;            // 0x20
+    uint64_t queue_driver;          // 0x28
+    uint64_t queue_device;          // 0x30
+} virtio_pci_common_cfg_t;
+
+typedef struct virtq_desc {
+    uint64_t address;
+    uint32_t length;
+    /**
+     * Bit 0     - Next field is valid
+     * Bit 1     - Device writes the buffer
+     * Bit 2     - Buffer is a table of indirect descriptors
+     */
+    uint16_t flags;
+    uint16_t next;
+} virtq_desc_t;
+
+/**
+ * @brief Driver area of a split virtqueue, ring has one entry per descriptor and is followed by
+ * used_event when VIRTIO_F_EVENT_IDX is negotiated
+ */
+typedef volatile struct virtq_avail {
+    uint16_t flags;
+    uint16_t index;
+    uint16_t ring[];
+} virtq_avail_t;
+
+typedef struct virtq_used_elem {
+    uint32_t id;        // Head of the completed descriptor chain
+    uint32_t length;    // Bytes written by the device
+} virtq_used_elem_t;
+
+/**
+ * @brief Device area of a split virtqueue, ring is followed by avail_event when
+ * VIRTIO_F_EVENT_IDX is negotiated
+ */
+typedef volatile struct virtq_used {
+    uint16_t flags;
+    uint16_t index;
+    virtq_used_elem_t ring[];
+} virtq_used_t;
+
+typedef volatile struct __attribute__((packed)) virtio_blk_config {
+    uint64_t capacity;              // In 512 byte sectors
+    uint32_t size_max;
+    uint32_t seg_max;
+    uint16_t cylinders;
+    uint8_t heads;
+    uint8_t sectors;
+    uint32_t block_size;
+    uint8_t physical_block_exp;
+    uint8_t alignment_offset;
+    uint16_t min_io_size;
+    uint32_t opt_io_size;
+    uint8_t writeback;
+    uint8_t unused;
+    uint16_t num_queues;
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+} virtio_blk_config_t;
+
+typedef struct virtio_blk_request_header {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;                // In 512 byte sectors
+} virtio_blk_request_header_t;
+
+typedef struct virtio_blk_discard {
+    uint64_t sector;
+    uint32_t sector_count;
+    uint32_t flags;
+} virtio_blk_discard_t;
+
+typedef struct __attribute__((packed)) mbr_partition {
+    uint8_t status;
+    uint8_t first_chs[3];
+    uint8_t type;               // 0xEE for a GPT protective partition
+    uint8_t last_chs[3];
+    uint32_t first_lba;
+    uint32_t sector_count;
+} mbr_partition_t;
+
+typedef struct __attribute__((packed)) mbr {
+    uint8_t boot_code[440];
+    uint32_t disk_signature;
+    uint16_t reserved;
+    mbr_partition_t partitions[4];
+    uint16_t signature;         // 0xAA55
+} mbr_t;
+
+typedef struct __attribute__((packed)) gpt_header {
+    uint64_t signature;         // "EFI PART"
+    uint32_t revision;
+    uint32_t header_size;
+    uint32_t header_crc32;      // Over header_size bytes, with this field zeroed
+    uint32_t reserved;
+    uint64_t current_lba;
+    uint64_t backup_lba;
+    uint64_t first_usable_lba;
+    uint64_t last_usable_lba;
+    efi_guid_t disk_guid;
+    uint64_t entries_lba;
+    uint32_t entry_count;
+    uint32_t entry_size;
+    uint32_t entries_crc32;
+} gpt_header_t;
+
+typedef struct __attribute__((packed)) gpt_entry {
+    efi_guid_t type_guid;       // All zero for an unused entry
+    efi_guid_t unique_guid;
+    uint64_t first_lba;
+    uint64_t last_lba;          // Inclusive
+    uint64_t attributes;
+    uint16_t name[36];          // UTF-16LE
+} gpt_entry_t;
+
+typedef struct __attribute__((packed)) fat32_boot_sector {
+    uint8_t jump[3];
+    uint8_t oem[8];
+    uint16_t bytes_per_sector;
+    uint8_t sectors_per_cluster;
+    uint16_t reserved_sectors;
+    uint8_t fat_count;
+    uint16_t root_entry_count;      // 0 on FAT32
+    uint16_t total_sectors_16;
+    uint8_t media;
+    uint16_t fat_size_16;           // 0 on FAT32
+    uint16_t sectors_per_track;
+    uint16_t head_count;
+    uint32_t hidden_sectors;
+    uint32_t total_sectors_32;
+    uint32_t fat_size_32;
+    uint16_t extended_flags;
+    uint16_t version;
+    uint32_t root_cluster;
+    uint16_t fs_info_sector;
+    uint16_t backup_boot_sector;
+    uint8_t reserved[12];
+    uint8_t drive_number;
+    uint8_t reserved1;
+    uint8_t boot_signature;
+    uint32_t volume_id;
+    uint8_t volume_label[11];
+    uint8_t fs_type[8];
+} fat32_boot_sector_t;
+
+typedef struct __attribute__((packed)) fat_dir_entry {
+    uint8_t name[11];               // 8.3, space padded. 0x00 ends the directory, 0xE5 is deleted
+    uint8_t attributes;
+    uint8_t case_flags;             // Bit 3 - name is lower case, Bit 4 - extension is lower case
+    uint8_t create_time_tenths;
+    uint16_t create_time;
+    uint16_t create_date;
+    uint16_t access_date;
+    uint16_t cluster_high;
+    uint16_t write_time;
+    uint16_t write_date;
+    uint16_t cluster_low;
+    uint32_t size;
+} fat_dir_entry_t;
+
+/**
+ * @brief Long file name entry, stored in reverse order before the 8.3 entry it names
+ */
+typedef struct __attribute__((packed)) fat_lfn_entry {
+    uint8_t order;                  // Bit 6 marks the last (first stored) entry
+    uint16_t name1[5];
+    uint8_t attributes;             // Always 0x0F
+    uint8_t type;
+    uint8_t checksum;               // Of the 8.3 name
+    uint16_t name2[6];
+    uint16_t cluster;
+    uint16_t name3[2];
+} fat_lfn_entry_t;
+
+/**
+ * @brief The ext2/3/4 superblock, 1024 bytes into the volume. Only fields up to s_flags are named
+ */
+typedef struct __attribute__((packed)) ext2_superblock {
+    uint32_t inodes_count;
+    uint32_t blocks_count_lo;
+    uint32_t reserved_blocks_count_lo;
+    uint32_t free_blocks_count_lo;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;      // 1 for 1K blocks, otherwise 0
+    uint32_t log_block_size;        // Block size is 1024 << log_block_size
+    uint32_t log_cluster_size;
+    uint32_t blocks_per_group;
+    uint32_t clusters_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mount_time;
+    uint32_t write_time;
+    uint16_t mount_count;
+    uint16_t max_mount_count;
+    uint16_t magic;                 // 0xEF53
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_revision;
+    uint32_t last_check;
+    uint32_t check_interval;
+    uint32_t creator_os;
+    uint32_t revision;              // 0 has fixed 128 byte inodes and no feature flags
+    uint16_t default_reserved_uid;
+    uint16_t default_reserved_gid;
+    uint32_t first_inode;
+    uint16_t inode_size;
+    uint16_t block_group;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;
+    uint32_t feature_ro_compat;
+    uint8_t uuid[16];
+    char volume_name[16];
+    char last_mounted[64];
+    uint32_t algorithm_bitmap;
+    uint8_t prealloc_blocks;
+    uint8_t prealloc_dir_blocks;
+    uint16_t reserved_gdt_blocks;
+    uint8_t journal_uuid[16];
+    uint32_t journal_inode;
+    uint32_t journal_device;
+    uint32_t last_orphan;
+    uint32_t hash_seed[4];          // Seed of the directory index hash
+    uint8_t default_hash_version;
+    uint8_t journal_backup_type;
+    uint16_t descriptor_size;       // Group descriptor size with the 64-bit feature
+    uint32_t default_mount_options;
+    uint32_t first_meta_group;
+    uint32_t mkfs_time;
+    uint32_t journal_blocks[17];
+    uint32_t blocks_count_hi;
+    uint32_t reserved_blocks_count_hi;
+    uint32_t free_blocks_count_hi;
+    uint16_t min_extra_inode_size;
+    uint16_t want_extra_inode_size;
+    uint32_t flags;                 // Bit 0 - signed directory hash, Bit 1 - unsigned
+    uint8_t reserved[668];
+} ext2_superblock_t;
+
+/**
+ * @brief Block group descriptor. Without the 64-bit feature only the first 32 bytes are stored
+ */
+typedef struct __attribute__((packed)) ext2_group_descriptor {
+    uint32_t block_bitmap_lo;
+    uint32_t inode_bitmap_lo;
+    uint32_t inode_table_lo;
+    uint16_t free_blocks_count_lo;
+    uint16_t free_inodes_count_lo;
+    uint16_t used_directories_count_lo;
+    uint16_t flags;
+    uint32_t exclude_bitmap_lo;
+    uint16_t block_bitmap_checksum_lo;
+    uint16_t inode_bitmap_checksum_lo;
+    uint16_t inode_table_unused_lo;
+    uint16_t checksum;
+    uint32_t block_bitmap_hi;
+    uint32_t inode_bitmap_hi;
+    uint32_t inode_table_hi;
+    uint16_t free_blocks_count_hi;
+    uint16_t free_inodes_count_hi;
+    uint16_t used_directories_count_hi;
+    uint16_t inode_table_unused_hi;
+    uint32_t exclude_bitmap_hi;
+    uint16_t block_bitmap_checksum_hi;
+    uint16_t inode_bitmap_checksum_hi;
+    uint32_t reserved;
+} ext2_group_descriptor_t;
+
+/**
+ * @brief The 128 bytes every inode has. Larger inodes carry extra fields after these
+ */
+typedef struct __attribute__((packed)) ext2_inode {
+    uint16_t mode;                  // Type in the top 4 bits, 0x4 directory, 0x8 regular file
+    uint16_t uid;
+    uint32_t size_lo;
+    uint32_t access_time;
+    uint32_t change_time;
+    uint32_t modify_time;
+    uint32_t delete_time;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t blocks_lo;
+    uint32_t flags;
+    uint32_t os1;
+    /**
+     * @brief 12 direct, one indirect, one double and one triple indirect block, or the root of
+     * an extent tree
+     */
+    uint32_t block[15];
+    uint32_t generation;
+    uint32_t file_acl_lo;
+    uint32_t size_hi;
+    uint32_t fragment_address;
+    uint8_t os2[12];
+} ext2_inode_t;
+
+typedef struct __attribute__((packed)) ext4_extent_header {
+    uint16_t magic;                 // 0xF30A
+    uint16_t entries;
+    uint16_t max;
+    uint16_t depth;                 // 0 when the entries are leaves
+    uint32_t generation;
+} ext4_extent_header_t;
+
+typedef struct __attribute__((packed)) ext4_extent_index {
+    uint32_t block;                 // First file block covered
+    uint32_t leaf_lo;               // Block holding the next level
+    uint16_t leaf_hi;
+    uint16_t unused;
+} ext4_extent_index_t;
+
+typedef struct __attribute__((packed)) ext4_extent {
+    uint32_t block;                 // First file block covered
+    uint16_t length;                // Above 32768 the extent is allocated but unwritten
+    uint16_t start_hi;
+    uint32_t start_lo;
+} ext4_extent_t;
+
+typedef struct __attribute__((packed)) ext2_dir_entry {
+    uint32_t inode;                 // 0 for an unused entry
+    uint16_t record_length;
+    uint8_t name_length;
+    uint8_t file_type;              // With the file type feature, otherwise high byte of name_length
+    char name[];
+} ext2_dir_entry_t;
+
+/**
+ * @brief Header of a hashed directory, after the "." and ".." entries of its first block
+ */
+typedef struct __attribute__((packed)) ext2_dx_root_info {
+    uint32_t reserved;
+    uint8_t hash_version;
+    uint8_t info_length;            // 8
+    uint8_t indirect_levels;
+    uint8_t unused_flags;
+} ext2_dx_root_info_t;
+
+/**
+ * @brief Entry of a hashed directory node. The first entry of each node holds the limit and count
+ * in place of its hash, which is implicitly 0
+ */
+typedef struct __attribute__((packed)) ext2_dx_entry {
+    uint32_t hash;
+    uint32_t block;                 // Directory block, not device block
+} ext2_dx_entry_t;
+
+#define IO_OP_READ 0
+#define IO_OP_WRITE 1
+#define IO_OP_FLUSH 2
+#define IO_OP_DISCARD 3
+
+#define IO_FLAG_FUA 0x1 // Write must reach stable media before completing
+
+/**
+ * @brief One piece of a scatter-gather transfer
+ */
+typedef struct io_segment {
+    void *buffer;
+    uint32_t length;        // Bytes, a multiple of 4 like the buffer address
+} io_segment_t;
+
+/**
+ * @brief A single asynchronous request to a storage device. The caller owns the request until its
+ * callback runs, and must not modify it while it is in flight
+ */
+typedef struct io_request {
+    /**
+     * @brief One of IO_OP_*
+     */
+    uint8_t op;
+    /**
+     * @brief Combination of IO_FLAG_* values
+     */
+    uint8_t flags;
+    /**
+     * @brief Set by the driver before the callback runs
+     */
+    bool success;
+    /**
+     * @brief First sector of the transfer
+     */
+    uint64_t lba;
+    /**
+     * @brief Number of sectors to transfer
+     */
+    uint32_t count;
+    /**
+     * @brief Data buffer, which must be DMA capable (see dma_alloc)
+     */
+    void *buffer;
+    /**
+     * @brief If segment_count is not zero the data is scattered over these segments instead of
+     * buffer. Their lengths must add up to count sectors
+     */
+    io_segment_t *segments;
+    uint32_t segment_count;
+    /**
+     * @brief Timestamp counter values when the request was issued and when it completed
+     */
+    uint64_t submit_ticks;
+    uint64_t complete_ticks;
+    /**
+     * @brief Called from the driver's poll function once the request has completed
+     */
+    void (*callback)(struct io_request *request);
+    /**
+     * @brief Free for use by the owner of the request
+     */
+    void *context;
+    /**
+     * @brief Device the request was submitted to and link in its queue, owned by the block layer
+     */
+    struct blk_device *device;
+    struct io_request *next;
+} io_request_t;
+
 #endif
@@ -0,0 +1,426 @@
+#include "virtio.h"
+#include "std.h"
+#include "defs.h"
+#include "pci.h"
+#include "timer.h"
+#include "blk.h"
+
+static const blk_ops_t virtio_ops = {virtio_submit, virtio_poll, virtio_abort};
+
+bool init_virtio(pci_device_list_t device_list) {
+    if (BOOT_VERBOSE) {
+        printf("Starting initialisation for virtio-blk\n");
+    }
+
+    pci_match_t match = {VIRTIO_VENDOR_ID, PCI_ANY, PCI_ANY, PCI_ANY, PCI_ANY, 0x0};
+    uint32_t matches[PCI_MAX_MATCHES];
+    uint32_t match_count = pci_find(&device_list, &match, matches, PCI_MAX_MATCHES);
+    if (match_count > PCI_MAX_MATCHES) match_count = PCI_MAX_MATCHES;
+
+    uint32_t device_count = 0;
+    for (uint32_t i = 0; i < match_count; i++) {
+        uint16_t device_id = device_list.device_id[matches[i]];
+        if (device_id != VIRTIO_DEVICE_BLK && device_id != VIRTIO_DEVICE_BLK_TRANSITIONAL) {
+            continue;
+        }
+        pci_header_t *pci_header = device_list.all_devices[matches[i]];
+
+        virtio_blk_t *virtio = malloc(sizeof(virtio_blk_t));
+        if (virtio == NULL) {
+            handle_error("Could not allocate virtio device\n");
+            return device_count > 0;
+        }
+        memset(virtio, 0, sizeof(virtio_blk_t));
+        virtio->device.ops = &virtio_ops;
+        virtio->device.driver = virtio;
+
+        pci_header_0_t *header = (pci_header_0_t *) pci_header;
+        // Memory space and bus master, with INTx off since completions are polled
+        header->command |= 0x406;
+        uint8_t vendor = device_list.capabilities[matches[i]].vendor;
+        if (!find_structures(virtio, header, vendor) || !init_device(virtio)) {
+            free(virtio);
+            continue;
+        }
+
+        blk_device_t *device = &virtio->device;
+        snprintf(device->name, BLK_NAME_LENGTH, "virtio%d", (uint64_t) device_count);
+        if (!blk_register(device)) {
+            free(virtio);
+            continue;
+        }
+
+        if (BOOT_VERBOSE) {
+            printf("%s: %d sectors of %d bytes, queue size %d, event index %s\n",
+                device->name, device->sector_count, (uint64_t) device->sector_size,
+                (uint64_t) virtio->queue_size,
+                (virtio->features & VIRTIO_F_EVENT_IDX) ? "on" : "off");
+        }
+        device_count++;
+    }
+
+    if (device_count == 0 && BOOT_VERBOSE) {
+        printf("No virtio-blk devices found\n");
+    }
+    return device_count > 0;
+}
+
+static bool find_structures(virtio_blk_t *virtio, pci_header_0_t *header, uint8_t offset) {
+    uint32_t notify_multiplier = 0;
+    uint32_t notify_base = 0;
+
+    while (offset != 0) {
+        virtio_pci_cap_t *cap = (virtio_pci_cap_t *) ((uint8_t *) header + offset);
+        uint64_t bar = cap->bar < 6 ? pci_bar_address(header, cap->bar) : 0;
+
+        if (bar != 0) {
+            void *structure = (void *) (bar + cap->offset);
+            switch (cap->config_type) {
+                case VIRTIO_CAP_COMMON:
+                    if (virtio->common == NULL) virtio->common = structure;
+                    break;
+                case VIRTIO_CAP_NOTIFY:
+                    if (virtio->notify == NULL) {
+                        virtio->notify = structure;
+                        notify_multiplier = cap->notify_off_multiplier;
+                    }
+                    break;
+                case VIRTIO_CAP_DEVICE:
+                    if (virtio->config == NULL) virtio->config = structure;
+                    break;
+            }
+        }
+        offset = pci_find_capability(header, PCI_CAP_VENDOR, offset);
+    }
+
+    if (virtio->common == NULL || virtio->notify == NULL || virtio->config == NULL) {
+        handle_error("virtio-blk device has no modern PCI capabilities\n");
+        return false;
+    }
+
+    // Queue 0 is the only queue used, its doorbell is found once the queue is selected
+    virtio->common->queue_select = 0;
+    uint16_t notify_offset = virtio->common->queue_notify_off;
+    virtio->notify = (volatile uint16_t *)
+        ((uint8_t *) virtio->notify + (uint64_t) notify_offset * notify_multiplier);
+    return true;
+}
+
+static bool init_device(virtio_blk_t *virtio) {
+    virtio_pci_common_cfg_t *common = virtio->common;
+
+    common->device_status = 0;
+    uint64_t deadline = timer_ticks() + ns_to_ticks((uint64_t) VIRTIO_RESET_TIMEOUT_MS * 1000000);
+    while (common->device_status != 0) {
+        if (timer_ticks() > deadline) {
+            handle_error("virtio-blk device did not reset\n");
+            return false;
+        }
+    }
+    common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+    common->device_status |= VIRTIO_STATUS_DRIVER;
+
+    common->device_feature_select = 0;
+    uint64_t offered = common->device_feature;
+    common->device_feature_select = 1;
+    offered |= (uint64_t) common->device_feature << 32;
+
+    uint64_t wanted = VIRTIO_F_VERSION_1 | VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX
+        | VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_BLK_SIZE
+        | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD;
+    virtio->features = offered & wanted;
+    if (!(virtio->features & VIRTIO_F_VERSION_1) || !(virtio->features & VIRTIO_F_INDIRECT_DESC)) {
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        handle_error("virtio-blk device lacks VERSION_1 or indirect descriptors\n");
+        return false;
+    }
+
+    common->driver_feature_select = 0;
+    common->driver_feature = (uint32_t) virtio->features;
+    common->driver_feature_select = 1;
+    common->driver_feature = virtio->features >> 32;
+    common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+    if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        handle_error("virtio-blk device rejected the negotiated features\n");
+        return false;
+    }
+
+    // The generation changes if the device updates its configuration while it is being read
+    virtio_blk_config_t *config = virtio->config;
+    uint8_t generation;
+    uint64_t capacity;
+    uint32_t block_size, size_max, seg_max;
+    do {
+        generation = common->config_generation;
+        capacity = config->capacity;
+        block_size = config->block_size;
+        size_max = config->size_max;
+        seg_max = config->seg_max;
+    } while (generation != common->config_generation);
+
+    virtio->sector_shift = 0;
+    if ((virtio->features & VIRTIO_BLK_F_BLK_SIZE) && block_size > 512 && block_size <= 4096
+        && (block_size & (block_size - 1)) == 0) {
+        virtio->sector_shift = __builtin_ctz(block_size) - 9;
+    }
+    virtio->segment_bytes = VIRTIO_SEGMENT_BYTES;
+    if ((virtio->features & VIRTIO_BLK_F_SIZE_MAX) && size_max >= 4096
+        && size_max < virtio->segment_bytes) {
+        virtio->segment_bytes = size_max & ~0xFFF;
+    }
+    virtio->max_segments = VIRTIO_MAX_SEGMENTS;
+    if ((virtio->features & VIRTIO_BLK_F_SEG_MAX) && seg_max != 0 && seg_max < VIRTIO_MAX_SEGMENTS) {
+        virtio->max_segments = seg_max;
+    }
+
+    blk_device_t *device = &virtio->device;
+    device->sector_size = 512 << virtio->sector_shift;
+    device->sector_count = capacity >> virtio->sector_shift;
+    // Half the descriptors are kept for scatter-gather segments, since each caller segment can
+    // add one more split to those the transfer size already needs
+    device->max_segments = virtio->max_segments / 2;
+    device->max_transfer = ((uint64_t) virtio->segment_bytes
+        * (virtio->max_segments - device->max_segments)) >> (9 + virtio->sector_shift);
+    if (device->max_transfer > 0xFFFF) device->max_transfer = 0xFFFF;
+    device->capabilities = 0;
+    if (virtio->features & VIRTIO_BLK_F_FLUSH) device->capabilities |= BLK_CAP_FLUSH;
+    if (virtio->features & VIRTIO_BLK_F_DISCARD) device->capabilities |= BLK_CAP_DISCARD;
+
+    if (!init_queue(virtio)) {
+        common->device_status |= VIRTIO_STATUS_FAILED;
+        return false;
+    }
+    device->queue_depth = virtio->queue_size;
+
+    common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+    return true;
+}
+
+static bool init_queue(virtio_blk_t *virtio) {
+    virtio_pci_common_cfg_t *common = virtio->common;
+    common->queue_select = 0;
+
+    // Indices wrap at 65536, so keep the ring size a power of two
+    uint16_t size = common->queue_size;
+    if (size > VIRTIO_QUEUE_SIZE) size = VIRTIO_QUEUE_SIZE;
+    while (size & (size - 1)) size &= size - 1;
+    if (size == 0) {
+        handle_error("virtio-blk device has no request queue\n");
+        return false;
+    }
+
+    // The used_event and avail_event words sit after each ring
+    uint64_t avail_bytes = sizeof(virtq_avail_t) + (size + 1) * sizeof(uint16_t);
+    uint64_t used_bytes = sizeof(virtq_used_t) + size * sizeof(virtq_used_elem_t)
+        + sizeof(uint16_t);
+    if (virtio->descriptors == NULL) {
+        virtio->queue_size = size;
+        virtio->descriptors = dma_alloc(size * sizeof(virtq_desc_t));
+        virtio->avail = dma_alloc(avail_bytes);
+        virtio->used = dma_alloc(used_bytes);
+        virtio->slots = dma_alloc(size * sizeof(virtio_slot_t));
+        virtio->requests = malloc(size * sizeof(io_request_t *));
+        virtio->aborted = malloc(size * sizeof(io_request_t *));
+        virtio->free_descriptors = malloc(size * sizeof(uint16_t));
+        if (virtio->descriptors == NULL || virtio->avail == NULL || virtio->used == NULL
+            || virtio->slots == NULL || virtio->requests == NULL || virtio->aborted == NULL
+            || virtio->free_descriptors == NULL) {
+            handle_error("Could not allocate virtqueue\n");
+            virtio->descriptors = NULL;
+            return false;
+        }
+    } else if (size < virtio->queue_size) {
+        handle_error("virtio-blk device shrank its request queue after a reset\n");
+        return false;
+    } else {
+        // A reset after an abort reuses the rings, which the device has stopped using
+        size = virtio->queue_size;
+        avail_bytes = sizeof(virtq_avail_t) + (size + 1) * sizeof(uint16_t);
+        used_bytes = sizeof(virtq_used_t) + size * sizeof(virtq_used_elem_t) + sizeof(uint16_t);
+    }
+    common->queue_size = size;
+    memset((void *) virtio->avail, 0, avail_bytes);
+    memset((void *) virtio->used, 0, used_bytes);
+    virtio->used_event = &virtio->avail->ring[size];
+    virtio->avail_event = (volatile uint16_t *) &virtio->used->ring[size];
+
+    virtio->free_count = size;
+    for (uint16_t i = 0; i < size; i++) {
+        virtio->free_descriptors[i] = size - 1 - i;
+        virtio->requests[i] = NULL;
+    }
+    virtio->avail_index = 0;
+    virtio->notified_index = 0;
+    virtio->used_index = 0;
+
+    // Completions are polled, so ask the device not to interrupt. With event indices the
+    // used_event is kept just behind used_index, which is only reached after 65536 completions
+    if (virtio->features & VIRTIO_F_EVENT_IDX) {
+        *virtio->used_event = virtio->used_index - 1;
+    } else {
+        virtio->avail->flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+
+    common->queue_desc = (uint64_t) virtio->descriptors;
+    common->queue_driver = (uint64_t) virtio->avail;
+    common->queue_device = (uint64_t) virtio->used;
+    common->queue_msix_vector = 0xFFFF; // No vector
+    common->queue_enable = 1;
+    return true;
+}
+
+static void kick_queue(virtio_blk_t *virtio) {
+    uint16_t new_index = virtio->avail_index;
+    uint16_t old_index = virtio->notified_index;
+    if (new_index == old_index) return;
+
+    // The available index must be visible before the device's suppression state is read
+    __asm__ volatile ("mfence" ::: "memory");
+
+    bool notify;
+    if (virtio->features & VIRTIO_F_EVENT_IDX) {
+        uint16_t event = *virtio->avail_event;
+        notify = (uint16_t) (new_index - event - 1) < (uint16_t) (new_index - old_index);
+    } else {
+        notify = !(virtio->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    virtio->notified_index = new_index;
+    if (notify) *virtio->notify = 0;
+}
+
+static void virtio_abort(blk_device_t *device) {
+    virtio_blk_t *virtio = device->driver;
+
+    // Callbacks may submit again, so the requests are taken off the queue before it is reset
+    uint16_t count = 0;
+    for (uint16_t i = 0; i < virtio->queue_size; i++) {
+        if (virtio->requests[i] != NULL) virtio->aborted[count++] = virtio->requests[i];
+        virtio->requests[i] = NULL;
+    }
+    // Writing zero to device_status resets the device, which then forgets the whole queue
+    if (!init_device(virtio)) handle_error("virtio-blk device did not recover from an abort\n");
+
+    uint64_t now = timer_ticks();
+    for (uint16_t i = 0; i < count; i++) {
+        virtio->aborted[i]->success = false;
+        virtio->aborted[i]->complete_ticks = now;
+        blk_complete(virtio->aborted[i]);
+    }
+}
+
+static bool virtio_submit(blk_device_t *device, io_request_t *request) {
+    virtio_blk_t *virtio = device->driver;
+    if (virtio->free_count == 0) return false;
+
+    uint16_t head = virtio->free_descriptors[--virtio->free_count];
+    virtio_slot_t *slot = &virtio->slots[head];
+    virtq_desc_t *table = slot->table;
+    uint32_t entries = 1;
+
+    slot->header.reserved = 0;
+    slot->header.sector = request->lba << virtio->sector_shift;
+    slot->status = 0xFF;
+    table[0].address = (uint64_t) &slot->header;
+    table[0].length = sizeof(virtio_blk_request_header_t);
+
+    switch (request->op) {
+        case IO_OP_READ:
+        case IO_OP_WRITE: {
+            bool read = request->op == IO_OP_READ;
+            slot->header.type = read ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+
+            // Split each segment into pieces the device accepts
+            io_segment_t single;
+            uint32_t segment_count;
+            io_segment_t *segments = blk_segments(request, &single, &segment_count);
+            for (uint32_t i = 0; i < segment_count; i++) {
+                uint8_t *buffer = segments[i].buffer;
+                uint32_t bytes = segments[i].length;
+                while (bytes > 0 && entries <= virtio->max_segments) {
+                    uint32_t chunk = bytes > virtio->segment_bytes ? virtio->segment_bytes : bytes;
+                    table[entries].address = (uint64_t) buffer;
+                    table[entries].length = chunk;
+                    table[entries].flags = read ? VIRTQ_DESC_F_WRITE : 0;
+                    buffer += chunk;
+                    bytes -= chunk;
+                    entries++;
+                }
+            }
+            break;
+        }
+        case IO_OP_FLUSH:
+            slot->header.type = VIRTIO_BLK_T_FLUSH;
+            slot->header.sector = 0;
+            break;
+        case IO_OP_DISCARD:
+            slot->header.type = VIRTIO_BLK_T_DISCARD;
+            slot->header.sector = 0;
+            slot->discard.sector = request->lba << virtio->sector_shift;
+            slot->discard.sector_count = request->count << virtio->sector_shift;
+            slot->discard.flags = 0;
+            table[entries].address = (uint64_t) &slot->discard;
+            table[entries].length = sizeof(virtio_blk_discard_t);
+            table[entries].flags = 0;
+            entries++;
+            break;
+    }
+
+    table[entries].address = (uint64_t) &slot->status;
+    table[entries].length = 1;
+    table[entries].flags = VIRTQ_DESC_F_WRITE;
+    entries++;
+    for (uint32_t i = 0; i + 1 < entries; i++) {
+        table[i].flags |= VIRTQ_DESC_F_NEXT;
+        table[i].next = i + 1;
+    }
+    table[0].flags = VIRTQ_DESC_F_NEXT;
+
+    virtq_desc_t *descriptor = &virtio->descriptors[head];
+    descriptor->address = (uint64_t) table;
+    descriptor->length = entries * sizeof(virtq_desc_t);
+    descriptor->flags = VIRTQ_DESC_F_INDIRECT;
+    descriptor->next = 0;
+
+    virtio->requests[head] = request;
+    request->submit_ticks = timer_ticks();
+
+    // Stores are not reordered on x86, so a compiler barrier orders the ring entry before the index
+    virtio->avail->ring[virtio->avail_index & (virtio->queue_size - 1)] = head;
+    __asm__ volatile ("" ::: "memory");
+    virtio->avail_index++;
+    virtio->avail->index = virtio->avail_index;
+    return true;
+}
+
+static uint32_t virtio_poll(blk_device_t *device) {
+    virtio_blk_t *virtio = device->driver;
+    kick_queue(virtio);
+
+    uint64_t now = 0;
+    uint32_t completed = 0;
+    while (virtio->used_index != virtio->used->index) {
+        __asm__ volatile ("" ::: "memory");
+        virtq_used_elem_t *element = (virtq_used_elem_t *)
+            &virtio->used->ring[virtio->used_index & (virtio->queue_size - 1)];
+        uint16_t head = element->id;
+        virtio->used_index++;
+
+        io_request_t *request = virtio->requests[head];
+        virtio->requests[head] = NULL;
+        virtio->free_descriptors[virtio->free_count++] = head;
+        if (request == NULL) continue;
+
+        if (now == 0) now = timer_ticks();
+        request->success = virtio->slots[head].status == 0;
+        request->complete_ticks = now;
+        blk_complete(request);
+        completed++;
+    }
+
+    if (virtio->features & VIRTIO_F_EVENT_IDX) {
+        *virtio->used_event = virtio->used_index - 1;
+    }
+    return completed;
+}
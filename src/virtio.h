@@ -0,0 +1,140 @@
+#ifndef _VIRTIO_H_
+#define _VIRTIO_H_
+
+#define VIRTIO_VENDOR_ID 0x1AF4
+#define VIRTIO_DEVICE_BLK_TRANSITIONAL 0x1001
+#define VIRTIO_DEVICE_BLK 0x1042
+
+#define VIRTIO_QUEUE_SIZE 128
+#define VIRTIO_MAX_SEGMENTS 32         // Data descriptors in one indirect table
+#define VIRTIO_SEGMENT_BYTES 0x400000  // Used when the device sets no size_max
+#define VIRTIO_RESET_TIMEOUT_MS 1000
+
+#define VIRTIO_CAP_COMMON 1
+#define VIRTIO_CAP_NOTIFY 2
+#define VIRTIO_CAP_DEVICE 4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 0x1
+#define VIRTIO_STATUS_DRIVER 0x2
+#define VIRTIO_STATUS_DRIVER_OK 0x4
+#define VIRTIO_STATUS_FEATURES_OK 0x8
+#define VIRTIO_STATUS_FAILED 0x80
+
+#define VIRTIO_BLK_F_SIZE_MAX (1ULL << 1)
+#define VIRTIO_BLK_F_SEG_MAX (1ULL << 2)
+#define VIRTIO_BLK_F_BLK_SIZE (1ULL << 6)
+#define VIRTIO_BLK_F_FLUSH (1ULL << 9)
+#define VIRTIO_BLK_F_DISCARD (1ULL << 13)
+#define VIRTIO_F_INDIRECT_DESC (1ULL << 28)
+#define VIRTIO_F_EVENT_IDX (1ULL << 29)
+#define VIRTIO_F_VERSION_1 (1ULL << 32)
+
+#define VIRTQ_DESC_F_NEXT 0x1
+#define VIRTQ_DESC_F_WRITE 0x2
+#define VIRTQ_DESC_F_INDIRECT 0x4
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 0x1
+#define VIRTQ_USED_F_NO_NOTIFY 0x1
+
+#define VIRTIO_BLK_T_IN 0
+#define VIRTIO_BLK_T_OUT 1
+#define VIRTIO_BLK_T_FLUSH 4
+#define VIRTIO_BLK_T_DISCARD 11
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+
+/**
+ * @brief Per descriptor storage for one request, referenced by its indirect descriptor
+ */
+typedef struct virtio_slot {
+    virtio_blk_request_header_t header;
+    virtio_blk_discard_t discard;
+    uint8_t status;
+    uint8_t reserved[31];
+    virtq_desc_t table[VIRTIO_MAX_SEGMENTS + 2];
+} virtio_slot_t;
+
+typedef struct virtio_blk {
+    blk_device_t device;
+    virtio_pci_common_cfg_t *common;
+    virtio_blk_config_t *config;
+    volatile uint16_t *notify;
+    uint64_t features;
+    /**
+     * @brief Split virtqueue 0. Every request takes a single descriptor pointing at the indirect
+     * table in its slot, so the queue holds queue_size requests whatever their segment count
+     */
+    uint16_t queue_size;
+    virtq_desc_t *descriptors;
+    virtq_avail_t *avail;
+    virtq_used_t *used;
+    volatile uint16_t *used_event;
+    volatile uint16_t *avail_event;
+    uint16_t avail_index;
+    uint16_t notified_index;
+    uint16_t used_index;
+    uint16_t *free_descriptors;
+    uint16_t free_count;
+    io_request_t **requests;
+    io_request_t **aborted;     // Requests being failed by virtio_abort
+    virtio_slot_t *slots;
+    uint8_t sector_shift;       // Device sectors to 512 byte virtio sectors
+    uint32_t segment_bytes;
+    uint32_t max_segments;
+} virtio_blk_t;
+
+/**
+ * @brief Initialises every modern virtio-blk device in a list of PCI devices, registering each
+ * as a block device named "virtioN"
+ * 
+ * @return True if at least one device was initialised
+ */
+bool init_virtio(pci_device_list_t device_list);
+
+/**
+ * @brief Locates the common, notification and device configuration structures from the vendor
+ * specific capabilities
+ * 
+ * @param offset The first vendor specific capability, from the device list
+ */
+static bool find_structures(virtio_blk_t *virtio, pci_header_0_t *header, uint8_t offset);
+
+/**
+ * @brief Resets the device, negotiates features and sets up the virtqueue
+ */
+static bool init_device(virtio_blk_t *virtio);
+
+/**
+ * @brief Allocates the virtqueue rings and request slots and hands them to the device. After a
+ * reset the existing rings are cleared and handed back instead
+ */
+static bool init_queue(virtio_blk_t *virtio);
+
+/**
+ * @brief Notifies the device of every request made available since the last notification,
+ * unless the device has suppressed notifications
+ */
+static void kick_queue(virtio_blk_t *virtio);
+
+/**
+ * @brief Makes a request available to the device. The notification is deferred to the next
+ * poll so requests submitted together share one
+ * 
+ * @return False if every descriptor is in use
+ */
+static bool virtio_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Resets the device and sets its queue up again, failing every request it held
+ */
+static void virtio_abort(blk_device_t *device);
+
+/**
+ * @brief Notifies the device of new requests, then completes those in the used ring through
+ * blk_complete
+ */
+static uint32_t virtio_poll(blk_device_t *device);
+
+#endif
@@ -0,0 +1,176 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "blk.h"
+#include "aes.h"
+#include "xts.h"
+
+static const blk_ops_t xts_ops = {xts_submit, xts_poll, xts_abort};
+static uint8_t volume_count = 0;
+
+blk_device_t *xts_create(blk_device_t *backing, const uint8_t *key, uint32_t key_bytes) {
+    if (backing == NULL || backing->sector_size % AES_BLOCK_BYTES != 0) {
+        handle_error("Encrypted volumes need sectors made of whole AES blocks\n");
+        return NULL;
+    }
+
+    xts_volume_t *volume = malloc(sizeof(xts_volume_t));
+    if (volume == NULL) {
+        handle_error("Could not allocate encrypted volume\n");
+        return NULL;
+    }
+    memset(volume, 0, sizeof(xts_volume_t));
+    if (!aes_xts_set_key(&volume->key, key, key_bytes)) {
+        free(volume);
+        return NULL;
+    }
+
+    uint64_t bounce_bytes = (uint64_t) XTS_QUEUE_DEPTH * XTS_MAX_TRANSFER * backing->sector_size;
+    volume->bounce = dma_alloc(bounce_bytes);
+    if (volume->bounce == NULL) {
+        memset(&volume->key, 0, sizeof(aes_xts_key_t));
+        free(volume);
+        handle_error("Could not allocate encrypted volume buffers\n");
+        return NULL;
+    }
+    volume->backing = backing;
+    for (uint32_t i = 0; i < XTS_QUEUE_DEPTH; i++) {
+        volume->requests[i].volume = volume;
+        volume->requests[i].bounce = volume->bounce
+            + (uint64_t) i * XTS_MAX_TRANSFER * backing->sector_size;
+        volume->idle[i] = &volume->requests[i];
+    }
+    volume->idle_count = XTS_QUEUE_DEPTH;
+
+    // The same geometry and capabilities as the backing device, but no scatter-gather, since
+    // every sector is encrypted or decrypted as one contiguous data unit
+    blk_device_t *device = &volume->device;
+    device->sector_size = backing->sector_size;
+    device->sector_count = backing->sector_count;
+    device->max_transfer = backing->max_transfer < XTS_MAX_TRANSFER
+        ? backing->max_transfer : XTS_MAX_TRANSFER;
+    device->queue_depth = XTS_QUEUE_DEPTH;
+    device->capabilities = backing->capabilities;
+    volume->number = volume_count++;
+    snprintf(device->name, BLK_NAME_LENGTH, "xts%d", (uint64_t) volume->number);
+    device->ops = &xts_ops;
+    device->driver = volume;
+
+    if (!blk_register(device)) {
+        memset(&volume->key, 0, sizeof(aes_xts_key_t));
+        dma_free(volume->bounce, bounce_bytes);
+        free(volume);
+        return NULL;
+    }
+    return device;
+}
+
+void xts_print_stats(blk_device_t *device) {
+    if (device->ops != &xts_ops) return;
+    xts_volume_t *volume = device->driver;
+    xts_stats_t *stats = &volume->stats;
+
+    // Hundredths of a megabyte (10^6 bytes) per second
+    uint64_t encrypt_x100 = stats->encrypt_ns == 0 ? 0
+        : stats->bytes_encrypted * 100000 / stats->encrypt_ns;
+    uint64_t decrypt_x100 = stats->decrypt_ns == 0 ? 0
+        : stats->bytes_decrypted * 100000 / stats->decrypt_ns;
+    printf("xts,%s,%s,%d,%d.%02d,%d,%d.%02d\n", device->name, aes_implementation(),
+        stats->bytes_encrypted / 1000000, encrypt_x100 / 100, encrypt_x100 % 100,
+        stats->bytes_decrypted / 1000000, decrypt_x100 / 100, decrypt_x100 % 100);
+}
+
+static void crypt_sectors(xts_volume_t *volume, uint64_t lba, uint32_t count, const uint8_t *input,
+    uint8_t *output, bool encrypt) {
+    uint32_t sector_size = volume->device.sector_size;
+    uint64_t start = timer_ticks();
+    for (uint32_t i = 0; i < count; i++) {
+        uint64_t offset = (uint64_t) i * sector_size;
+        if (encrypt) {
+            aes_xts_encrypt(&volume->key, lba + i, input + offset, output + offset, sector_size);
+        } else {
+            aes_xts_decrypt(&volume->key, lba + i, input + offset, output + offset, sector_size);
+        }
+    }
+
+    uint64_t elapsed = ticks_to_ns(timer_ticks() - start);
+    uint64_t bytes = (uint64_t) count * sector_size;
+    if (encrypt) {
+        volume->stats.bytes_encrypted += bytes;
+        volume->stats.encrypt_ns += elapsed;
+    } else {
+        volume->stats.bytes_decrypted += bytes;
+        volume->stats.decrypt_ns += elapsed;
+    }
+}
+
+static void xts_child_complete(io_request_t *child) {
+    xts_request_t *xts_request = child->context;
+    io_request_t *parent = xts_request->parent;
+    if (child->success && parent->op == IO_OP_READ) {
+        crypt_sectors(xts_request->volume, parent->lba, parent->count, parent->buffer,
+            parent->buffer, false);
+    }
+    finish_xts_request(xts_request);
+}
+
+static void finish_xts_request(xts_request_t *xts_request) {
+    xts_volume_t *volume = xts_request->volume;
+    io_request_t *parent = xts_request->parent;
+    xts_request->parent = NULL;
+    volume->idle[volume->idle_count++] = xts_request;
+    volume->completed++;
+
+    parent->success = xts_request->request.success;
+    parent->complete_ticks = timer_ticks();
+    blk_complete(parent);
+}
+
+static bool xts_submit(blk_device_t *device, io_request_t *request) {
+    xts_volume_t *volume = device->driver;
+    if (volume->idle_count == 0) return false;
+
+    xts_request_t *xts_request = volume->idle[--volume->idle_count];
+    xts_request->parent = request;
+
+    io_request_t *child = &xts_request->request;
+    memset(child, 0, sizeof(io_request_t));
+    child->op = request->op;
+    child->flags = request->flags;
+    child->lba = request->lba;
+    child->count = request->count;
+    child->buffer = request->buffer;
+    child->callback = xts_child_complete;
+    child->context = xts_request;
+    child->device = volume->backing;
+
+    // The volume and backing LBAs are the same, so the tweak is the LBA either way
+    request->submit_ticks = timer_ticks();
+    if (request->op == IO_OP_WRITE) {
+        crypt_sectors(volume, request->lba, request->count, request->buffer, xts_request->bounce,
+            true);
+        child->buffer = xts_request->bounce;
+    }
+    blk_submit(volume->backing, child);
+    return true;
+}
+
+static uint32_t xts_poll(blk_device_t *device) {
+    xts_volume_t *volume = device->driver;
+    volume->completed = 0;
+    blk_poll(volume->backing);
+    return volume->completed;
+}
+
+static void xts_abort(blk_device_t *device) {
+    xts_volume_t *volume = device->driver;
+    for (uint32_t i = 0; i < XTS_QUEUE_DEPTH; i++) {
+        xts_request_t *xts_request = &volume->requests[i];
+        if (xts_request->parent != NULL) blk_cancel(volume->backing, &xts_request->request);
+    }
+    blk_abort(volume->backing);
+}
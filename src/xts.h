@@ -0,0 +1,106 @@
+#ifndef _XTS_H_
+#define _XTS_H_
+
+#define XTS_QUEUE_DEPTH 32
+#define XTS_MAX_TRANSFER 256            // Sectors per request, the size of each bounce buffer
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+#include "aes.h"
+
+/**
+ * @brief A volume request in flight and the request it became on the backing device
+ */
+typedef struct xts_request {
+    io_request_t request;
+    io_request_t *parent;
+    struct xts_volume *volume;
+    /**
+     * @brief Writes are encrypted here rather than in the caller's buffer, XTS_MAX_TRANSFER
+     * sectors long
+     */
+    uint8_t *bounce;
+} xts_request_t;
+
+typedef struct xts_stats {
+    uint64_t bytes_encrypted;
+    uint64_t encrypt_ns;
+    uint64_t bytes_decrypted;
+    uint64_t decrypt_ns;
+} xts_stats_t;
+
+/**
+ * @brief An encrypted view of a backing device, registered as "xtsN"
+ */
+typedef struct xts_volume {
+    blk_device_t device;
+    blk_device_t *backing;
+    uint8_t number;
+    aes_xts_key_t key;
+    uint8_t *bounce;
+    xts_request_t requests[XTS_QUEUE_DEPTH];
+    xts_request_t *idle[XTS_QUEUE_DEPTH];
+    uint32_t idle_count;
+    /**
+     * @brief Volume requests completed during the current poll
+     */
+    uint32_t completed;
+    xts_stats_t stats;
+} xts_volume_t;
+
+/**
+ * @brief Registers a block device named "xtsN" that encrypts everything written to the backing
+ * device with XTS-AES, using each sector's LBA as its tweak. Reads go straight into the caller's
+ * buffer and are decrypted there, writes are encrypted into a bounce buffer so the caller's data
+ * is left as it was. Flushes, FUA and discards pass through. The data can be read back by any
+ * XTS-AES implementation using the same key and 512 or 4096 byte data units
+ * 
+ * @param key The data key followed by the tweak key, 32 bytes for XTS-AES-128 or 64 for
+ * XTS-AES-256
+ * @return The volume's block device, or NULL if the key is the wrong length, its two halves are
+ * equal or memory runs out
+ */
+blk_device_t *xts_create(blk_device_t *backing, const uint8_t *key, uint32_t key_bytes);
+
+/**
+ * @brief Prints a "xts," CSV line for a volume: the AES implementation, then the MB encrypted and
+ * decrypted and the MB/s of each. Does nothing for other devices
+ */
+void xts_print_stats(blk_device_t *device);
+
+/**
+ * @brief Encrypts or decrypts count sectors one data unit at a time, adding the time to the stats
+ */
+static void crypt_sectors(xts_volume_t *volume, uint64_t lba, uint32_t count, const uint8_t *input,
+    uint8_t *output, bool encrypt);
+
+/**
+ * @brief Backing request callback, decrypting reads before completing the volume request
+ */
+static void xts_child_complete(io_request_t *child);
+
+/**
+ * @brief Returns the volume request to the idle list and completes its parent
+ */
+static void finish_xts_request(xts_request_t *xts_request);
+
+/**
+ * @brief Encrypts writes into the bounce buffer and passes the request to the backing device
+ * 
+ * @return False if the volume is out of requests
+ */
+static bool xts_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Polls the backing device
+ */
+static uint32_t xts_poll(blk_device_t *device);
+
+/**
+ * @brief Cancels the children still queued on the backing device and aborts it, failing the rest
+ */
+static void xts_abort(blk_device_t *device);
+
+#endif
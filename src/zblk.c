@@ -0,0 +1,569 @@
+#include <uefi/uefi.h>
+#include <stdbool.h>
+
+#include "defs.h"
+#include "types.h"
+#include "std.h"
+#include "timer.h"
+#include "crc.h"
+#include "blk.h"
+#include "lz4.h"
+#include "zblk.h"
+
+static const blk_ops_t zblk_ops = {zblk_submit, zblk_poll, zblk_abort};
+static uint8_t volume_count = 0;
+
+bool zblk_format(blk_device_t *backing, uint32_t chunk_bytes) {
+    uint32_t sector_size = backing->sector_size;
+    if (chunk_bytes == 0) chunk_bytes = ZBLK_CHUNK_BYTES;
+    if (chunk_bytes % sector_size != 0 || chunk_bytes > ZBLK_MAX_CHUNK_BYTES
+        || chunk_bytes / sector_size > backing->max_transfer) {
+        handle_error("Chunk size must be sectors the device can transfer at once, up to 256KB\n");
+        return false;
+    }
+    uint32_t chunk_sectors = chunk_bytes / sector_size;
+
+    // Every chunk takes a map entry and two slots, and slots start on a chunk boundary after the
+    // superblock and map
+    uint64_t chunk_count = backing->sector_count / (2 * chunk_sectors);
+    uint64_t map_sectors;
+    uint64_t data_lba;
+    while (chunk_count > 0) {
+        map_sectors = (chunk_count * sizeof(zblk_map_entry_t) + sector_size - 1) / sector_size;
+        data_lba = (1 + map_sectors + chunk_sectors - 1) / chunk_sectors * chunk_sectors;
+        if (data_lba + chunk_count * 2 * chunk_sectors <= backing->sector_count) break;
+        chunk_count--;
+    }
+    if (chunk_count == 0) {
+        handle_error("Device is too small for a compressed volume\n");
+        return false;
+    }
+
+    // An empty map, then the superblock, so an interrupted format is never opened
+    uint8_t *map = dma_alloc(map_sectors * sector_size);
+    zblk_superblock_t *superblock = dma_alloc(sector_size);
+    if (map == NULL || superblock == NULL) {
+        dma_free(map, map_sectors * sector_size);
+        dma_free(superblock, sector_size);
+        handle_error("Could not allocate compressed volume map\n");
+        return false;
+    }
+    superblock->magic = ZBLK_MAGIC;
+    superblock->version = ZBLK_VERSION;
+    superblock->sector_size = sector_size;
+    superblock->chunk_bytes = chunk_bytes;
+    superblock->chunk_count = chunk_count;
+    superblock->map_lba = 1;
+    superblock->map_sectors = map_sectors;
+    superblock->data_lba = data_lba;
+    superblock->crc = crc32c(0, superblock, sizeof(zblk_superblock_t));
+
+    bool success = transfer_backing(backing, true, 1, map_sectors, map)
+        && blk_write(backing, 0, 1, superblock)
+        && (!(backing->capabilities & BLK_CAP_FLUSH) || blk_flush(backing));
+    dma_free(map, map_sectors * sector_size);
+    dma_free(superblock, sector_size);
+    if (!success) handle_error("Could not write compressed volume\n");
+    return success;
+}
+
+bool zblk_probe(blk_device_t *backing) {
+    zblk_superblock_t superblock;
+    return read_superblock(backing, &superblock);
+}
+
+blk_device_t *zblk_open(blk_device_t *backing) {
+    zblk_superblock_t superblock;
+    if (!read_superblock(backing, &superblock)) {
+        handle_error("Device does not hold a compressed volume\n");
+        return NULL;
+    }
+
+    zblk_volume_t *volume = malloc(sizeof(zblk_volume_t));
+    if (volume == NULL) {
+        handle_error("Could not allocate compressed volume\n");
+        return NULL;
+    }
+    memset(volume, 0, sizeof(zblk_volume_t));
+    volume->backing = backing;
+    volume->chunk_bytes = superblock.chunk_bytes;
+    volume->chunk_sectors = superblock.chunk_bytes / superblock.sector_size;
+    volume->chunk_count = superblock.chunk_count;
+    volume->map_lba = superblock.map_lba;
+    volume->map_sectors = superblock.map_sectors;
+    volume->data_lba = superblock.data_lba;
+    volume->dirty_first = ~0ULL;
+
+    uint64_t staging_bytes = (uint64_t) ZBLK_QUEUE_DEPTH * ZBLK_REQUEST_CHUNKS
+        * volume->chunk_bytes;
+    volume->map = dma_alloc(volume->map_sectors * superblock.sector_size);
+    volume->durable_slot = malloc(volume->chunk_count);
+    volume->scratch = dma_alloc(volume->chunk_bytes);
+    volume->staging = dma_alloc(staging_bytes);
+    if (volume->map == NULL || volume->durable_slot == NULL || volume->scratch == NULL
+        || volume->staging == NULL) {
+        free_volume(volume);
+        handle_error("Could not allocate compressed volume buffers\n");
+        return NULL;
+    }
+    if (!transfer_backing(backing, false, volume->map_lba, volume->map_sectors,
+        (uint8_t *) volume->map)) {
+        free_volume(volume);
+        handle_error("Could not read compressed volume map\n");
+        return NULL;
+    }
+    for (uint64_t i = 0; i < volume->chunk_count; i++) {
+        if (volume->map[i].slot > 1) {
+            free_volume(volume);
+            handle_error("Compressed volume map is corrupt\n");
+            return NULL;
+        }
+        volume->durable_slot[i] = volume->map[i].slot;
+    }
+
+    uint8_t *staging = volume->staging;
+    for (uint32_t i = 0; i < ZBLK_QUEUE_DEPTH; i++) {
+        zblk_request_t *zblk_request = &volume->requests[i];
+        zblk_request->volume = volume;
+        for (uint32_t j = 0; j < ZBLK_REQUEST_CHUNKS; j++) {
+            zblk_request->chunks[j].parent = zblk_request;
+            zblk_request->chunks[j].staging = staging;
+            staging += volume->chunk_bytes;
+        }
+        volume->idle[i] = zblk_request;
+    }
+    volume->idle_count = ZBLK_QUEUE_DEPTH;
+
+    // Flushes write back the map, so they are offered whether or not the backing device caches
+    blk_device_t *device = &volume->device;
+    device->sector_size = superblock.sector_size;
+    device->sector_count = volume->chunk_count * volume->chunk_sectors;
+    device->max_transfer = (ZBLK_REQUEST_CHUNKS - 1) * volume->chunk_sectors;
+    device->queue_depth = ZBLK_QUEUE_DEPTH;
+    device->capabilities = BLK_CAP_FLUSH;
+    volume->number = volume_count++;
+    snprintf(device->name, BLK_NAME_LENGTH, "z%d", (uint64_t) volume->number);
+    device->ops = &zblk_ops;
+    device->driver = volume;
+
+    if (!blk_register(device)) {
+        free_volume(volume);
+        return NULL;
+    }
+    return device;
+}
+
+void zblk_print_stats(blk_device_t *device) {
+    if (device->ops != &zblk_ops) return;
+    zblk_volume_t *volume = device->driver;
+    zblk_stats_t *stats = &volume->stats;
+
+    // Hundredths of the ratio and of a megabyte (10^6 bytes) per second
+    uint64_t ratio_x100 = stats->compress_output == 0 ? 0
+        : stats->compress_input * 100 / stats->compress_output;
+    uint64_t compress_x100 = stats->compress_ns == 0 ? 0
+        : stats->compress_input * 100000 / stats->compress_ns;
+    uint64_t decompress_x100 = stats->decompress_ns == 0 ? 0
+        : stats->decompress_output * 100000 / stats->decompress_ns;
+    printf("zblk,%s,%d,%d,%d,%d,%d.%02d,%d.%02d,%d.%02d,%d\n", device->name,
+        stats->chunks_written, stats->raw_chunks, stats->chunks_read, stats->zero_chunks,
+        ratio_x100 / 100, ratio_x100 % 100, compress_x100 / 100, compress_x100 % 100,
+        decompress_x100 / 100, decompress_x100 % 100, stats->checksum_errors);
+}
+
+static void split_chunks(zblk_volume_t *volume, zblk_request_t *zblk_request) {
+    io_request_t *parent = zblk_request->parent;
+    uint32_t sector_size = volume->device.sector_size;
+    uint64_t lba = parent->lba;
+    uint32_t remaining = parent->count;
+    uint8_t *buffer = parent->buffer;
+
+    zblk_request->chunk_count = 0;
+    while (remaining > 0) {
+        zblk_chunk_t *chunk = &zblk_request->chunks[zblk_request->chunk_count++];
+        chunk->chunk = lba / volume->chunk_sectors;
+        uint32_t offset = lba - chunk->chunk * volume->chunk_sectors;
+        uint32_t count = volume->chunk_sectors - offset;
+        if (count > remaining) count = remaining;
+
+        chunk->offset = offset * sector_size;
+        chunk->length = count * sector_size;
+        chunk->data = buffer;
+        chunk->read_first = false;
+
+        lba += count;
+        remaining -= count;
+        buffer += (uint64_t) count * sector_size;
+    }
+
+    for (uint32_t i = 0; i < zblk_request->chunk_count; i++) {
+        if (parent->op == IO_OP_READ) {
+            start_read(volume, &zblk_request->chunks[i]);
+        } else {
+            start_write(volume, &zblk_request->chunks[i]);
+        }
+    }
+}
+
+static void start_read(zblk_volume_t *volume, zblk_chunk_t *chunk) {
+    zblk_map_entry_t *entry = &volume->map[chunk->chunk];
+    if (entry->length == 0) {
+        memset(chunk->data, 0, chunk->length);
+        volume->stats.zero_chunks++;
+        return;
+    }
+
+    // A whole chunk stored raw can go straight into the caller's buffer
+    uint32_t sector_size = volume->device.sector_size;
+    uint32_t sectors = (entry->length + sector_size - 1) / sector_size;
+    bool direct = entry->length == volume->chunk_bytes && chunk->length == volume->chunk_bytes;
+    submit_chunk(volume, chunk, IO_OP_READ, slot_lba(volume, chunk->chunk, entry->slot), sectors,
+        direct ? chunk->data : chunk->staging);
+}
+
+static void start_write(zblk_volume_t *volume, zblk_chunk_t *chunk) {
+    if (chunk->length == volume->chunk_bytes) {
+        compress_chunk(volume, chunk, chunk->data);
+        submit_write(volume, chunk);
+        return;
+    }
+
+    // The rest of a chunk never written is zeros, otherwise it has to be read back first
+    zblk_map_entry_t *entry = &volume->map[chunk->chunk];
+    if (entry->length == 0) {
+        memset(volume->scratch, 0, volume->chunk_bytes);
+        memcpy(volume->scratch + chunk->offset, chunk->data, chunk->length);
+        compress_chunk(volume, chunk, volume->scratch);
+        submit_write(volume, chunk);
+        return;
+    }
+    chunk->read_first = true;
+    uint32_t sector_size = volume->device.sector_size;
+    uint32_t sectors = (entry->length + sector_size - 1) / sector_size;
+    submit_chunk(volume, chunk, IO_OP_READ, slot_lba(volume, chunk->chunk, entry->slot), sectors,
+        chunk->staging);
+}
+
+static void compress_chunk(zblk_volume_t *volume, zblk_chunk_t *chunk, const uint8_t *source) {
+    // Anything that does not save at least a sector is not worth decompressing
+    uint64_t start = timer_ticks();
+    uint32_t capacity = volume->chunk_bytes - volume->device.sector_size;
+    uint32_t length = lz4_compress(source, volume->chunk_bytes, chunk->staging, capacity,
+        volume->hash_table);
+    if (length == 0) {
+        memcpy(chunk->staging, source, volume->chunk_bytes);
+        length = volume->chunk_bytes;
+        volume->stats.raw_chunks++;
+    }
+    chunk->entry.length = length;
+    chunk->entry.crc = crc32c(0, chunk->staging, length);
+
+    volume->stats.compress_ns += ticks_to_ns(timer_ticks() - start);
+    volume->stats.compress_input += volume->chunk_bytes;
+    volume->stats.compress_output += length;
+}
+
+static void submit_write(zblk_volume_t *volume, zblk_chunk_t *chunk) {
+    // Writes since the last flush all go to the same spare slot, which nothing durable refers to
+    uint32_t sector_size = volume->device.sector_size;
+    chunk->entry.slot = 1 - volume->durable_slot[chunk->chunk];
+    chunk->entry.reserved = 0;
+    uint32_t sectors = (chunk->entry.length + sector_size - 1) / sector_size;
+    submit_chunk(volume, chunk, IO_OP_WRITE, slot_lba(volume, chunk->chunk, chunk->entry.slot),
+        sectors, chunk->staging);
+}
+
+static bool decompress_chunk(zblk_volume_t *volume, zblk_chunk_t *chunk, const uint8_t *stored,
+    uint8_t *output) {
+    zblk_map_entry_t *entry = &volume->map[chunk->chunk];
+    if (crc32c(0, stored, entry->length) != entry->crc) {
+        volume->stats.checksum_errors++;
+        handle_error("Compressed chunk failed its checksum\n");
+        return false;
+    }
+
+    uint64_t start = timer_ticks();
+    uint32_t length = entry->length;
+    if (entry->length == volume->chunk_bytes) {
+        if (stored != output) memcpy(output, stored, length);
+    } else if (!lz4_decompress(stored, entry->length, output, volume->chunk_bytes, &length)
+        || length != volume->chunk_bytes) {
+        handle_error("Compressed chunk could not be decompressed\n");
+        return false;
+    }
+
+    volume->stats.decompress_ns += ticks_to_ns(timer_ticks() - start);
+    volume->stats.decompress_input += entry->length;
+    volume->stats.decompress_output += length;
+    volume->stats.chunks_read++;
+    return true;
+}
+
+static void continue_flush(zblk_volume_t *volume, zblk_request_t *zblk_request) {
+    if (zblk_request->map_next < zblk_request->map_end) {
+        // Each piece is copied out of the map, so entries may keep changing while it is written
+        uint32_t sector_size = volume->device.sector_size;
+        for (uint32_t i = 0; i < ZBLK_REQUEST_CHUNKS; i++) {
+            if (zblk_request->map_next >= zblk_request->map_end) break;
+            uint64_t count = zblk_request->map_end - zblk_request->map_next;
+            if (count > volume->chunk_sectors) count = volume->chunk_sectors;
+
+            zblk_chunk_t *chunk = &zblk_request->chunks[i];
+            memcpy(chunk->staging, (uint8_t *) volume->map + zblk_request->map_next * sector_size,
+                count * sector_size);
+            submit_chunk(volume, chunk, IO_OP_WRITE, volume->map_lba + zblk_request->map_next,
+                count, chunk->staging);
+            zblk_request->map_next += count;
+        }
+        zblk_request->step = ZBLK_STEP_FLUSH;
+    } else if (volume->backing->capabilities & BLK_CAP_FLUSH) {
+        submit_chunk(volume, &zblk_request->chunks[0], IO_OP_FLUSH, 0, 0, NULL);
+    }
+}
+
+static void submit_chunk(zblk_volume_t *volume, zblk_chunk_t *chunk, uint8_t op, uint64_t lba,
+    uint32_t count, void *buffer) {
+    io_request_t *request = &chunk->request;
+    memset(request, 0, sizeof(io_request_t));
+    request->op = op;
+    request->lba = lba;
+    request->count = count;
+    request->buffer = buffer;
+    request->callback = chunk_complete;
+    request->context = chunk;
+    request->device = volume->backing;
+
+    chunk->parent->pending++;
+    blk_submit(volume->backing, request);
+}
+
+static void chunk_complete(io_request_t *request) {
+    zblk_chunk_t *chunk = request->context;
+    zblk_request_t *zblk_request = chunk->parent;
+    zblk_volume_t *volume = zblk_request->volume;
+    uint32_t sector_size = volume->device.sector_size;
+
+    if (!request->success) {
+        zblk_request->success = false;
+        // A piece of the map that failed to write is still changed
+        if (zblk_request->parent->op == IO_OP_FLUSH && request->op == IO_OP_WRITE) {
+            uint64_t first = request->lba - volume->map_lba;
+            mark_dirty(volume, first, first + request->count);
+        }
+    } else if (request->op == IO_OP_READ) {
+        bool whole = chunk->length == volume->chunk_bytes;
+        uint8_t *output = whole ? chunk->data : volume->scratch;
+        if (!decompress_chunk(volume, chunk, request->buffer, output)) {
+            zblk_request->success = false;
+        } else if (chunk->read_first) {
+            // Merged and compressed now, while the scratch chunk is free, and written from
+            // zblk_poll rather than inside the backing device's completion
+            memcpy(volume->scratch + chunk->offset, chunk->data, chunk->length);
+            compress_chunk(volume, chunk, volume->scratch);
+            zblk_request->step = ZBLK_STEP_WRITE;
+        } else if (!whole) {
+            memcpy(chunk->data, volume->scratch + chunk->offset, chunk->length);
+        }
+    } else if (request->op == IO_OP_WRITE && zblk_request->parent->op == IO_OP_WRITE) {
+        volume->map[chunk->chunk] = chunk->entry;
+        volume->stats.chunks_written++;
+        uint64_t sector = chunk->chunk * sizeof(zblk_map_entry_t) / sector_size;
+        mark_dirty(volume, sector, sector + 1);
+    }
+    put_request(zblk_request);
+}
+
+static void put_request(zblk_request_t *zblk_request) {
+    if (--zblk_request->pending > 0) return;
+    // zblk_poll takes the next step
+    if (zblk_request->success && zblk_request->step != ZBLK_STEP_NONE) return;
+
+    if (!zblk_request->success && zblk_request->parent->op == IO_OP_FLUSH) {
+        mark_dirty(zblk_request->volume, zblk_request->map_next, zblk_request->map_end);
+    }
+    finish_zblk_request(zblk_request);
+}
+
+static void finish_zblk_request(zblk_request_t *zblk_request) {
+    zblk_volume_t *volume = zblk_request->volume;
+    io_request_t *parent = zblk_request->parent;
+
+    // No write ran during the flush, so the map it wrote is the one in memory
+    if (parent->op == IO_OP_FLUSH && zblk_request->success) {
+        uint64_t per_sector = volume->device.sector_size / sizeof(zblk_map_entry_t);
+        uint64_t end = zblk_request->map_end * per_sector;
+        if (end > volume->chunk_count) end = volume->chunk_count;
+        for (uint64_t i = zblk_request->map_first * per_sector; i < end; i++) {
+            volume->durable_slot[i] = volume->map[i].slot;
+        }
+    }
+    zblk_request->parent = NULL;
+    zblk_request->step = ZBLK_STEP_NONE;
+    volume->idle[volume->idle_count++] = zblk_request;
+    volume->completed++;
+
+    parent->success = zblk_request->success;
+    parent->complete_ticks = timer_ticks();
+    blk_complete(parent);
+}
+
+static bool conflicts(zblk_volume_t *volume, uint8_t op, uint64_t first_chunk,
+    uint64_t last_chunk) {
+    for (uint32_t i = 0; i < ZBLK_QUEUE_DEPTH; i++) {
+        zblk_request_t *other = &volume->requests[i];
+        if (other->parent == NULL) continue;
+
+        // Flushes take the whole dirty range of the map, and reads never change it
+        uint8_t other_op = other->parent->op;
+        if (op == IO_OP_FLUSH || other_op == IO_OP_FLUSH) {
+            if (op != IO_OP_READ && other_op != IO_OP_READ) return true;
+            continue;
+        }
+        if (op == IO_OP_READ && other_op == IO_OP_READ) continue;
+        if (first_chunk <= other->last_chunk && other->first_chunk <= last_chunk) return true;
+    }
+    return false;
+}
+
+static uint64_t slot_lba(zblk_volume_t *volume, uint64_t chunk, uint32_t slot) {
+    return volume->data_lba + (chunk * 2 + slot) * volume->chunk_sectors;
+}
+
+static void mark_dirty(zblk_volume_t *volume, uint64_t first, uint64_t end) {
+    if (first >= end) return;
+    if (first < volume->dirty_first) volume->dirty_first = first;
+    if (end > volume->dirty_end) volume->dirty_end = end;
+}
+
+static bool read_superblock(blk_device_t *backing, zblk_superblock_t *superblock) {
+    uint8_t *sector = dma_alloc(backing->sector_size);
+    if (sector == NULL) return false;
+    bool read = blk_read(backing, 0, 1, sector);
+    memcpy(superblock, sector, sizeof(zblk_superblock_t));
+    dma_free(sector, backing->sector_size);
+    if (!read) return false;
+
+    uint32_t crc = superblock->crc;
+    superblock->crc = 0;
+    if (superblock->magic != ZBLK_MAGIC || superblock->version != ZBLK_VERSION
+        || crc32c(0, superblock, sizeof(zblk_superblock_t)) != crc) {
+        return false;
+    }
+
+    // The geometry has to fit the device as it is now
+    uint64_t chunk_bytes = superblock->chunk_bytes;
+    return superblock->sector_size == backing->sector_size
+        && chunk_bytes != 0 && chunk_bytes % backing->sector_size == 0
+        && chunk_bytes <= ZBLK_MAX_CHUNK_BYTES
+        && chunk_bytes / backing->sector_size <= backing->max_transfer
+        && superblock->chunk_count != 0 && superblock->chunk_count <= backing->sector_count
+        && superblock->map_sectors * backing->sector_size
+            >= superblock->chunk_count * sizeof(zblk_map_entry_t)
+        && superblock->map_lba + superblock->map_sectors <= superblock->data_lba
+        && superblock->data_lba
+            + superblock->chunk_count * 2 * (chunk_bytes / backing->sector_size)
+            <= backing->sector_count;
+}
+
+static void free_volume(zblk_volume_t *volume) {
+    uint32_t sector_size = volume->backing->sector_size;
+    dma_free(volume->map, volume->map_sectors * sector_size);
+    free(volume->durable_slot);
+    dma_free(volume->scratch, volume->chunk_bytes);
+    dma_free(volume->staging,
+        (uint64_t) ZBLK_QUEUE_DEPTH * ZBLK_REQUEST_CHUNKS * volume->chunk_bytes);
+    free(volume);
+}
+
+static bool transfer_backing(blk_device_t *backing, bool write, uint64_t lba, uint64_t count,
+    uint8_t *buffer) {
+    while (count > 0) {
+        uint32_t piece = count > backing->max_transfer ? backing->max_transfer : count;
+        bool success = write ? blk_write(backing, lba, piece, buffer)
+            : blk_read(backing, lba, piece, buffer);
+        if (!success) return false;
+        lba += piece;
+        count -= piece;
+        buffer += (uint64_t) piece * backing->sector_size;
+    }
+    return true;
+}
+
+static bool zblk_submit(blk_device_t *device, io_request_t *request) {
+    zblk_volume_t *volume = device->driver;
+    if (volume->idle_count == 0) return false;
+
+    uint64_t first_chunk = 0;
+    uint64_t last_chunk = 0;
+    if (request->op != IO_OP_FLUSH) {
+        first_chunk = request->lba / volume->chunk_sectors;
+        last_chunk = (request->lba + request->count - 1) / volume->chunk_sectors;
+    }
+    if (conflicts(volume, request->op, first_chunk, last_chunk)) return false;
+
+    zblk_request_t *zblk_request = volume->idle[--volume->idle_count];
+    zblk_request->parent = request;
+    zblk_request->success = true;
+    zblk_request->step = ZBLK_STEP_NONE;
+    zblk_request->first_chunk = first_chunk;
+    zblk_request->last_chunk = last_chunk;
+
+    // A piece may complete inside blk_submit, so hold an extra reference until every piece is
+    // submitted
+    request->submit_ticks = timer_ticks();
+    zblk_request->pending = 1;
+    if (request->op == IO_OP_FLUSH) {
+        // Entries changed from here on belong to the next flush
+        zblk_request->map_first = volume->dirty_first;
+        zblk_request->map_next = volume->dirty_first;
+        zblk_request->map_end = volume->dirty_end;
+        volume->dirty_first = ~0ULL;
+        volume->dirty_end = 0;
+        continue_flush(volume, zblk_request);
+    } else {
+        split_chunks(volume, zblk_request);
+    }
+    put_request(zblk_request);
+    return true;
+}
+
+static uint32_t zblk_poll(blk_device_t *device) {
+    zblk_volume_t *volume = device->driver;
+    volume->completed = 0;
+    blk_poll(volume->backing);
+
+    for (uint32_t i = 0; i < ZBLK_QUEUE_DEPTH; i++) {
+        zblk_request_t *zblk_request = &volume->requests[i];
+        if (zblk_request->parent == NULL || zblk_request->pending > 0
+            || zblk_request->step == ZBLK_STEP_NONE) {
+            continue;
+        }
+
+        uint8_t step = zblk_request->step;
+        zblk_request->step = ZBLK_STEP_NONE;
+        zblk_request->pending++;
+        if (step == ZBLK_STEP_WRITE) {
+            for (uint32_t j = 0; j < zblk_request->chunk_count; j++) {
+                zblk_chunk_t *chunk = &zblk_request->chunks[j];
+                if (!chunk->read_first) continue;
+                chunk->read_first = false;
+                submit_write(volume, chunk);
+            }
+        } else {
+            continue_flush(volume, zblk_request);
+        }
+        put_request(zblk_request);
+    }
+    return volume->completed;
+}
+
+static void zblk_abort(blk_device_t *device) {
+    zblk_volume_t *volume = device->driver;
+    for (uint32_t i = 0; i < ZBLK_QUEUE_DEPTH; i++) {
+        zblk_request_t *zblk_request = &volume->requests[i];
+        for (uint32_t j = 0; zblk_request->parent != NULL && j < ZBLK_REQUEST_CHUNKS; j++) {
+            blk_cancel(volume->backing, &zblk_request->chunks[j].request);
+        }
+    }
+    blk_abort(volume->backing);
+}
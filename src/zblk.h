@@ -0,0 +1,297 @@
+#ifndef _ZBLK_H_
+#define _ZBLK_H_
+
+#define ZBLK_MAGIC 0x31345A4C4B4C425A   // "ZBLKLZ41"
+#define ZBLK_VERSION 2                  // 2: two slots per chunk
+#define ZBLK_CHUNK_BYTES (64 * 1024)    // Default uncompressed bytes per chunk
+#define ZBLK_MAX_CHUNK_BYTES (256 * 1024)
+#define ZBLK_QUEUE_DEPTH 16             // Volume requests in flight at once
+#define ZBLK_REQUEST_CHUNKS 5           // Chunks one request may touch, so it spans up to 4 whole
+
+#define ZBLK_STEP_NONE 0
+#define ZBLK_STEP_WRITE 1               // Chunks read for a read-modify-write are ready to write
+#define ZBLK_STEP_FLUSH 2               // A flush continues with the map or the backing flush
+
+#include <stdbool.h>
+
+#include "types.h"
+#include "blk.h"
+#include "lz4.h"
+
+/**
+ * @brief Sector 0 of the backing device, written by zblk_format
+ */
+typedef struct zblk_superblock {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t crc;                   // CRC32C of the superblock with this field 0
+    uint32_t sector_size;
+    uint32_t chunk_bytes;
+    uint64_t chunk_count;
+    uint64_t map_lba;
+    uint64_t map_sectors;
+    uint64_t data_lba;
+} __attribute__((packed)) zblk_superblock_t;
+
+/**
+ * @brief Chunk map entry. Every chunk has two slots of chunk_bytes at data_lba, and its compressed
+ * form is stored at the start of one so reading it moves only the sectors it fills. A write goes
+ * to the slot the map on the device does not point at, so a crash before the next flush leaves
+ * the chunk as it was then rather than torn
+ */
+typedef struct zblk_map_entry {
+    /**
+     * @brief Bytes stored: 0 for a chunk never written, which reads as zeros, chunk_bytes for one
+     * that did not compress and is stored as is, otherwise the length of its LZ4 block
+     */
+    uint32_t length;
+    uint32_t crc;                   // CRC32C of the stored bytes
+    uint32_t slot;                  // 0 or 1
+    uint32_t reserved;              // Keeps entries from crossing a sector
+} __attribute__((packed)) zblk_map_entry_t;
+
+struct zblk_request;
+
+/**
+ * @brief The part of a volume request that falls in one chunk, and the backing request for it
+ */
+typedef struct zblk_chunk {
+    io_request_t request;
+    struct zblk_request *parent;
+    uint64_t chunk;
+    uint32_t offset;                // Where the volume request's bytes start in the chunk
+    uint32_t length;
+    uint8_t *data;                  // The volume request's bytes
+    /**
+     * @brief Compressed form of the chunk, as read or about to be written, chunk_bytes long
+     */
+    uint8_t *staging;
+    zblk_map_entry_t entry;         // Map entry of a chunk being written, set once it is
+    bool read_first;                // A partial write, reading the old contents first
+} zblk_chunk_t;
+
+/**
+ * @brief A volume request in flight, with the chunks it was split into
+ */
+typedef struct zblk_request {
+    io_request_t *parent;
+    struct zblk_volume *volume;
+    uint32_t pending;
+    bool success;
+    uint8_t step;                   // One of ZBLK_STEP_*, run from zblk_poll
+    uint64_t first_chunk;
+    uint64_t last_chunk;
+    uint32_t chunk_count;
+    /**
+     * @brief Map sectors a flush took, and those it still has to write
+     */
+    uint64_t map_first;
+    uint64_t map_next;
+    uint64_t map_end;
+    zblk_chunk_t chunks[ZBLK_REQUEST_CHUNKS];
+} zblk_request_t;
+
+typedef struct zblk_stats {
+    uint64_t chunks_read;           // Read from the backing device and decompressed
+    uint64_t chunks_written;
+    uint64_t zero_chunks;           // Read without I/O because they were never written
+    uint64_t raw_chunks;            // Written uncompressed because LZ4 did not save a sector
+    uint64_t compress_input;        // Chunk bytes compressed, and the bytes stored for them
+    uint64_t compress_output;
+    uint64_t compress_ns;
+    uint64_t decompress_input;      // Stored bytes read back, and the chunk bytes they gave
+    uint64_t decompress_output;
+    uint64_t decompress_ns;
+    uint64_t checksum_errors;
+} zblk_stats_t;
+
+/**
+ * @brief A compressed volume over a backing device, registered as "zN"
+ */
+typedef struct zblk_volume {
+    blk_device_t device;
+    blk_device_t *backing;
+    uint8_t number;
+    uint32_t chunk_bytes;
+    uint32_t chunk_sectors;
+    uint64_t chunk_count;
+    uint64_t map_lba;
+    uint64_t map_sectors;
+    uint64_t data_lba;
+    /**
+     * @brief The whole chunk map, and the range of its sectors changed since the last flush
+     */
+    zblk_map_entry_t *map;
+    uint64_t dirty_first;
+    uint64_t dirty_end;
+    /**
+     * @brief Slot of each chunk the map on the device points at, as of the last flush
+     */
+    uint8_t *durable_slot;
+    /**
+     * @brief One uncompressed chunk, for partial reads and read-modify-write. Chunks are
+     * decompressed and merged inside a single callback, so one buffer serves every request
+     */
+    uint8_t *scratch;
+    /**
+     * @brief Staging buffers of every chunk of every request, allocated together
+     */
+    uint8_t *staging;
+    uint32_t hash_table[LZ4_HASH_SIZE];
+    zblk_request_t requests[ZBLK_QUEUE_DEPTH];
+    zblk_request_t *idle[ZBLK_QUEUE_DEPTH];
+    uint32_t idle_count;
+    /**
+     * @brief Volume requests completed during the current poll
+     */
+    uint32_t completed;
+    zblk_stats_t stats;
+} zblk_volume_t;
+
+/**
+ * @brief Writes an empty volume to the backing device, destroying its contents
+ * 
+ * @param chunk_bytes Uncompressed bytes per chunk, a multiple of the sector size up to 4MB, 0 for
+ * ZBLK_CHUNK_BYTES. Larger chunks compress better but every read moves a whole chunk
+ */
+bool zblk_format(blk_device_t *backing, uint32_t chunk_bytes);
+
+/**
+ * @brief Returns true if the device holds a volume written by zblk_format
+ */
+bool zblk_probe(blk_device_t *backing);
+
+/**
+ * @brief Loads the chunk map of a volume and registers it as a block device named "zN". Reads
+ * fetch only the compressed sectors of each chunk and decompress them into the caller's buffer,
+ * writes compress whole chunks (reading partial ones first) into their spare slot, and a flush
+ * writes the changed part of the map before flushing the backing device
+ * 
+ * @return The volume's block device, or NULL if the backing device holds no volume
+ */
+blk_device_t *zblk_open(blk_device_t *backing);
+
+/**
+ * @brief Prints a "zblk," CSV line for a volume: chunks written, of which stored raw, chunks read,
+ * unwritten chunks read as zeros, the compression ratio, compression and decompression MB/s and
+ * checksum errors. Does nothing for other devices
+ */
+void zblk_print_stats(blk_device_t *device);
+
+/**
+ * @brief Splits a read or write at chunk boundaries and starts each piece
+ */
+static void split_chunks(zblk_volume_t *volume, zblk_request_t *zblk_request);
+
+/**
+ * @brief Starts the piece of a read in one chunk, completing it at once if the chunk is unwritten
+ */
+static void start_read(zblk_volume_t *volume, zblk_chunk_t *chunk);
+
+/**
+ * @brief Starts the piece of a write in one chunk, reading the chunk first if only part of it
+ * is written
+ */
+static void start_write(zblk_volume_t *volume, zblk_chunk_t *chunk);
+
+/**
+ * @brief Compresses the whole chunk held in source into the staging buffer and sets the map
+ * entry it will have once written. Chunks that would not save a sector are stored as they are
+ */
+static void compress_chunk(zblk_volume_t *volume, zblk_chunk_t *chunk, const uint8_t *source);
+
+/**
+ * @brief Submits the write of a compressed chunk to the slot the map on the device does not use
+ */
+static void submit_write(zblk_volume_t *volume, zblk_chunk_t *chunk);
+
+/**
+ * @brief Checks a chunk read from the backing device against its map entry and decompresses it
+ * 
+ * @param stored The bytes read, which for a chunk stored raw may already be output
+ * @param output Where the whole chunk goes, chunk_bytes long
+ */
+static bool decompress_chunk(zblk_volume_t *volume, zblk_chunk_t *chunk, const uint8_t *stored,
+    uint8_t *output);
+
+/**
+ * @brief Writes the next pieces of a flush's map range, or flushes the backing device once the
+ * map is written
+ */
+static void continue_flush(zblk_volume_t *volume, zblk_request_t *zblk_request);
+
+/**
+ * @brief Fills in and submits the backing request of a chunk
+ */
+static void submit_chunk(zblk_volume_t *volume, zblk_chunk_t *chunk, uint8_t op, uint64_t lba,
+    uint32_t count, void *buffer);
+
+/**
+ * @brief Backing request callback, finishing the piece or leaving the next step for zblk_poll
+ */
+static void chunk_complete(io_request_t *request);
+
+/**
+ * @brief Drops a reference on a volume request, running its next step or completing it once the
+ * last piece is done
+ */
+static void put_request(zblk_request_t *zblk_request);
+
+/**
+ * @brief Returns the volume request to the idle list and completes its parent
+ */
+static void finish_zblk_request(zblk_request_t *zblk_request);
+
+/**
+ * @brief Returns true if a request for these chunks must wait for one in flight, since a chunk
+ * may only be read or written by one request while it is being written. Flushes and writes also
+ * wait for each other, so the map does not change while a flush writes it
+ */
+static bool conflicts(zblk_volume_t *volume, uint8_t op, uint64_t first_chunk,
+    uint64_t last_chunk);
+
+/**
+ * @brief First backing sector of one of a chunk's slots
+ */
+static uint64_t slot_lba(zblk_volume_t *volume, uint64_t chunk, uint32_t slot);
+
+/**
+ * @brief Adds map sectors first up to end to the range the next flush writes
+ */
+static void mark_dirty(zblk_volume_t *volume, uint64_t first, uint64_t end);
+
+/**
+ * @brief Reads the superblock of a volume, returning false without reporting it if there is none
+ */
+static bool read_superblock(blk_device_t *backing, zblk_superblock_t *superblock);
+
+/**
+ * @brief Frees a volume and whichever of its buffers were allocated
+ */
+static void free_volume(zblk_volume_t *volume);
+
+/**
+ * @brief Reads or writes sectors of the backing device in pieces of its maximum transfer
+ */
+static bool transfer_backing(blk_device_t *backing, bool write, uint64_t lba, uint64_t count,
+    uint8_t *buffer);
+
+/**
+ * @brief Splits the request into chunks and starts them
+ * 
+ * @return False if the volume is out of requests or the request must wait for one in flight
+ */
+static bool zblk_submit(blk_device_t *device, io_request_t *request);
+
+/**
+ * @brief Polls the backing device, then runs the steps completions left for it
+ */
+static uint32_t zblk_poll(blk_device_t *device);
+
+/**
+ * @brief Cancels the chunk requests still queued on the backing device and aborts it, failing the
+ * rest. Requests waiting on a step carry on from the next poll
+ */
+static void zblk_abort(blk_device_t *device);
+
+#endif